@@ -0,0 +1,81 @@
+#ifndef CMDCBOR_H
+#define CMDCBOR_H
+
+#include "cmdparser.h"
+
+/**
+ * @brief Integer map keys of the CBOR command encoding
+ * Command: { 0: command_id, 1: seq, 2: ack_now, 3: { relay number: { 0: state, 1: duration } }, 4: scene }
+ * A relay map may also carry a waveform: { 2: pulse us, 3: gap us, 4: count } or { 5: pwm Hz, 6: duty % }
+ * A batch is an array of command maps
+ */
+#define CMD_CBOR_KEY_COMMAND_ID 0
+#define CMD_CBOR_KEY_SEQ 1
+#define CMD_CBOR_KEY_ACK_NOW 2
+#define CMD_CBOR_KEY_RELAYS 3
+#define CMD_CBOR_KEY_SCENE 4
+#define CMD_CBOR_KEY_STATE 0
+#define CMD_CBOR_KEY_DURATION 1
+#define CMD_CBOR_KEY_PULSE 2
+#define CMD_CBOR_KEY_GAP 3
+#define CMD_CBOR_KEY_COUNT 4
+#define CMD_CBOR_KEY_PWM 5
+#define CMD_CBOR_KEY_DUTY 6
+
+/**
+ * @brief Incremental CBOR command decoder state
+ * Lives on the caller's stack; the decoder never allocates
+ */
+typedef struct
+{
+    uint8_t state;
+    uint8_t major;
+    uint8_t arg_bytes;
+    uint64_t arg;
+    uint8_t depth;
+    uint8_t base; // Depth of the command map (1 inside a batch array)
+    bool is_map[CMD_PARSER_MAX_DEPTH];
+    uint32_t remaining[CMD_PARSER_MAX_DEPTH]; // Items left in each open container
+    int32_t key[CMD_PARSER_MAX_DEPTH];        // Current key of each open map (-1 = not decoded)
+    int8_t relay;
+    uint32_t text_left;
+    bool text_is_id;
+    size_t id_len;
+    bool id_overflow;
+    bool has_fields;
+    bool started;
+    bool error;
+    uint32_t commands;
+    relay_command_t command;
+    cmd_parser_cb_t on_command;
+    void *ctx;
+} cmd_cbor_parser_t;
+
+/**
+ * @brief Prepare a decoder for a new document
+ * @param parser The decoder to reset
+ * @param on_command Called for every complete command (may be NULL)
+ * @param ctx Passed to on_command
+ */
+void CmdCborParserInit(cmd_cbor_parser_t *parser, cmd_parser_cb_t on_command, void *ctx);
+
+/**
+ * @brief Feed the next chunk of the document
+ * Chunks may be split anywhere. The document is a command map or an array
+ * of them (a batch, reported in order). Unknown keys and their values are
+ * skipped; indefinite-length items are not supported.
+ * @param parser The decoder
+ * @param data The chunk
+ * @param len Length of the chunk
+ * @return 0 while the input is valid so far, -1 on malformed or unsupported input
+ */
+int CmdCborParserFeed(cmd_cbor_parser_t *parser, const uint8_t *data, size_t len);
+
+/**
+ * @brief End the document
+ * @param parser The decoder
+ * @return Number of commands found (0 for an empty map or array), -1 if the document was invalid or incomplete
+ */
+int CmdCborParserFinish(cmd_cbor_parser_t *parser);
+
+#endif // CMDCBOR_H
@@ -0,0 +1,111 @@
+#ifndef CMDPARSER_H
+#define CMDPARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "relay.h"
+#include "waveform.h"
+
+#define CMD_MAX_RELAYS RELAY_COUNT
+#define CMD_MAX_ID_LENGTH 64
+#define CMD_MAX_BATCH 8 // Commands per poll response the device asks for (X-Relay-Batch)
+#define CMD_PARSER_MAX_DEPTH 8
+#define CMD_PARSER_TOKEN_LENGTH 24
+
+/**
+ * @brief Action requested for one relay
+ */
+typedef struct
+{
+    bool present;        // true if the command sets this relay
+    int state;           // Requested state (1 = ON, 0 = OFF, anything else is invalid)
+    int duration_ms;     // Auto-off duration (0 = none); PWM: run time (0 = until switched)
+    waveform_t waveform; // Pulse train or PWM instead of the state (all zero = none)
+} relay_action_t;
+
+/**
+ * @brief A decoded relay command
+ */
+typedef struct
+{
+    char command_id[CMD_MAX_ID_LENGTH]; // Raw JSON string contents (escapes kept), "" if absent
+    bool has_seq;
+    uint32_t seq;
+    bool ack_now;
+    int scene;                             // Scene to recall before the relay actions (0 = none)
+    relay_action_t relays[CMD_MAX_RELAYS]; // Index 0 = relay1
+} relay_command_t;
+
+/**
+ * @brief Called for every complete command found in the input
+ */
+typedef void (*cmd_parser_cb_t)(const relay_command_t *command, void *ctx);
+
+/**
+ * @brief Incremental command parser state
+ * Lives on the caller's stack; the parser never allocates
+ */
+typedef struct
+{
+    uint8_t state;
+    uint8_t depth;
+    uint8_t base; // Depth of the command object (1 inside a batch array)
+    char stack[CMD_PARSER_MAX_DEPTH];
+    uint8_t field;
+    int8_t relay;
+    int8_t pending_relay;
+    bool escape;
+    bool error;
+    char token[CMD_PARSER_TOKEN_LENGTH];
+    uint8_t token_len;
+    bool token_overflow;
+    size_t id_len;
+    bool id_overflow;
+    bool has_fields;
+    uint32_t commands;
+    relay_command_t command;
+    cmd_parser_cb_t on_command;
+    void *ctx;
+} cmd_parser_t;
+
+/**
+ * @brief Prepare a parser for a new document
+ * @param parser The parser to reset
+ * @param on_command Called for every complete command (may be NULL)
+ * @param ctx Passed to on_command
+ */
+void CmdParserInit(cmd_parser_t *parser, cmd_parser_cb_t on_command, void *ctx);
+
+/**
+ * @brief Feed the next chunk of the document
+ * Chunks may be split anywhere, including inside keys, strings and numbers.
+ * The document is a single command object or an array of them (a batch,
+ * reported in order). Only command_id, seq, ack_now, scene and relayN.state/duration
+ * and the waveform members relayN.pulse/gap/count/pwm/duty are decoded; any other
+ * member is skipped, so the document size is not limited.
+ * @param parser The parser
+ * @param data The chunk
+ * @param len Length of the chunk
+ * @return 0 while the input is valid so far, -1 on a syntax error
+ */
+int CmdParserFeed(cmd_parser_t *parser, const char *data, size_t len);
+
+/**
+ * @brief End the document
+ * A number still being read is completed here, so a bare legacy "0" or "1"
+ * body works without a terminator
+ * @param parser The parser
+ * @return Number of commands found (0 for "{}" or "[]"), -1 if the document was invalid or incomplete
+ */
+int CmdParserFinish(cmd_parser_t *parser);
+
+/**
+ * @brief Convert a decimal number of milliseconds to microseconds
+ * Up to three decimals are kept ("0.25" -> 250), further ones are dropped
+ * @param text The number, e.g. "150" or "0.5"
+ * @return The time in microseconds, 0 if the text is not a positive number
+ */
+uint32_t CmdParserMsToUs(const char *text);
+
+#endif // CMDPARSER_H
@@ -0,0 +1,28 @@
+#ifndef COAP_H
+#define COAP_H
+
+#include <stdbool.h>
+
+/**
+ * @brief Callback polled by the CoAP session to know when to end it
+ * @return true to deregister and return
+ */
+typedef bool (*coap_stop_cb_t)(void);
+
+/**
+ * @brief Run a CoAP command session (blocking)
+ * Registers as an observer of the URL's resource with a confirmable GET
+ * (Observe, RFC 7641) and feeds every notification into the command
+ * processing. Each notification is confirmable; its CoAP ACK is sent once
+ * the commands it carried have been executed and acknowledges them, so no
+ * separate ACK message is sent. Other reports (waveform ends, held commands)
+ * are POSTed to the resource as confirmable requests. The registration is
+ * refreshed periodically, which also keeps NAT bindings open.
+ * @param url coap:// URL of the command resource, e.g. coap://host:5683/api/relay
+ * @param should_stop Called periodically; the session ends when it returns true
+ * @return 0 if the registration succeeded and the session has ended,
+ *         -1 if the server could not be reached
+ */
+int CoapRun(const char *url, coap_stop_cb_t should_stop);
+
+#endif // COAP_H
@@ -13,17 +13,28 @@ typedef enum
 {
     CMD_LED_ON,
     CMD_LED_OFF,
-    CMD_RELAY1_ON,
-    CMD_RELAY1_OFF,
-    CMD_RELAY2_ON,
-    CMD_RELAY2_OFF,
+    CMD_RELAY_ON,       // param = relay number
+    CMD_RELAY_OFF,      // param = relay number
+    CMD_RELAY_WAVEFORM, // param = "<relay number> pulse|pwm ..."
     CMD_SSID_SET,
     CMD_WIFIPASS_SET,
     CMD_SSID_QUERY,
     CMD_WIFIPASS_QUERY,
     CMD_URL_SET,
     CMD_URL_QUERY,
+    CMD_URL_ADD,
+    CMD_URL_DELETE,
+    CMD_URLS_QUERY,
     CMD_IP_QUERY,
+    CMD_STATS_QUERY,
+    CMD_ECHO_SET,
+    CMD_ECHO_QUERY,
+    CMD_PSK_SET,
+    CMD_PSK_QUERY,
+    CMD_SCHED_QUERY,
+    CMD_SCENE_SET,
+    CMD_SCENE_QUERY,
+    CMD_SCENE_RECALL,   // param = scene number
     CMD_UNKNOWN
 } command_type_t;
 
@@ -0,0 +1,60 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DEDUP_WINDOW 32           // Recently executed command ids remembered
+#define DEDUP_CHECKPOINT_EVERY 8  // New ids between NVS checkpoints
+
+/**
+ * @brief Restore the window of executed command ids
+ * Taken from RTC memory after a reset (kept across panics, watchdog and
+ * software resets) or from the last NVS checkpoint after a power cycle.
+ * Must be called after NVS is initialized (WifiInit).
+ */
+void DedupInit(void);
+
+/**
+ * @brief Check whether a command id was executed recently
+ * O(1), no allocation
+ * @param command_id The command id as received
+ * @return true if it is in the window (the command must not run again)
+ */
+bool DedupSeen(const char *command_id);
+
+/**
+ * @brief Record an executed command id
+ * The oldest id leaves the window once it is full
+ * @param command_id The command id as received
+ */
+void DedupRecord(const char *command_id);
+
+/**
+ * @brief Raise the sequence number of the last executed command
+ * The watermark never goes down: an older seq (e.g. a command delivered
+ * again) leaves it unchanged. Kept with the window in RTC memory at once;
+ * DedupFlush writes it to NVS.
+ * @param seq The sequence number
+ */
+void DedupSetSeq(uint32_t seq);
+
+/**
+ * @brief Write the NVS checkpoint if the sequence number advanced since the last one
+ * Called after every batch, before it is acknowledged, so a power cycle
+ * cannot restore a watermark older than what the server was told
+ */
+void DedupFlush(void);
+
+/**
+ * @brief Get the sequence number of the last executed command, as restored by DedupInit
+ * @return The sequence number (0 = none)
+ */
+uint32_t DedupGetSeq(void);
+
+/**
+ * @brief Number of duplicate commands caught since boot
+ */
+uint32_t DedupGetDuplicates(void);
+
+#endif // DEDUP_H
@@ -0,0 +1,123 @@
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "relay.h"
+#include "waveform.h"
+
+#define DISPATCHER_MAX_LISTENERS 4
+#define DISPATCHER_REPORT_ID_LENGTH 64 // Kept per running waveform (CMD_MAX_ID_LENGTH)
+
+/**
+ * @brief Where a relay command comes from
+ * Local manual sources (web page, UART) have the highest priority
+ */
+typedef enum
+{
+    RELAY_SOURCE_TIMER,    // Auto-off of a timed ON
+    RELAY_SOURCE_WAVEFORM, // End of a pulse train or timed PWM
+    RELAY_SOURCE_SCHEDULE, // Schedule run on the device
+    RELAY_SOURCE_REMOTE,   // Server (poll, LAN, WebSocket, MQTT, CoAP)
+    RELAY_SOURCE_WEB,      // Local web page
+    RELAY_SOURCE_UART,     // Serial console
+    RELAY_SOURCE_COUNT
+} relay_source_t;
+
+/**
+ * @brief A transition of one or more relays
+ */
+typedef struct
+{
+    relay_source_t source;
+    uint32_t mask;                     // Relays to switch, bit (n - 1) for relay n
+    uint32_t states;                   // Their new states (bit set = ON)
+    uint32_t duration_ms[RELAY_COUNT]; // Relays switched ON: auto-off after this long (0 = none); PWM: run time
+    const waveform_t *waveform[RELAY_COUNT]; // Relays in the mask to drive with a waveform instead (NULL = none)
+    const char *report_id;                   // Reported with the end of its waveforms (e.g. command_id, may be NULL)
+} relay_request_t;
+
+/**
+ * @brief Relay state as of the last transition
+ */
+typedef struct
+{
+    uint32_t states;       // Bit (n - 1) set if relay n is ON
+    uint32_t changed;      // Relays the last transition changed
+    uint32_t waveforms;    // Relays driven by a running waveform (their state bit is 0)
+    uint32_t version;      // Incremented by every transition (0 = none since boot)
+    relay_source_t source; // Source of the last transition
+    int64_t changed_us;    // esp_timer time of the last transition
+} relay_snapshot_t;
+
+/**
+ * @brief Called once for every transition that changed at least one relay
+ * Runs in the task that submitted the command, in transition order; it must
+ * return quickly and must not submit commands itself
+ */
+typedef void (*dispatcher_listener_t)(const relay_snapshot_t *snapshot, void *ctx);
+
+/**
+ * @brief Called when a waveform started by a request has ended or could not start
+ * Runs without the dispatcher lock, in the waveform task or the task that submitted the request
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ * @param result How the waveform ended
+ * @param report_id The request's report_id ("" if it had none)
+ */
+typedef void (*dispatcher_waveform_end_t)(int relayNumber, waveform_result_t result, const char *report_id);
+
+/**
+ * @brief Initialize the dispatcher, the auto-off timers and the waveform task
+ * Must be called after RelayInit, before any command source starts
+ */
+void DispatcherInit(void);
+
+/**
+ * @brief Switch relays
+ * All relay changes go through here, whatever their source. A relay switched
+ * by a local manual source (web page, UART) is held for
+ * CONFIG_RELAY_MANUAL_HOLD_S: commands of lower priority leave it alone
+ * meanwhile. The accepted relays switch in one transition (RelayApplyMask),
+ * after their auto-off timers have been armed or cancelled. Relays with a
+ * waveform are switched OFF in that transition and their waveforms start
+ * right after it; any command for a relay stops its running waveform first.
+ * @param request The transition
+ * @return The relays that were switched (held relays are missing)
+ */
+uint32_t DispatcherSubmit(const relay_request_t *request);
+
+/**
+ * @brief Switch a single relay
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ * @param state 1 = ON, 0 = OFF
+ * @param source Where the command comes from
+ * @return 0 if the relay was switched, -1 for an invalid relay or if it is held
+ */
+int DispatcherSwitch(int relayNumber, int state, relay_source_t source);
+
+/**
+ * @brief Get the current relay state without taking a lock
+ * @param snapshot Filled with a consistent copy of the state
+ */
+void DispatcherGetSnapshot(relay_snapshot_t *snapshot);
+
+/**
+ * @brief Register a change listener
+ * @param listener Called after every transition
+ * @param ctx Passed to the listener
+ * @return 0 on success, -1 if all DISPATCHER_MAX_LISTENERS slots are taken
+ */
+int DispatcherAddListener(dispatcher_listener_t listener, void *ctx);
+
+/**
+ * @brief Set the function told about the end of waveforms
+ * @param handler The handler, or NULL
+ */
+void DispatcherSetWaveformHandler(dispatcher_waveform_end_t handler);
+
+/**
+ * @brief Get the name of a source for logs and reports
+ */
+const char *DispatcherSourceName(relay_source_t source);
+
+#endif // DISPATCHER_H
@@ -0,0 +1,64 @@
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include <stdint.h>
+
+#define DNS_CACHE_MAX_HOST_LENGTH 64
+
+/**
+ * @brief Resolve a host name to an IPv4 address
+ * @param host The name to resolve
+ * @param ipv4 Set to the address (network byte order)
+ * @param ttl_s Set to the time the answer may be cached, in seconds
+ * @param timeout_ms Time the lookup may take
+ * @return 0 on success, -1 on failure
+ */
+typedef int (*dns_resolver_fn_t)(const char *host, uint32_t *ipv4, uint32_t *ttl_s, uint32_t timeout_ms);
+
+/**
+ * @brief Cache counters (since boot)
+ */
+typedef struct
+{
+    uint32_t hits;       // Lookups answered from a fresh entry
+    uint32_t stale_hits; // Lookups answered from an expired entry while it was refreshed
+    uint32_t misses;     // Lookups that had to wait for the resolver
+    uint32_t refreshes;  // Background resolutions (refreshes and prefetches)
+    uint32_t failures;   // Resolutions that failed
+} dns_cache_stats_t;
+
+/**
+ * @brief Initialize the cache and start its refresh task
+ * @param resolver The resolver to use, or NULL for the built-in one, which
+ *                 queries the DNS server of the network interface over UDP
+ *                 and honours the TTL of the answer
+ */
+void DnsCacheInit(dns_resolver_fn_t resolver);
+
+/**
+ * @brief Look up a host name
+ * A fresh entry is returned at once. An expired entry is still returned
+ * (serve-stale) while the refresh task resolves the name again; only a
+ * missing or long-expired entry waits for the resolver.
+ * @param host The name to look up
+ * @param ipv4 Set to the address (network byte order)
+ * @return 0 on success, -1 if the name could not be resolved
+ */
+int DnsCacheLookup(const char *host, uint32_t *ipv4);
+
+/**
+ * @brief Make sure an answer for host is still fresh in within_ms
+ * If it is missing or expires before then, the refresh task resolves the
+ * name in the background, so the next lookup does not wait
+ * @param host The name to resolve ahead of time
+ * @param within_ms Time until the name is needed
+ */
+void DnsCachePrefetch(const char *host, uint32_t within_ms);
+
+/**
+ * @brief Get a copy of the cache counters
+ * @param stats Pointer to store the counters
+ */
+void DnsCacheGetStats(dns_cache_stats_t *stats);
+
+#endif // DNSCACHE_H
@@ -0,0 +1,126 @@
+#ifndef ENDPOINT_H
+#define ENDPOINT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "retry.h"
+
+#define ENDPOINT_MAX 4
+#define ENDPOINT_URL_LENGTH 128
+#define ENDPOINT_LIST_LENGTH (ENDPOINT_MAX * ENDPOINT_URL_LENGTH) // Space-separated list
+
+/**
+ * @brief Health and latency of one server endpoint, as exposed to diagnostics
+ */
+typedef struct
+{
+    char url[ENDPOINT_URL_LENGTH];
+    uint32_t rtt_ms;     // Smoothed probe round trip (0 = not measured yet)
+    uint8_t error_pct;   // Smoothed share of failed operations
+    bool healthy;        // Breaker not open and error rate below the limit
+    bool active;         // Currently used for polling and ACKs
+    uint32_t operations; // Operations reported (polls, POSTs, probes)
+    uint32_t failures;   // Operations that failed
+} endpoint_info_t;
+
+/**
+ * @brief Initialize the endpoint list and load it from NVS
+ * Must be called after NVS is initialized (WifiInit)
+ */
+void EndpointInit(void);
+
+/**
+ * @brief Replace the endpoint list and save it to NVS
+ * Entries that keep their URL keep their statistics. Saving an unchanged
+ * list does not write to NVS.
+ * @param list URLs in order of preference, separated by spaces or commas
+ * @return 0 on success, -1 if the list is empty, too long or could not be saved
+ */
+int EndpointSetList(const char *list);
+
+/**
+ * @brief Append an endpoint to the list and save it
+ * @param url The URL to add
+ * @return 0 on success, -1 if the list is full or could not be saved
+ */
+int EndpointAdd(const char *url);
+
+/**
+ * @brief Remove an endpoint from the list and save it
+ * @param index Zero-based position in the list
+ * @return 0 on success, -1 if there is no such entry or it could not be saved
+ */
+int EndpointRemove(size_t index);
+
+/**
+ * @brief Get the endpoint list as a space-separated string
+ * @return 0 on success, -1 if the list is empty
+ */
+int EndpointGetList(char *list, size_t max_len);
+
+/**
+ * @brief Number of configured endpoints
+ */
+size_t EndpointCount(void);
+
+/**
+ * @brief Get the endpoint currently in use
+ * @param url Buffer for its URL (may be NULL)
+ * @param max_len Size of the buffer
+ * @return Its index, or -1 if no endpoint is configured
+ */
+int EndpointGetActive(char *url, size_t max_len);
+
+/**
+ * @brief Get the URL of an endpoint
+ * @return 0 on success, -1 if there is no such entry
+ */
+int EndpointGetUrl(size_t index, char *url, size_t max_len);
+
+/**
+ * @brief Get the circuit breaker of an endpoint
+ * Breakers live as long as the module, so the pointer stays valid
+ * @return The breaker, or NULL if index is out of range
+ */
+retry_breaker_t *EndpointGetBreaker(size_t index);
+
+/**
+ * @brief Record the outcome of an operation against an endpoint
+ */
+void EndpointReportResult(size_t index, bool success);
+
+/**
+ * @brief Record a measured round trip to an endpoint
+ */
+void EndpointReportRtt(size_t index, uint32_t rtt_ms);
+
+/**
+ * @brief Switch away from a failing active endpoint
+ * Picks the best healthy other endpoint, if any
+ * @return true if the active endpoint changed
+ */
+bool EndpointFailover(void);
+
+/**
+ * @brief Re-evaluate the choice of endpoint after new measurements
+ * Moves to a healthy endpoint that is clearly faster than the active one, or
+ * to the best healthy one if the active endpoint is unhealthy
+ * @return true if the active endpoint changed
+ */
+bool EndpointReselect(void);
+
+/**
+ * @brief Time until the endpoints should be probed again
+ * Probes are frequent while some endpoint is unhealthy, so a recovered
+ * primary is noticed quickly
+ */
+uint32_t EndpointProbeIntervalMs(void);
+
+/**
+ * @brief Get the health and latency of an endpoint
+ * @return 0 on success, -1 if there is no such entry
+ */
+int EndpointGetInfo(size_t index, endpoint_info_t *info);
+
+#endif // ENDPOINT_H
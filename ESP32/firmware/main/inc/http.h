@@ -2,6 +2,7 @@
 #define HTTP_H
 
 #include <stddef.h>
+#include "retry.h"
 
 /**
  * @brief Initialize the HTTP client module
@@ -10,32 +11,61 @@ void HttpInit(void);
 
 /**
  * @brief Start the HTTP polling task
- * This task will fetch the URL every 2 seconds when WiFi is connected
+ * While WiFi is connected the task polls 1 s after a command, doubles the
+ * interval up to 30 s while the server is idle (a server hint overrides it),
+ * and spreads every delay by +/-20 % jitter. A server that grants a long-poll
+ * wait is asked again right after each answer. ws://, mqtt:// and coap://
+ * URLs run their push session instead.
  */
 void HttpStartPolling(void);
 
 /**
  * @brief Save URL to NVS
+ * The URL replaces the whole endpoint list; use the endpoint module to keep
+ * several servers
  * @param url The URL to save
  * @return 0 on success, -1 on failure
  */
 int HttpSaveUrl(const char* url);
 
 /**
- * @brief Load URL from NVS
+ * @brief Load the primary URL (first entry of the endpoint list)
  * @param url Buffer to store the URL (must be at least 128 bytes)
  * @param max_len Maximum length of the buffer
  * @return 0 on success, -1 on failure or not found
  */
 int HttpLoadUrl(char* url, size_t max_len);
 
+/**
+ * @brief Outcome of HttpPostJson
+ */
+typedef enum
+{
+    HTTP_POST_OK,          // Accepted by the server (2xx)
+    HTTP_POST_FAILED,      // Transport error, any other non-2xx status, or the breaker is open: try again later
+    HTTP_POST_REJECTED,    // The server refused the body (400, 413, 415, 422): sending it again will not help
+    HTTP_POST_UNAVAILABLE, // No URL is set, or the active server is not reached over HTTP (mqtt://, coap://)
+} http_post_result_t;
+
 /**
  * @brief Send POST request with JSON payload to the configured URL
- * Uses the same endpoint as GET requests (same URL, different HTTP method)
+ * Uses the same endpoint as GET requests (same URL, different HTTP method).
+ * Blocks for up to the POST timeout; producers should queue messages with
+ * OutboxEnqueue instead of calling this from the poll path. Failed attempts
+ * are retried briefly, and the call fails immediately while the server's
+ * circuit breaker is open. A 429 is not retried here; the caller waits for
+ * its Retry-After
  * @param json_payload The JSON string to send
- * @return 0 on success, -1 on failure
+ * @param retry_after_ms Set to the Retry-After the server sent with a failure, 0 if none (may be NULL)
+ * @return The outcome
  */
-int HttpPostJson(const char* json_payload);
+http_post_result_t HttpPostJson(const char* json_payload, uint32_t* retry_after_ms);
 
-#endif // HTTP_H
+/**
+ * @brief Get the state of the active server's circuit breaker and retry counters
+ * Shared by the GET polls and the POSTs; every endpoint has its own breaker
+ * @param stats Filled with the current state
+ */
+void HttpGetRetryStats(retry_stats_t *stats);
 
+#endif // HTTP_H
@@ -0,0 +1,145 @@
+#ifndef HTTPCLIENT_H
+#define HTTPCLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_http_client.h"
+
+/**
+ * @brief Extra request header
+ */
+typedef struct
+{
+    const char *key;
+    const char *value;
+} http_header_t;
+
+/**
+ * @brief Request description
+ */
+typedef struct
+{
+    esp_http_client_method_t method; // HTTP method (HTTP_METHOD_GET or HTTP_METHOD_POST)
+    const char *url;                 // Full request URL
+    const http_header_t *headers;    // Extra headers for this request only (may be NULL)
+    size_t header_count;             // Number of entries in headers
+    const char *content_type;        // Content-Type of the body (NULL for application/json)
+    const char *body;                // Request body (NULL for none)
+    size_t body_len;                 // Length of the request body
+    int timeout_ms;                  // Timeout for this request in milliseconds
+} http_request_t;
+
+/**
+ * @brief Callback for response headers
+ * @param key Header name
+ * @param value Header value
+ * @param ctx The ctx pointer of the response context
+ */
+typedef void (*http_header_cb_t)(const char *key, const char *value, void *ctx);
+
+/**
+ * @brief Callback for each chunk of the response body as it arrives
+ * @param data The chunk (not null-terminated)
+ * @param len Length of the chunk
+ * @param ctx The ctx of the response context
+ */
+typedef void (*http_data_cb_t)(const char *data, size_t len, void *ctx);
+
+/**
+ * @brief Per-request response context
+ * The caller owns the buffer; the client fills it while the request runs.
+ * Callers that consume the body incrementally set on_data and may leave buffer NULL.
+ */
+typedef struct
+{
+    char *buffer;               // Response body (always null-terminated, may be NULL)
+    size_t buffer_size;         // Size of buffer in bytes
+    size_t length;              // Number of body bytes stored in buffer
+    size_t received;            // Number of body bytes received
+    bool truncated;             // true if the body did not fit into buffer
+    int status_code;            // HTTP status code (0 if the request failed)
+    http_header_cb_t on_header; // Called for every response header (may be NULL)
+    http_data_cb_t on_data;     // Called for every body chunk (may be NULL)
+    void *ctx;                  // Passed to on_header and on_data
+} http_response_t;
+
+/**
+ * @brief Connection statistics of the persistent client
+ */
+typedef struct
+{
+    uint32_t requests;         // Requests performed
+    uint32_t connections;      // New TCP/TLS connections (handshakes)
+    uint32_t reused;           // Requests served over an already open connection
+    uint32_t reconnects;       // Stale connections re-opened transparently
+    uint32_t failures;         // Requests that failed after reconnecting
+    uint32_t connect_ms_last;  // Duration of the last connect, TLS handshake included
+    uint32_t connect_ms_total; // Sum of all connect durations (divide by connections)
+} http_client_stats_t;
+
+/**
+ * @brief Initialize the persistent HTTP client
+ * The connection itself is opened lazily by the first request
+ */
+void HttpClientInit(void);
+
+/**
+ * @brief Perform a request over a persistent keep-alive connection
+ * GET polls use the primary connection. Other requests share it while it is
+ * free and use a second connection while a poll runs, so they never wait
+ * for a parked long-poll. If the server closed the connection in the
+ * meantime, it is re-opened once
+ * @param request The request to perform
+ * @param response Response context to fill (may be NULL to discard the body)
+ * @return 0 if the request completed (any status code), -1 on transport failure
+ */
+int HttpClientRequest(const http_request_t *request, http_response_t *response);
+
+/**
+ * @brief Close the persistent connections (they are re-opened on the next request)
+ */
+void HttpClientClose(void);
+
+/**
+ * @brief Measure the round trip to a server with a HEAD request
+ * Uses a separate, short-lived connection; the handshake is part of the
+ * measurement, so results are comparable between servers
+ * @param url The URL to probe
+ * @param timeout_ms Request timeout
+ * @param status_code Set to the HTTP status code (0 if the request failed)
+ * @param elapsed_ms Set to the time from connect to the end of the response
+ * @return 0 if the request completed (any status code), -1 on transport failure
+ */
+int HttpClientProbe(const char *url, int timeout_ms, int *status_code, uint32_t *elapsed_ms);
+
+/**
+ * @brief Resolve the host of a URL ahead of the next request
+ * Requests connect to the cached address of the host; this refreshes it in
+ * the background if it would expire before the request is made
+ * @param url The URL that will be requested
+ * @param within_ms Time until the request
+ */
+void HttpClientPrefetch(const char *url, uint32_t within_ms);
+
+/**
+ * @brief Get a copy of the connection statistics
+ * Does not wait for a request in progress
+ * @param stats Pointer to store the statistics
+ */
+void HttpClientGetStats(http_client_stats_t *stats);
+
+/**
+ * @brief Enable or disable the echo of response bodies to the UART
+ * The setting is saved to NVS; echo is on by default
+ * @param enabled true to echo text response bodies
+ * @return 0 on success, -1 if the setting could not be saved
+ */
+int HttpClientSetEcho(bool enabled);
+
+/**
+ * @brief Check whether response bodies are echoed to the UART
+ */
+bool HttpClientGetEcho(void);
+
+#endif // HTTPCLIENT_H
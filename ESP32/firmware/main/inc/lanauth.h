@@ -0,0 +1,55 @@
+#ifndef LANAUTH_H
+#define LANAUTH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LAN_AUTH_MAX_KEY_LENGTH 64
+#define LAN_AUTH_SIGNATURE_LENGTH 64 // Hex-encoded HMAC-SHA256
+#define LAN_AUTH_MAX_SKEW_S 30       // Accepted difference between request timestamp and device clock
+
+/**
+ * @brief Outcome of checking a signed LAN request
+ */
+typedef enum
+{
+    LAN_AUTH_OK,
+    LAN_AUTH_DISABLED,      // No key configured
+    LAN_AUTH_BAD_SIGNATURE, // Missing or wrong signature
+    LAN_AUTH_NO_CLOCK,      // The device clock is not set yet, timestamps cannot be checked
+    LAN_AUTH_EXPIRED,       // Timestamp outside the accepted window
+} lan_auth_result_t;
+
+/**
+ * @brief Load the pre-shared key from NVS
+ * Must be called after NVS is initialized (WifiInit)
+ */
+void LanAuthInit(void);
+
+/**
+ * @brief Set and save the pre-shared key
+ * @param key The key (up to LAN_AUTH_MAX_KEY_LENGTH characters), or "" to
+ *            disable LAN commands
+ * @return 0 on success, -1 if the key is too long or could not be saved
+ */
+int LanAuthSetKey(const char *key);
+
+/**
+ * @brief Check whether a key is configured (LAN commands are accepted)
+ */
+bool LanAuthIsEnabled(void);
+
+/**
+ * @brief Verify a signed request
+ * The signature is HMAC-SHA256(key, "<timestamp>.<body>") in hex; the body
+ * carries the command ids and sequence numbers, so they are covered too.
+ * Replayed requests are caught by the timestamp window here and by the
+ * sequence numbers when the commands are executed.
+ * @param timestamp Unix time of the request, as sent
+ * @param body The request body
+ * @param body_len Length of the body
+ * @param signature The hex signature, as sent
+ */
+lan_auth_result_t LanAuthVerify(const char *timestamp, const char *body, size_t body_len, const char *signature);
+
+#endif // LANAUTH_H
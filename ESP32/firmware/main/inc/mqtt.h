@@ -0,0 +1,32 @@
+#ifndef MQTT_H
+#define MQTT_H
+
+#include <stdbool.h>
+
+/**
+ * @brief Callback polled by the MQTT session to know when to end it
+ * @return true to disconnect and return
+ */
+typedef bool (*mqtt_stop_cb_t)(void);
+
+/**
+ * @brief Run an MQTT command session (blocking)
+ * Subscribes to <prefix>/<device_id>/cmd and feeds every message into
+ * ServerProcessResponse. ACKs are published to <prefix>/<device_id>/ack and
+ * the relay states to <prefix>/<device_id>/state, both with QoS 1.
+ * @param url mqtt:// or mqtts:// broker URL; an optional path sets the
+ *            topic prefix (default "webrelay")
+ * @param should_stop Called periodically; the session ends when it returns true
+ * @return 0 if the session was established and has ended,
+ *         -1 if the broker could not be reached
+ */
+int MqttRun(const char *url, mqtt_stop_cb_t should_stop);
+
+/**
+ * @brief Publish an ACK on the active MQTT session (QoS 1)
+ * @param json_payload The ACK JSON string
+ * @return 0 on success, -1 on failure or when no session is active
+ */
+int MqttPublishAck(const char *json_payload);
+
+#endif // MQTT_H
@@ -0,0 +1,62 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Outbound queue counters (since boot)
+ */
+typedef struct
+{
+    uint32_t pending;  // Messages currently waiting for delivery
+    uint32_t sent;     // Messages delivered to the server
+    uint32_t batches;  // POST requests that delivered them
+    uint32_t retries;  // Failed delivery attempts
+    uint32_t dropped;  // Messages discarded because the queue was full
+    uint32_t rejected; // Messages discarded because the server refused them (4xx)
+    uint32_t restored; // Messages restored from NVS at boot
+} outbox_stats_t;
+
+/**
+ * @brief Delivers one message over a transport session (same as server_ack_sender_t)
+ * @return 0 if the message was sent, -1 to keep it queued
+ */
+typedef int (*outbox_sender_t)(const char *json_payload);
+
+/**
+ * @brief Initialize the outbound queue and start the sender task
+ * Undelivered persistent messages from the previous run are restored from NVS.
+ * Must be called after NVS is initialized (WifiInit).
+ */
+void OutboxInit(void);
+
+/**
+ * @brief Queue a JSON message for delivery to the server (non-blocking)
+ * Messages are POSTed in order, batched into a JSON array when several are
+ * waiting, and retried with exponential backoff until the server accepts them.
+ * While a transport session is set (OutboxSetSender) they are handed to it
+ * one by one instead; without either (MQTT or CoAP server, session down)
+ * they wait. A message the server refuses is dropped and counted, as is a
+ * new message while the queue is full.
+ * @param json_payload The JSON object to send
+ * @param persist true to keep the message in NVS until it is delivered (ACKs)
+ * @return 0 on success, -1 if the message is too long, the queue is full or not initialized
+ */
+int OutboxEnqueue(const char *json_payload, bool persist);
+
+/**
+ * @brief Set the transport session that delivers queued messages
+ * Installed by push transports while connected (ServerSetAckSender); the
+ * queue is drained through it right away
+ * @param sender The session's sender, or NULL to POST again
+ */
+void OutboxSetSender(outbox_sender_t sender);
+
+/**
+ * @brief Get the outbound queue counters
+ * @param stats Filled with the current counters
+ */
+void OutboxGetStats(outbox_stats_t *stats);
+
+#endif // OUTBOX_H
@@ -1,24 +1,99 @@
 #ifndef RELAY_H
 #define RELAY_H
 
+#include <stdint.h>
+#include "sdkconfig.h"
 #include "driver/gpio.h"
 
+#define RELAY_MAX_COUNT 16                 // Upper bound of CONFIG_RELAY_COUNT (fits the state mask)
+#define RELAY_COUNT CONFIG_RELAY_COUNT     // Relays on this board, set in menuconfig ("Web Relay")
+
+/**
+ * @brief Board description of one relay, from menuconfig
+ */
+typedef struct
+{
+    gpio_num_t gpio;
+    uint8_t active_level;   // GPIO level that energises the relay
+    uint8_t default_state;  // State applied by RelayInit
+    uint16_t operate_us;    // Coil energised to contacts closed (zero-cross timing)
+    uint16_t release_us;    // Coil released to contacts open
+    const char *name;
+} relay_descriptor_t;
+
+/**
+ * @brief Switching statistics of multi-relay transitions
+ */
+typedef struct
+{
+    uint32_t transitions;  // Transitions that switched more than one relay
+    uint32_t last_skew_ns; // Time from the first to the last output register write of the last one
+    uint32_t max_skew_ns;  // Largest skew since boot
+} relay_switch_stats_t;
+
 /**
- * @brief Initialize the relay GPIOs
+ * @brief Initialize the relay GPIOs and apply each relay's boot state
  */
 void RelayInit(void);
 
 /**
  * @brief Turn a relay ON
- * @param relayNumber The relay number (1 or 2)
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
  */
 void RelayOn(int relayNumber);
 
 /**
  * @brief Turn a relay OFF
- * @param relayNumber The relay number (1 or 2)
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
  */
 void RelayOff(int relayNumber);
 
-#endif // RELAY_H
+/**
+ * @brief Switch several relays at once
+ * The output levels of all relays in the mask are applied with one write to
+ * the GPIO set and one to the clear register (per 32-pin bank), so the
+ * loads switch together instead of milliseconds apart. With zero-cross
+ * switching (CONFIG_RELAY_ZERO_CROSS) and a regular detector signal, each
+ * relay is written its operate or release time before the next usable
+ * crossing instead, so the contacts change together at the crossing; the
+ * call then blocks until the writes are done (about 10 to 40 ms).
+ * @param mask Relays to switch, bit (n - 1) for relay n; bits above RELAY_COUNT are ignored
+ * @param states New states of the relays in the mask (bit set = ON)
+ */
+void RelayApplyMask(uint32_t mask, uint32_t states);
+
+/**
+ * @brief Get the measured switching skew of multi-relay transitions
+ * @param stats Filled with the statistics
+ */
+void RelayGetSwitchStats(relay_switch_stats_t *stats);
 
+/**
+ * @brief Get the last commanded state of a relay
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ * @return 1 if ON, 0 if OFF, -1 for an invalid relay number
+ */
+int RelayGetState(int relayNumber);
+
+/**
+ * @brief Get the last commanded state of all relays
+ * @return Bit (n - 1) set if relay n is ON
+ */
+uint32_t RelayGetStates(void);
+
+/**
+ * @brief Give a relay's pin back to its GPIO output
+ * Used after a peripheral (RMT, LEDC) has driven the pin; the pin is set to
+ * the relay's last commanded state before it is reconnected, so it does not glitch
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ */
+void RelayRestoreOutput(int relayNumber);
+
+/**
+ * @brief Get the board description of a relay
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ * @return The descriptor, or NULL for an invalid relay number
+ */
+const relay_descriptor_t *RelayGetDescriptor(int relayNumber);
+
+#endif // RELAY_H
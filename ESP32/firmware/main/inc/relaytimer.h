@@ -0,0 +1,55 @@
+#ifndef RELAYTIMER_H
+#define RELAYTIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Called from the relay timer task when a relay's auto-off timer fires
+ * It may block (zero-cross switching) without delaying other esp_timer callbacks
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ */
+typedef void (*relay_timer_expired_t)(int relayNumber);
+
+/**
+ * @brief Create the auto-off timers (one esp_timer per relay) and the task that handles their expiry
+ * Called by DispatcherInit, which switches the relays when they expire
+ * @param on_expired Called when a timer fires
+ */
+void RelayTimerInit(relay_timer_expired_t on_expired);
+
+/**
+ * @brief Turn a relay OFF after a delay
+ * Replaces any pending auto-off of the relay, so this also extends or
+ * shortens a running one. Call it before switching the relay ON: an
+ * auto-off that is already due can then no longer turn the new state off.
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ * @param duration_us Delay in microseconds
+ * @return 0 on success, -1 for an invalid relay number or if the timer could not be started
+ */
+int RelayTimerArm(int relayNumber, uint64_t duration_us);
+
+/**
+ * @brief Cancel the pending auto-off of a relay, if any
+ * Call it before switching the relay by hand, for the same reason as above
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ */
+void RelayTimerCancel(int relayNumber);
+
+/**
+ * @brief Check from the expiry callback whether the auto-off is still due
+ * Clears the deadline if it has passed. A timer that was re-armed or
+ * cancelled after the callback was dispatched is not claimed.
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ * @return true if the relay must be switched OFF now
+ */
+bool RelayTimerClaimExpired(int relayNumber);
+
+/**
+ * @brief Get the time left until a relay's auto-off
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ * @return Remaining time in microseconds, 0 if no auto-off is pending
+ */
+uint64_t RelayTimerRemainingUs(int relayNumber);
+
+#endif // RELAYTIMER_H
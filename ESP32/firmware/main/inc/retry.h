@@ -0,0 +1,141 @@
+#ifndef RETRY_H
+#define RETRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+/**
+ * @brief How one operation is retried
+ */
+typedef struct
+{
+    uint8_t max_attempts;        // Attempts per operation, including the first
+    uint32_t attempt_timeout_ms; // Budget of a single attempt
+    uint32_t total_budget_ms;    // Budget of the whole operation, delays included
+    uint32_t base_delay_ms;      // Shortest delay between attempts
+    uint32_t max_delay_ms;       // Longest delay between attempts
+} retry_policy_t;
+
+/**
+ * @brief Outcome of a single attempt
+ */
+typedef enum
+{
+    RETRY_ATTEMPT_OK,       // Completed
+    RETRY_ATTEMPT_FAILED,   // Transport error or server failure: retry, counts against the breaker
+    RETRY_ATTEMPT_REJECTED, // The server answered but refused: no retry, the server is up
+} retry_attempt_result_t;
+
+/**
+ * @brief Perform one attempt of an operation
+ * @param timeout_ms Time the attempt may take (already clamped to the remaining budget)
+ * @param ctx The ctx passed to RetryRun
+ */
+typedef retry_attempt_result_t (*retry_attempt_fn_t)(uint32_t timeout_ms, void *ctx);
+
+/**
+ * @brief Circuit breaker states
+ */
+typedef enum
+{
+    RETRY_BREAKER_CLOSED,    // Operations run normally
+    RETRY_BREAKER_OPEN,      // The endpoint is known to be down, operations fail fast
+    RETRY_BREAKER_HALF_OPEN, // Cooldown over, a single probe operation is running
+} retry_breaker_state_t;
+
+/**
+ * @brief Breaker state and counters, as exposed to diagnostics
+ */
+typedef struct
+{
+    retry_breaker_state_t state;
+    uint32_t consecutive_failures; // Failed operations since the last success
+    uint32_t open_remaining_ms;    // Time until the next probe while open
+    uint32_t operations;           // Operations started (including fast-failed ones)
+    uint32_t attempts;             // Attempts performed
+    uint32_t retries;              // Attempts that were retries
+    uint32_t failures;             // Operations that failed after all attempts
+    uint32_t fast_fails;           // Operations refused while the breaker was open
+    uint32_t trips;                // Times the breaker opened
+} retry_stats_t;
+
+/**
+ * @brief Circuit breaker shared by every operation against one endpoint
+ * Fields are private; use the functions below
+ */
+typedef struct
+{
+    const char *name;
+    uint8_t failure_threshold;
+    uint32_t cooldown_min_ms;
+    uint32_t cooldown_max_ms;
+    uint32_t cooldown_ms;
+    TickType_t open_until;
+    bool probe_in_flight;
+    retry_stats_t stats;
+    SemaphoreHandle_t mutex;
+} retry_breaker_t;
+
+/**
+ * @brief Initialize a circuit breaker
+ * @param breaker The breaker to initialize
+ * @param name Name used in log messages
+ * @param failure_threshold Consecutive failed operations that open the breaker
+ * @param cooldown_min_ms Time the breaker stays open after tripping
+ * @param cooldown_max_ms Upper bound of the cooldown, which doubles after every failed probe
+ */
+void RetryBreakerInit(retry_breaker_t *breaker, const char *name, uint8_t failure_threshold,
+                      uint32_t cooldown_min_ms, uint32_t cooldown_max_ms);
+
+/**
+ * @brief Close a breaker and clear its counters
+ * Used when the breaker is reassigned to a different endpoint
+ */
+void RetryBreakerReset(retry_breaker_t *breaker);
+
+/**
+ * @brief Run an operation with retries
+ * Failed attempts are retried after a decorrelated-jitter delay while attempts
+ * and budget remain. While the breaker is open the operation fails immediately
+ * without calling attempt; once the cooldown is over a single attempt probes
+ * the endpoint and closes or re-opens the breaker.
+ * @param breaker The endpoint's breaker
+ * @param policy The retry policy
+ * @param attempt Performs one attempt
+ * @param ctx Passed to attempt
+ * @return 0 if an attempt succeeded, -1 otherwise
+ */
+int RetryRun(retry_breaker_t *breaker, const retry_policy_t *policy, retry_attempt_fn_t attempt, void *ctx);
+
+/**
+ * @brief Compute the next delay with decorrelated jitter
+ * A random value between base_delay_ms and three times the previous delay,
+ * capped at max_delay_ms, so retries spread out instead of arriving in waves
+ * @param policy Supplies base_delay_ms and max_delay_ms
+ * @param prev_delay_ms The previous delay (0 for the first retry)
+ * @return The delay in milliseconds
+ */
+uint32_t RetryNextDelay(const retry_policy_t *policy, uint32_t prev_delay_ms);
+
+/**
+ * @brief Get the time until the breaker lets the next operation through
+ * @param breaker The breaker
+ * @return Milliseconds until the next probe, 0 if operations may run now
+ */
+uint32_t RetryBreakerWaitMs(retry_breaker_t *breaker);
+
+/**
+ * @brief Get a copy of the breaker state and counters
+ * @param breaker The breaker
+ * @param stats Filled with the current state
+ */
+void RetryBreakerGetStats(retry_breaker_t *breaker, retry_stats_t *stats);
+
+/**
+ * @brief Name of a breaker state for logs and diagnostics
+ */
+const char *RetryBreakerStateName(retry_breaker_state_t state);
+
+#endif // RETRY_H
@@ -0,0 +1,54 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCENE_MAX 16         // Scenes are numbered 1 to SCENE_MAX
+#define SCENE_NAME_LENGTH 16 // Including the terminator
+
+/**
+ * @brief A named set of relay states, recalled with one command
+ */
+typedef struct
+{
+    uint32_t mask;   // Relays the scene sets, bit (n - 1) for relay n (0 = scene not defined)
+    uint32_t states; // Their states (bit set = ON)
+    char name[SCENE_NAME_LENGTH];
+} scene_t;
+
+/**
+ * @brief Load the scene table from NVS into RAM
+ * Must be called after WifiInit (NVS)
+ */
+void SceneInit(void);
+
+/**
+ * @brief Define or delete a scene
+ * Format: "<number> <name> <relay>=<state>[,<relay>=<state>...]", e.g.
+ * "3 evening 1=1,2=0"; the name has no spaces. "<number>" alone deletes the
+ * scene. Relays not listed are left alone when the scene is recalled.
+ * The table is saved to NVS.
+ * @param definition The definition
+ * @return 0 on success, -1 if the definition is invalid or could not be saved
+ */
+int SceneDefine(const char *definition);
+
+/**
+ * @brief Look up a scene (from the RAM copy, no flash access)
+ * @param number The scene number (1 to SCENE_MAX)
+ * @param scene Filled with the scene
+ * @return 0 on success, -1 if the scene is not defined
+ */
+int SceneGet(int number, scene_t *scene);
+
+/**
+ * @brief Format a scene in the SceneDefine format
+ * @param number The scene number (1 to SCENE_MAX)
+ * @param buffer Output buffer
+ * @param size Size of the buffer
+ * @return 0 on success, -1 if the scene is not defined
+ */
+int SceneFormat(int number, char *buffer, size_t size);
+
+#endif // SCENE_H
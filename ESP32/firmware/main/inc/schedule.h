@@ -0,0 +1,56 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define SCHEDULE_MAX_ENTRIES 16
+#define SCHEDULE_MAX_TZ_LENGTH 48
+#define SCHEDULE_SPEC_LENGTH 640 // Longest X-Relay-Schedule value accepted
+
+/**
+ * @brief One scheduled relay action
+ * Recurring entries (days != 0) run at a local time of day on the selected
+ * weekdays; one-shot entries (days == 0) run once at an absolute time
+ */
+typedef struct
+{
+    uint32_t start;      // Seconds after local midnight, or Unix time for one-shot entries
+    uint32_t duration_s; // For ON: switch OFF again after this long (0 = stay ON)
+    uint8_t relay;       // Relay number (1-based)
+    uint8_t state;       // 1 = ON, 0 = OFF
+    uint8_t days;        // Weekday mask, bit 0 = Sunday ... bit 6 = Saturday
+    uint8_t reserved;
+} schedule_entry_t;
+
+/**
+ * @brief Load the stored schedule and start executing it
+ * Entries run from the local clock, so they keep working without the server.
+ * Must be called after WifiInit (NVS) and ServerInit.
+ */
+void ScheduleInit(void);
+
+/**
+ * @brief Replace the schedule with one sent by the server
+ * Format: "<version> [tz=<POSIX TZ>] [<relay>,<state>,<days>,<start>,<duration_s> ...]",
+ * fields as in schedule_entry_t, e.g. "3 tz=CET-1CEST,M3.5.0,M10.5.0/3 2,1,62,25200,1800"
+ * (relay 2 ON on weekdays 07:00-07:30). A version alone clears the schedule.
+ * The schedule is saved to NVS; a spec with the current version is ignored.
+ * @param spec The schedule
+ * @return 0 on success (or unchanged), -1 if the spec is invalid
+ */
+int ScheduleApply(const char *spec);
+
+/**
+ * @brief Get the version of the stored schedule (0 = none received yet)
+ */
+uint32_t ScheduleGetVersion(void);
+
+/**
+ * @brief Get the number of entries and the time of the next action
+ * @param next Set to the Unix time of the next action, 0 if none (or the clock is not set)
+ * @return Number of entries
+ */
+int ScheduleGetInfo(time_t *next);
+
+#endif // SCHEDULE_H
@@ -2,15 +2,92 @@
 #define SERVER_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include "cmdparser.h"
+#include "dispatcher.h"
+
+#define SERVER_MAX_HELD 4                              // Held commands remembered until the server is told
+#define SERVER_HELD_LIST_LENGTH (SERVER_MAX_HELD * 11) // "<seq>,<seq>..." as written by ServerGetHeld
+
+/**
+ * @brief Function used to deliver an ACK JSON payload to the server
+ * @param json_payload The JSON string to send
+ * @return 0 on success, -1 on failure
+ */
+typedef int (*server_ack_sender_t)(const char *json_payload);
+
+/**
+ * @brief Initialize command execution
+ * Must be called before any transport delivers commands
+ */
+void ServerInit(void);
+
+/**
+ * @brief Execute a batch of decoded commands in order
+ * Switches the relays, updates the ACK watermark and sends the ACKs that are
+ * needed; sequenced commands share one cumulative ACK for the last of them
+ * @param commands The commands to execute
+ * @param count Number of commands
+ * @param source Where the commands come from (RELAY_SOURCE_REMOTE for the server)
+ */
+void ServerExecuteCommands(const relay_command_t *commands, size_t count, relay_source_t source);
+
+/**
+ * @brief Execute the commands of a batch that have not been executed yet
+ * Sequenced commands at or below the watermark are skipped, so a batch that
+ * is delivered again is not executed twice. No ACK is sent; the caller
+ * reports the returned watermark itself.
+ * @param commands The commands to execute
+ * @param count Number of commands
+ * @return Sequence number of the last executed command afterwards
+ */
+uint32_t ServerExecuteNewCommands(const relay_command_t *commands, size_t count);
 
 /**
  * @brief Process server response
- * Parses JSON response and controls relays accordingly
+ * Parses a complete JSON response (one command or an array of them) and
+ * controls relays accordingly
  * @param response The response string to process
  * @param response_len Length of the response string
  * @param status_code HTTP status code (200 for success)
+ * @return 1 if the response carried at least one command, 0 otherwise
+ */
+int ServerProcessResponse(const char *response, size_t response_len, int status_code);
+
+/**
+ * @brief Set the function used to send ACKs
+ * Transports with their own uplink (e.g. WebSocket) install their sender while connected;
+ * ACKs the sender fails to deliver fall back to the outbox, which the same sender drains
+ * @param sender The ACK sender, or NULL to restore the default (the outbox POST queue)
+ */
+void ServerSetAckSender(server_ack_sender_t sender);
+
+/**
+ * @brief Get the cumulative ACK watermark
+ * Sequenced commands are not acknowledged one by one; the device reports the
+ * sequence number of the last executed command on its next poll instead
+ * @return Sequence number of the last executed command (0 = none); kept across
+ *         reboots with the executed command ids (dedup.c)
+ */
+uint32_t ServerGetExecutedSeq(void);
+
+/**
+ * @brief Get the sequenced commands a manual hold kept from running
+ * They are covered by the cumulative ACK like executed commands, so the
+ * server must be told separately not to take their relay states as applied:
+ * the list goes with every sequenced ACK ("held" member) and poll
+ * (X-Relay-Held header) until ServerClearHeld removes it
+ * @param out Set to a comma-separated list of sequence numbers ("" if none)
+ * @param size Size of out (SERVER_HELD_LIST_LENGTH)
+ * @return The newest sequence number in the list, 0 if it is empty
+ */
+uint32_t ServerGetHeld(char *out, size_t size);
+
+/**
+ * @brief Forget held commands once the server has their list
+ * @param up_to_seq The value ServerGetHeld returned with the list
  */
-void ServerProcessResponse(const char *response, size_t response_len, int status_code);
+void ServerClearHeld(uint32_t up_to_seq);
 
 #endif // SERVER_H
 
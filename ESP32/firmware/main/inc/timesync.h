@@ -0,0 +1,35 @@
+#ifndef TIMESYNC_H
+#define TIMESYNC_H
+
+#include <stdbool.h>
+
+/**
+ * @brief Start keeping the system clock in sync over SNTP
+ * The clock is set once the network is up and re-synced periodically; use
+ * time() to read it. Must be called after WifiInit.
+ */
+void TimeSyncInit(void);
+
+/**
+ * @brief Check whether the system clock holds the real time
+ * @return true once the clock has been set
+ */
+bool TimeSyncIsValid(void);
+
+/**
+ * @brief Set the clock from an HTTP Date header
+ * Fallback for networks that block NTP: only used while SNTP has not
+ * synchronized the clock, and only if it is off by more than a couple of
+ * seconds (the header has 1 s resolution)
+ * @param date The header value, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+ * @return 0 if the clock was set, -1 otherwise
+ */
+int TimeSyncFromHttpDate(const char *date);
+
+/**
+ * @brief Set the time zone used for local time (localtime_r, mktime)
+ * @param tz POSIX TZ string, e.g. "CET-1CEST,M3.5.0,M10.5.0/3"; "" for UTC
+ */
+void TimeSyncSetTimezone(const char *tz);
+
+#endif // TIMESYNC_H
@@ -4,6 +4,17 @@
 #include "driver/uart.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include <stdint.h>
+
+/**
+ * @brief TX statistics
+ */
+typedef struct
+{
+    uint32_t written_bytes;  // Bytes queued for transmission
+    uint32_t dropped_bytes;  // Bytes dropped because the TX buffer was full
+    uint32_t dropped_writes; // Writes dropped because the TX buffer was full
+} uart_tx_stats_t;
 
 /**
  * @brief Initialize the UART
@@ -11,13 +22,31 @@
 void UartInit(void);
 
 /**
- * @brief Write data to UART
+ * @brief Queue data for transmission on the UART
+ * Never waits for the serial port: the data is copied into the TX ring buffer
+ * and sent in the background. If it does not fit, the whole write is dropped
+ * and counted in the TX statistics.
  * @param data Pointer to the data buffer to write
  * @param length Length of the data to write
- * @return Number of bytes written, or -1 on error
+ * @return Number of bytes queued, or -1 on error or overflow
  */
 int UartWrite(const char *data, size_t length);
 
+/**
+ * @brief Queue a line followed by CR+LF as one write
+ * The line and its terminator are queued together or dropped together, so
+ * lines from different tasks never interleave
+ * @param line Null-terminated line (without terminator)
+ * @return Number of bytes queued, or -1 on error or overflow
+ */
+int UartWriteLine(const char *line);
+
+/**
+ * @brief Get a copy of the TX statistics
+ * @param stats Pointer to store the statistics
+ */
+void UartGetTxStats(uart_tx_stats_t *stats);
+
 /**
  * @brief Read bytes from UART
  * @param data Pointer to the data buffer to store read data
@@ -0,0 +1,98 @@
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define WAVEFORM_RESOLUTION_HZ 1000000 // RMT tick of pulse trains (1 us)
+#define WAVEFORM_MAX_SYMBOLS 512       // RMT symbols of one pulse train (one symbol covers up to 65 ms)
+#define WAVEFORM_MAX_PWM 4             // PWM outputs at the same time (one LEDC timer each)
+#define WAVEFORM_MAX_PWM_HZ 1000
+
+/**
+ * @brief Hardware-timed output of one relay
+ * A pulse train is generated by RMT, PWM by LEDC; all zero = no waveform
+ */
+typedef struct
+{
+    uint32_t pulse_us; // Pulse train: ON time of each pulse
+    uint32_t gap_us;   // Pulse train: OFF time between pulses
+    uint16_t count;    // Pulse train: number of pulses (0 = 1)
+    uint16_t pwm_hz;   // PWM: frequency (0 = pulse train)
+    uint8_t duty;      // PWM: ON time in percent (1 to 99)
+} waveform_t;
+
+/**
+ * @brief How a waveform ended, as reported to the server
+ */
+typedef enum
+{
+    WAVEFORM_COMPLETED, // Ran to its end
+    WAVEFORM_FAILED,    // Invalid, or no RMT/LEDC channel was free
+} waveform_result_t;
+
+/**
+ * @brief Called from the waveform task when a waveform may have ended
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ * @param generation Identifies the waveform, for WaveformClaimEnded
+ */
+typedef void (*waveform_end_t)(int relayNumber, uint32_t generation);
+
+/**
+ * @brief Start the waveform task
+ * Called by DispatcherInit. WaveformStart, WaveformStop and
+ * WaveformClaimEnded are only called by the dispatcher, with its lock held.
+ * @param on_end Called when a pulse train has been sent or a PWM duration is over
+ */
+void WaveformInit(waveform_end_t on_end);
+
+/**
+ * @brief Check whether a relay action carries a waveform
+ */
+bool WaveformIsSet(const waveform_t *waveform);
+
+/**
+ * @brief Parse the UART form of a waveform
+ * "pulse <ms> [<gap ms> <count>]" or "pwm <Hz> <duty %> [<duration ms>]"
+ * @param text The text after "relay<N> "
+ * @param waveform Filled with the waveform
+ * @param duration_ms Filled with the PWM duration (0 = until switched)
+ * @return 0 on success, -1 if the text is invalid
+ */
+int WaveformParse(const char *text, waveform_t *waveform, uint32_t *duration_ms);
+
+/**
+ * @brief Hand a relay's pin to RMT (pulse train) or LEDC (PWM) and start the waveform
+ * The relay must be OFF; its pin idles at the OFF level before, between
+ * and after the pulses. A PWM with a duration stops when it is over,
+ * otherwise it runs until WaveformStop.
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ * @param waveform The waveform
+ * @param duration_ms PWM only: how long to run it (0 = until stopped)
+ * @return 0 on success, -1 if the waveform is invalid or no channel is free
+ */
+int WaveformStart(int relayNumber, const waveform_t *waveform, uint32_t duration_ms);
+
+/**
+ * @brief Check whether a waveform is running on a relay
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ */
+bool WaveformIsRunning(int relayNumber);
+
+/**
+ * @brief Stop a relay's waveform and give its pin back to the relay (OFF)
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ */
+void WaveformStop(int relayNumber);
+
+/**
+ * @brief Check from the end callback whether the waveform is still the one that ended
+ * Releases its channel and gives the pin back to the relay (OFF) if so. A
+ * waveform that was stopped or replaced after the end was signalled is not claimed.
+ * @param relayNumber The relay number (1 to RELAY_COUNT)
+ * @param generation The generation passed to the end callback
+ * @return true if the waveform has ended now
+ */
+bool WaveformClaimEnded(int relayNumber, uint32_t generation);
+
+#endif // WAVEFORM_H
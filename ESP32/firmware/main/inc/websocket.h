@@ -0,0 +1,30 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stdbool.h>
+
+/**
+ * @brief Callback polled by the WebSocket session to know when to end it
+ * @return true to close the session and return
+ */
+typedef bool (*websocket_stop_cb_t)(void);
+
+/**
+ * @brief Run a WebSocket command session (blocking)
+ * Commands pushed by the server are processed as they arrive and
+ * ACKs are sent back on the same socket while the session is up
+ * @param url The ws:// or wss:// URL of the server
+ * @param should_stop Called periodically; the session ends when it returns true
+ * @return 0 if the session was established and has ended,
+ *         -1 if the connection or the upgrade failed
+ */
+int WebsocketRun(const char *url, websocket_stop_cb_t should_stop);
+
+/**
+ * @brief Send a text message on the active WebSocket session
+ * @param text The null-terminated text to send
+ * @return 0 on success, -1 on failure or when no session is active
+ */
+int WebsocketSendText(const char *text);
+
+#endif // WEBSOCKET_H
@@ -62,5 +62,13 @@ int WifiLoadPassword(char* password, size_t max_len);
  */
 int WifiGetIpAddress(char* ip_str, size_t max_len);
 
+/**
+ * @brief Get the unique device ID (station MAC address as 12 hex digits)
+ * @param id_str Buffer to store the ID (must be at least 13 bytes)
+ * @param max_len Maximum length of the buffer
+ * @return 0 on success, -1 on failure
+ */
+int WifiGetDeviceId(char* id_str, size_t max_len);
+
 #endif // WIFI_H
 
@@ -0,0 +1,69 @@
+#ifndef ZCTIMING_H
+#define ZCTIMING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "zerocross.h"
+
+/**
+ * @brief Zero-cross detector state, advanced by ZcTimingEdge
+ * All times are counts of the 1 MHz zero-cross timer
+ */
+typedef struct
+{
+    bool have_edge;
+    uint64_t last_edge_us;
+    uint32_t interval_us; // Filtered time between edges, 0 = not measured yet
+    uint32_t regular;     // Edges in a row that matched interval_us
+} zc_detector_t;
+
+/**
+ * @brief A step with the timer count it is due at
+ */
+typedef struct
+{
+    uint64_t at_us;
+    zero_cross_step_t step;
+} zc_scheduled_step_t;
+
+/**
+ * @brief Take a detector edge into account
+ * An edge that comes too soon after the previous one is noise (contact
+ * bounce, ringing) and is dropped without touching the timing. The interval
+ * follows slow mains frequency drift without reacting to jitter; an
+ * irregular or missing edge restarts the lock. Runs from IRAM (detector interrupt).
+ * @param detector The detector state
+ * @param now Time of the edge
+ * @return true if the edge was accepted, false if it was rejected as noise
+ */
+bool ZcTimingEdge(zc_detector_t *detector, uint64_t now);
+
+/**
+ * @brief Check whether the detector signal is regular and current
+ * One missed edge is tolerated
+ * @param detector The detector state
+ * @param now Current time
+ * @return true if transitions can be timed to the crossings
+ */
+bool ZcTimingIsLocked(const zc_detector_t *detector, uint64_t now);
+
+/**
+ * @brief Get the first crossing at or after a time (detector must be locked)
+ * @param detector The detector state
+ * @param earliest Earliest usable crossing time
+ * @param offset_us Time from a detector edge to its crossing
+ * @return Time of the crossing
+ */
+uint64_t ZcTimingNextCrossing(const zc_detector_t *detector, uint64_t earliest, uint32_t offset_us);
+
+/**
+ * @brief Plan the writes of a transition for a crossing
+ * Each step is due its delay_us before the crossing; the plan is sorted by due time
+ * @param steps The writes, one per actuation delay
+ * @param count Number of steps (at most RELAY_COUNT)
+ * @param crossing Time the contacts must change at
+ * @param out Filled with count scheduled steps
+ */
+void ZcTimingSchedule(const zero_cross_step_t *steps, int count, uint64_t crossing, zc_scheduled_step_t *out);
+
+#endif // ZCTIMING_H
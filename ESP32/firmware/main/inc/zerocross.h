@@ -0,0 +1,63 @@
+#ifndef ZEROCROSS_H
+#define ZEROCROSS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ZERO_CROSS_RESOLUTION_HZ 1000000 // Timestamps and alarms (1 us)
+#define ZERO_CROSS_MIN_INTERVAL_US 4000  // Shortest time between detector edges (120 Hz crossings)
+#define ZERO_CROSS_MAX_INTERVAL_US 25000 // Longest (one edge per 40 Hz cycle)
+#define ZERO_CROSS_LOCK_EDGES 4          // Regular intervals in a row before transitions are timed
+
+/**
+ * @brief Output register writes of relays that share one actuation delay
+ */
+typedef struct
+{
+    uint32_t delay_us;        // Operate or release time of these relays
+    uint32_t set_bits;        // GPIO_OUT_W1TS_REG
+    uint32_t clear_bits;      // GPIO_OUT_W1TC_REG
+    uint32_t set_bits_high;   // GPIO_OUT1_W1TS_REG (pins 32 and up)
+    uint32_t clear_bits_high; // GPIO_OUT1_W1TC_REG
+} zero_cross_step_t;
+
+/**
+ * @brief Zero-cross detector and timing statistics
+ */
+typedef struct
+{
+    bool locked;           // Edges are regular, transitions are timed to them
+    uint32_t interval_us;  // Measured time between detector edges (0 = none)
+    uint32_t edges;        // Edges accepted
+    uint32_t noise;        // Edges rejected as too early after the previous one
+    uint32_t synced;       // Transitions timed to a crossing
+    uint32_t unsynced;     // Transitions switched at once (no lock)
+    uint32_t last_late_us; // How late the last timed write was against its target
+    uint32_t max_late_us;  // Latest timed write since boot
+} zero_cross_stats_t;
+
+/**
+ * @brief Start timestamping the detector edges (CONFIG_RELAY_ZERO_CROSS)
+ * Does nothing when zero-cross switching is not configured
+ */
+void ZeroCrossInit(void);
+
+/**
+ * @brief Write relay outputs so their contacts change at the next usable zero crossing
+ * Each step is written its delay_us before the crossing, from a timer
+ * interrupt running from IRAM, so relays with different operate and release
+ * times still change together. Blocks until the last step is written (at most
+ * about two crossing intervals plus the longest delay).
+ * @param steps The writes, one per actuation delay
+ * @param count Number of steps
+ * @return 0 once written, -1 if there is no regular detector signal (nothing was written)
+ */
+int ZeroCrossApply(const zero_cross_step_t *steps, int count);
+
+/**
+ * @brief Get the detector and timing statistics
+ * @param stats Filled with the statistics (all zero when not configured)
+ */
+void ZeroCrossGetStats(zero_cross_stats_t *stats);
+
+#endif // ZEROCROSS_H
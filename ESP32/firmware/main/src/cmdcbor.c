@@ -0,0 +1,376 @@
+#include "cmdcbor.h"
+#include <string.h>
+
+/**
+ * @brief Decoder states
+ */
+enum
+{
+    CB_HEAD, // Expecting the initial byte of an item
+    CB_ARG,  // Reading the argument bytes that follow the initial byte
+    CB_TEXT, // Reading string payload
+    CB_DONE, // Top-level item complete
+};
+
+/**
+ * @brief CBOR major types
+ */
+enum
+{
+    MAJOR_UINT = 0,
+    MAJOR_NEGINT = 1,
+    MAJOR_BYTES = 2,
+    MAJOR_TEXT = 3,
+    MAJOR_ARRAY = 4,
+    MAJOR_MAP = 5,
+    MAJOR_TAG = 6,
+    MAJOR_SIMPLE = 7,
+};
+
+#define CBOR_SIMPLE_TRUE 21
+
+/**
+ * @brief Check whether the item being decoded is a map key
+ */
+static bool at_key(const cmd_cbor_parser_t *p)
+{
+    return p->depth > 0 && p->is_map[p->depth - 1] && p->remaining[p->depth - 1] % 2 == 0;
+}
+
+/**
+ * @brief Check whether the item being decoded is the value of a command map member
+ */
+static bool top_level_value(const cmd_cbor_parser_t *p, int32_t key)
+{
+    uint8_t base = p->base;
+    return p->depth == base + 1 && p->is_map[base] && p->key[base] == key;
+}
+
+static void container_closed(cmd_cbor_parser_t *p)
+{
+    p->depth--;
+
+    if (p->depth == p->base + 2)
+    {
+        p->relay = -1;
+    }
+    else if (p->depth == p->base && p->is_map[p->base] && p->has_fields)
+    {
+        if (p->id_overflow)
+        {
+            p->command.command_id[0] = '\0';
+        }
+        p->commands++;
+        if (p->on_command != NULL)
+        {
+            p->on_command(&p->command, p->ctx);
+        }
+    }
+}
+
+/**
+ * @brief Account for a completed item and close every container it completes
+ */
+static void item_done(cmd_cbor_parser_t *p)
+{
+    while (p->depth > 0)
+    {
+        if (--p->remaining[p->depth - 1] > 0)
+        {
+            p->state = CB_HEAD;
+            return;
+        }
+        container_closed(p);
+    }
+    p->state = CB_DONE;
+}
+
+static void open_container(cmd_cbor_parser_t *p, bool is_map, uint64_t count)
+{
+    if (p->depth == CMD_PARSER_MAX_DEPTH || count > UINT32_MAX / 2)
+    {
+        p->error = true;
+        return;
+    }
+
+    uint8_t base = p->base;
+    if (p->depth == 0 && !is_map)
+    {
+        // Batch: every element of the top-level array is a command map
+        base = p->base = 1;
+    }
+
+    if (p->depth == base && is_map)
+    {
+        memset(&p->command, 0, sizeof(p->command));
+        p->id_len = 0;
+        p->id_overflow = false;
+        p->has_fields = (count > 0);
+    }
+    else if (is_map && p->depth == base + 2 && p->is_map[base] && p->key[base] == CMD_CBOR_KEY_RELAYS &&
+             p->is_map[base + 1])
+    {
+        // { 3: { relay number: { ... } } }
+        int32_t number = p->key[base + 1];
+        p->relay = (number >= 1 && number <= CMD_MAX_RELAYS) ? (int8_t)(number - 1) : -1;
+    }
+
+    uint8_t level = p->depth++;
+    p->is_map[level] = is_map;
+    p->remaining[level] = is_map ? (uint32_t)count * 2 : (uint32_t)count;
+    p->key[level] = -1;
+
+    if (p->remaining[level] == 0)
+    {
+        container_closed(p);
+        item_done(p);
+    }
+    else
+    {
+        p->state = CB_HEAD;
+    }
+}
+
+static void apply_uint(cmd_cbor_parser_t *p, uint64_t value)
+{
+    if (top_level_value(p, CMD_CBOR_KEY_SEQ))
+    {
+        p->command.seq = (uint32_t)value;
+        p->command.has_seq = true;
+    }
+    else if (top_level_value(p, CMD_CBOR_KEY_SCENE))
+    {
+        p->command.scene = (value <= INT16_MAX) ? (int)value : -1;
+    }
+    else if (p->depth == p->base + 3 && p->relay >= 0)
+    {
+        relay_action_t *action = &p->command.relays[p->relay];
+        int clamped = (value > INT32_MAX) ? INT32_MAX : (int)value;
+        if (p->key[p->base + 2] == CMD_CBOR_KEY_STATE)
+        {
+            action->present = true;
+            action->state = clamped;
+        }
+        else if (p->key[p->base + 2] == CMD_CBOR_KEY_DURATION)
+        {
+            action->duration_ms = clamped;
+        }
+        else if (p->key[p->base + 2] == CMD_CBOR_KEY_PULSE)
+        {
+            action->waveform.pulse_us = (value > UINT32_MAX) ? UINT32_MAX : (uint32_t)value;
+        }
+        else if (p->key[p->base + 2] == CMD_CBOR_KEY_GAP)
+        {
+            action->waveform.gap_us = (value > UINT32_MAX) ? UINT32_MAX : (uint32_t)value;
+        }
+        else if (p->key[p->base + 2] == CMD_CBOR_KEY_COUNT)
+        {
+            action->waveform.count = (value <= UINT16_MAX) ? (uint16_t)value : 0;
+        }
+        // Out-of-range frequency and duty are kept invalid, so the waveform is reported as failed
+        else if (p->key[p->base + 2] == CMD_CBOR_KEY_PWM)
+        {
+            action->waveform.pwm_hz = (value <= UINT16_MAX) ? (uint16_t)value : UINT16_MAX;
+        }
+        else if (p->key[p->base + 2] == CMD_CBOR_KEY_DUTY)
+        {
+            action->waveform.duty = (value <= 100) ? (uint8_t)value : 0;
+        }
+    }
+}
+
+/**
+ * @brief Store one character of command_id, JSON-escaped so ACKs can embed it as-is
+ */
+static void append_id(cmd_cbor_parser_t *p, uint8_t c)
+{
+    if (c < 0x20)
+    {
+        return;
+    }
+
+    size_t needed = (c == '"' || c == '\\') ? 2 : 1;
+    if (p->id_len + needed > CMD_MAX_ID_LENGTH - 1)
+    {
+        p->id_overflow = true;
+        return;
+    }
+
+    if (needed == 2)
+    {
+        p->command.command_id[p->id_len++] = '\\';
+    }
+    p->command.command_id[p->id_len++] = (char)c;
+}
+
+/**
+ * @brief Handle an item whose initial byte and argument have been read
+ */
+static void process_item(cmd_cbor_parser_t *p)
+{
+    bool key = at_key(p);
+    uint64_t arg = p->arg;
+
+    if (key)
+    {
+        p->key[p->depth - 1] = (p->major == MAJOR_UINT && arg <= INT32_MAX) ? (int32_t)arg : -1;
+    }
+
+    switch (p->major)
+    {
+    case MAJOR_UINT:
+        if (!key)
+        {
+            apply_uint(p, arg);
+        }
+        item_done(p);
+        break;
+
+    case MAJOR_NEGINT:
+        item_done(p);
+        break;
+
+    case MAJOR_BYTES:
+    case MAJOR_TEXT:
+        if (arg > UINT32_MAX)
+        {
+            p->error = true;
+            break;
+        }
+        p->text_is_id = !key && p->major == MAJOR_TEXT && top_level_value(p, CMD_CBOR_KEY_COMMAND_ID);
+        p->text_left = (uint32_t)arg;
+        if (p->text_left == 0)
+        {
+            item_done(p);
+        }
+        else
+        {
+            p->state = CB_TEXT;
+        }
+        break;
+
+    case MAJOR_ARRAY:
+    case MAJOR_MAP:
+        open_container(p, p->major == MAJOR_MAP, arg);
+        break;
+
+    case MAJOR_TAG:
+        // The tagged item follows; the tag itself is not an item
+        p->state = CB_HEAD;
+        break;
+
+    case MAJOR_SIMPLE:
+    default:
+        if (!key && arg == CBOR_SIMPLE_TRUE && top_level_value(p, CMD_CBOR_KEY_ACK_NOW))
+        {
+            p->command.ack_now = true;
+        }
+        item_done(p);
+        break;
+    }
+}
+
+void CmdCborParserInit(cmd_cbor_parser_t *parser, cmd_parser_cb_t on_command, void *ctx)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->state = CB_HEAD;
+    parser->relay = -1;
+    parser->on_command = on_command;
+    parser->ctx = ctx;
+}
+
+int CmdCborParserFeed(cmd_cbor_parser_t *parser, const uint8_t *data, size_t len)
+{
+    if (parser == NULL || data == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < len && !parser->error; i++)
+    {
+        uint8_t b = data[i];
+
+        switch (parser->state)
+        {
+        case CB_HEAD:
+        {
+            uint8_t info = b & 0x1f;
+            parser->started = true;
+            parser->major = b >> 5;
+            if (info < 24)
+            {
+                parser->arg = info;
+                process_item(parser);
+            }
+            else if (info <= 27)
+            {
+                // 1, 2, 4 or 8 argument bytes follow
+                parser->arg = 0;
+                parser->arg_bytes = 1 << (info - 24);
+                parser->state = CB_ARG;
+            }
+            else
+            {
+                // Reserved or indefinite length
+                parser->error = true;
+            }
+            break;
+        }
+
+        case CB_ARG:
+            parser->arg = (parser->arg << 8) | b;
+            if (--parser->arg_bytes == 0)
+            {
+                process_item(parser);
+            }
+            break;
+
+        case CB_TEXT:
+        {
+            size_t take = len - i;
+            if (take > parser->text_left)
+            {
+                take = parser->text_left;
+            }
+            if (parser->text_is_id)
+            {
+                for (size_t j = 0; j < take; j++)
+                {
+                    append_id(parser, data[i + j]);
+                }
+            }
+            parser->text_left -= take;
+            i += take - 1;
+            if (parser->text_left == 0)
+            {
+                item_done(parser);
+            }
+            break;
+        }
+
+        case CB_DONE:
+        default:
+            // Trailing data after the top-level item
+            parser->error = true;
+            break;
+        }
+    }
+
+    return parser->error ? -1 : 0;
+}
+
+int CmdCborParserFinish(cmd_cbor_parser_t *parser)
+{
+    if (parser == NULL || parser->error)
+    {
+        return -1;
+    }
+
+    // An empty body carries no command
+    if (!parser->started)
+    {
+        return 0;
+    }
+
+    return (parser->state == CB_DONE) ? (int)parser->commands : -1;
+}
@@ -0,0 +1,605 @@
+#include "cmdparser.h"
+#include <string.h>
+#include <stdlib.h>
+
+/**
+ * @brief Lexer states
+ */
+enum
+{
+    PS_VALUE,        // Expecting a value
+    PS_OBJECT_START, // After '{': key or '}'
+    PS_KEY_NEXT,     // After ',' in an object: key
+    PS_KEY,          // Inside a key string
+    PS_COLON,        // After a key: ':'
+    PS_ARRAY_START,  // After '[': value or ']'
+    PS_STRING,       // Inside a string value
+    PS_NUMBER,       // Inside a number
+    PS_LITERAL,      // Inside true/false/null
+    PS_AFTER_VALUE,  // After a member or element: ',' or closing bracket
+    PS_DONE,         // Top-level value complete, only whitespace may follow
+};
+
+/**
+ * @brief Command fields the parser decodes
+ */
+enum
+{
+    FIELD_NONE,
+    FIELD_COMMAND_ID,
+    FIELD_SEQ,
+    FIELD_ACK_NOW,
+    FIELD_SCENE,
+    FIELD_RELAY,
+    FIELD_STATE,
+    FIELD_DURATION,
+    FIELD_PULSE,
+    FIELD_GAP,
+    FIELD_COUNT,
+    FIELD_PWM,
+    FIELD_DUTY,
+};
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static void token_reset(cmd_parser_t *p)
+{
+    p->token_len = 0;
+    p->token_overflow = false;
+}
+
+static void token_append(cmd_parser_t *p, char c)
+{
+    if (p->token_len < CMD_PARSER_TOKEN_LENGTH - 1)
+    {
+        p->token[p->token_len++] = c;
+    }
+    else
+    {
+        p->token_overflow = true;
+    }
+}
+
+/**
+ * @brief Parse "relayN" and return the zero-based relay index, or -1
+ */
+static int relay_index_from_key(const char *key)
+{
+    if (strncmp(key, "relay", 5) != 0 || key[5] < '1' || key[5] > '9')
+    {
+        return -1;
+    }
+
+    int number = 0;
+    for (const char *c = key + 5; *c != '\0'; c++)
+    {
+        if (*c < '0' || *c > '9')
+        {
+            return -1;
+        }
+        number = number * 10 + (*c - '0');
+    }
+    return (number <= CMD_MAX_RELAYS) ? number - 1 : -1;
+}
+
+/**
+ * @brief Decide which field the value after the key just read belongs to
+ */
+static void resolve_key(cmd_parser_t *p)
+{
+    // Nesting level relative to the command object (1 = command member)
+    int level = p->depth - p->base;
+
+    p->field = FIELD_NONE;
+    if (level == 1)
+    {
+        p->has_fields = true;
+    }
+    if (p->token_overflow)
+    {
+        return;
+    }
+    p->token[p->token_len] = '\0';
+
+    if (level == 1)
+    {
+        if (strcmp(p->token, "command_id") == 0)
+        {
+            p->field = FIELD_COMMAND_ID;
+        }
+        else if (strcmp(p->token, "seq") == 0)
+        {
+            p->field = FIELD_SEQ;
+        }
+        else if (strcmp(p->token, "ack_now") == 0)
+        {
+            p->field = FIELD_ACK_NOW;
+        }
+        else if (strcmp(p->token, "scene") == 0)
+        {
+            p->field = FIELD_SCENE;
+        }
+        else
+        {
+            p->pending_relay = relay_index_from_key(p->token);
+            if (p->pending_relay >= 0)
+            {
+                p->field = FIELD_RELAY;
+            }
+        }
+    }
+    else if (level == 2 && p->relay >= 0)
+    {
+        if (strcmp(p->token, "state") == 0)
+        {
+            p->field = FIELD_STATE;
+        }
+        else if (strcmp(p->token, "duration") == 0)
+        {
+            p->field = FIELD_DURATION;
+        }
+        else if (strcmp(p->token, "pulse") == 0)
+        {
+            p->field = FIELD_PULSE;
+        }
+        else if (strcmp(p->token, "gap") == 0)
+        {
+            p->field = FIELD_GAP;
+        }
+        else if (strcmp(p->token, "count") == 0)
+        {
+            p->field = FIELD_COUNT;
+        }
+        else if (strcmp(p->token, "pwm") == 0)
+        {
+            p->field = FIELD_PWM;
+        }
+        else if (strcmp(p->token, "duty") == 0)
+        {
+            p->field = FIELD_DUTY;
+        }
+    }
+}
+
+static void emit_command(cmd_parser_t *p)
+{
+    p->commands++;
+    if (p->on_command != NULL)
+    {
+        p->on_command(&p->command, p->ctx);
+    }
+}
+
+static void value_done(cmd_parser_t *p)
+{
+    p->state = (p->depth == 0) ? PS_DONE : PS_AFTER_VALUE;
+}
+
+static void begin_container(cmd_parser_t *p, char c)
+{
+    if (p->depth == CMD_PARSER_MAX_DEPTH)
+    {
+        p->error = true;
+        return;
+    }
+
+    if (p->depth == 0 && c == '[')
+    {
+        // Batch: every element of the top-level array is a command
+        p->base = 1;
+    }
+
+    if (p->depth == p->base && c == '{')
+    {
+        memset(&p->command, 0, sizeof(p->command));
+        p->id_len = 0;
+        p->id_overflow = false;
+        p->has_fields = false;
+    }
+    else if (p->depth == p->base + 1 && c == '{' && p->field == FIELD_RELAY)
+    {
+        p->relay = p->pending_relay;
+    }
+
+    p->stack[p->depth++] = c;
+    p->field = FIELD_NONE;
+    p->state = (c == '{') ? PS_OBJECT_START : PS_ARRAY_START;
+}
+
+static void end_container(cmd_parser_t *p)
+{
+    p->depth--;
+
+    if (p->depth == p->base + 1)
+    {
+        p->relay = -1;
+    }
+    else if (p->depth == p->base && p->stack[p->base] == '{' && p->has_fields)
+    {
+        if (p->id_overflow)
+        {
+            p->command.command_id[0] = '\0';
+        }
+        emit_command(p);
+    }
+
+    value_done(p);
+}
+
+static void apply_number(cmd_parser_t *p)
+{
+    if (p->token_overflow)
+    {
+        return;
+    }
+    p->token[p->token_len] = '\0';
+
+    if (p->depth == 0)
+    {
+        // Legacy plain-text protocol: a bare 0 or 1 switches relay 1
+        if (strcmp(p->token, "0") == 0 || strcmp(p->token, "1") == 0)
+        {
+            memset(&p->command, 0, sizeof(p->command));
+            p->command.relays[0].present = true;
+            p->command.relays[0].state = p->token[0] - '0';
+            emit_command(p);
+        }
+        return;
+    }
+
+    switch (p->field)
+    {
+    case FIELD_SEQ:
+        p->command.seq = (uint32_t)strtoul(p->token, NULL, 10);
+        p->command.has_seq = true;
+        break;
+    case FIELD_SCENE:
+    {
+        // Out-of-range numbers are kept invalid rather than wrapped onto a real scene
+        long scene = strtol(p->token, NULL, 10);
+        p->command.scene = (scene >= 0 && scene <= INT16_MAX) ? (int)scene : -1;
+        break;
+    }
+    case FIELD_STATE:
+        p->command.relays[p->relay].present = true;
+        p->command.relays[p->relay].state = (int)strtol(p->token, NULL, 10);
+        break;
+    case FIELD_DURATION:
+    {
+        long duration = strtol(p->token, NULL, 10);
+        p->command.relays[p->relay].duration_ms = (duration > 0) ? (int)duration : 0;
+        break;
+    }
+    // Out-of-range waveform values are kept invalid, so the waveform is reported as failed
+    case FIELD_PULSE:
+        p->command.relays[p->relay].waveform.pulse_us = CmdParserMsToUs(p->token);
+        break;
+    case FIELD_GAP:
+        p->command.relays[p->relay].waveform.gap_us = CmdParserMsToUs(p->token);
+        break;
+    case FIELD_COUNT:
+    {
+        long count = strtol(p->token, NULL, 10);
+        p->command.relays[p->relay].waveform.count = (count > 0 && count <= UINT16_MAX) ? (uint16_t)count : 0;
+        break;
+    }
+    case FIELD_PWM:
+    {
+        long hz = strtol(p->token, NULL, 10);
+        p->command.relays[p->relay].waveform.pwm_hz = (hz > 0 && hz <= UINT16_MAX) ? (uint16_t)hz : UINT16_MAX;
+        break;
+    }
+    case FIELD_DUTY:
+    {
+        long duty = strtol(p->token, NULL, 10);
+        p->command.relays[p->relay].waveform.duty = (duty > 0 && duty <= 100) ? (uint8_t)duty : 0;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void apply_literal(cmd_parser_t *p)
+{
+    p->token[p->token_len] = '\0';
+    if (p->token_overflow || (strcmp(p->token, "true") != 0 && strcmp(p->token, "false") != 0 &&
+                              strcmp(p->token, "null") != 0))
+    {
+        p->error = true;
+        return;
+    }
+
+    if (p->field == FIELD_ACK_NOW && p->token[0] == 't')
+    {
+        p->command.ack_now = true;
+    }
+}
+
+/**
+ * @brief Start reading a value
+ */
+static void begin_value(cmd_parser_t *p, char c)
+{
+    if (c == '{' || c == '[')
+    {
+        begin_container(p, c);
+    }
+    else if (c == '"')
+    {
+        p->escape = false;
+        p->state = PS_STRING;
+    }
+    else if (c == '-' || (c >= '0' && c <= '9'))
+    {
+        token_reset(p);
+        token_append(p, c);
+        p->state = PS_NUMBER;
+    }
+    else if (c == 't' || c == 'f' || c == 'n')
+    {
+        token_reset(p);
+        token_append(p, c);
+        p->state = PS_LITERAL;
+    }
+    else
+    {
+        p->error = true;
+    }
+}
+
+/**
+ * @brief Process one character
+ * @return false if the character ended a number or literal and must be processed again
+ */
+static bool process_char(cmd_parser_t *p, char c)
+{
+    switch (p->state)
+    {
+    case PS_VALUE:
+        if (!is_space(c))
+        {
+            begin_value(p, c);
+        }
+        break;
+
+    case PS_OBJECT_START:
+    case PS_KEY_NEXT:
+        if (is_space(c))
+        {
+            break;
+        }
+        if (c == '"')
+        {
+            token_reset(p);
+            p->escape = false;
+            p->state = PS_KEY;
+        }
+        else if (c == '}' && p->state == PS_OBJECT_START)
+        {
+            end_container(p);
+        }
+        else
+        {
+            p->error = true;
+        }
+        break;
+
+    case PS_KEY:
+        if (p->escape)
+        {
+            p->escape = false;
+        }
+        else if (c == '\\')
+        {
+            // Keys we decode never contain escapes
+            p->escape = true;
+            p->token_overflow = true;
+        }
+        else if (c == '"')
+        {
+            resolve_key(p);
+            p->state = PS_COLON;
+        }
+        else
+        {
+            token_append(p, c);
+        }
+        break;
+
+    case PS_COLON:
+        if (c == ':')
+        {
+            p->state = PS_VALUE;
+        }
+        else if (!is_space(c))
+        {
+            p->error = true;
+        }
+        break;
+
+    case PS_ARRAY_START:
+        if (c == ']')
+        {
+            end_container(p);
+        }
+        else if (!is_space(c))
+        {
+            begin_value(p, c);
+        }
+        break;
+
+    case PS_STRING:
+        if (!p->escape && c == '"')
+        {
+            value_done(p);
+            break;
+        }
+        p->escape = !p->escape && c == '\\';
+
+        // command_id is kept in its raw JSON form so it can be echoed back as-is
+        if (p->field == FIELD_COMMAND_ID)
+        {
+            if (p->id_len < CMD_MAX_ID_LENGTH - 1)
+            {
+                p->command.command_id[p->id_len++] = c;
+            }
+            else
+            {
+                p->id_overflow = true;
+            }
+        }
+        break;
+
+    case PS_NUMBER:
+        if ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-')
+        {
+            token_append(p, c);
+            break;
+        }
+        apply_number(p);
+        value_done(p);
+        return false;
+
+    case PS_LITERAL:
+        if (c >= 'a' && c <= 'z')
+        {
+            token_append(p, c);
+            break;
+        }
+        apply_literal(p);
+        value_done(p);
+        return false;
+
+    case PS_AFTER_VALUE:
+    {
+        char container = p->stack[p->depth - 1];
+        if (is_space(c))
+        {
+            break;
+        }
+        if (c == ',')
+        {
+            p->field = FIELD_NONE;
+            p->state = (container == '{') ? PS_KEY_NEXT : PS_VALUE;
+        }
+        else if ((c == '}' && container == '{') || (c == ']' && container == '['))
+        {
+            end_container(p);
+        }
+        else
+        {
+            p->error = true;
+        }
+        break;
+    }
+
+    case PS_DONE:
+    default:
+        if (!is_space(c))
+        {
+            p->error = true;
+        }
+        break;
+    }
+
+    return true;
+}
+
+void CmdParserInit(cmd_parser_t *parser, cmd_parser_cb_t on_command, void *ctx)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->state = PS_VALUE;
+    parser->relay = -1;
+    parser->pending_relay = -1;
+    parser->on_command = on_command;
+    parser->ctx = ctx;
+}
+
+int CmdParserFeed(cmd_parser_t *parser, const char *data, size_t len)
+{
+    if (parser == NULL || data == NULL)
+    {
+        return -1;
+    }
+
+    // Fast path for the common "nothing queued" answer
+    if (parser->state == PS_VALUE && parser->depth == 0 && len == 2 && data[0] == '{' && data[1] == '}')
+    {
+        parser->state = PS_DONE;
+        return 0;
+    }
+
+    for (size_t i = 0; i < len && !parser->error; i++)
+    {
+        while (!process_char(parser, data[i]) && !parser->error)
+        {
+        }
+    }
+
+    return parser->error ? -1 : 0;
+}
+
+int CmdParserFinish(cmd_parser_t *parser)
+{
+    if (parser == NULL || parser->error)
+    {
+        return -1;
+    }
+
+    // A top-level number has no terminator
+    if (parser->state == PS_NUMBER && parser->depth == 0)
+    {
+        apply_number(parser);
+        parser->state = PS_DONE;
+    }
+
+    // An empty body carries no command
+    if (parser->state == PS_VALUE && parser->depth == 0)
+    {
+        return 0;
+    }
+
+    return (parser->state == PS_DONE) ? (int)parser->commands : -1;
+}
+
+uint32_t CmdParserMsToUs(const char *text)
+{
+    uint64_t us = 0;
+    int decimals = -1; // Digits after the decimal point, -1 before it
+
+    for (const char *c = text; *c != '\0'; c++)
+    {
+        if (*c == '.' && decimals < 0)
+        {
+            decimals = 0;
+            continue;
+        }
+        if (*c < '0' || *c > '9')
+        {
+            break;
+        }
+        if (decimals >= 3)
+        {
+            continue; // Below 1 us
+        }
+        us = us * 10 + (*c - '0');
+        if (decimals >= 0)
+        {
+            decimals++;
+        }
+        if (us > UINT32_MAX)
+        {
+            return 0;
+        }
+    }
+
+    for (int i = (decimals < 0) ? 0 : decimals; i < 3; i++)
+    {
+        us *= 10;
+    }
+    return (us <= UINT32_MAX) ? (uint32_t)us : 0;
+}
@@ -0,0 +1,902 @@
+#include "coap.h"
+#include "server.h"
+#include "cmdcbor.h"
+#include "dnscache.h"
+#include "outbox.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "lwip/sockets.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "coap";
+
+#define COAP_DEFAULT_PORT 5683
+#define COAP_ACK_TIMEOUT_MS 2000   // RFC 7252 ACK_TIMEOUT, doubled on every retransmission
+#define COAP_MAX_RETRANSMIT 2      // Gives up after 14-21 s instead of RFC 7252's 93 s, so failover is quick
+#define COAP_REREGISTER_MS 60000   // Refresh the registration (and NAT bindings) this often
+#define COAP_RECEIVE_SLICE_MS 500  // How often the session checks should_stop and its timers
+#define COAP_MAX_MESSAGE_SIZE 1024 // Largest notification accepted
+#define COAP_MAX_REQUEST_SIZE 128
+#define COAP_MAX_REPORT_LENGTH 256 // Largest report payload; holds any outbox message
+#define COAP_TOKEN_LENGTH 4
+#define COAP_RECENT_IDS 8          // Message IDs remembered to spot retransmitted notifications
+#define MAX_HOST_LENGTH 64
+#define MAX_PATH_LENGTH 64
+
+#define COAP_VERSION 1
+#define COAP_TYPE_CON 0
+#define COAP_TYPE_NON 1
+#define COAP_TYPE_ACK 2
+#define COAP_TYPE_RST 3
+
+#define COAP_CODE_EMPTY 0x00
+#define COAP_CODE_GET 0x01
+#define COAP_CODE_POST 0x02
+#define COAP_CODE_CONTENT 0x45 // 2.05
+
+#define COAP_OPTION_OBSERVE 6
+#define COAP_OPTION_URI_PATH 11
+#define COAP_OPTION_CONTENT_FORMAT 12
+#define COAP_OPTION_ACCEPT 17
+
+#define COAP_OBSERVE_REGISTER 0
+#define COAP_OBSERVE_DEREGISTER 1
+#define COAP_FORMAT_JSON 50
+#define COAP_FORMAT_CBOR 60
+
+/**
+ * @brief The fields of a received message the session needs
+ */
+typedef struct
+{
+    uint8_t type;
+    uint8_t code;
+    uint16_t message_id;
+    uint8_t token_length;
+    uint8_t token[8];
+    bool has_observe;
+    int content_format; // -1 if absent
+    const uint8_t *payload;
+    size_t payload_length;
+} coap_message_t;
+
+/**
+ * @brief State of the observe session (only touched from the polling task)
+ */
+typedef struct
+{
+    int sock;
+    char path[MAX_PATH_LENGTH];
+    uint8_t token[COAP_TOKEN_LENGTH];
+    uint16_t next_message_id;
+
+    // Outstanding registration request, retransmitted until it is answered
+    bool request_pending;
+    uint16_t request_id;
+    uint8_t request[COAP_MAX_REQUEST_SIZE];
+    size_t request_length;
+    uint8_t attempts;
+    uint32_t timeout_ms;
+    TickType_t retransmit_at;
+
+    TickType_t register_at; // Next registration refresh
+    bool registered;        // The server has confirmed the observation
+    bool failed;            // The server rejected or cannot serve the observation
+
+    uint16_t recent_ids[COAP_RECENT_IDS];
+    size_t recent_count;
+    size_t recent_next;
+
+    TaskHandle_t task; // The task running the session
+
+    // Outstanding report POST, retransmitted until it is answered
+    uint16_t report_id;
+    uint8_t report_attempts;
+    uint32_t report_timeout_ms;
+    TickType_t report_retransmit_at;
+
+    // ACK of a notification held back until the report it caused is answered
+    bool ack_deferred;
+    uint16_t deferred_ack_id;
+} coap_session_t;
+
+/**
+ * @brief Progress of the report slot
+ */
+typedef enum
+{
+    REPORT_NONE,   // Free
+    REPORT_QUEUED, // Payload waiting to be sent by the session task
+    REPORT_SENT,   // POST sent, waiting for its ACK
+} report_state_t;
+
+static coap_session_t session;
+
+// Report (waveform end, ACK listing held commands) to POST to the server; filled
+// by any task through coap_ack_sender, sent and retransmitted by the session task
+static portMUX_TYPE report_lock = portMUX_INITIALIZER_UNLOCKED;
+static report_state_t report_state = REPORT_NONE;
+static bool report_open = false; // Reports are taken while the session runs
+static char report_payload[COAP_MAX_REPORT_LENGTH];
+static uint8_t buffer[COAP_MAX_MESSAGE_SIZE];
+
+// Commands of a CBOR notification, executed once it has been decoded
+static relay_command_t commands[CMD_MAX_BATCH];
+static size_t command_count = 0;
+
+static uint16_t read_u16(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+/**
+ * @brief Split a coap:// URL into host, port and path
+ * "coap://host:5683/api/relay" -> "host", 5683 and "api/relay"
+ * @return 0 on success, -1 if the URL is not a usable coap:// URL
+ */
+static int parse_url(const char *url, char *host, size_t host_len, uint16_t *port, char *path, size_t path_len)
+{
+    if (strncmp(url, "coap://", 7) != 0)
+    {
+        return -1;
+    }
+
+    const char *authority = url + 7;
+    size_t authority_len = strcspn(authority, "/?#");
+    size_t name_len = strcspn(authority, ":/?#");
+    if (name_len == 0 || name_len >= host_len || authority[0] == '[')
+    {
+        return -1;
+    }
+    memcpy(host, authority, name_len);
+    host[name_len] = '\0';
+
+    *port = COAP_DEFAULT_PORT;
+    if (name_len < authority_len)
+    {
+        int value = atoi(authority + name_len + 1);
+        if (value <= 0 || value > 65535)
+        {
+            return -1;
+        }
+        *port = (uint16_t)value;
+    }
+
+    const char *resource = authority + authority_len;
+    while (*resource == '/')
+    {
+        resource++;
+    }
+    snprintf(path, path_len, "%.*s", (int)strcspn(resource, "?#"), resource);
+    return 0;
+}
+
+/**
+ * @brief Write the delta or length nibble of an option, with its extended bytes
+ */
+static uint8_t option_nibble(uint32_t value, uint8_t *out, size_t *pos)
+{
+    if (value < 13)
+    {
+        return (uint8_t)value;
+    }
+    if (value < 269)
+    {
+        out[(*pos)++] = (uint8_t)(value - 13);
+        return 13;
+    }
+    out[(*pos)++] = (uint8_t)((value - 269) >> 8);
+    out[(*pos)++] = (uint8_t)((value - 269) & 0xFF);
+    return 14;
+}
+
+/**
+ * @brief Append an option; options must be added in ascending order
+ * @return Position after the option, or 0 if it does not fit
+ */
+static size_t put_option(uint8_t *out, size_t max_len, size_t pos, uint16_t *last_number,
+                         uint16_t number, const void *value, size_t length)
+{
+    if (pos == 0 || pos + 5 + length > max_len)
+    {
+        return 0;
+    }
+
+    size_t head = pos++;
+    uint8_t delta = option_nibble(number - *last_number, out, &pos);
+    uint8_t len = option_nibble((uint32_t)length, out, &pos);
+    out[head] = (uint8_t)((delta << 4) | len);
+    memcpy(out + pos, value, length);
+    *last_number = number;
+    return pos + length;
+}
+
+/**
+ * @brief Append an unsigned integer option in its shortest form
+ */
+static size_t put_uint_option(uint8_t *out, size_t max_len, size_t pos, uint16_t *last_number,
+                              uint16_t number, uint32_t value)
+{
+    uint8_t bytes[4];
+    size_t length = 0;
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        if (length > 0 || ((value >> shift) & 0xFF) != 0)
+        {
+            bytes[length++] = (uint8_t)(value >> shift);
+        }
+    }
+    return put_option(out, max_len, pos, last_number, number, bytes, length);
+}
+
+/**
+ * @brief Read the extended form of an option delta or length
+ * @return 0 on success, -1 if the message is malformed
+ */
+static int read_extended(const uint8_t *data, size_t len, size_t *pos, uint32_t *value)
+{
+    if (*value == 13)
+    {
+        if (*pos + 1 > len)
+        {
+            return -1;
+        }
+        *value = 13 + data[*pos];
+        *pos += 1;
+    }
+    else if (*value == 14)
+    {
+        if (*pos + 2 > len)
+        {
+            return -1;
+        }
+        *value = 269 + read_u16(data + *pos);
+        *pos += 2;
+    }
+    else if (*value == 15)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parse a received datagram
+ * @return 0 on success, -1 if it is not a valid CoAP message
+ */
+static int parse_message(const uint8_t *data, size_t len, coap_message_t *msg)
+{
+    if (len < 4 || (data[0] >> 6) != COAP_VERSION)
+    {
+        return -1;
+    }
+
+    memset(msg, 0, sizeof(*msg));
+    msg->type = (data[0] >> 4) & 0x03;
+    msg->token_length = data[0] & 0x0F;
+    msg->code = data[1];
+    msg->message_id = read_u16(data + 2);
+    msg->content_format = -1;
+    if (msg->token_length > sizeof(msg->token) || 4 + msg->token_length > len)
+    {
+        return -1;
+    }
+    memcpy(msg->token, data + 4, msg->token_length);
+
+    size_t pos = 4 + msg->token_length;
+    uint32_t number = 0;
+    while (pos < len && data[pos] != 0xFF)
+    {
+        uint32_t delta = data[pos] >> 4;
+        uint32_t length = data[pos] & 0x0F;
+        pos++;
+        if (read_extended(data, len, &pos, &delta) != 0 || read_extended(data, len, &pos, &length) != 0 ||
+            pos + length > len)
+        {
+            return -1;
+        }
+
+        number += delta;
+        uint32_t value = 0;
+        for (uint32_t i = 0; i < length && i < 4; i++)
+        {
+            value = (value << 8) | data[pos + i];
+        }
+        if (number == COAP_OPTION_OBSERVE)
+        {
+            msg->has_observe = true;
+        }
+        else if (number == COAP_OPTION_CONTENT_FORMAT)
+        {
+            msg->content_format = (int)value;
+        }
+        pos += length;
+    }
+
+    if (pos < len)
+    {
+        // Skip the payload marker
+        msg->payload = data + pos + 1;
+        msg->payload_length = len - pos - 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send an empty ACK or RST for a received message
+ */
+static void send_empty(uint8_t type, uint16_t message_id)
+{
+    uint8_t message[4] = {
+        (COAP_VERSION << 6) | (type << 4),
+        COAP_CODE_EMPTY,
+        message_id >> 8,
+        message_id & 0xFF,
+    };
+    send(session.sock, message, sizeof(message), 0);
+}
+
+/**
+ * @brief Append the session's resource path as Uri-Path options
+ * @return Position after the options, or 0 if they do not fit
+ */
+static size_t put_path(uint8_t *out, size_t max_len, size_t pos, uint16_t *last_number)
+{
+    const char *segment = session.path;
+    while (*segment != '\0')
+    {
+        size_t length = strcspn(segment, "/");
+        if (length > 0)
+        {
+            pos = put_option(out, max_len, pos, last_number, COAP_OPTION_URI_PATH, segment, length);
+        }
+        segment += length;
+        if (*segment == '/')
+        {
+            segment++;
+        }
+    }
+    return pos;
+}
+
+/**
+ * @brief Build a GET for the command resource with an Observe option
+ * @return Length of the request, or 0 if it does not fit
+ */
+static size_t build_request(uint8_t *out, size_t max_len, uint8_t type, uint16_t message_id, uint32_t observe)
+{
+    out[0] = (COAP_VERSION << 6) | (type << 4) | COAP_TOKEN_LENGTH;
+    out[1] = COAP_CODE_GET;
+    out[2] = message_id >> 8;
+    out[3] = message_id & 0xFF;
+    memcpy(out + 4, session.token, COAP_TOKEN_LENGTH);
+
+    size_t pos = 4 + COAP_TOKEN_LENGTH;
+    uint16_t last_number = 0;
+    pos = put_uint_option(out, max_len, pos, &last_number, COAP_OPTION_OBSERVE, observe);
+    pos = put_path(out, max_len, pos, &last_number);
+    return put_uint_option(out, max_len, pos, &last_number, COAP_OPTION_ACCEPT, COAP_FORMAT_CBOR);
+}
+
+/**
+ * @brief Build a confirmable POST of a JSON report to the command resource
+ * Sent without a token: the server answers it piggybacked on the ACK
+ * @return Length of the request, or 0 if it does not fit
+ */
+static size_t build_report(uint8_t *out, size_t max_len, uint16_t message_id, const char *payload)
+{
+    out[0] = (COAP_VERSION << 6) | (COAP_TYPE_CON << 4);
+    out[1] = COAP_CODE_POST;
+    out[2] = message_id >> 8;
+    out[3] = message_id & 0xFF;
+
+    uint16_t last_number = 0;
+    size_t pos = put_path(out, max_len, 4, &last_number);
+    pos = put_uint_option(out, max_len, pos, &last_number, COAP_OPTION_CONTENT_FORMAT, COAP_FORMAT_JSON);
+
+    size_t length = strlen(payload);
+    if (pos == 0 || pos + 1 + length > max_len)
+    {
+        return 0;
+    }
+    out[pos++] = 0xFF;
+    memcpy(out + pos, payload, length);
+    return pos + length;
+}
+
+/**
+ * @brief Send a new registration and arm its retransmission
+ */
+static void start_registration(void)
+{
+    session.request_id = session.next_message_id++;
+    session.request_length = build_request(session.request, sizeof(session.request), COAP_TYPE_CON,
+                                           session.request_id, COAP_OBSERVE_REGISTER);
+    if (session.request_length == 0)
+    {
+        ESP_LOGE(TAG, "Resource path too long: %s", session.path);
+        session.failed = true;
+        return;
+    }
+
+    // Initial timeout is randomized between ACK_TIMEOUT and 1.5 * ACK_TIMEOUT
+    session.timeout_ms = COAP_ACK_TIMEOUT_MS + esp_random() % (COAP_ACK_TIMEOUT_MS / 2);
+    session.attempts = 0;
+    session.request_pending = true;
+    session.retransmit_at = xTaskGetTickCount() + pdMS_TO_TICKS(session.timeout_ms);
+    session.register_at = xTaskGetTickCount() + pdMS_TO_TICKS(COAP_REREGISTER_MS);
+    send(session.sock, session.request, session.request_length, 0);
+}
+
+/**
+ * @brief Retransmit the outstanding registration, or give up on the server
+ */
+static void retransmit_registration(void)
+{
+    if (session.attempts >= COAP_MAX_RETRANSMIT)
+    {
+        ESP_LOGW(TAG, "No answer to registration after %d retransmissions", COAP_MAX_RETRANSMIT);
+        session.request_pending = false;
+        session.failed = true;
+        return;
+    }
+
+    session.attempts++;
+    session.timeout_ms *= 2;
+    session.retransmit_at = xTaskGetTickCount() + pdMS_TO_TICKS(session.timeout_ms);
+    send(session.sock, session.request, session.request_length, 0);
+}
+
+/**
+ * @brief Send the queued report, or resend the outstanding one
+ */
+static void transmit_report(void)
+{
+    uint8_t request[COAP_MAX_REQUEST_SIZE + COAP_MAX_REPORT_LENGTH];
+    size_t length = build_report(request, sizeof(request), session.report_id, report_payload);
+    if (length > 0)
+    {
+        send(session.sock, request, length, 0);
+    }
+}
+
+/**
+ * @brief Start sending a report that coap_ack_sender queued
+ */
+static void start_report(void)
+{
+    session.report_id = session.next_message_id++;
+    session.report_timeout_ms = COAP_ACK_TIMEOUT_MS + esp_random() % (COAP_ACK_TIMEOUT_MS / 2);
+    session.report_attempts = 0;
+    session.report_retransmit_at = xTaskGetTickCount() + pdMS_TO_TICKS(session.report_timeout_ms);
+
+    portENTER_CRITICAL(&report_lock);
+    report_state = REPORT_SENT;
+    portEXIT_CRITICAL(&report_lock);
+    transmit_report();
+}
+
+/**
+ * @brief Free the report slot and send the notification ACK that waited for it
+ * @param keep true to hand the report to the outbox, which tries again later
+ */
+static void finish_report(bool keep)
+{
+    if (keep)
+    {
+        OutboxEnqueue(report_payload, true);
+    }
+
+    portENTER_CRITICAL(&report_lock);
+    report_state = REPORT_NONE;
+    portEXIT_CRITICAL(&report_lock);
+
+    if (session.ack_deferred)
+    {
+        session.ack_deferred = false;
+        send_empty(COAP_TYPE_ACK, session.deferred_ack_id);
+    }
+}
+
+/**
+ * @brief Retransmit the outstanding report, or leave it to the outbox
+ */
+static void retransmit_report(void)
+{
+    if (session.report_attempts >= COAP_MAX_RETRANSMIT)
+    {
+        ESP_LOGW(TAG, "No answer to report after %d retransmissions, queued in the outbox", COAP_MAX_RETRANSMIT);
+        finish_report(true);
+        return;
+    }
+
+    session.report_attempts++;
+    session.report_timeout_ms *= 2;
+    session.report_retransmit_at = xTaskGetTickCount() + pdMS_TO_TICKS(session.report_timeout_ms);
+    transmit_report();
+}
+
+/**
+ * @brief Handle the ACK or reset of the outstanding report
+ */
+static void handle_report_answer(const coap_message_t *msg)
+{
+    if (msg->type == COAP_TYPE_RST || (msg->code >> 5) == 4)
+    {
+        // The server cannot take it (e.g. 4.05 from a server without the uplink); sending it again won't help
+        ESP_LOGW(TAG, "Server refused report (%d.%02d), dropped: %s", msg->code >> 5, msg->code & 0x1F,
+                 report_payload);
+        finish_report(false);
+    }
+    else if ((msg->code >> 5) == 5)
+    {
+        ESP_LOGW(TAG, "Server failed to take report (%d.%02d), queued in the outbox", msg->code >> 5,
+                 msg->code & 0x1F);
+        finish_report(true);
+    }
+    else
+    {
+        // 2.xx, or an empty ACK: the server has it and answers separately
+        finish_report(false);
+    }
+}
+
+/**
+ * @brief Remember the ID of a processed notification
+ * @return true if it was processed before (our ACK got lost and the server retransmitted)
+ */
+static bool seen_before(uint16_t message_id)
+{
+    for (size_t i = 0; i < session.recent_count; i++)
+    {
+        if (session.recent_ids[i] == message_id)
+        {
+            return true;
+        }
+    }
+
+    session.recent_ids[session.recent_next] = message_id;
+    session.recent_next = (session.recent_next + 1) % COAP_RECENT_IDS;
+    if (session.recent_count < COAP_RECENT_IDS)
+    {
+        session.recent_count++;
+    }
+    return false;
+}
+
+/**
+ * @brief Decoder callback: keep the commands until the notification has been decoded
+ */
+static void collect_command(const relay_command_t *command, void *ctx)
+{
+    if (command_count < CMD_MAX_BATCH)
+    {
+        commands[command_count++] = *command;
+    }
+}
+
+/**
+ * @brief Execute the commands carried by a notification
+ */
+static void execute_payload(const coap_message_t *msg)
+{
+    if (msg->payload_length == 0)
+    {
+        return;
+    }
+
+    if (msg->content_format != COAP_FORMAT_CBOR)
+    {
+        ServerProcessResponse((const char *)msg->payload, msg->payload_length, 200);
+        return;
+    }
+
+    cmd_cbor_parser_t parser;
+    command_count = 0;
+    CmdCborParserInit(&parser, collect_command, NULL);
+    CmdCborParserFeed(&parser, msg->payload, msg->payload_length);
+    if (CmdCborParserFinish(&parser) < 0)
+    {
+        ESP_LOGW(TAG, "Invalid command notification (%u bytes)", (unsigned)msg->payload_length);
+    }
+    if (command_count > 0)
+    {
+        ESP_LOGI(TAG, "Executing %u command(s)", (unsigned)command_count);
+        ServerExecuteCommands(commands, command_count, RELAY_SOURCE_REMOTE);
+    }
+}
+
+/**
+ * @brief Handle a response to the registration or a notification
+ */
+static void handle_response(const coap_message_t *msg)
+{
+    if (msg->type == COAP_TYPE_CON && seen_before(msg->message_id))
+    {
+        // Retransmitted because the ACK is late or lost; a deferred one still goes after its report
+        if (!session.ack_deferred || session.deferred_ack_id != msg->message_id)
+        {
+            send_empty(COAP_TYPE_ACK, msg->message_id);
+        }
+        return;
+    }
+
+    if (msg->code != COAP_CODE_CONTENT)
+    {
+        ESP_LOGW(TAG, "Server answered %d.%02d", msg->code >> 5, msg->code & 0x1F);
+        session.failed = true;
+    }
+    else if (!msg->has_observe)
+    {
+        // Without Observe the server sent one representation and will not notify
+        ESP_LOGW(TAG, "Server does not support Observe");
+        session.failed = true;
+    }
+    else if (!session.registered)
+    {
+        ESP_LOGI(TAG, "Observing /%s", session.path);
+        session.registered = true;
+    }
+
+    if (msg->code == COAP_CODE_CONTENT)
+    {
+        execute_payload(msg);
+    }
+
+    // Acknowledged after execution, so the ACK confirms the commands. A report
+    // the execution produced (e.g. commands held by a manual hold) must reach the
+    // server first, so that the ACK waits for it.
+    if (msg->type == COAP_TYPE_CON)
+    {
+        portENTER_CRITICAL(&report_lock);
+        bool report_outstanding = (report_state != REPORT_NONE);
+        portEXIT_CRITICAL(&report_lock);
+
+        if (!report_outstanding)
+        {
+            send_empty(COAP_TYPE_ACK, msg->message_id);
+        }
+        else
+        {
+            if (session.ack_deferred)
+            {
+                send_empty(COAP_TYPE_ACK, session.deferred_ack_id);
+            }
+            session.ack_deferred = true;
+            session.deferred_ack_id = msg->message_id;
+        }
+    }
+    session.register_at = xTaskGetTickCount() + pdMS_TO_TICKS(COAP_REREGISTER_MS);
+}
+
+/**
+ * @brief Dispatch a received message
+ */
+static void handle_message(const coap_message_t *msg)
+{
+    if (msg->type == COAP_TYPE_ACK || msg->type == COAP_TYPE_RST)
+    {
+        portENTER_CRITICAL(&report_lock);
+        bool report_sent = (report_state == REPORT_SENT);
+        portEXIT_CRITICAL(&report_lock);
+        if (report_sent && msg->message_id == session.report_id)
+        {
+            handle_report_answer(msg);
+            return;
+        }
+
+        if (!session.request_pending || msg->message_id != session.request_id)
+        {
+            return;
+        }
+        session.request_pending = false;
+
+        if (msg->type == COAP_TYPE_RST)
+        {
+            ESP_LOGW(TAG, "Server rejected the registration");
+            session.failed = true;
+        }
+        else if (msg->code != COAP_CODE_EMPTY)
+        {
+            // Piggybacked response; an empty ACK means a separate one follows
+            handle_response(msg);
+        }
+        return;
+    }
+
+    // A ping, or a notification of an observation this session did not make
+    if (msg->code == COAP_CODE_EMPTY || msg->token_length != COAP_TOKEN_LENGTH ||
+        memcmp(msg->token, session.token, COAP_TOKEN_LENGTH) != 0)
+    {
+        send_empty(COAP_TYPE_RST, msg->message_id);
+        return;
+    }
+
+    handle_response(msg);
+}
+
+/**
+ * @brief ACK sender while a CoAP session is up
+ * The CoAP ACK of a notification acknowledges the commands it carried, so a
+ * plain ACK needs nothing else. Other reports (waveform ends, ACKs listing
+ * held commands) are POSTed to the command resource as confirmable requests,
+ * one at a time; while one is outstanding the next is refused and waits in
+ * the outbox. Called from any task.
+ * @return 0 if there is nothing to send or the report was taken, -1 if it was not
+ */
+static int coap_ack_sender(const char *json_payload)
+{
+    if (strstr(json_payload, "\"status\":\"received\"") != NULL && strstr(json_payload, "\"held\":") == NULL)
+    {
+        return 0;
+    }
+    if (strlen(json_payload) >= sizeof(report_payload))
+    {
+        ESP_LOGW(TAG, "Report too long for CoAP, dropped: %s", json_payload);
+        return 0;
+    }
+
+    portENTER_CRITICAL(&report_lock);
+    bool taken = report_open && report_state == REPORT_NONE;
+    if (taken)
+    {
+        snprintf(report_payload, sizeof(report_payload), "%s", json_payload);
+        report_state = REPORT_QUEUED;
+    }
+    portEXIT_CRITICAL(&report_lock);
+
+    if (!taken)
+    {
+        return -1;
+    }
+
+    // From the session itself (commands being executed) it goes out right away,
+    // ahead of the notification ACK; other tasks leave it to the session loop
+    if (xTaskGetCurrentTaskHandle() == session.task)
+    {
+        start_report();
+    }
+    return 0;
+}
+
+/**
+ * @brief Resolve the server and open a UDP socket connected to it
+ * @return The socket, or -1 on failure
+ */
+static int open_socket(const char *host, uint16_t port)
+{
+    struct sockaddr_in server = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+    };
+    if (inet_aton(host, &server.sin_addr) == 0 &&
+        DnsCacheLookup(host, (uint32_t *)&server.sin_addr.s_addr) != 0)
+    {
+        ESP_LOGE(TAG, "Failed to resolve %s", host);
+        return -1;
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+        ESP_LOGE(TAG, "Failed to create socket");
+        return -1;
+    }
+
+    // Connected, so only datagrams from the server are received
+    struct timeval timeout = {
+        .tv_sec = 0,
+        .tv_usec = COAP_RECEIVE_SLICE_MS * 1000,
+    };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(sock, (struct sockaddr *)&server, sizeof(server)) != 0)
+    {
+        ESP_LOGE(TAG, "Failed to connect socket");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int CoapRun(const char *url, coap_stop_cb_t should_stop)
+{
+    if (url == NULL)
+    {
+        return -1;
+    }
+
+    char host[MAX_HOST_LENGTH];
+    uint16_t port;
+    memset(&session, 0, sizeof(session));
+    if (parse_url(url, host, sizeof(host), &port, session.path, sizeof(session.path)) != 0)
+    {
+        ESP_LOGE(TAG, "Invalid CoAP URL: %s", url);
+        return -1;
+    }
+
+    session.sock = open_socket(host, port);
+    if (session.sock < 0)
+    {
+        return -1;
+    }
+
+    uint32_t random = esp_random();
+    memcpy(session.token, &random, COAP_TOKEN_LENGTH);
+    session.next_message_id = (uint16_t)esp_random();
+    session.task = xTaskGetCurrentTaskHandle();
+
+    portENTER_CRITICAL(&report_lock);
+    report_state = REPORT_NONE;
+    report_open = true;
+    portEXIT_CRITICAL(&report_lock);
+
+    ESP_LOGI(TAG, "Registering with %s:%u", host, port);
+    ServerSetAckSender(coap_ack_sender);
+    start_registration();
+
+    while (!session.failed && !should_stop())
+    {
+        TickType_t now = xTaskGetTickCount();
+        if (session.request_pending && (int32_t)(now - session.retransmit_at) >= 0)
+        {
+            retransmit_registration();
+        }
+        else if (!session.request_pending && (int32_t)(now - session.register_at) >= 0)
+        {
+            start_registration();
+        }
+
+        portENTER_CRITICAL(&report_lock);
+        report_state_t state = report_state;
+        portEXIT_CRITICAL(&report_lock);
+        if (state == REPORT_QUEUED)
+        {
+            start_report();
+        }
+        else if (state == REPORT_SENT && (int32_t)(now - session.report_retransmit_at) >= 0)
+        {
+            retransmit_report();
+        }
+
+        // Times out after a slice; errors (e.g. ICMP port unreachable) are covered by retransmission
+        int received = recv(session.sock, buffer, sizeof(buffer), 0);
+        coap_message_t msg;
+        if (received > 0 && parse_message(buffer, (size_t)received, &msg) == 0)
+        {
+            handle_message(&msg);
+        }
+    }
+
+    ServerSetAckSender(NULL);
+
+    // A report not answered yet is left to the outbox
+    portENTER_CRITICAL(&report_lock);
+    report_open = false;
+    bool report_outstanding = (report_state != REPORT_NONE);
+    portEXIT_CRITICAL(&report_lock);
+    if (report_outstanding)
+    {
+        finish_report(true);
+    }
+
+    // Deregister so the server stops sending notifications nobody will ACK
+    if (session.registered)
+    {
+        uint8_t request[COAP_MAX_REQUEST_SIZE];
+        size_t length = build_request(request, sizeof(request), COAP_TYPE_NON, session.next_message_id++,
+                                      COAP_OBSERVE_DEREGISTER);
+        if (length > 0)
+        {
+            send(session.sock, request, length, 0);
+        }
+    }
+    close(session.sock);
+
+    ESP_LOGI(TAG, "CoAP session ended");
+    return session.registered ? 0 : -1;
+}
@@ -1,8 +1,10 @@
 #include "com.h"
 #include "uart.h"
+#include "relay.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include "esp_log.h"
@@ -92,38 +94,145 @@ static command_type_t parse_command(const char *cmd_str, char *param_out)
         return CMD_URL_QUERY;
     }
 
+    // Check for URLADD= command
+    if (strncmp(cmd_copy, "URLADD=", 7) == 0)
+    {
+        if (param_out != NULL && len > 7)
+        {
+            strncpy(param_out, cmd_copy + 7, MAX_PARAM_LENGTH - 1);
+            param_out[MAX_PARAM_LENGTH - 1] = '\0';
+        }
+        return CMD_URL_ADD;
+    }
+
+    // Check for URLDEL= command
+    if (strncmp(cmd_copy, "URLDEL=", 7) == 0)
+    {
+        if (param_out != NULL && len > 7)
+        {
+            strncpy(param_out, cmd_copy + 7, MAX_PARAM_LENGTH - 1);
+            param_out[MAX_PARAM_LENGTH - 1] = '\0';
+        }
+        return CMD_URL_DELETE;
+    }
+
+    // Check for URLS? query
+    if (strcmp(cmd_copy, "URLS?") == 0)
+    {
+        return CMD_URLS_QUERY;
+    }
+
     // Check for IP? query
     if (strcmp(cmd_copy, "IP?") == 0)
     {
         return CMD_IP_QUERY;
     }
 
-    // Convert to lowercase for other commands
-    to_lowercase(cmd_copy);
+    // Check for ECHO= command
+    if (strncmp(cmd_copy, "ECHO=", 5) == 0)
+    {
+        if (param_out != NULL && len > 5)
+        {
+            strncpy(param_out, cmd_copy + 5, MAX_PARAM_LENGTH - 1);
+            param_out[MAX_PARAM_LENGTH - 1] = '\0';
+        }
+        return CMD_ECHO_SET;
+    }
 
-    if (strcmp(cmd_copy, "led on") == 0)
+    // Check for ECHO? query
+    if (strcmp(cmd_copy, "ECHO?") == 0)
     {
-        return CMD_LED_ON;
+        return CMD_ECHO_QUERY;
     }
-    else if (strcmp(cmd_copy, "led off") == 0)
+
+    // Check for PSK= command (empty clears the key)
+    if (strncmp(cmd_copy, "PSK=", 4) == 0)
     {
-        return CMD_LED_OFF;
+        if (param_out != NULL && len > 4)
+        {
+            strncpy(param_out, cmd_copy + 4, MAX_PARAM_LENGTH - 1);
+            param_out[MAX_PARAM_LENGTH - 1] = '\0';
+        }
+        return CMD_PSK_SET;
     }
-    else if (strcmp(cmd_copy, "relay1 on") == 0)
+
+    // Check for PSK? query
+    if (strcmp(cmd_copy, "PSK?") == 0)
+    {
+        return CMD_PSK_QUERY;
+    }
+
+    // Check for SCHED? query
+    if (strcmp(cmd_copy, "SCHED?") == 0)
+    {
+        return CMD_SCHED_QUERY;
+    }
+
+    // Check for SCENE= command
+    if (strncmp(cmd_copy, "SCENE=", 6) == 0)
+    {
+        if (param_out != NULL && len > 6)
+        {
+            strncpy(param_out, cmd_copy + 6, MAX_PARAM_LENGTH - 1);
+            param_out[MAX_PARAM_LENGTH - 1] = '\0';
+        }
+        return CMD_SCENE_SET;
+    }
+
+    // Check for SCENE? query
+    if (strcmp(cmd_copy, "SCENE?") == 0)
+    {
+        return CMD_SCENE_QUERY;
+    }
+
+    // Check for STATS? query
+    if (strcmp(cmd_copy, "STATS?") == 0)
+    {
+        return CMD_STATS_QUERY;
+    }
+
+    // Convert to lowercase for other commands
+    to_lowercase(cmd_copy);
+
+    int consumed = 0;
+
+    // scene <N>
+    int scene_number = 0;
+    if (sscanf(cmd_copy, "scene %d%n", &scene_number, &consumed) == 1 && cmd_copy[consumed] == '\0')
     {
-        return CMD_RELAY1_ON;
+        snprintf(param_out, MAX_PARAM_LENGTH, "%d", scene_number);
+        return CMD_SCENE_RECALL;
     }
-    else if (strcmp(cmd_copy, "relay1 off") == 0)
+
+    // relay<N> on|off, N from 1 to RELAY_COUNT
+    int relay_number = 0;
+    char action[4] = {0};
+    if (sscanf(cmd_copy, "relay%d %3s%n", &relay_number, action, &consumed) == 2 &&
+        cmd_copy[consumed] == '\0' && relay_number >= 1 && relay_number <= RELAY_COUNT)
     {
-        return CMD_RELAY1_OFF;
+        if (strcmp(action, "on") == 0 || strcmp(action, "off") == 0)
+        {
+            snprintf(param_out, MAX_PARAM_LENGTH, "%d", relay_number);
+            return (action[1] == 'n') ? CMD_RELAY_ON : CMD_RELAY_OFF;
+        }
     }
-    else if (strcmp(cmd_copy, "relay2 on") == 0)
+
+    // relay<N> pulse|pwm ..., checked by WaveformParse
+    if (sscanf(cmd_copy, "relay%d %n", &relay_number, &consumed) == 1 && relay_number >= 1 &&
+        relay_number <= RELAY_COUNT &&
+        (strncmp(cmd_copy + consumed, "pulse ", 6) == 0 || strncmp(cmd_copy + consumed, "pwm ", 4) == 0))
+    {
+        snprintf(param_out, MAX_PARAM_LENGTH, "%d %s", relay_number, cmd_copy + consumed);
+        return CMD_RELAY_WAVEFORM;
+    }
+
+    if (strcmp(cmd_copy, "led on") == 0)
     {
-        return CMD_RELAY2_ON;
+        return CMD_LED_ON;
     }
-    else if (strcmp(cmd_copy, "relay2 off") == 0)
+    else if (strcmp(cmd_copy, "led off") == 0)
     {
-        return CMD_RELAY2_OFF;
+        return CMD_LED_OFF;
     }
     else
     {
@@ -232,7 +341,6 @@ void ComSendResponse(const char *response)
         return;
     }
 
-    size_t len = strlen(response);
-    UartWrite(response, len);
-    UartWrite("\r\n", 2);  // Add CR+LF for line ending
+    // Response and CR+LF are queued as one write
+    UartWriteLine(response);
 }
@@ -0,0 +1,258 @@
+#include "dedup.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include <string.h>
+
+static const char *TAG = "dedup";
+
+#define DEDUP_TABLE_SIZE (DEDUP_WINDOW * 2) // Open-addressing slots, kept at most half full
+#define DEDUP_MAGIC 0x44445550u             // "DDUP"
+#define DEDUP_NVS_NAMESPACE "dedup"
+#define DEDUP_NVS_KEY "window"
+
+/**
+ * @brief The window as it is checkpointed: a ring of command id hashes, oldest at head
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t head;
+    uint32_t count;
+    uint32_t hashes[DEDUP_WINDOW];
+    uint32_t executed_seq; // Sequence number of the last executed command (0 = none)
+    uint32_t checksum;
+} dedup_window_t;
+
+// Survives every reset except a power cycle; checked with magic and checksum
+static RTC_NOINIT_ATTR dedup_window_t window;
+
+// Hash set over the ring: each slot holds a ring position + 1 (0 = empty), linear probing
+static uint8_t table[DEDUP_TABLE_SIZE];
+
+static uint32_t unsaved = 0;
+static bool seq_unsaved = false; // executed_seq advanced since the last checkpoint
+static uint32_t duplicates = 0;
+
+/**
+ * @brief FNV-1a hash of a command id
+ */
+static uint32_t hash_id(const char *command_id)
+{
+    uint32_t hash = 2166136261u;
+    for (const char *p = command_id; *p != '\0'; p++)
+    {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t window_checksum(const dedup_window_t *w)
+{
+    uint32_t sum = w->magic ^ (w->head * 31u) ^ (w->count * 131u) ^ (w->executed_seq * 257u);
+    for (size_t i = 0; i < DEDUP_WINDOW; i++)
+    {
+        sum = (sum ^ w->hashes[i]) * 16777619u;
+    }
+    return sum;
+}
+
+static bool window_is_valid(const dedup_window_t *w)
+{
+    return w->magic == DEDUP_MAGIC && w->head < DEDUP_WINDOW && w->count <= DEDUP_WINDOW &&
+           w->checksum == window_checksum(w);
+}
+
+/**
+ * @brief Find the slot of a hash, or the empty slot ending its probe sequence
+ */
+static size_t find_slot(uint32_t hash)
+{
+    size_t slot = hash % DEDUP_TABLE_SIZE;
+    while (table[slot] != 0 && window.hashes[table[slot] - 1] != hash)
+    {
+        slot = (slot + 1) % DEDUP_TABLE_SIZE;
+    }
+    return slot;
+}
+
+/**
+ * @brief Remove the entry in a slot, shifting later entries of the probe run back
+ */
+static void remove_slot(size_t slot)
+{
+    table[slot] = 0;
+    size_t next = (slot + 1) % DEDUP_TABLE_SIZE;
+    while (table[next] != 0)
+    {
+        size_t home = window.hashes[table[next] - 1] % DEDUP_TABLE_SIZE;
+        // Move the entry back if its home is not in (slot, next]
+        bool in_range = (slot <= next) ? (home > slot && home <= next) : (home > slot || home <= next);
+        if (!in_range)
+        {
+            table[slot] = table[next];
+            table[next] = 0;
+            slot = next;
+        }
+        next = (next + 1) % DEDUP_TABLE_SIZE;
+    }
+}
+
+/**
+ * @brief Rebuild the hash set from the ring
+ */
+static void rebuild_table(void)
+{
+    memset(table, 0, sizeof(table));
+    for (uint32_t i = 0; i < window.count; i++)
+    {
+        uint32_t position = (window.head + i) % DEDUP_WINDOW;
+        size_t slot = find_slot(window.hashes[position]);
+        table[slot] = (uint8_t)(position + 1);
+    }
+}
+
+/**
+ * @brief Write the window to NVS
+ */
+static void save_checkpoint(void)
+{
+    unsaved = 0;
+    seq_unsaved = false;
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(DEDUP_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_blob(nvs_handle, DEDUP_NVS_KEY, &window, sizeof(window));
+        if (err == ESP_OK)
+        {
+            err = nvs_commit(nvs_handle);
+        }
+        nvs_close(nvs_handle);
+    }
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error saving command window: %s", esp_err_to_name(err));
+    }
+}
+
+/**
+ * @brief Read the window from NVS
+ * @return true if a valid window was loaded
+ */
+static bool load_checkpoint(void)
+{
+    nvs_handle_t nvs_handle;
+    if (nvs_open(DEDUP_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK)
+    {
+        return false;
+    }
+
+    size_t length = sizeof(window);
+    esp_err_t err = nvs_get_blob(nvs_handle, DEDUP_NVS_KEY, &window, &length);
+    nvs_close(nvs_handle);
+    return err == ESP_OK && length == sizeof(window) && window_is_valid(&window);
+}
+
+void DedupInit(void)
+{
+    if (window_is_valid(&window))
+    {
+        ESP_LOGI(TAG, "Restored %lu command ids from RTC memory", (unsigned long)window.count);
+    }
+    else if (load_checkpoint())
+    {
+        ESP_LOGI(TAG, "Restored %lu command ids from NVS", (unsigned long)window.count);
+    }
+    else
+    {
+        memset(&window, 0, sizeof(window));
+        window.magic = DEDUP_MAGIC;
+        window.checksum = window_checksum(&window);
+    }
+    rebuild_table();
+}
+
+bool DedupSeen(const char *command_id)
+{
+    if (command_id == NULL || command_id[0] == '\0')
+    {
+        return false;
+    }
+
+    if (table[find_slot(hash_id(command_id))] == 0)
+    {
+        return false;
+    }
+    duplicates++;
+    return true;
+}
+
+void DedupRecord(const char *command_id)
+{
+    if (command_id == NULL || command_id[0] == '\0')
+    {
+        return;
+    }
+
+    uint32_t hash = hash_id(command_id);
+    if (table[find_slot(hash)] != 0)
+    {
+        return;
+    }
+
+    uint32_t position;
+    if (window.count == DEDUP_WINDOW)
+    {
+        // Evict the oldest id
+        position = window.head;
+        remove_slot(find_slot(window.hashes[position]));
+        window.head = (window.head + 1) % DEDUP_WINDOW;
+    }
+    else
+    {
+        position = (window.head + window.count) % DEDUP_WINDOW;
+        window.count++;
+    }
+
+    window.hashes[position] = hash;
+    table[find_slot(hash)] = (uint8_t)(position + 1);
+    window.checksum = window_checksum(&window);
+
+    // RTC memory is always current; flash is written in batches to limit wear
+    if (++unsaved >= DEDUP_CHECKPOINT_EVERY)
+    {
+        save_checkpoint();
+    }
+}
+
+void DedupSetSeq(uint32_t seq)
+{
+    if (seq <= window.executed_seq)
+    {
+        return;
+    }
+    window.executed_seq = seq;
+    window.checksum = window_checksum(&window);
+    seq_unsaved = true;
+}
+
+void DedupFlush(void)
+{
+    if (seq_unsaved)
+    {
+        save_checkpoint();
+    }
+}
+
+uint32_t DedupGetSeq(void)
+{
+    return window.executed_seq;
+}
+
+uint32_t DedupGetDuplicates(void)
+{
+    return duplicates;
+}
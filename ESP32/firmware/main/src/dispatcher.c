@@ -0,0 +1,372 @@
+#include "dispatcher.h"
+#include "relay.h"
+#include "relaytimer.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "dispatcher";
+
+#define DISPATCHER_HOLD_US ((int64_t)CONFIG_RELAY_MANUAL_HOLD_S * 1000000)
+#define PRIORITY_MANUAL 3 // Local manual sources; their commands hold the relay
+
+/**
+ * @brief Priority of each source; a held relay only accepts commands of the same or higher priority
+ */
+static const uint8_t source_priority[RELAY_SOURCE_COUNT] = {
+    [RELAY_SOURCE_TIMER] = 0,
+    [RELAY_SOURCE_WAVEFORM] = 0,
+    [RELAY_SOURCE_SCHEDULE] = 1,
+    [RELAY_SOURCE_REMOTE] = 2,
+    [RELAY_SOURCE_WEB] = PRIORITY_MANUAL,
+    [RELAY_SOURCE_UART] = PRIORITY_MANUAL,
+};
+
+static const char *source_names[RELAY_SOURCE_COUNT] = {
+    [RELAY_SOURCE_TIMER] = "timer",
+    [RELAY_SOURCE_WAVEFORM] = "waveform",
+    [RELAY_SOURCE_SCHEDULE] = "schedule",
+    [RELAY_SOURCE_REMOTE] = "remote",
+    [RELAY_SOURCE_WEB] = "web",
+    [RELAY_SOURCE_UART] = "uart",
+};
+
+/**
+ * @brief Manual override of one relay
+ */
+typedef struct
+{
+    uint8_t priority;
+    int64_t until_us; // esp_timer time the hold ends, 0 = not held
+} relay_hold_t;
+
+// Serializes transitions, timer changes and listener calls
+static SemaphoreHandle_t dispatch_mutex = NULL;
+static relay_hold_t holds[RELAY_COUNT];
+
+// Relays driven by a running waveform, and the report_id of each
+static uint32_t waveform_relays;
+static char waveform_ids[RELAY_COUNT][DISPATCHER_REPORT_ID_LENGTH];
+static dispatcher_waveform_end_t waveform_handler = NULL;
+
+static struct
+{
+    dispatcher_listener_t listener;
+    void *ctx;
+} listeners[DISPATCHER_MAX_LISTENERS];
+
+// Published state: written with dispatch_mutex held inside a critical section
+// (so the writer cannot be preempted by a reader), read without any lock.
+// An odd sequence number means a write is in progress.
+static relay_snapshot_t snapshot;
+static atomic_uint snapshot_seq;
+static portMUX_TYPE snapshot_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Publish a new snapshot (dispatch_mutex must be held)
+ */
+static void publish_snapshot(const relay_snapshot_t *next)
+{
+    portENTER_CRITICAL(&snapshot_lock);
+    atomic_fetch_add_explicit(&snapshot_seq, 1, memory_order_acq_rel);
+    snapshot = *next;
+    atomic_fetch_add_explicit(&snapshot_seq, 1, memory_order_release);
+    portEXIT_CRITICAL(&snapshot_lock);
+}
+
+/**
+ * @brief Publish a transition and tell the listeners (dispatch_mutex must be held)
+ */
+static void publish_transition(relay_source_t source, uint32_t changed, int64_t now)
+{
+    relay_snapshot_t next = {
+        .states = RelayGetStates(),
+        .changed = changed,
+        .waveforms = waveform_relays,
+        .version = snapshot.version + 1,
+        .source = source,
+        .changed_us = now,
+    };
+    publish_snapshot(&next);
+    ESP_LOGI(TAG, "Relays 0x%lx switched by %s, states 0x%lx", (unsigned long)changed, source_names[source],
+             (unsigned long)next.states);
+
+    for (int i = 0; i < DISPATCHER_MAX_LISTENERS; i++)
+    {
+        if (listeners[i].listener != NULL)
+        {
+            listeners[i].listener(&next, listeners[i].ctx);
+        }
+    }
+}
+
+/**
+ * @brief Switch the accepted relays and report the transition (dispatch_mutex must be held)
+ * @param failed Set to the accepted relays whose waveform could not start
+ * @return The relays that were switched
+ */
+static uint32_t apply_request(const relay_request_t *request, uint32_t *failed)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t accepted = 0;
+    uint32_t started = 0;
+    uint32_t waveforms_before = waveform_relays;
+    uint8_t priority = source_priority[request->source];
+
+    *failed = 0;
+    for (int i = 0; i < RELAY_COUNT; i++)
+    {
+        uint32_t bit = 1u << i;
+        if ((request->mask & bit) == 0)
+        {
+            continue;
+        }
+
+        // An auto-off only fires for a timer armed by an accepted command, so it is never held
+        if (request->source != RELAY_SOURCE_TIMER && holds[i].until_us > now && priority < holds[i].priority)
+        {
+            ESP_LOGW(TAG, "Relay %d is held by a manual command, %s command ignored", i + 1,
+                     source_names[request->source]);
+            continue;
+        }
+        accepted |= bit;
+
+        if (priority == PRIORITY_MANUAL && DISPATCHER_HOLD_US > 0)
+        {
+            holds[i].priority = priority;
+            holds[i].until_us = now + DISPATCHER_HOLD_US;
+        }
+
+        // Timers are set first so an auto-off that is due cannot undo an ON
+        if (request->source == RELAY_SOURCE_TIMER)
+        {
+            continue;
+        }
+        if (waveform_relays & bit)
+        {
+            WaveformStop(i + 1);
+            waveform_relays &= ~bit;
+        }
+        if (request->waveform[i] != NULL)
+        {
+            RelayTimerCancel(i + 1);
+            started |= bit;
+            continue;
+        }
+        if ((request->states & bit) && request->duration_ms[i] > 0)
+        {
+            if (RelayTimerArm(i + 1, (uint64_t)request->duration_ms[i] * 1000) == 0)
+            {
+                ESP_LOGI(TAG, "Relay %d will auto-turn OFF after %lu ms", i + 1,
+                         (unsigned long)request->duration_ms[i]);
+            }
+        }
+        else
+        {
+            RelayTimerCancel(i + 1);
+        }
+    }
+
+    if (accepted == 0)
+    {
+        return 0;
+    }
+
+    // Waveforms start from OFF, right after the transition
+    uint32_t before = RelayGetStates();
+    RelayApplyMask(accepted, request->states & ~started);
+    for (int i = 0; i < RELAY_COUNT; i++)
+    {
+        uint32_t bit = 1u << i;
+        if ((started & bit) == 0)
+        {
+            continue;
+        }
+        if (WaveformStart(i + 1, request->waveform[i], request->duration_ms[i]) == 0)
+        {
+            waveform_relays |= bit;
+            snprintf(waveform_ids[i], sizeof(waveform_ids[i]), "%s",
+                     (request->report_id != NULL) ? request->report_id : "");
+        }
+        else
+        {
+            *failed |= bit;
+        }
+    }
+
+    uint32_t changed = ((before ^ RelayGetStates()) & accepted) | (waveforms_before ^ waveform_relays) |
+                       (started & waveform_relays);
+    if (changed != 0)
+    {
+        publish_transition(request->source, changed, now);
+    }
+    return accepted;
+}
+
+/**
+ * @brief Auto-off timer callback (runs in the relay timer task)
+ * The timer is claimed under dispatch_mutex, so a command that re-arms or
+ * cancels it is either fully before or fully after the auto-off
+ */
+static void timer_expired(int relayNumber)
+{
+    xSemaphoreTake(dispatch_mutex, portMAX_DELAY);
+    if (RelayTimerClaimExpired(relayNumber))
+    {
+        relay_request_t request = {
+            .source = RELAY_SOURCE_TIMER,
+            .mask = 1u << (relayNumber - 1),
+            .states = 0,
+        };
+        uint32_t failed;
+        apply_request(&request, &failed);
+        ESP_LOGI(TAG, "Relay %d auto-turned OFF", relayNumber);
+    }
+    xSemaphoreGive(dispatch_mutex);
+}
+
+/**
+ * @brief Waveform end callback (runs in the waveform task)
+ * Claimed under dispatch_mutex like the auto-off, so a waveform that a
+ * command stopped or replaced meanwhile is neither published nor reported
+ */
+static void waveform_ended(int relayNumber, uint32_t generation)
+{
+    char report_id[DISPATCHER_REPORT_ID_LENGTH];
+    dispatcher_waveform_end_t handler = NULL;
+    uint32_t bit = 1u << (relayNumber - 1);
+
+    xSemaphoreTake(dispatch_mutex, portMAX_DELAY);
+    bool ended = (waveform_relays & bit) && WaveformClaimEnded(relayNumber, generation);
+    if (ended)
+    {
+        waveform_relays &= ~bit;
+        snprintf(report_id, sizeof(report_id), "%s", waveform_ids[relayNumber - 1]);
+        handler = waveform_handler;
+        publish_transition(RELAY_SOURCE_WAVEFORM, bit, esp_timer_get_time());
+    }
+    xSemaphoreGive(dispatch_mutex);
+
+    if (ended)
+    {
+        ESP_LOGI(TAG, "Relay %d: waveform completed", relayNumber);
+        if (handler != NULL)
+        {
+            handler(relayNumber, WAVEFORM_COMPLETED, report_id);
+        }
+    }
+}
+
+void DispatcherInit(void)
+{
+    if (dispatch_mutex != NULL)
+    {
+        return;
+    }
+    dispatch_mutex = xSemaphoreCreateMutex();
+
+    // The boot states set by RelayInit are the first snapshot
+    relay_snapshot_t initial = {
+        .states = RelayGetStates(),
+        .source = RELAY_SOURCE_TIMER,
+    };
+    publish_snapshot(&initial);
+
+    RelayTimerInit(timer_expired);
+    WaveformInit(waveform_ended);
+}
+
+uint32_t DispatcherSubmit(const relay_request_t *request)
+{
+    if (request == NULL || request->source >= RELAY_SOURCE_COUNT || dispatch_mutex == NULL)
+    {
+        return 0;
+    }
+
+    uint32_t failed;
+    xSemaphoreTake(dispatch_mutex, portMAX_DELAY);
+    uint32_t accepted = apply_request(request, &failed);
+    dispatcher_waveform_end_t handler = waveform_handler;
+    xSemaphoreGive(dispatch_mutex);
+
+    // Reported outside the lock, like a completion
+    for (int i = 0; i < RELAY_COUNT && failed != 0; i++)
+    {
+        if ((failed & (1u << i)) && handler != NULL)
+        {
+            handler(i + 1, WAVEFORM_FAILED, (request->report_id != NULL) ? request->report_id : "");
+        }
+    }
+    return accepted;
+}
+
+int DispatcherSwitch(int relayNumber, int state, relay_source_t source)
+{
+    if (relayNumber < 1 || relayNumber > RELAY_COUNT)
+    {
+        ESP_LOGE(TAG, "Invalid relay number: %d", relayNumber);
+        return -1;
+    }
+
+    relay_request_t request = {
+        .source = source,
+        .mask = 1u << (relayNumber - 1),
+        .states = state ? 1u << (relayNumber - 1) : 0,
+    };
+    return (DispatcherSubmit(&request) != 0) ? 0 : -1;
+}
+
+void DispatcherGetSnapshot(relay_snapshot_t *out)
+{
+    unsigned int seq;
+    do
+    {
+        seq = atomic_load_explicit(&snapshot_seq, memory_order_acquire);
+        *out = *(volatile relay_snapshot_t *)&snapshot;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) != 0 || seq != atomic_load_explicit(&snapshot_seq, memory_order_relaxed));
+}
+
+int DispatcherAddListener(dispatcher_listener_t listener, void *ctx)
+{
+    if (listener == NULL || dispatch_mutex == NULL)
+    {
+        return -1;
+    }
+
+    int result = -1;
+    xSemaphoreTake(dispatch_mutex, portMAX_DELAY);
+    for (int i = 0; i < DISPATCHER_MAX_LISTENERS; i++)
+    {
+        if (listeners[i].listener == NULL)
+        {
+            listeners[i].listener = listener;
+            listeners[i].ctx = ctx;
+            result = 0;
+            break;
+        }
+    }
+    xSemaphoreGive(dispatch_mutex);
+    return result;
+}
+
+void DispatcherSetWaveformHandler(dispatcher_waveform_end_t handler)
+{
+    if (dispatch_mutex == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(dispatch_mutex, portMAX_DELAY);
+    waveform_handler = handler;
+    xSemaphoreGive(dispatch_mutex);
+}
+
+const char *DispatcherSourceName(relay_source_t source)
+{
+    return (source < RELAY_SOURCE_COUNT) ? source_names[source] : "unknown";
+}
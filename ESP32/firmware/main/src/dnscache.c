@@ -0,0 +1,431 @@
+#include "dnscache.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "lwip/sockets.h"
+#include "lwip/dns.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "dnscache";
+
+#define DNS_CACHE_SIZE 4
+#define DNS_CACHE_TIMEOUT_MS 3000      // Time a lookup may wait for the resolver
+#define DNS_CACHE_MIN_TTL_S 30         // Shorter TTLs are raised to this, so a 0 TTL doesn't defeat the cache
+#define DNS_CACHE_MAX_TTL_S 86400
+#define DNS_CACHE_STALE_S 3600         // How long an expired answer may be served while it is refreshed
+#define DNS_CACHE_PREFETCH_MARGIN_MS 2000 // Refresh this much before the name is needed
+#define DNS_PORT 53
+#define DNS_PACKET_SIZE 512
+#define DNS_TYPE_A 1
+#define DNS_CLASS_IN 1
+
+/**
+ * @brief A cached answer
+ */
+typedef struct
+{
+    char host[DNS_CACHE_MAX_HOST_LENGTH];
+    uint32_t ipv4;
+    TickType_t expires_at;
+    TickType_t used_at; // For least-recently-used eviction
+    bool valid;         // ipv4 holds an answer (false while a prefetch is pending)
+    bool refresh;       // The refresh task should resolve the name again
+} dns_entry_t;
+
+// Guarded by cache_mutex
+static dns_entry_t entries[DNS_CACHE_SIZE];
+static dns_cache_stats_t stats = {0};
+
+static SemaphoreHandle_t cache_mutex = NULL;
+static TaskHandle_t refresh_task = NULL;
+static dns_resolver_fn_t resolve = NULL;
+
+/**
+ * @brief Find the entry of a host (mutex must be held)
+ */
+static dns_entry_t *find_entry(const char *host)
+{
+    for (size_t i = 0; i < DNS_CACHE_SIZE; i++)
+    {
+        if (entries[i].host[0] != '\0' && strcmp(entries[i].host, host) == 0)
+        {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Get the entry of a host, reusing the least recently used one if needed (mutex must be held)
+ */
+static dns_entry_t *claim_entry(const char *host)
+{
+    dns_entry_t *entry = find_entry(host);
+    if (entry != NULL)
+    {
+        return entry;
+    }
+
+    entry = &entries[0];
+    for (size_t i = 0; i < DNS_CACHE_SIZE; i++)
+    {
+        if (entries[i].host[0] == '\0')
+        {
+            entry = &entries[i];
+            break;
+        }
+        if ((int32_t)(entries[i].used_at - entry->used_at) < 0)
+        {
+            entry = &entries[i];
+        }
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->host, sizeof(entry->host), "%s", host);
+    entry->used_at = xTaskGetTickCount();
+    return entry;
+}
+
+/**
+ * @brief Store an answer (mutex must be held)
+ */
+static void store_answer(const char *host, uint32_t ipv4, uint32_t ttl_s)
+{
+    if (ttl_s < DNS_CACHE_MIN_TTL_S)
+    {
+        ttl_s = DNS_CACHE_MIN_TTL_S;
+    }
+    else if (ttl_s > DNS_CACHE_MAX_TTL_S)
+    {
+        ttl_s = DNS_CACHE_MAX_TTL_S;
+    }
+
+    dns_entry_t *entry = claim_entry(host);
+    entry->ipv4 = ipv4;
+    entry->expires_at = xTaskGetTickCount() + pdMS_TO_TICKS(ttl_s * 1000);
+    entry->valid = true;
+    entry->refresh = false;
+}
+
+/**
+ * @brief Append a host name to a query as DNS labels
+ * @return Bytes written, or 0 if the name does not fit or has an invalid label
+ */
+static size_t encode_name(const char *host, uint8_t *out, size_t max_len)
+{
+    size_t pos = 0;
+    while (*host != '\0')
+    {
+        size_t label = strcspn(host, ".");
+        if (label == 0 || label > 63 || pos + label + 2 > max_len)
+        {
+            return 0;
+        }
+        out[pos++] = (uint8_t)label;
+        memcpy(out + pos, host, label);
+        pos += label;
+        host += label;
+        if (*host == '.')
+        {
+            host++;
+        }
+    }
+    out[pos++] = 0;
+    return pos;
+}
+
+/**
+ * @brief Skip a (possibly compressed) name in a response
+ * @return Position after the name, or 0 if it runs past the end
+ */
+static size_t skip_name(const uint8_t *packet, size_t len, size_t pos)
+{
+    while (pos < len)
+    {
+        if ((packet[pos] & 0xC0) == 0xC0)
+        {
+            return (pos + 2 <= len) ? pos + 2 : 0;
+        }
+        if (packet[pos] == 0)
+        {
+            return pos + 1;
+        }
+        pos += packet[pos] + 1;
+    }
+    return 0;
+}
+
+static uint16_t read_u16(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+/**
+ * @brief Built-in resolver: one A query to the interface's DNS server
+ * Unlike getaddrinfo() this reports the TTL of the answer
+ */
+static int udp_resolve(const char *host, uint32_t *ipv4, uint32_t *ttl_s, uint32_t timeout_ms)
+{
+    const ip_addr_t *server = dns_getserver(0);
+    if (server == NULL || !IP_IS_V4(server) || ip_2_ip4(server)->addr == 0)
+    {
+        return -1;
+    }
+
+    uint8_t packet[DNS_PACKET_SIZE];
+    uint16_t id = (uint16_t)esp_random();
+
+    // Header: id, recursion desired, one question
+    memset(packet, 0, 12);
+    packet[0] = id >> 8;
+    packet[1] = id & 0xFF;
+    packet[2] = 0x01;
+    packet[5] = 1;
+    size_t name_len = encode_name(host, packet + 12, sizeof(packet) - 16);
+    if (name_len == 0)
+    {
+        return -1;
+    }
+    size_t len = 12 + name_len;
+    packet[len++] = 0;
+    packet[len++] = DNS_TYPE_A;
+    packet[len++] = 0;
+    packet[len++] = DNS_CLASS_IN;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+        return -1;
+    }
+
+    struct timeval timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct sockaddr_in dest = {
+        .sin_family = AF_INET,
+        .sin_port = htons(DNS_PORT),
+        .sin_addr.s_addr = ip_2_ip4(server)->addr,
+    };
+    int received = -1;
+    if (sendto(sock, packet, len, 0, (struct sockaddr *)&dest, sizeof(dest)) == (int)len)
+    {
+        received = recv(sock, packet, sizeof(packet), 0);
+    }
+    close(sock);
+
+    // Our id, a response, no error, at least one answer
+    if (received < 12 || read_u16(packet) != id || !(packet[2] & 0x80) || (packet[3] & 0x0F) != 0)
+    {
+        return -1;
+    }
+
+    size_t pos = 12;
+    for (uint16_t i = 0; i < read_u16(packet + 4) && pos != 0; i++)
+    {
+        pos = skip_name(packet, received, pos);
+        pos = (pos != 0) ? pos + 4 : 0;
+    }
+
+    // The TTL is the shortest along the answer chain (CNAMEs included)
+    uint32_t ttl = UINT32_MAX;
+    uint16_t answers = read_u16(packet + 6);
+    for (uint16_t i = 0; i < answers && pos != 0; i++)
+    {
+        pos = skip_name(packet, received, pos);
+        if (pos == 0 || pos + 10 > (size_t)received)
+        {
+            break;
+        }
+        uint16_t type = read_u16(packet + pos);
+        uint16_t rclass = read_u16(packet + pos + 2);
+        uint32_t record_ttl = ((uint32_t)read_u16(packet + pos + 4) << 16) | read_u16(packet + pos + 6);
+        uint16_t rdlength = read_u16(packet + pos + 8);
+        pos += 10;
+        if (pos + rdlength > (size_t)received)
+        {
+            break;
+        }
+        if (record_ttl < ttl)
+        {
+            ttl = record_ttl;
+        }
+        if (type == DNS_TYPE_A && rclass == DNS_CLASS_IN && rdlength == 4)
+        {
+            memcpy(ipv4, packet + pos, 4);
+            *ttl_s = ttl;
+            return 0;
+        }
+        pos += rdlength;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Resolve a name and store the answer, without holding the mutex while waiting
+ */
+static int resolve_and_store(const char *host, uint32_t *ipv4)
+{
+    uint32_t address = 0;
+    uint32_t ttl_s = 0;
+    int err = resolve(host, &address, &ttl_s, DNS_CACHE_TIMEOUT_MS);
+
+    xSemaphoreTake(cache_mutex, portMAX_DELAY);
+    if (err == 0)
+    {
+        store_answer(host, address, ttl_s);
+    }
+    else
+    {
+        // A stale answer stays in place; the next lookup tries again
+        stats.failures++;
+    }
+    xSemaphoreGive(cache_mutex);
+
+    if (err == 0 && ipv4 != NULL)
+    {
+        *ipv4 = address;
+    }
+    if (err != 0)
+    {
+        ESP_LOGW(TAG, "Failed to resolve %s", host);
+    }
+    return err;
+}
+
+/**
+ * @brief Refresh task: resolves the names marked by lookups and prefetches
+ */
+static void dns_refresh_task(void *pvParameters)
+{
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        for (size_t i = 0; i < DNS_CACHE_SIZE; i++)
+        {
+            char host[DNS_CACHE_MAX_HOST_LENGTH] = {0};
+
+            xSemaphoreTake(cache_mutex, portMAX_DELAY);
+            if (entries[i].refresh)
+            {
+                snprintf(host, sizeof(host), "%s", entries[i].host);
+                entries[i].refresh = false;
+                stats.refreshes++;
+            }
+            xSemaphoreGive(cache_mutex);
+
+            if (host[0] != '\0')
+            {
+                resolve_and_store(host, NULL);
+            }
+        }
+    }
+}
+
+void DnsCacheInit(dns_resolver_fn_t resolver)
+{
+    resolve = (resolver != NULL) ? resolver : udp_resolve;
+
+    if (cache_mutex != NULL)
+    {
+        return;
+    }
+
+    cache_mutex = xSemaphoreCreateMutex();
+    if (cache_mutex == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create cache mutex");
+        return;
+    }
+
+    if (xTaskCreate(dns_refresh_task, "dns_refresh", 3072, NULL, 4, &refresh_task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create refresh task");
+        refresh_task = NULL;
+    }
+}
+
+int DnsCacheLookup(const char *host, uint32_t *ipv4)
+{
+    if (host == NULL || ipv4 == NULL || cache_mutex == NULL || strlen(host) >= DNS_CACHE_MAX_HOST_LENGTH)
+    {
+        return -1;
+    }
+
+    xSemaphoreTake(cache_mutex, portMAX_DELAY);
+    TickType_t now = xTaskGetTickCount();
+    dns_entry_t *entry = find_entry(host);
+    if (entry != NULL && entry->valid)
+    {
+        int32_t expired_ticks = (int32_t)(now - entry->expires_at);
+        if (expired_ticks < 0 || expired_ticks < (int32_t)pdMS_TO_TICKS(DNS_CACHE_STALE_S * 1000))
+        {
+            *ipv4 = entry->ipv4;
+            entry->used_at = now;
+            if (expired_ticks < 0)
+            {
+                stats.hits++;
+            }
+            else
+            {
+                // Serve-stale: answer now, refresh in the background
+                stats.stale_hits++;
+                entry->refresh = true;
+            }
+            xSemaphoreGive(cache_mutex);
+
+            if (expired_ticks >= 0 && refresh_task != NULL)
+            {
+                xTaskNotifyGive(refresh_task);
+            }
+            return 0;
+        }
+    }
+    stats.misses++;
+    xSemaphoreGive(cache_mutex);
+
+    return resolve_and_store(host, ipv4);
+}
+
+void DnsCachePrefetch(const char *host, uint32_t within_ms)
+{
+    if (host == NULL || cache_mutex == NULL || refresh_task == NULL || strlen(host) >= DNS_CACHE_MAX_HOST_LENGTH)
+    {
+        return;
+    }
+
+    xSemaphoreTake(cache_mutex, portMAX_DELAY);
+    TickType_t needed_at = xTaskGetTickCount() + pdMS_TO_TICKS(within_ms + DNS_CACHE_PREFETCH_MARGIN_MS);
+    dns_entry_t *entry = find_entry(host);
+    bool refresh = (entry == NULL || !entry->valid || (int32_t)(entry->expires_at - needed_at) < 0);
+    if (refresh)
+    {
+        claim_entry(host)->refresh = true;
+    }
+    xSemaphoreGive(cache_mutex);
+
+    if (refresh)
+    {
+        xTaskNotifyGive(refresh_task);
+    }
+}
+
+void DnsCacheGetStats(dns_cache_stats_t *out)
+{
+    if (out == NULL || cache_mutex == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(cache_mutex, portMAX_DELAY);
+    *out = stats;
+    xSemaphoreGive(cache_mutex);
+}
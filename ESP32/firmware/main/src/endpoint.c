@@ -0,0 +1,552 @@
+#include "endpoint.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "endpoint";
+
+#define ENDPOINT_NVS_NAMESPACE "http"
+#define ENDPOINT_NVS_KEY_LIST "urls"
+#define ENDPOINT_NVS_KEY_PRIMARY "url" // Primary alone, as read by older firmware
+#define ENDPOINT_UNHEALTHY_PCT 50      // Error rate above which an endpoint is avoided
+#define ENDPOINT_SWITCH_PCT 80         // A faster endpoint must take less than this share of the active RTT
+#define ENDPOINT_SWITCH_MIN_MS 10      // ...and be at least this much faster
+#define ENDPOINT_PROBE_MS 300000       // Probe interval while every endpoint is healthy
+#define ENDPOINT_REPROBE_MS 30000      // Probe interval while some endpoint is unhealthy
+#define ENDPOINT_BREAKER_THRESHOLD 3   // Consecutive failed operations that open an endpoint's breaker
+#define ENDPOINT_BREAKER_COOLDOWN_MS 5000
+#define ENDPOINT_BREAKER_COOLDOWN_MAX_MS 60000
+
+/**
+ * @brief One configured server
+ */
+typedef struct
+{
+    char url[ENDPOINT_URL_LENGTH];
+    uint32_t rtt_ms;
+    uint16_t error_permille; // Exponentially weighted, 1/8 per operation
+    uint32_t operations;
+    uint32_t failures;
+} endpoint_t;
+
+// Guarded by endpoint_mutex
+static endpoint_t endpoints[ENDPOINT_MAX];
+static size_t endpoint_count = 0;
+static size_t active = 0;
+
+// One breaker per slot; reset when the slot gets a new URL
+static retry_breaker_t breakers[ENDPOINT_MAX];
+
+static SemaphoreHandle_t endpoint_mutex = NULL;
+
+// Breaker names for log messages, by position in the list
+static const char *const breaker_names[ENDPOINT_MAX] = {"server1", "server2", "server3", "server4"};
+
+static bool is_separator(char c)
+{
+    return c == ' ' || c == ',' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/**
+ * @brief Check whether an endpoint may be used (mutex must be held)
+ */
+static bool is_healthy(size_t index)
+{
+    return endpoints[index].error_permille < ENDPOINT_UNHEALTHY_PCT * 10 &&
+           RetryBreakerWaitMs(&breakers[index]) == 0;
+}
+
+/**
+ * @brief Order endpoints by preference (mutex must be held)
+ * Healthy before unhealthy, measured before unmeasured, then by RTT, then by
+ * position in the list
+ * @return true if a is preferred over b
+ */
+static bool is_better(size_t a, size_t b)
+{
+    bool healthy_a = is_healthy(a);
+    bool healthy_b = is_healthy(b);
+    if (healthy_a != healthy_b)
+    {
+        return healthy_a;
+    }
+
+    uint32_t rtt_a = endpoints[a].rtt_ms;
+    uint32_t rtt_b = endpoints[b].rtt_ms;
+    if ((rtt_a == 0) != (rtt_b == 0))
+    {
+        return rtt_a != 0;
+    }
+    if (rtt_a != rtt_b)
+    {
+        return rtt_a < rtt_b;
+    }
+    return a < b;
+}
+
+/**
+ * @brief Find the most preferred endpoint other than exclude (mutex must be held)
+ * @return Its index, or -1 if there is none
+ */
+static int best_endpoint(int exclude)
+{
+    int best = -1;
+    for (size_t i = 0; i < endpoint_count; i++)
+    {
+        if ((int)i != exclude && (best < 0 || is_better(i, (size_t)best)))
+        {
+            best = (int)i;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Format the list as a space-separated string (mutex must be held)
+ */
+static void format_list(char *list, size_t max_len)
+{
+    size_t len = 0;
+    list[0] = '\0';
+    for (size_t i = 0; i < endpoint_count && len < max_len; i++)
+    {
+        len += snprintf(list + len, max_len - len, "%s%s", (i > 0) ? " " : "", endpoints[i].url);
+    }
+}
+
+static int save_list(const char *list, const char *primary)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(ENDPOINT_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return -1;
+    }
+
+    err = nvs_set_str(nvs_handle, ENDPOINT_NVS_KEY_LIST, list);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_str(nvs_handle, ENDPOINT_NVS_KEY_PRIMARY, primary);
+    }
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error saving endpoints: %s", esp_err_to_name(err));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Install a new list (mutex must be held)
+ * @param save false when loading the list from NVS
+ */
+static int apply_list(const char *list, bool save)
+{
+    char urls[ENDPOINT_MAX][ENDPOINT_URL_LENGTH];
+    size_t count = 0;
+
+    const char *p = list;
+    while (*p != '\0')
+    {
+        while (is_separator(*p))
+        {
+            p++;
+        }
+        size_t len = 0;
+        while (p[len] != '\0' && !is_separator(p[len]))
+        {
+            len++;
+        }
+        if (len == 0)
+        {
+            break;
+        }
+        if (count == ENDPOINT_MAX || len >= ENDPOINT_URL_LENGTH)
+        {
+            ESP_LOGE(TAG, "Endpoint list too long (at most %d URLs of %d characters)", ENDPOINT_MAX,
+                     ENDPOINT_URL_LENGTH - 1);
+            return -1;
+        }
+        memcpy(urls[count], p, len);
+        urls[count][len] = '\0';
+        count++;
+        p += len;
+    }
+
+    if (count == 0)
+    {
+        ESP_LOGE(TAG, "Endpoint list is empty");
+        return -1;
+    }
+
+    // Carry the measurements of URLs that stay in the list over to their new slot
+    endpoint_t updated[ENDPOINT_MAX];
+    size_t new_active = 0;
+    bool changed = (count != endpoint_count);
+    for (size_t i = 0; i < count; i++)
+    {
+        updated[i] = (endpoint_t){0};
+        snprintf(updated[i].url, sizeof(updated[i].url), "%s", urls[i]);
+        for (size_t j = 0; j < endpoint_count; j++)
+        {
+            if (strcmp(endpoints[j].url, urls[i]) == 0)
+            {
+                updated[i] = endpoints[j];
+                if (j == active)
+                {
+                    new_active = i;
+                }
+                break;
+            }
+        }
+        if (i >= endpoint_count || strcmp(endpoints[i].url, urls[i]) != 0)
+        {
+            RetryBreakerReset(&breakers[i]);
+            changed = true;
+        }
+    }
+
+    if (!changed)
+    {
+        return 0;
+    }
+
+    if (save)
+    {
+        char formatted[ENDPOINT_LIST_LENGTH];
+        size_t len = 0;
+        formatted[0] = '\0';
+        for (size_t i = 0; i < count; i++)
+        {
+            len += snprintf(formatted + len, sizeof(formatted) - len, "%s%s", (i > 0) ? " " : "", urls[i]);
+        }
+        if (save_list(formatted, urls[0]) != 0)
+        {
+            return -1;
+        }
+    }
+
+    memcpy(endpoints, updated, count * sizeof(endpoint_t));
+    endpoint_count = count;
+    active = new_active;
+
+    ESP_LOGI(TAG, "%u endpoint(s), using %s", (unsigned)count, endpoints[active].url);
+    return 0;
+}
+
+void EndpointInit(void)
+{
+    if (endpoint_mutex != NULL)
+    {
+        return;
+    }
+
+    endpoint_mutex = xSemaphoreCreateMutex();
+    for (size_t i = 0; i < ENDPOINT_MAX; i++)
+    {
+        RetryBreakerInit(&breakers[i], breaker_names[i], ENDPOINT_BREAKER_THRESHOLD, ENDPOINT_BREAKER_COOLDOWN_MS,
+                         ENDPOINT_BREAKER_COOLDOWN_MAX_MS);
+    }
+
+    nvs_handle_t nvs_handle;
+    if (nvs_open(ENDPOINT_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK)
+    {
+        ESP_LOGI(TAG, "No endpoints in NVS");
+        return;
+    }
+
+    // Older firmware stored a single URL under the primary key only
+    char list[ENDPOINT_LIST_LENGTH] = {0};
+    size_t required_size = sizeof(list);
+    esp_err_t err = nvs_get_str(nvs_handle, ENDPOINT_NVS_KEY_LIST, list, &required_size);
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        required_size = ENDPOINT_URL_LENGTH;
+        err = nvs_get_str(nvs_handle, ENDPOINT_NVS_KEY_PRIMARY, list, &required_size);
+    }
+    nvs_close(nvs_handle);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGI(TAG, "No endpoints in NVS");
+        return;
+    }
+
+    xSemaphoreTake(endpoint_mutex, portMAX_DELAY);
+    apply_list(list, false);
+    xSemaphoreGive(endpoint_mutex);
+}
+
+int EndpointSetList(const char *list)
+{
+    if (list == NULL || endpoint_mutex == NULL)
+    {
+        return -1;
+    }
+
+    xSemaphoreTake(endpoint_mutex, portMAX_DELAY);
+    int result = apply_list(list, true);
+    xSemaphoreGive(endpoint_mutex);
+    return result;
+}
+
+int EndpointAdd(const char *url)
+{
+    if (url == NULL || endpoint_mutex == NULL)
+    {
+        return -1;
+    }
+
+    char list[ENDPOINT_LIST_LENGTH + ENDPOINT_URL_LENGTH];
+    xSemaphoreTake(endpoint_mutex, portMAX_DELAY);
+    format_list(list, sizeof(list));
+    size_t len = strlen(list);
+    snprintf(list + len, sizeof(list) - len, "%s%s", (len > 0) ? " " : "", url);
+    int result = apply_list(list, true);
+    xSemaphoreGive(endpoint_mutex);
+    return result;
+}
+
+int EndpointRemove(size_t index)
+{
+    if (endpoint_mutex == NULL)
+    {
+        return -1;
+    }
+
+    xSemaphoreTake(endpoint_mutex, portMAX_DELAY);
+    if (index >= endpoint_count || endpoint_count == 1)
+    {
+        // The last endpoint can only be replaced, not removed
+        xSemaphoreGive(endpoint_mutex);
+        return -1;
+    }
+
+    char list[ENDPOINT_LIST_LENGTH];
+    size_t len = 0;
+    list[0] = '\0';
+    for (size_t i = 0; i < endpoint_count; i++)
+    {
+        if (i != index)
+        {
+            len += snprintf(list + len, sizeof(list) - len, "%s%s", (len > 0) ? " " : "", endpoints[i].url);
+        }
+    }
+    int result = apply_list(list, true);
+    xSemaphoreGive(endpoint_mutex);
+    return result;
+}
+
+int EndpointGetList(char *list, size_t max_len)
+{
+    if (list == NULL || max_len == 0 || endpoint_mutex == NULL)
+    {
+        return -1;
+    }
+
+    xSemaphoreTake(endpoint_mutex, portMAX_DELAY);
+    format_list(list, max_len);
+    size_t count = endpoint_count;
+    xSemaphoreGive(endpoint_mutex);
+
+    return (count > 0) ? 0 : -1;
+}
+
+size_t EndpointCount(void)
+{
+    return endpoint_count;
+}
+
+int EndpointGetActive(char *url, size_t max_len)
+{
+    if (endpoint_mutex == NULL)
+    {
+        return -1;
+    }
+
+    xSemaphoreTake(endpoint_mutex, portMAX_DELAY);
+    int index = (endpoint_count > 0) ? (int)active : -1;
+    if (url != NULL && max_len > 0)
+    {
+        snprintf(url, max_len, "%s", (index >= 0) ? endpoints[index].url : "");
+    }
+    xSemaphoreGive(endpoint_mutex);
+
+    return index;
+}
+
+int EndpointGetUrl(size_t index, char *url, size_t max_len)
+{
+    if (url == NULL || max_len == 0 || endpoint_mutex == NULL)
+    {
+        return -1;
+    }
+
+    xSemaphoreTake(endpoint_mutex, portMAX_DELAY);
+    int result = (index < endpoint_count) ? 0 : -1;
+    if (result == 0)
+    {
+        snprintf(url, max_len, "%s", endpoints[index].url);
+    }
+    xSemaphoreGive(endpoint_mutex);
+
+    return result;
+}
+
+retry_breaker_t *EndpointGetBreaker(size_t index)
+{
+    return (index < ENDPOINT_MAX) ? &breakers[index] : NULL;
+}
+
+void EndpointReportResult(size_t index, bool success)
+{
+    if (endpoint_mutex == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(endpoint_mutex, portMAX_DELAY);
+    if (index < endpoint_count)
+    {
+        endpoint_t *endpoint = &endpoints[index];
+        endpoint->operations++;
+        endpoint->error_permille -= endpoint->error_permille / 8;
+        if (!success)
+        {
+            endpoint->failures++;
+            endpoint->error_permille += 1000 / 8;
+        }
+    }
+    xSemaphoreGive(endpoint_mutex);
+}
+
+void EndpointReportRtt(size_t index, uint32_t rtt_ms)
+{
+    if (endpoint_mutex == NULL)
+    {
+        return;
+    }
+
+    // A zero RTT would read as "not measured"
+    if (rtt_ms == 0)
+    {
+        rtt_ms = 1;
+    }
+
+    xSemaphoreTake(endpoint_mutex, portMAX_DELAY);
+    if (index < endpoint_count)
+    {
+        uint32_t *rtt = &endpoints[index].rtt_ms;
+        *rtt = (*rtt == 0) ? rtt_ms : (*rtt * 3 + rtt_ms) / 4;
+    }
+    xSemaphoreGive(endpoint_mutex);
+}
+
+bool EndpointFailover(void)
+{
+    if (endpoint_mutex == NULL)
+    {
+        return false;
+    }
+
+    xSemaphoreTake(endpoint_mutex, portMAX_DELAY);
+    bool switched = false;
+    int best = best_endpoint((int)active);
+    if (best >= 0 && is_healthy((size_t)best))
+    {
+        ESP_LOGW(TAG, "Failing over from %s to %s", endpoints[active].url, endpoints[best].url);
+        active = (size_t)best;
+        switched = true;
+    }
+    xSemaphoreGive(endpoint_mutex);
+
+    return switched;
+}
+
+bool EndpointReselect(void)
+{
+    if (endpoint_mutex == NULL)
+    {
+        return false;
+    }
+
+    xSemaphoreTake(endpoint_mutex, portMAX_DELAY);
+    bool switched = false;
+    int best = best_endpoint((int)active);
+    if (best >= 0 && is_healthy((size_t)best))
+    {
+        uint32_t best_rtt = endpoints[best].rtt_ms;
+        uint32_t active_rtt = endpoints[active].rtt_ms;
+
+        // Hysteresis: don't flap between endpoints of similar latency
+        bool faster = best_rtt != 0 && active_rtt != 0 && best_rtt * 100 < active_rtt * ENDPOINT_SWITCH_PCT &&
+                      best_rtt + ENDPOINT_SWITCH_MIN_MS < active_rtt;
+        if (!is_healthy(active) || faster)
+        {
+            ESP_LOGI(TAG, "Switching from %s (%lu ms) to %s (%lu ms)", endpoints[active].url,
+                     (unsigned long)active_rtt, endpoints[best].url, (unsigned long)best_rtt);
+            active = (size_t)best;
+            switched = true;
+        }
+    }
+    xSemaphoreGive(endpoint_mutex);
+
+    return switched;
+}
+
+uint32_t EndpointProbeIntervalMs(void)
+{
+    if (endpoint_mutex == NULL)
+    {
+        return ENDPOINT_PROBE_MS;
+    }
+
+    xSemaphoreTake(endpoint_mutex, portMAX_DELAY);
+    uint32_t interval_ms = ENDPOINT_PROBE_MS;
+    for (size_t i = 0; i < endpoint_count; i++)
+    {
+        if (!is_healthy(i))
+        {
+            interval_ms = ENDPOINT_REPROBE_MS;
+            break;
+        }
+    }
+    xSemaphoreGive(endpoint_mutex);
+
+    return interval_ms;
+}
+
+int EndpointGetInfo(size_t index, endpoint_info_t *info)
+{
+    if (info == NULL || endpoint_mutex == NULL)
+    {
+        return -1;
+    }
+
+    xSemaphoreTake(endpoint_mutex, portMAX_DELAY);
+    int result = (index < endpoint_count) ? 0 : -1;
+    if (result == 0)
+    {
+        const endpoint_t *endpoint = &endpoints[index];
+        snprintf(info->url, sizeof(info->url), "%s", endpoint->url);
+        info->rtt_ms = endpoint->rtt_ms;
+        info->error_pct = (uint8_t)(endpoint->error_permille / 10);
+        info->healthy = is_healthy(index);
+        info->active = (index == active);
+        info->operations = endpoint->operations;
+        info->failures = endpoint->failures;
+    }
+    xSemaphoreGive(endpoint_mutex);
+
+    return result;
+}
@@ -2,206 +2,735 @@
 #include "wifi.h"
 #include "uart.h"
 #include "server.h"
+#include "httpclient.h"
+#include "websocket.h"
+#include "mqtt.h"
+#include "coap.h"
+#include "cmdparser.h"
+#include "cmdcbor.h"
+#include "retry.h"
+#include "endpoint.h"
+#include "lanauth.h"
+#include "schedule.h"
+#include "timesync.h"
 #include "esp_log.h"
-#include "esp_http_client.h"
-#include "esp_crt_bundle.h"
-#include "esp_tls.h"
+#include "esp_random.h"
 #include "nvs.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 static const char *TAG = "http";
 
-#define HTTP_POLL_INTERVAL_MS 2000
-#define HTTP_BUFFER_SIZE 512
-#define MAX_URL_LENGTH 128
-#define MAX_RESPONSE_LENGTH 512 // Increased for JSON
+#define HTTP_POLL_INTERVAL_MS 2000 // Retry delay while WiFi, URL or a transport is unavailable
+#define HTTP_POLL_MIN_MS 1000      // Poll interval right after a command
+#define HTTP_POLL_MAX_MS 30000     // Idle back-off ceiling
+#define HTTP_POLL_JITTER_PCT 20    // +/- spread applied to every poll delay
+#define HTTP_STARTUP_JITTER_MS 3000 // Random extra delay before the first poll after boot
+#define HTTP_TIMEOUT_MS 10000 // Request timeout on top of the long-poll wait
+#define HTTP_POST_TIMEOUT_MS 5000 // Shorter timeout for ACK
+#define HTTP_RETRY_AFTER_MAX_S 3600 // Longest Retry-After honoured for a POST
+#define HTTP_PROBE_TIMEOUT_MS 5000 // Timeout of an endpoint latency probe
+#define HTTP_LONG_POLL_WAIT_S 25  // Wait budget offered to the server (below common 30 s proxy idle limits)
+#define WS_FALLBACK_RETRY_MS 60000 // Poll over HTTP this long before retrying a failed WebSocket upgrade
+#define MAX_URL_LENGTH ENDPOINT_URL_LENGTH
+#define MAX_ETAG_LENGTH 48
+#define HTTP_POLL_MAX_HEADERS 8
 
-static char current_url[MAX_URL_LENGTH] = {0};
-static char response_buffer[MAX_RESPONSE_LENGTH] = {0};
-static size_t response_length = 0;
+// URL the current transport session was started with, and its endpoint
+static char active_url[MAX_URL_LENGTH] = {0};
+static size_t active_index = 0;
+
+// HTTP(S) URL used for GET polls and ACK POSTs (derived from active_url)
+static char poll_url[MAX_URL_LENGTH] = {0};
+
+// Guards active_index and poll_url: the polling task, their only writer,
+// changes them under it; other tasks (outbox POSTs, STATS?) copy them under it
+static SemaphoreHandle_t active_mutex = NULL;
+
+// Wait budget granted by the server on the last poll (0 = plain polling)
+static int long_poll_wait_s = 0;
+
+// ETag of the last empty poll, sent back as If-None-Match
+static char poll_etag[MAX_ETAG_LENGTH] = {0};
+
+// Current (un-jittered) delay between interval polls
+static uint32_t poll_delay_ms = HTTP_POLL_MIN_MS;
+
+// When the endpoints are probed next (only used by the polling task)
+static TickType_t next_probe_at = 0;
 
 /**
- * @brief HTTP event handler
+ * @brief Retry policy of a GET poll
+ * A single attempt may last a full long-poll; the budget leaves room for one
+ * short retry after a timeout, or several after quick connection failures
  */
-static esp_err_t http_event_handler(esp_http_client_event_t *evt)
+static const retry_policy_t poll_retry_policy = {
+    .max_attempts = 3,
+    .attempt_timeout_ms = HTTP_TIMEOUT_MS + HTTP_LONG_POLL_WAIT_S * 1000,
+    .total_budget_ms = HTTP_TIMEOUT_MS + HTTP_LONG_POLL_WAIT_S * 1000 + 5000,
+    .base_delay_ms = 250,
+    .max_delay_ms = 4000,
+};
+
+/**
+ * @brief Retry policy of a POST; the outbox keeps retrying undelivered messages itself
+ */
+static const retry_policy_t post_retry_policy = {
+    .max_attempts = 2,
+    .attempt_timeout_ms = HTTP_POST_TIMEOUT_MS,
+    .total_budget_ms = HTTP_POST_TIMEOUT_MS + 3000,
+    .base_delay_ms = 250,
+    .max_delay_ms = 2000,
+};
+
+/**
+ * @brief Retry policy of a latency probe: a single short attempt
+ */
+static const retry_policy_t probe_retry_policy = {
+    .max_attempts = 1,
+    .attempt_timeout_ms = HTTP_PROBE_TIMEOUT_MS,
+    .total_budget_ms = HTTP_PROBE_TIMEOUT_MS,
+};
+
+/**
+ * @brief Outcome of a poll, used to schedule the next one
+ */
+typedef enum
 {
-    switch (evt->event_id)
-    {
-    case HTTP_EVENT_ERROR:
-        ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
-        break;
-    case HTTP_EVENT_ON_CONNECTED:
-        ESP_LOGD(TAG, "HTTP_EVENT_ON_CONNECTED");
-        break;
-    case HTTP_EVENT_HEADER_SENT:
-        ESP_LOGD(TAG, "HTTP_EVENT_HEADER_SENT");
-        break;
-    case HTTP_EVENT_ON_HEADER:
-        ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
-        break;
-    case HTTP_EVENT_ON_DATA:
-        // Capture response data and write to UART
-        if (evt->data_len > 0)
-        {
-            // Write to UART
-            UartWrite((const char *)evt->data, evt->data_len);
+    POLL_RESULT_COMMAND, // A command was received and executed
+    POLL_RESULT_IDLE,    // Nothing pending (304 or empty response)
+    POLL_RESULT_ERROR,   // All attempts failed
+} poll_result_t;
 
-            // Capture response for processing (limit to buffer size)
-            size_t copy_len = evt->data_len;
-            if (response_length + copy_len >= MAX_RESPONSE_LENGTH)
-            {
-                copy_len = MAX_RESPONSE_LENGTH - response_length - 1;
-            }
-            if (copy_len > 0)
-            {
-                memcpy(response_buffer + response_length, evt->data, copy_len);
-                response_length += copy_len;
-                response_buffer[response_length] = '\0';
-            }
-            ESP_LOGD(TAG, "Received %d bytes, written to UART", evt->data_len);
-        }
-        break;
-    case HTTP_EVENT_ON_FINISH:
-        ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH");
-        // Add newline after response
-        UartWrite("\r\n", 2);
-        // Ensure response is null-terminated
-        if (response_length < MAX_RESPONSE_LENGTH)
-        {
-            response_buffer[response_length] = '\0';
-        }
-        break;
-    case HTTP_EVENT_DISCONNECTED:
-        ESP_LOGI(TAG, "HTTP_EVENT_DISCONNECTED");
-        break;
-    default:
-        break;
-    }
-    return ESP_OK;
+/**
+ * @brief Scheduling-related response headers of a GET poll
+ */
+typedef struct
+{
+    int granted_wait_s;         // X-Relay-Long-Poll
+    int next_poll_ms;           // X-Relay-Next-Poll (0 = no hint)
+    char etag[MAX_ETAG_LENGTH]; // ETag
+    bool cbor;                  // Content-Type is application/cbor
+    char endpoints[ENDPOINT_LIST_LENGTH]; // X-Relay-Endpoints (empty = not sent)
+    char schedule[SCHEDULE_SPEC_LENGTH];  // X-Relay-Schedule (empty = not sent)
+} poll_headers_t;
+
+/**
+ * @brief Per-request state of a GET poll
+ * The body is parsed as it streams in, so it is never buffered
+ */
+typedef struct
+{
+    poll_headers_t headers;
+    cmd_parser_t parser;
+    cmd_cbor_parser_t cbor_parser;
+    relay_command_t commands[CMD_MAX_BATCH]; // Complete commands of the body, in order
+    size_t command_count;
+    bool overflow; // The body held more commands than fit
+    const http_response_t *response;
+    const http_header_t *extra_headers; // Request headers besides X-Relay-Wait
+    size_t extra_header_count;
+    poll_result_t result;
+} poll_context_t;
+
+/**
+ * @brief Response header callback for GET polls
+ * The server confirms long-poll support by echoing the granted wait budget,
+ * may suggest when to poll next and tags empty answers with an ETag
+ */
+static void poll_header_handler(const char *key, const char *value, void *ctx)
+{
+    poll_headers_t *headers = &((poll_context_t *)ctx)->headers;
+
+    if (strcasecmp(key, "X-Relay-Long-Poll") == 0)
+    {
+        headers->granted_wait_s = atoi(value);
+    }
+    else if (strcasecmp(key, "X-Relay-Next-Poll") == 0)
+    {
+        headers->next_poll_ms = atoi(value);
+    }
+    else if (strcasecmp(key, "ETag") == 0)
+    {
+        snprintf(headers->etag, sizeof(headers->etag), "%s", value);
+    }
+    else if (strcasecmp(key, "Content-Type") == 0)
+    {
+        headers->cbor = strncasecmp(value, "application/cbor", 16) == 0;
+    }
+    else if (strcasecmp(key, "X-Relay-Endpoints") == 0)
+    {
+        snprintf(headers->endpoints, sizeof(headers->endpoints), "%s", value);
+    }
+    else if (strcasecmp(key, "X-Relay-Schedule") == 0)
+    {
+        snprintf(headers->schedule, sizeof(headers->schedule), "%s", value);
+    }
+    else if (strcasecmp(key, "Date") == 0)
+    {
+        // Sets the clock if SNTP has not (e.g. NTP is blocked on this network)
+        TimeSyncFromHttpDate(value);
+    }
 }
 
 /**
- * @brief Fetch the URL and write response to UART
+ * @brief Parser callback: keep the commands until the request has completed
  */
-static void http_fetch_url(void)
+static void poll_command_handler(const relay_command_t *command, void *ctx)
 {
-    // Use current URL (should be checked before calling this function)
-    if (strlen(current_url) == 0)
+    poll_context_t *poll = (poll_context_t *)ctx;
+    if (poll->command_count < CMD_MAX_BATCH)
     {
-        ESP_LOGW(TAG, "URL not set, skipping HTTP request");
-        return;
+        poll->commands[poll->command_count++] = *command;
     }
+    else
+    {
+        poll->overflow = true;
+    }
+}
 
-    const char *url_to_fetch = current_url;
-    ESP_LOGI(TAG, "Fetching URL: %s", url_to_fetch);
+/**
+ * @brief Body callback for GET polls: feed each chunk straight into the parser
+ */
+static void poll_data_handler(const char *data, size_t len, void *ctx)
+{
+    poll_context_t *poll = (poll_context_t *)ctx;
 
-    esp_http_client_config_t config = {
-        .url = url_to_fetch,
-        .event_handler = http_event_handler,
-        .timeout_ms = 10000,
-        .keep_alive_enable = false, // Disable keep-alive to avoid connection issues
-    };
+    // First chunk of an attempt (the client may transparently retry on a new connection)
+    if (poll->response->received == len)
+    {
+        CmdParserInit(&poll->parser, poll_command_handler, poll);
+        CmdCborParserInit(&poll->cbor_parser, poll_command_handler, poll);
+        poll->command_count = 0;
+        poll->overflow = false;
+    }
 
-    // Retry up to 3 times
-    int retry_count = 0;
-    const int max_retries = 3;
-    esp_err_t err = ESP_FAIL;
+    if (poll->headers.cbor)
+    {
+        CmdCborParserFeed(&poll->cbor_parser, (const uint8_t *)data, len);
+    }
+    else
+    {
+        CmdParserFeed(&poll->parser, data, len);
+    }
+}
 
-    while (retry_count < max_retries && err != ESP_OK)
+/**
+ * @brief Compute the delay before the next interval poll
+ * Polls fast after a command, doubles the delay on idle or failed polls up
+ * to HTTP_POLL_MAX_MS and lets a server hint override both. The result is
+ * spread by +/- HTTP_POLL_JITTER_PCT so devices don't poll in lockstep.
+ */
+static uint32_t schedule_next_poll(poll_result_t result, int hint_ms)
+{
+    if (hint_ms > 0)
     {
-        if (retry_count > 0)
-        {
-            ESP_LOGW(TAG, "Retrying HTTP request (attempt %d/%d)...", retry_count + 1, max_retries);
-            vTaskDelay(pdMS_TO_TICKS(1000)); // Wait 1 second before retry
-        }
+        poll_delay_ms = (uint32_t)hint_ms;
+    }
+    else if (result == POLL_RESULT_COMMAND)
+    {
+        poll_delay_ms = HTTP_POLL_MIN_MS;
+    }
+    else
+    {
+        poll_delay_ms *= 2;
+    }
 
-        esp_http_client_handle_t client = esp_http_client_init(&config);
-        if (client == NULL)
-        {
-            ESP_LOGE(TAG, "Failed to initialize HTTP client");
-            retry_count++;
-            continue;
-        }
+    if (poll_delay_ms < HTTP_POLL_MIN_MS)
+    {
+        poll_delay_ms = HTTP_POLL_MIN_MS;
+    }
+    else if (poll_delay_ms > HTTP_POLL_MAX_MS)
+    {
+        poll_delay_ms = HTTP_POLL_MAX_MS;
+    }
 
-        // Set HTTP method to GET
-        esp_http_client_set_method(client, HTTP_METHOD_GET);
+    uint32_t spread = poll_delay_ms * HTTP_POLL_JITTER_PCT / 100;
+    return poll_delay_ms - spread + esp_random() % (2 * spread + 1);
+}
 
-        // Reset response buffer
-        response_length = 0;
-        response_buffer[0] = '\0';
+/**
+ * @brief Perform one GET poll attempt and process the response
+ * The long-poll wait offered to the server is sized to fit into the attempt's
+ * timeout, so a retry with little budget left becomes a plain poll
+ */
+static retry_attempt_result_t poll_attempt(uint32_t timeout_ms, void *ctx)
+{
+    poll_context_t *poll = (poll_context_t *)ctx;
 
-        err = esp_http_client_perform(client);
-        if (err == ESP_OK)
-        {
-            int status_code = esp_http_client_get_status_code(client);
-            int content_length = esp_http_client_get_content_length(client);
-            ESP_LOGI(TAG, "HTTP GET Status = %d, content_length = %d", status_code, content_length);
+    int wait_s = ((int)timeout_ms - HTTP_TIMEOUT_MS) / 1000;
+    if (wait_s > HTTP_LONG_POLL_WAIT_S)
+    {
+        wait_s = HTTP_LONG_POLL_WAIT_S;
+    }
 
-            // Process response if status is 200
-            if (status_code == 200 && response_length > 0)
-            {
-                // Ensure response is null-terminated
-                if (response_length < MAX_RESPONSE_LENGTH)
-                {
-                    response_buffer[response_length] = '\0';
-                }
-                else
-                {
-                    response_buffer[MAX_RESPONSE_LENGTH - 1] = '\0';
-                }
+    // Offer a long-poll wait budget; servers that don't know the header
+    // answer immediately and the device keeps plain interval polling
+    http_header_t headers[HTTP_POLL_MAX_HEADERS];
+    size_t header_count = 0;
+    char wait_str[8];
+    if (wait_s > 0)
+    {
+        snprintf(wait_str, sizeof(wait_str), "%d", wait_s);
+        headers[header_count++] = (http_header_t){"X-Relay-Wait", wait_str};
+    }
+    for (size_t i = 0; i < poll->extra_header_count; i++)
+    {
+        headers[header_count++] = poll->extra_headers[i];
+    }
 
-                ESP_LOGI(TAG, "Response received (%d bytes): %s", response_length, response_buffer);
+    const http_request_t request = {
+        .method = HTTP_METHOD_GET,
+        .url = poll_url,
+        .headers = headers,
+        .header_count = header_count,
+        // The server may hold the request for the whole wait budget
+        .timeout_ms = (int)timeout_ms,
+    };
 
-                // Process response through server module
-                ServerProcessResponse(response_buffer, response_length, status_code);
-            }
-            else if (status_code == 200 && response_length == 0)
+    http_response_t response = {
+        .on_header = poll_header_handler,
+        .on_data = poll_data_handler,
+        .ctx = poll,
+    };
+    poll->response = &response;
+
+    memset(&poll->headers, 0, sizeof(poll->headers));
+    CmdParserInit(&poll->parser, poll_command_handler, poll);
+    CmdCborParserInit(&poll->cbor_parser, poll_command_handler, poll);
+    poll->command_count = 0;
+    poll->overflow = false;
+
+    if (HttpClientRequest(&request, &response) != 0)
+    {
+        ESP_LOGE(TAG, "HTTP GET request failed");
+        return RETRY_ATTEMPT_FAILED;
+    }
+
+    ESP_LOGI(TAG, "HTTP GET Status = %d, length = %u", response.status_code, (unsigned)response.received);
+
+    // The server is up but failing; back off like on a transport error
+    if (response.status_code >= 500)
+    {
+        return RETRY_ATTEMPT_FAILED;
+    }
+
+    poll->result = POLL_RESULT_IDLE;
+
+    // Execute the commands once the whole body has been parsed
+    if (response.status_code == 200 && response.received > 0)
+    {
+        int commands = poll->headers.cbor ? CmdCborParserFinish(&poll->cbor_parser) : CmdParserFinish(&poll->parser);
+        if (commands < 0)
+        {
+            ESP_LOGW(TAG, "Invalid command response (%u bytes)", (unsigned)response.received);
+        }
+        else if (poll->command_count > 0)
+        {
+            if (poll->overflow)
             {
-                ESP_LOGD(TAG, "Empty response (no pending commands)");
+                ESP_LOGW(TAG, "Response held more than %d commands, extra ones ignored", CMD_MAX_BATCH);
             }
+            ESP_LOGI(TAG, "Executing %u command(s)", (unsigned)poll->command_count);
+            ServerExecuteCommands(poll->commands, poll->command_count, RELAY_SOURCE_REMOTE);
+            poll->result = POLL_RESULT_COMMAND;
         }
         else
         {
-            ESP_LOGE(TAG, "HTTP GET request failed: %s (attempt %d/%d)",
-                     esp_err_to_name(err), retry_count + 1, max_retries);
+            ESP_LOGD(TAG, "Empty response (no pending commands)");
         }
+    }
+    else if (response.status_code == 200 && response.received == 0)
+    {
+        ESP_LOGD(TAG, "Empty response (no pending commands)");
+    }
+    else if (response.status_code == 304)
+    {
+        ESP_LOGD(TAG, "Not modified (no pending commands)");
+    }
 
-        esp_http_client_cleanup(client);
-        retry_count++;
+    // Remember the tag of the current (empty) queue state
+    if (response.status_code == 200 || (response.status_code == 304 && poll->headers.etag[0] != '\0'))
+    {
+        snprintf(poll_etag, sizeof(poll_etag), "%s", poll->headers.etag);
     }
 
-    if (err != ESP_OK)
+    return RETRY_ATTEMPT_OK;
+}
+
+/**
+ * @brief Fetch the URL and process the response
+ * Failed attempts are retried per poll_retry_policy; while the server's
+ * breaker is open the poll fails immediately
+ * @param hint_ms Set to the server's next-poll hint in ms, or to the time
+ *                until the next breaker probe (0 if none)
+ * @return The outcome of the poll
+ */
+static poll_result_t http_fetch_url(int *hint_ms)
+{
+    *hint_ms = 0;
+
+    // Use poll URL (should be checked before calling this function)
+    if (strlen(poll_url) == 0)
     {
+        ESP_LOGW(TAG, "URL not set, skipping HTTP request");
+        return POLL_RESULT_IDLE;
+    }
+
+    ESP_LOGI(TAG, "Fetching URL: %s", poll_url);
+
+    http_header_t headers[HTTP_POLL_MAX_HEADERS - 1];
+    size_t header_count = 0;
+
+    // Prefer the compact CBOR encoding; servers without it keep answering JSON
+    headers[header_count++] = (http_header_t){"Accept", "application/cbor, application/json;q=0.5"};
+
+    // Let the server deliver several queued commands in one response
+    char batch_str[8];
+    snprintf(batch_str, sizeof(batch_str), "%d", CMD_MAX_BATCH);
+    headers[header_count++] = (http_header_t){"X-Relay-Batch", batch_str};
+
+    // Conditional GET: the server answers 304 without a body while nothing changed
+    if (poll_etag[0] != '\0')
+    {
+        headers[header_count++] = (http_header_t){"If-None-Match", poll_etag};
+    }
+
+    // Cumulative ACK: every command up to this sequence number has been executed
+    char ack_str[12];
+    uint32_t executed_seq = ServerGetExecutedSeq();
+    if (executed_seq > 0)
+    {
+        snprintf(ack_str, sizeof(ack_str), "%lu", (unsigned long)executed_seq);
+        headers[header_count++] = (http_header_t){"X-Relay-Ack", ack_str};
+    }
+
+    // Commands the cumulative ACK covers although a manual hold kept them from running
+    char held_str[SERVER_HELD_LIST_LENGTH];
+    uint32_t held_up_to = ServerGetHeld(held_str, sizeof(held_str));
+    if (held_up_to != 0)
+    {
+        headers[header_count++] = (http_header_t){"X-Relay-Held", held_str};
+    }
+
+    // The server sends the schedule only when the device's copy is outdated
+    char schedule_str[12];
+    snprintf(schedule_str, sizeof(schedule_str), "%lu", (unsigned long)ScheduleGetVersion());
+    headers[header_count++] = (http_header_t){"X-Relay-Schedule-Version", schedule_str};
+
+    // Tell the server where it can send signed commands directly on the LAN
+    char lan_url[48];
+    char ip_str[16];
+    if (LanAuthIsEnabled() && WifiGetIpAddress(ip_str, sizeof(ip_str)) == 0)
+    {
+        snprintf(lan_url, sizeof(lan_url), "http://%s/api/command", ip_str);
+        headers[header_count++] = (http_header_t){"X-Relay-Lan", lan_url};
+    }
+
+    // Static because the command batch is too large for the polling task's
+    // stack (only used by that task)
+    static poll_context_t poll;
+    poll.extra_headers = headers;
+    poll.extra_header_count = header_count;
+    poll.result = POLL_RESULT_ERROR;
+
+    retry_breaker_t *breaker = EndpointGetBreaker(active_index);
+    bool admitted = (RetryBreakerWaitMs(breaker) == 0);
+    int err = RetryRun(breaker, &poll_retry_policy, poll_attempt, &poll);
+    if (admitted)
+    {
+        EndpointReportResult(active_index, err == 0);
+    }
+
+    int granted_wait_s = (err == 0) ? poll.headers.granted_wait_s : 0;
+    if (granted_wait_s > 0 && long_poll_wait_s == 0)
+    {
+        ESP_LOGI(TAG, "Server granted long-poll (%d s)", granted_wait_s);
+    }
+    else if (granted_wait_s == 0 && long_poll_wait_s > 0)
+    {
+        ESP_LOGI(TAG, "Long-poll not available, back to interval polling");
+    }
+    long_poll_wait_s = granted_wait_s;
+
+    if (err != 0)
+    {
+        // While the breaker is open, come back when the next probe is allowed
+        *hint_ms = (int)RetryBreakerWaitMs(breaker);
+
         // Write error to UART after all retries failed
-        char error_msg[64];
-        snprintf(error_msg, sizeof(error_msg), "HTTP Error: %s\r\n", esp_err_to_name(err));
+        const char *error_msg = "HTTP Error: request failed\r\n";
         UartWrite(error_msg, strlen(error_msg));
+        return POLL_RESULT_ERROR;
+    }
+
+    // The server has the held list now (commands this poll held are newer and stay)
+    ServerClearHeld(held_up_to);
+
+    // The server manages the endpoint list; an unchanged list is not saved again
+    if (poll.headers.endpoints[0] != '\0' && EndpointSetList(poll.headers.endpoints) != 0)
+    {
+        ESP_LOGW(TAG, "Ignoring invalid endpoint list from server");
+    }
+    if (poll.headers.schedule[0] != '\0' && ScheduleApply(poll.headers.schedule) != 0)
+    {
+        ESP_LOGW(TAG, "Ignoring invalid schedule from server");
+    }
+
+    *hint_ms = poll.headers.next_poll_ms;
+    return poll.result;
+}
+
+/**
+ * @brief Check if a URL selects the WebSocket transport
+ */
+static bool url_is_websocket(const char *url)
+{
+    return strncmp(url, "ws://", 5) == 0 || strncmp(url, "wss://", 6) == 0;
+}
+
+/**
+ * @brief Check if a URL selects the MQTT transport
+ */
+static bool url_is_mqtt(const char *url)
+{
+    return strncmp(url, "mqtt://", 7) == 0 || strncmp(url, "mqtts://", 8) == 0;
+}
+
+/**
+ * @brief Check if a URL selects the CoAP transport
+ */
+static bool url_is_coap(const char *url)
+{
+    return strncmp(url, "coap://", 7) == 0;
+}
+
+/**
+ * @brief Check if a URL is an HTTP(S) URL
+ */
+static bool url_is_http(const char *url)
+{
+    return strncmp(url, "http://", 7) == 0 || strncmp(url, "https://", 8) == 0;
+}
+
+/**
+ * @brief Derive the HTTP(S) polling URL from the configured URL
+ * ws:// maps to http:// and wss:// to https:// on the same host and path
+ */
+static void make_poll_url(const char *url, char *out, size_t max_len)
+{
+    if (url_is_websocket(url))
+    {
+        snprintf(out, max_len, "http%s", url + 2);
+    }
+    else
+    {
+        snprintf(out, max_len, "%s", url);
+    }
+}
+
+/**
+ * @brief Tell a running transport session to end
+ * Sessions end when WiFi drops or the configured URL changes
+ */
+static bool transport_should_stop(void)
+{
+    char url[MAX_URL_LENGTH];
+    EndpointGetActive(url, sizeof(url));
+    return !WifiIsConnected() || strcmp(active_url, url) != 0;
+}
+
+/**
+ * @brief An endpoint being probed
+ */
+typedef struct
+{
+    size_t index;
+    char url[MAX_URL_LENGTH]; // HTTP(S) URL of the endpoint
+} probe_t;
+
+/**
+ * @brief Perform one latency probe
+ */
+static retry_attempt_result_t probe_attempt(uint32_t timeout_ms, void *ctx)
+{
+    const probe_t *probe = (const probe_t *)ctx;
+    int status_code;
+    uint32_t rtt_ms;
+
+    if (HttpClientProbe(probe->url, (int)timeout_ms, &status_code, &rtt_ms) != 0)
+    {
+        return RETRY_ATTEMPT_FAILED;
+    }
+
+    ESP_LOGD(TAG, "Probe %s: status %d, %lu ms", probe->url, status_code, (unsigned long)rtt_ms);
+    // Any answer but a server error means the server is up, even 405 from one without HEAD
+    if (status_code >= 500)
+    {
+        return RETRY_ATTEMPT_FAILED;
+    }
+
+    EndpointReportRtt(probe->index, rtt_ms);
+    return RETRY_ATTEMPT_OK;
+}
+
+/**
+ * @brief Measure every endpoint and move to a better one if there is one
+ * Each probe goes through its endpoint's breaker, so a server that is down is
+ * probed once per cooldown, and a successful probe closes the breaker again
+ */
+static void probe_endpoints(void)
+{
+    size_t count = EndpointCount();
+    if (count < 2)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        char url[MAX_URL_LENGTH];
+        if (EndpointGetUrl(i, url, sizeof(url)) != 0)
+        {
+            break;
+        }
+
+        // Brokers and CoAP servers have no HTTP side to probe; they are chosen by list order
+        if (url_is_mqtt(url) || url_is_coap(url))
+        {
+            continue;
+        }
+
+        retry_breaker_t *breaker = EndpointGetBreaker(i);
+        if (RetryBreakerWaitMs(breaker) > 0)
+        {
+            continue;
+        }
+
+        probe_t probe = {.index = i};
+        make_poll_url(url, probe.url, sizeof(probe.url));
+        int err = RetryRun(breaker, &probe_retry_policy, probe_attempt, &probe);
+        EndpointReportResult(i, err == 0);
     }
+
+    EndpointReselect();
 }
 
 /**
  * @brief HTTP polling task
- * Fetches the URL every 2 seconds when WiFi is connected
+ * Holds an MQTT session for mqtt:// and mqtts:// URLs, a CoAP observe session
+ * for coap:// URLs, a WebSocket session
+ * for ws:// and wss:// URLs (falling back to polling when the upgrade fails), long-polls the URL back to back when
+ * the server supports it, and otherwise fetches it on the adaptive schedule
+ * of schedule_next_poll() when WiFi is connected
  */
 static void http_polling_task(void *pvParameters)
 {
     ESP_LOGI(TAG, "HTTP polling task started");
 
-    // Wait a bit after task start to ensure WiFi is fully ready
-    vTaskDelay(pdMS_TO_TICKS(2000));
+    // Wait a bit after task start to ensure WiFi is fully ready; the random
+    // part keeps a fleet powered up together from polling in lockstep
+    vTaskDelay(pdMS_TO_TICKS(2000 + esp_random() % HTTP_STARTUP_JITTER_MS));
+
+    TickType_t ws_retry_at = 0;
 
     while (1)
     {
+        uint32_t delay_ms = HTTP_POLL_INTERVAL_MS;
+
         // Wait for WiFi connection and check if URL is set
         if (WifiIsConnected())
         {
             // Only fetch if URL is configured
-            if (strlen(current_url) > 0)
+            char url[MAX_URL_LENGTH];
+            int index = EndpointGetActive(url, sizeof(url));
+            if (index >= 0)
             {
+                if (strcmp(active_url, url) != 0)
+                {
+                    ESP_LOGI(TAG, "Using endpoint %d: %s", index + 1, url);
+                    strncpy(active_url, url, MAX_URL_LENGTH - 1);
+                    active_url[MAX_URL_LENGTH - 1] = '\0';
+                    xSemaphoreTake(active_mutex, portMAX_DELAY);
+                    active_index = (size_t)index;
+                    make_poll_url(active_url, poll_url, sizeof(poll_url));
+                    xSemaphoreGive(active_mutex);
+                    long_poll_wait_s = 0;
+                    poll_etag[0] = '\0';
+                    poll_delay_ms = HTTP_POLL_MIN_MS;
+                    ws_retry_at = xTaskGetTickCount();
+                }
+
+                if (url_is_mqtt(active_url))
+                {
+                    // Commands arrive from the broker; there is nothing to poll
+                    if (MqttRun(active_url, transport_should_stop) != 0)
+                    {
+                        EndpointReportResult(active_index, false);
+                        if (EndpointFailover())
+                        {
+                            continue;
+                        }
+                        ESP_LOGW(TAG, "MQTT broker unavailable, retrying");
+                    }
+                    vTaskDelay(pdMS_TO_TICKS(HTTP_POLL_INTERVAL_MS));
+                    continue;
+                }
+
+                if (url_is_coap(active_url))
+                {
+                    // Commands arrive as Observe notifications; there is nothing to poll
+                    if (CoapRun(active_url, transport_should_stop) != 0)
+                    {
+                        EndpointReportResult(active_index, false);
+                        if (EndpointFailover())
+                        {
+                            continue;
+                        }
+                        ESP_LOGW(TAG, "CoAP server unavailable, retrying");
+                    }
+                    vTaskDelay(pdMS_TO_TICKS(HTTP_POLL_INTERVAL_MS));
+                    continue;
+                }
+
+                if (url_is_websocket(active_url) && (int32_t)(xTaskGetTickCount() - ws_retry_at) >= 0)
+                {
+                    if (WebsocketRun(active_url, transport_should_stop) == 0)
+                    {
+                        // Session ended (server closed, WiFi or URL changed); reconnect after the delay
+                        long_poll_wait_s = 0;
+                        vTaskDelay(pdMS_TO_TICKS(HTTP_POLL_INTERVAL_MS));
+                        continue;
+                    }
+
+                    ESP_LOGW(TAG, "WebSocket unavailable, falling back to polling %s", poll_url);
+                    ws_retry_at = xTaskGetTickCount() + pdMS_TO_TICKS(WS_FALLBACK_RETRY_MS);
+                }
+
                 ESP_LOGD(TAG, "WiFi connected, fetching URL");
-                http_fetch_url();
+                int hint_ms;
+                poll_result_t result = http_fetch_url(&hint_ms);
+
+                // Move to another endpoint right away instead of waiting out the breaker
+                if (result == POLL_RESULT_ERROR && EndpointFailover())
+                {
+                    continue;
+                }
+                delay_ms = schedule_next_poll(result, hint_ms);
+
+                // Have the poll host's address ready before the next poll needs it
+                HttpClientPrefetch(poll_url, long_poll_wait_s > 0 ? (uint32_t)long_poll_wait_s * 1000 : delay_ms);
+
+                if ((int32_t)(xTaskGetTickCount() - next_probe_at) >= 0)
+                {
+                    probe_endpoints();
+                    next_probe_at = xTaskGetTickCount() + pdMS_TO_TICKS(EndpointProbeIntervalMs());
+                }
             }
             else
             {
@@ -213,24 +742,32 @@ static void http_polling_task(void *pvParameters)
             ESP_LOGD(TAG, "WiFi not connected, waiting...");
         }
 
-        // Wait 2 seconds before next poll
-        vTaskDelay(pdMS_TO_TICKS(HTTP_POLL_INTERVAL_MS));
+        // A long-poll already waited on the server side, re-issue it right away
+        if (long_poll_wait_s > 0 && WifiIsConnected())
+        {
+            continue;
+        }
+
+        ESP_LOGD(TAG, "Next poll in %lu ms", (unsigned long)delay_ms);
+        vTaskDelay(pdMS_TO_TICKS(delay_ms));
     }
 }
 
 void HttpInit(void)
 {
-    // Load URL from NVS
-    char url[MAX_URL_LENGTH] = {0};
-    if (HttpLoadUrl(url, MAX_URL_LENGTH) == 0)
+    HttpClientInit();
+
+    active_mutex = xSemaphoreCreateMutex();
+    if (active_mutex == NULL)
     {
-        ESP_LOGI(TAG, "Loaded URL from NVS: %s", url);
+        ESP_LOGE(TAG, "Failed to create endpoint mutex");
     }
-    else
+
+    // Load the server list from NVS
+    EndpointInit();
+    if (EndpointCount() == 0)
     {
         ESP_LOGI(TAG, "No URL found in NVS, HTTP polling will be skipped until URL is set");
-        // Don't set default URL - skip HTTP requests until URL is configured
-        current_url[0] = '\0';
     }
 
     ESP_LOGI(TAG, "HTTP client module initialized");
@@ -239,7 +776,7 @@ void HttpInit(void)
 void HttpStartPolling(void)
 {
     // Create the HTTP polling task
-    xTaskCreate(http_polling_task, "http_polling", 4096, NULL, 5, NULL);
+    xTaskCreate(http_polling_task, "http_polling", 6144, NULL, 5, NULL);
     ESP_LOGI(TAG, "HTTP polling task created");
 }
 
@@ -251,35 +788,12 @@ int HttpSaveUrl(const char *url)
         return -1;
     }
 
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open("http", NVS_READWRITE, &nvs_handle);
-    if (err != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
-        return -1;
-    }
-
-    err = nvs_set_str(nvs_handle, "url", url);
-    if (err != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Error saving URL: %s", esp_err_to_name(err));
-        nvs_close(nvs_handle);
-        return -1;
-    }
-
-    err = nvs_commit(nvs_handle);
-    nvs_close(nvs_handle);
-
-    if (err != ESP_OK)
+    // A single URL replaces the whole list
+    if (EndpointSetList(url) != 0)
     {
-        ESP_LOGE(TAG, "Error committing NVS: %s", esp_err_to_name(err));
         return -1;
     }
 
-    // Update current URL
-    strncpy(current_url, url, MAX_URL_LENGTH - 1);
-    current_url[MAX_URL_LENGTH - 1] = '\0';
-
     ESP_LOGI(TAG, "URL saved to NVS: %s", url);
     return 0;
 }
@@ -292,87 +806,174 @@ int HttpLoadUrl(char *url, size_t max_len)
         return -1;
     }
 
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open("http", NVS_READONLY, &nvs_handle);
-    if (err != ESP_OK)
+    // The primary endpoint
+    if (EndpointGetUrl(0, url, max_len) != 0)
     {
-        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        ESP_LOGI(TAG, "URL not found in NVS");
         return -1;
     }
+    return 0;
+}
 
-    size_t required_size = max_len;
-    err = nvs_get_str(nvs_handle, "url", url, &required_size);
-    nvs_close(nvs_handle);
+/**
+ * @brief A POST and the outcome of its last attempt
+ */
+typedef struct
+{
+    char url[MAX_URL_LENGTH]; // Copy of poll_url taken when the POST started
+    const char *json_payload;
+    retry_attempt_result_t result;
+    bool refused;            // The server refused the body itself (the result is REJECTED)
+    uint32_t retry_after_ms; // Retry-After of the last response, 0 if none
+} post_t;
+
+/**
+ * @brief Response header callback for POSTs: the server may ask to wait before retrying
+ * Only the delta-seconds form of Retry-After is understood
+ */
+static void post_header_handler(const char *key, const char *value, void *ctx)
+{
+    post_t *post = (post_t *)ctx;
 
-    if (err == ESP_ERR_NVS_NOT_FOUND)
+    if (strcasecmp(key, "Retry-After") == 0 && value[0] >= '0' && value[0] <= '9')
     {
-        ESP_LOGI(TAG, "URL not found in NVS");
-        return -1;
+        long seconds = strtol(value, NULL, 10);
+        if (seconds > HTTP_RETRY_AFTER_MAX_S)
+        {
+            seconds = HTTP_RETRY_AFTER_MAX_S;
+        }
+        post->retry_after_ms = (uint32_t)seconds * 1000;
     }
-    else if (err != ESP_OK)
+}
+
+/**
+ * @brief Check whether a status says the body itself is bad, so it will never be accepted
+ * Anything else (redirects, authentication, a missing route on a failover
+ * server, timeouts, throttling, server errors) may succeed later
+ */
+static bool status_refuses_body(int status_code)
+{
+    return status_code == 400 || status_code == 413 || status_code == 415 || status_code == 422;
+}
+
+/**
+ * @brief Perform one POST attempt
+ */
+static retry_attempt_result_t post_attempt(uint32_t timeout_ms, void *ctx)
+{
+    post_t *post = (post_t *)ctx;
+    const char *json_payload = post->json_payload;
+
+    // The POST shares the kept-alive connection with the polling GETs
+    const http_request_t request = {
+        .method = HTTP_METHOD_POST,
+        .url = post->url,
+        .content_type = "application/json",
+        .body = json_payload,
+        .body_len = strlen(json_payload),
+        .timeout_ms = (int)timeout_ms,
+    };
+    http_response_t response = {
+        .on_header = post_header_handler,
+        .ctx = post,
+    };
+    post->refused = false;
+    post->retry_after_ms = 0;
+    if (HttpClientRequest(&request, &response) != 0)
     {
-        ESP_LOGE(TAG, "Error reading URL: %s", esp_err_to_name(err));
-        return -1;
+        ESP_LOGE(TAG, "HTTP POST request failed");
+        post->result = RETRY_ATTEMPT_FAILED;
+        return post->result;
     }
 
-    // Update current URL
-    strncpy(current_url, url, MAX_URL_LENGTH - 1);
-    current_url[MAX_URL_LENGTH - 1] = '\0';
+    ESP_LOGI(TAG, "HTTP POST Status = %d", response.status_code);
+    if (response.status_code >= 200 && response.status_code < 300)
+    {
+        post->result = RETRY_ATTEMPT_OK;
+    }
+    else if (status_refuses_body(response.status_code))
+    {
+        post->result = RETRY_ATTEMPT_REJECTED;
+        post->refused = true;
+    }
+    else if (response.status_code == 429)
+    {
+        // The server is up but throttling: no retry now, and no mark against it
+        post->result = RETRY_ATTEMPT_REJECTED;
+    }
+    else
+    {
+        post->result = RETRY_ATTEMPT_FAILED;
+    }
+    return post->result;
+}
 
-    ESP_LOGI(TAG, "URL loaded from NVS: %s", url);
-    return 0;
+void HttpGetRetryStats(retry_stats_t *stats)
+{
+    size_t index = 0;
+    if (active_mutex != NULL)
+    {
+        xSemaphoreTake(active_mutex, portMAX_DELAY);
+        index = active_index;
+        xSemaphoreGive(active_mutex);
+    }
+    RetryBreakerGetStats(EndpointGetBreaker(index), stats);
 }
 
-int HttpPostJson(const char *json_payload)
+http_post_result_t HttpPostJson(const char *json_payload, uint32_t *retry_after_ms)
 {
+    if (retry_after_ms != NULL)
+    {
+        *retry_after_ms = 0;
+    }
     if (json_payload == NULL)
     {
         ESP_LOGE(TAG, "JSON payload cannot be NULL");
-        return -1;
+        return HTTP_POST_FAILED;
     }
 
-    // Use the same URL as GET requests
-    if (strlen(current_url) == 0)
+    if (active_mutex == NULL)
     {
-        ESP_LOGW(TAG, "URL not set, skipping POST");
-        return -1;
+        return HTTP_POST_UNAVAILABLE;
     }
 
-    esp_http_client_config_t config = {
-        .url = current_url,
-        .event_handler = http_event_handler,
-        .timeout_ms = 5000, // Shorter timeout for ACK
-        .keep_alive_enable = false,
+    // Use the same URL as GET requests, copied so the polling task can switch
+    // endpoints meanwhile
+    post_t post = {
+        .json_payload = json_payload,
+        .result = RETRY_ATTEMPT_FAILED,
     };
+    xSemaphoreTake(active_mutex, portMAX_DELAY);
+    size_t index = active_index;
+    snprintf(post.url, sizeof(post.url), "%s", poll_url);
+    xSemaphoreGive(active_mutex);
 
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    if (client == NULL)
+    // Brokers and CoAP servers take messages only over their own sessions
+    if (!url_is_http(post.url))
     {
-        ESP_LOGE(TAG, "Failed to initialize HTTP client for POST");
-        return -1;
+        ESP_LOGD(TAG, "No HTTP server active, skipping POST");
+        return HTTP_POST_UNAVAILABLE;
     }
 
-    // Set method to POST
-    esp_http_client_set_method(client, HTTP_METHOD_POST);
-
-    // Set content type header
-    esp_http_client_set_header(client, "Content-Type", "application/json");
-
-    // Set POST data
-    esp_http_client_set_post_field(client, json_payload, strlen(json_payload));
+    retry_breaker_t *breaker = EndpointGetBreaker(index);
+    bool admitted = (RetryBreakerWaitMs(breaker) == 0);
+    int err = RetryRun(breaker, &post_retry_policy, post_attempt, &post);
+    if (admitted)
+    {
+        EndpointReportResult(index, err == 0 || post.result == RETRY_ATTEMPT_REJECTED);
+    }
 
-    esp_err_t err = esp_http_client_perform(client);
-    if (err == ESP_OK)
+    if (err == 0)
     {
-        int status_code = esp_http_client_get_status_code(client);
-        ESP_LOGI(TAG, "HTTP POST Status = %d", status_code);
-        esp_http_client_cleanup(client);
-        return (status_code >= 200 && status_code < 300) ? 0 : -1;
+        return HTTP_POST_OK;
     }
-    else
+    if (post.refused)
     {
-        ESP_LOGE(TAG, "HTTP POST request failed: %s", esp_err_to_name(err));
-        esp_http_client_cleanup(client);
-        return -1;
+        return HTTP_POST_REJECTED;
     }
-}
\ No newline at end of file
+    if (retry_after_ms != NULL)
+    {
+        *retry_after_ms = post.retry_after_ms;
+    }
+    return HTTP_POST_FAILED;
+}
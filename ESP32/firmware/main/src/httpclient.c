@@ -0,0 +1,594 @@
+#include "httpclient.h"
+#include "dnscache.h"
+#include "uart.h"
+#include "esp_log.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <string.h>
+#include <strings.h>
+
+static const char *TAG = "httpclient";
+
+#define MAX_ORIGIN_LENGTH 96
+#define MAX_RESOLVED_URL_LENGTH 160
+#define CONNECTION_PRIMARY 0 // Polls, and other requests while no poll is running
+#define CONNECTION_SIDE 1    // Requests that arrive while a poll (possibly a parked long-poll) runs
+#define CONNECTION_COUNT 2
+
+/**
+ * @brief Where a request actually connects to
+ */
+typedef struct
+{
+    char url[MAX_RESOLVED_URL_LENGTH];             // URL with the host name replaced by its address
+    char host[DNS_CACHE_MAX_HOST_LENGTH];          // Name for SNI and the certificate check
+    char authority[DNS_CACHE_MAX_HOST_LENGTH + 6]; // "host[:port]" for the Host header
+} resolved_url_t;
+
+/**
+ * @brief A kept-alive connection; everything but the mutex is guarded by it
+ */
+typedef struct
+{
+    esp_http_client_handle_t client;
+    SemaphoreHandle_t mutex;
+    char origin[MAX_ORIGIN_LENGTH];
+    bool resolved;               // The handle connects by address (common_name set)
+    resolved_url_t target;       // Of the request in progress
+    bool open;
+    bool connected_this_request;
+    int64_t attempt_start_us;    // Start of the current attempt, for connect timing
+    bool echo_body;              // Echo of the current response; binary bodies are never echoed
+    http_response_t *response;   // Of the request in progress (may be NULL)
+} http_connection_t;
+
+static http_connection_t connections[CONNECTION_COUNT];
+static bool echo_enabled = true; // Echo response bodies to the UART (ECHO=ON|OFF)
+
+// Own lock, so reading the counters never waits for a request in progress
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static http_client_stats_t stats = {0};
+
+/**
+ * @brief Add to one of the counters
+ */
+static void count_stat(uint32_t *counter, uint32_t value)
+{
+    portENTER_CRITICAL(&stats_lock);
+    *counter += value;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+/**
+ * @brief Extract "scheme://host:port" from a URL
+ * A change of origin requires a new connection (and possibly a new transport)
+ */
+static void get_origin(const char *url, char *origin, size_t max_len)
+{
+    const char *authority = strstr(url, "://");
+    authority = (authority != NULL) ? authority + 3 : url;
+
+    size_t len = strcspn(authority, "/?#") + (authority - url);
+    if (len >= max_len)
+    {
+        len = max_len - 1;
+    }
+    memcpy(origin, url, len);
+    origin[len] = '\0';
+}
+
+/**
+ * @brief Extract the host name of an http(s) URL
+ * IP literals, IPv6 hosts and URLs with credentials are left alone
+ * @return Length of "host[:port]", or 0 if there is no name to resolve
+ */
+static size_t get_host(const char *url, char *host, size_t max_len)
+{
+    size_t scheme_len;
+    if (strncmp(url, "http://", 7) == 0)
+    {
+        scheme_len = 7;
+    }
+    else if (strncmp(url, "https://", 8) == 0)
+    {
+        scheme_len = 8;
+    }
+    else
+    {
+        return 0;
+    }
+
+    const char *authority = url + scheme_len;
+    size_t authority_len = strcspn(authority, "/?#");
+    size_t host_len = strcspn(authority, ":/?#");
+    if (host_len == 0 || host_len >= max_len || authority[0] == '[' ||
+        memchr(authority, '@', authority_len) != NULL ||
+        strspn(authority, "0123456789.") == host_len)
+    {
+        return 0;
+    }
+
+    memcpy(host, authority, host_len);
+    host[host_len] = '\0';
+    return authority_len;
+}
+
+/**
+ * @brief Replace the host name of a URL with its cached address
+ * Connecting by address skips the DNS round trip; the name still goes into
+ * the Host header, SNI and the certificate check
+ * @return true if the URL was rewritten
+ */
+static bool resolve_url(const char *url, resolved_url_t *out)
+{
+    size_t authority_len = get_host(url, out->host, sizeof(out->host));
+    if (authority_len == 0 || authority_len >= sizeof(out->authority))
+    {
+        return false;
+    }
+
+    // Without an answer the client resolves the name itself
+    uint32_t ipv4;
+    if (DnsCacheLookup(out->host, &ipv4) != 0)
+    {
+        return false;
+    }
+
+    const char *authority = strstr(url, "://") + 3;
+    size_t host_len = strlen(out->host);
+    const uint8_t *ip = (const uint8_t *)&ipv4;
+    int len = snprintf(out->url, sizeof(out->url), "%.*s%u.%u.%u.%u%s",
+                       (int)(authority - url), url, ip[0], ip[1], ip[2], ip[3], authority + host_len);
+    if (len < 0 || (size_t)len >= sizeof(out->url))
+    {
+        return false;
+    }
+
+    memcpy(out->authority, authority, authority_len);
+    out->authority[authority_len] = '\0';
+    return true;
+}
+
+/**
+ * @brief Count a new connection and how long it took
+ * TCP connect plus TLS handshake (abbreviated if the session was resumed)
+ */
+static void record_connect(const http_connection_t *connection)
+{
+    uint32_t connect_ms = (uint32_t)((esp_timer_get_time() - connection->attempt_start_us) / 1000);
+    portENTER_CRITICAL(&stats_lock);
+    stats.connections++;
+    stats.connect_ms_last = connect_ms;
+    stats.connect_ms_total += connect_ms;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+/**
+ * @brief HTTP event handler
+ * Stores the body into the response context of the request in progress
+ */
+static esp_err_t http_event_handler(esp_http_client_event_t *evt)
+{
+    http_connection_t *connection = (http_connection_t *)evt->user_data;
+    http_response_t *response = connection->response;
+
+    switch (evt->event_id)
+    {
+    case HTTP_EVENT_ERROR:
+        ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
+        break;
+    case HTTP_EVENT_ON_CONNECTED:
+        ESP_LOGD(TAG, "HTTP_EVENT_ON_CONNECTED");
+        connection->open = true;
+        connection->connected_this_request = true;
+        record_connect(connection);
+        break;
+    case HTTP_EVENT_HEADER_SENT:
+        ESP_LOGD(TAG, "HTTP_EVENT_HEADER_SENT");
+        break;
+    case HTTP_EVENT_ON_HEADER:
+        ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
+        if (strcasecmp(evt->header_key, "Content-Type") == 0 &&
+            strncasecmp(evt->header_value, "application/cbor", 16) == 0)
+        {
+            connection->echo_body = false;
+        }
+        if (response != NULL && response->on_header != NULL)
+        {
+            response->on_header(evt->header_key, evt->header_value, response->ctx);
+        }
+        break;
+    case HTTP_EVENT_ON_DATA:
+        // Capture response data and write to UART
+        if (evt->data_len > 0)
+        {
+            // Write to UART
+            if (connection->echo_body)
+            {
+                UartWrite((const char *)evt->data, evt->data_len);
+            }
+
+            if (response == NULL)
+            {
+                break;
+            }
+
+            response->received += evt->data_len;
+            if (response->on_data != NULL)
+            {
+                response->on_data((const char *)evt->data, evt->data_len, response->ctx);
+            }
+
+            if (response->buffer == NULL || response->buffer_size == 0)
+            {
+                break;
+            }
+
+            // Capture response for processing (limit to buffer size)
+            size_t copy_len = evt->data_len;
+            if (response->length + copy_len >= response->buffer_size)
+            {
+                copy_len = response->buffer_size - response->length - 1;
+                response->truncated = true;
+            }
+            if (copy_len > 0)
+            {
+                memcpy(response->buffer + response->length, evt->data, copy_len);
+                response->length += copy_len;
+                response->buffer[response->length] = '\0';
+            }
+            ESP_LOGD(TAG, "Received %d bytes, written to UART", evt->data_len);
+        }
+        break;
+    case HTTP_EVENT_ON_FINISH:
+        ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH");
+        // Add newline after response
+        if (connection->echo_body)
+        {
+            UartWrite("\r\n", 2);
+        }
+        break;
+    case HTTP_EVENT_DISCONNECTED:
+        ESP_LOGI(TAG, "HTTP_EVENT_DISCONNECTED");
+        connection->open = false;
+        break;
+    default:
+        break;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Make sure a connection has a client handle for the origin of the URL
+ * If resolved is not NULL the handle connects to its address instead
+ * Must be called with the connection's mutex held
+ */
+static int ensure_client(http_connection_t *connection, const char *url, const resolved_url_t *resolved,
+                         int timeout_ms)
+{
+    char origin[MAX_ORIGIN_LENGTH];
+    get_origin(url, origin, sizeof(origin));
+    const char *connect_url = (resolved != NULL) ? resolved->url : url;
+
+    // A new address of the same name reuses the handle; set_url reconnects
+    if (connection->client != NULL && strcmp(origin, connection->origin) == 0 &&
+        connection->resolved == (resolved != NULL))
+    {
+        esp_http_client_set_url(connection->client, connect_url);
+        esp_http_client_set_timeout_ms(connection->client, timeout_ms);
+        return 0;
+    }
+
+    if (connection->client != NULL)
+    {
+        ESP_LOGI(TAG, "Server changed to %s, dropping connection to %s", origin, connection->origin);
+        esp_http_client_cleanup(connection->client);
+        connection->client = NULL;
+        connection->open = false;
+    }
+
+    esp_http_client_config_t config = {
+        .url = connect_url,
+        .event_handler = http_event_handler,
+        .timeout_ms = timeout_ms,
+        .keep_alive_enable = true,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+        .common_name = (resolved != NULL) ? resolved->host : NULL,
+        .user_data = connection,
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+        // Keep the TLS session of this handle so a reconnect resumes it
+        // instead of paying a full handshake
+        .save_client_session = true,
+#endif
+    };
+
+    connection->client = esp_http_client_init(&config);
+    if (connection->client == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to initialize HTTP client");
+        connection->origin[0] = '\0';
+        return -1;
+    }
+
+    strncpy(connection->origin, origin, sizeof(connection->origin) - 1);
+    connection->origin[sizeof(connection->origin) - 1] = '\0';
+    connection->resolved = (resolved != NULL);
+    return 0;
+}
+
+/**
+ * @brief Take a connection for a request
+ * Polls always use the primary connection. Other requests (ACK POSTs) use
+ * it when it is free and the side connection otherwise, so they never wait
+ * for a long-poll parked on the primary one.
+ */
+static http_connection_t *acquire_connection(esp_http_client_method_t method)
+{
+    http_connection_t *primary = &connections[CONNECTION_PRIMARY];
+    if (method == HTTP_METHOD_GET)
+    {
+        xSemaphoreTake(primary->mutex, portMAX_DELAY);
+        return primary;
+    }
+    if (xSemaphoreTake(primary->mutex, 0) == pdTRUE)
+    {
+        return primary;
+    }
+
+    http_connection_t *side = &connections[CONNECTION_SIDE];
+    xSemaphoreTake(side->mutex, portMAX_DELAY);
+    return side;
+}
+
+void HttpClientInit(void)
+{
+    for (int i = 0; i < CONNECTION_COUNT; i++)
+    {
+        if (connections[i].mutex == NULL)
+        {
+            connections[i].mutex = xSemaphoreCreateMutex();
+        }
+    }
+    DnsCacheInit(NULL);
+
+    // Older firmware always echoed, so a missing key means on
+    nvs_handle_t nvs_handle;
+    uint8_t echo = 1;
+    if (nvs_open("http", NVS_READONLY, &nvs_handle) == ESP_OK)
+    {
+        nvs_get_u8(nvs_handle, "echo", &echo);
+        nvs_close(nvs_handle);
+    }
+    echo_enabled = (echo != 0);
+
+    ESP_LOGI(TAG, "Persistent HTTP client initialized (echo %s)", echo_enabled ? "on" : "off");
+}
+
+int HttpClientSetEcho(bool enabled)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("http", NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return -1;
+    }
+
+    err = nvs_set_u8(nvs_handle, "echo", enabled ? 1 : 0);
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error saving echo setting: %s", esp_err_to_name(err));
+        return -1;
+    }
+
+    echo_enabled = enabled;
+    ESP_LOGI(TAG, "Response echo %s", enabled ? "enabled" : "disabled");
+    return 0;
+}
+
+bool HttpClientGetEcho(void)
+{
+    return echo_enabled;
+}
+
+int HttpClientRequest(const http_request_t *request, http_response_t *response)
+{
+    if (request == NULL || request->url == NULL || connections[CONNECTION_PRIMARY].mutex == NULL)
+    {
+        return -1;
+    }
+
+    http_connection_t *connection = acquire_connection(request->method);
+
+    bool resolved = resolve_url(request->url, &connection->target);
+    if (ensure_client(connection, request->url, resolved ? &connection->target : NULL, request->timeout_ms) != 0)
+    {
+        count_stat(&stats.failures, 1);
+        xSemaphoreGive(connection->mutex);
+        return -1;
+    }
+    esp_http_client_handle_t client = connection->client;
+    if (resolved)
+    {
+        // The client would send the address; the server wants the name
+        esp_http_client_set_header(client, "Host", connection->target.authority);
+    }
+
+    esp_http_client_set_method(client, request->method);
+    connection->response = response;
+    if (request->body != NULL)
+    {
+        esp_http_client_set_header(client, "Content-Type",
+                                   request->content_type ? request->content_type : "application/json");
+        esp_http_client_set_post_field(client, request->body, request->body_len);
+    }
+    else
+    {
+        esp_http_client_delete_header(client, "Content-Type");
+        esp_http_client_set_post_field(client, NULL, 0);
+    }
+    for (size_t i = 0; i < request->header_count; i++)
+    {
+        esp_http_client_set_header(client, request->headers[i].key, request->headers[i].value);
+    }
+
+    esp_err_t err = ESP_FAIL;
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (response != NULL)
+        {
+            response->length = 0;
+            response->received = 0;
+            response->truncated = false;
+            response->status_code = 0;
+            if (response->buffer != NULL && response->buffer_size > 0)
+            {
+                response->buffer[0] = '\0';
+            }
+        }
+
+        bool was_open = connection->open;
+        connection->connected_this_request = false;
+        connection->echo_body = echo_enabled;
+        count_stat(&stats.requests, 1);
+        connection->attempt_start_us = esp_timer_get_time();
+        err = esp_http_client_perform(client);
+        if (err == ESP_OK)
+        {
+            if (!connection->connected_this_request)
+            {
+                count_stat(&stats.reused, 1);
+            }
+            break;
+        }
+
+        // A failure on a fresh connection is a real error; a failure on a
+        // reused one usually means the server closed it while we were idle
+        esp_http_client_close(client);
+        connection->open = false;
+        if (!was_open || connection->connected_this_request)
+        {
+            break;
+        }
+        ESP_LOGW(TAG, "Kept-alive connection dropped (%s), reconnecting", esp_err_to_name(err));
+        count_stat(&stats.reconnects, 1);
+    }
+
+    int result = -1;
+    if (err == ESP_OK)
+    {
+        if (response != NULL)
+        {
+            response->status_code = esp_http_client_get_status_code(client);
+        }
+        result = 0;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "HTTP request failed: %s", esp_err_to_name(err));
+        count_stat(&stats.failures, 1);
+    }
+
+    // Headers stick to the handle, so drop the per-request ones again
+    for (size_t i = 0; i < request->header_count; i++)
+    {
+        esp_http_client_delete_header(client, request->headers[i].key);
+    }
+    connection->response = NULL;
+    xSemaphoreGive(connection->mutex);
+    return result;
+}
+
+void HttpClientClose(void)
+{
+    for (int i = 0; i < CONNECTION_COUNT; i++)
+    {
+        http_connection_t *connection = &connections[i];
+        if (connection->mutex == NULL)
+        {
+            continue;
+        }
+
+        xSemaphoreTake(connection->mutex, portMAX_DELAY);
+        if (connection->client != NULL)
+        {
+            esp_http_client_cleanup(connection->client);
+            connection->client = NULL;
+            connection->origin[0] = '\0';
+            connection->open = false;
+        }
+        xSemaphoreGive(connection->mutex);
+    }
+}
+
+int HttpClientProbe(const char *url, int timeout_ms, int *status_code, uint32_t *elapsed_ms)
+{
+    if (url == NULL || status_code == NULL || elapsed_ms == NULL)
+    {
+        return -1;
+    }
+
+    // Resolved before the clock starts: the probe compares servers, not resolvers
+    resolved_url_t resolved;
+    bool is_resolved = resolve_url(url, &resolved);
+
+    // A short-lived client of its own, so the kept-alive connection to the
+    // active server stays open
+    esp_http_client_config_t config = {
+        .url = is_resolved ? resolved.url : url,
+        .method = HTTP_METHOD_HEAD,
+        .timeout_ms = timeout_ms,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+        .common_name = is_resolved ? resolved.host : NULL,
+    };
+
+    int64_t start_us = esp_timer_get_time();
+    esp_http_client_handle_t probe = esp_http_client_init(&config);
+    if (probe == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to initialize probe client");
+        return -1;
+    }
+    if (is_resolved)
+    {
+        esp_http_client_set_header(probe, "Host", resolved.authority);
+    }
+
+    esp_err_t err = esp_http_client_perform(probe);
+    *elapsed_ms = (uint32_t)((esp_timer_get_time() - start_us) / 1000);
+    *status_code = (err == ESP_OK) ? esp_http_client_get_status_code(probe) : 0;
+    esp_http_client_cleanup(probe);
+
+    return (err == ESP_OK) ? 0 : -1;
+}
+
+void HttpClientPrefetch(const char *url, uint32_t within_ms)
+{
+    char host[DNS_CACHE_MAX_HOST_LENGTH];
+    if (url != NULL && get_host(url, host, sizeof(host)) != 0)
+    {
+        DnsCachePrefetch(host, within_ms);
+    }
+}
+
+void HttpClientGetStats(http_client_stats_t *out)
+{
+    if (out == NULL)
+    {
+        return;
+    }
+
+    portENTER_CRITICAL(&stats_lock);
+    *out = stats;
+    portEXIT_CRITICAL(&stats_lock);
+}
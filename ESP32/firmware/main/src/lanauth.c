@@ -0,0 +1,164 @@
+#include "lanauth.h"
+#include "timesync.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "mbedtls/md.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *TAG = "lanauth";
+
+#define LAN_AUTH_NVS_NAMESPACE "lan"
+#define LAN_AUTH_NVS_KEY "key"
+
+static char key[LAN_AUTH_MAX_KEY_LENGTH + 1] = {0};
+
+/**
+ * @brief Compute the hex HMAC-SHA256 of "<timestamp>.<body>"
+ * @return 0 on success, -1 on failure
+ */
+static int sign(const char *timestamp, const char *body, size_t body_len, char *hex)
+{
+    uint8_t digest[32];
+    mbedtls_md_context_t ctx;
+    mbedtls_md_init(&ctx);
+
+    int err = mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+    if (err == 0)
+    {
+        err = mbedtls_md_hmac_starts(&ctx, (const unsigned char *)key, strlen(key));
+    }
+    if (err == 0)
+    {
+        err = mbedtls_md_hmac_update(&ctx, (const unsigned char *)timestamp, strlen(timestamp));
+    }
+    if (err == 0)
+    {
+        err = mbedtls_md_hmac_update(&ctx, (const unsigned char *)".", 1);
+    }
+    if (err == 0)
+    {
+        err = mbedtls_md_hmac_update(&ctx, (const unsigned char *)body, body_len);
+    }
+    if (err == 0)
+    {
+        err = mbedtls_md_hmac_finish(&ctx, digest);
+    }
+    mbedtls_md_free(&ctx);
+
+    if (err != 0)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(digest); i++)
+    {
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    }
+    return 0;
+}
+
+void LanAuthInit(void)
+{
+    nvs_handle_t nvs_handle;
+    if (nvs_open(LAN_AUTH_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK)
+    {
+        return;
+    }
+
+    size_t required_size = sizeof(key);
+    if (nvs_get_str(nvs_handle, LAN_AUTH_NVS_KEY, key, &required_size) != ESP_OK)
+    {
+        key[0] = '\0';
+    }
+    nvs_close(nvs_handle);
+
+    ESP_LOGI(TAG, "LAN commands %s", key[0] != '\0' ? "enabled" : "disabled (no key)");
+}
+
+int LanAuthSetKey(const char *new_key)
+{
+    if (new_key == NULL || strlen(new_key) > LAN_AUTH_MAX_KEY_LENGTH)
+    {
+        return -1;
+    }
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(LAN_AUTH_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return -1;
+    }
+
+    err = nvs_set_str(nvs_handle, LAN_AUTH_NVS_KEY, new_key);
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error saving LAN key: %s", esp_err_to_name(err));
+        return -1;
+    }
+
+    snprintf(key, sizeof(key), "%s", new_key);
+    ESP_LOGI(TAG, "LAN commands %s", key[0] != '\0' ? "enabled" : "disabled");
+    return 0;
+}
+
+bool LanAuthIsEnabled(void)
+{
+    return key[0] != '\0';
+}
+
+lan_auth_result_t LanAuthVerify(const char *timestamp, const char *body, size_t body_len, const char *signature)
+{
+    if (!LanAuthIsEnabled())
+    {
+        return LAN_AUTH_DISABLED;
+    }
+    if (timestamp == NULL || body == NULL || signature == NULL || strlen(signature) != LAN_AUTH_SIGNATURE_LENGTH)
+    {
+        return LAN_AUTH_BAD_SIGNATURE;
+    }
+
+    char expected[LAN_AUTH_SIGNATURE_LENGTH + 1];
+    if (sign(timestamp, body, body_len, expected) != 0)
+    {
+        return LAN_AUTH_BAD_SIGNATURE;
+    }
+
+    // Constant time, so the comparison leaks nothing about the expected value
+    uint8_t diff = 0;
+    for (size_t i = 0; i < LAN_AUTH_SIGNATURE_LENGTH; i++)
+    {
+        char c = signature[i];
+        if (c >= 'A' && c <= 'F')
+        {
+            c = (char)(c - 'A' + 'a');
+        }
+        diff |= (uint8_t)(c ^ expected[i]);
+    }
+    if (diff != 0)
+    {
+        return LAN_AUTH_BAD_SIGNATURE;
+    }
+
+    // Checked after the signature, so unauthenticated requests learn nothing about the clock
+    if (!TimeSyncIsValid())
+    {
+        return LAN_AUTH_NO_CLOCK;
+    }
+    long long skew = (long long)time(NULL) - strtoll(timestamp, NULL, 10);
+    if (skew > LAN_AUTH_MAX_SKEW_S || skew < -LAN_AUTH_MAX_SKEW_S)
+    {
+        ESP_LOGW(TAG, "Rejected LAN request with timestamp %s (%lld s off)", timestamp, skew);
+        return LAN_AUTH_EXPIRED;
+    }
+    return LAN_AUTH_OK;
+}
@@ -1,16 +1,29 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
 #include "led.h"
 #include "relay.h"
+#include "zerocross.h"
+#include "dispatcher.h"
 #include "uart.h"
 #include "com.h"
 #include "wifi.h"
 #include "http.h"
+#include "httpclient.h"
+#include "dnscache.h"
+#include "endpoint.h"
+#include "outbox.h"
 #include "webserver.h"
+#include "server.h"
+#include "timesync.h"
+#include "lanauth.h"
+#include "schedule.h"
+#include "dedup.h"
+#include "scene.h"
 
 static const char *TAG = "main";
 
@@ -23,13 +36,22 @@ void app_main(void)
     UartInit();
     LedInit();
     RelayInit();
+    ZeroCrossInit();
+    DispatcherInit();
     ComInit();
 
     // Initialize WiFi
     WifiInit();
+    TimeSyncInit();
+    LanAuthInit();
+    SceneInit();
+    DedupInit();
+    ServerInit();
+    ScheduleInit();
 
     // Initialize HTTP client
     HttpInit();
+    OutboxInit();
     HttpStartPolling();
 
     // Load SSID and password from NVS
@@ -88,25 +110,43 @@ void app_main(void)
                 ESP_LOGI(TAG, "Executed: LED OFF");
                 break;
 
-            case CMD_RELAY1_ON:
-                RelayOn(1);
-                ESP_LOGI(TAG, "Executed: RELAY1 ON");
-                break;
-
-            case CMD_RELAY1_OFF:
-                RelayOff(1);
-                ESP_LOGI(TAG, "Executed: RELAY1 OFF");
+            case CMD_RELAY_ON:
+            {
+                int relay = atoi(cmd.param);
+                DispatcherSwitch(relay, 1, RELAY_SOURCE_UART);
+                ESP_LOGI(TAG, "Executed: RELAY%d ON", relay);
                 break;
+            }
 
-            case CMD_RELAY2_ON:
-                RelayOn(2);
-                ESP_LOGI(TAG, "Executed: RELAY2 ON");
+            case CMD_RELAY_OFF:
+            {
+                int relay = atoi(cmd.param);
+                DispatcherSwitch(relay, 0, RELAY_SOURCE_UART);
+                ESP_LOGI(TAG, "Executed: RELAY%d OFF", relay);
                 break;
+            }
 
-            case CMD_RELAY2_OFF:
-                RelayOff(2);
-                ESP_LOGI(TAG, "Executed: RELAY2 OFF");
+            case CMD_RELAY_WAVEFORM:
+            {
+                relay_command_t command;
+                int relay = 0;
+                int consumed = 0;
+                memset(&command, 0, sizeof(command));
+                sscanf(cmd.param, "%d %n", &relay, &consumed);
+                uint32_t duration_ms = 0;
+                if (relay >= 1 && relay <= RELAY_COUNT &&
+                    WaveformParse(cmd.param + consumed, &command.relays[relay - 1].waveform, &duration_ms) == 0)
+                {
+                    command.relays[relay - 1].duration_ms = (int)duration_ms;
+                    ServerExecuteCommands(&command, 1, RELAY_SOURCE_UART);
+                    ESP_LOGI(TAG, "Executed: RELAY%d %s", relay, cmd.param + consumed);
+                }
+                else
+                {
+                    ComSendResponse("ERROR");
+                }
                 break;
+            }
 
             case CMD_SSID_SET:
                 if (WifiSaveSsid(cmd.param) == 0)
@@ -223,6 +263,55 @@ void app_main(void)
                 break;
             }
 
+            case CMD_URL_ADD:
+                if (EndpointAdd(cmd.param) == 0)
+                {
+                    ComSendResponse("OK");
+                    ESP_LOGI(TAG, "Endpoint added: %s", cmd.param);
+                }
+                else
+                {
+                    ComSendResponse("ERROR");
+                    ESP_LOGE(TAG, "Failed to add endpoint");
+                }
+                break;
+
+            case CMD_URL_DELETE:
+            {
+                int number = atoi(cmd.param);
+                if (number >= 1 && EndpointRemove((size_t)(number - 1)) == 0)
+                {
+                    ComSendResponse("OK");
+                    ESP_LOGI(TAG, "Endpoint %d removed", number);
+                }
+                else
+                {
+                    ComSendResponse("ERROR");
+                    ESP_LOGE(TAG, "Failed to remove endpoint %s", cmd.param);
+                }
+                break;
+            }
+
+            case CMD_URLS_QUERY:
+            {
+                // One line per endpoint: number, '*' for the active one, URL and health
+                endpoint_info_t info;
+                char line[ENDPOINT_URL_LENGTH + 64];
+                size_t count = EndpointCount();
+                for (size_t i = 0; i < count && EndpointGetInfo(i, &info) == 0; i++)
+                {
+                    snprintf(line, sizeof(line), "%u%s %s rtt_ms=%lu errors=%u%% %s", (unsigned)(i + 1),
+                             info.active ? "*" : "", info.url, (unsigned long)info.rtt_ms, info.error_pct,
+                             info.healthy ? "healthy" : "unhealthy");
+                    ComSendResponse(line);
+                }
+                if (count == 0)
+                {
+                    ComSendResponse("NOT_SET");
+                }
+                break;
+            }
+
             case CMD_IP_QUERY:
             {
                 char ip_str[16] = {0};
@@ -237,6 +326,154 @@ void app_main(void)
                 break;
             }
 
+            case CMD_ECHO_SET:
+            {
+                bool valid = (strcmp(cmd.param, "ON") == 0 || strcmp(cmd.param, "OFF") == 0);
+                if (valid && HttpClientSetEcho(strcmp(cmd.param, "ON") == 0) == 0)
+                {
+                    ComSendResponse("OK");
+                    ESP_LOGI(TAG, "Echo set: %s", cmd.param);
+                }
+                else
+                {
+                    ComSendResponse("ERROR");
+                    ESP_LOGE(TAG, "Failed to set echo");
+                }
+                break;
+            }
+
+            case CMD_ECHO_QUERY:
+                ComSendResponse(HttpClientGetEcho() ? "ON" : "OFF");
+                break;
+
+            case CMD_PSK_SET:
+                if (LanAuthSetKey(cmd.param) == 0)
+                {
+                    ComSendResponse("OK");
+                }
+                else
+                {
+                    ComSendResponse("ERROR");
+                    ESP_LOGE(TAG, "Failed to set LAN key");
+                }
+                break;
+
+            case CMD_PSK_QUERY:
+                // The key itself is never echoed
+                ComSendResponse(LanAuthIsEnabled() ? "SET" : "NOT SET");
+                break;
+
+            case CMD_SCHED_QUERY:
+            {
+                time_t next;
+                int entries = ScheduleGetInfo(&next);
+                char sched_str[96];
+                snprintf(sched_str, sizeof(sched_str), "version=%lu entries=%d next=%lld clock=%s",
+                         (unsigned long)ScheduleGetVersion(), entries, (long long)next,
+                         TimeSyncIsValid() ? "set" : "not_set");
+                ComSendResponse(sched_str);
+                break;
+            }
+
+            case CMD_SCENE_SET:
+                if (SceneDefine(cmd.param) == 0)
+                {
+                    ComSendResponse("OK");
+                }
+                else
+                {
+                    ComSendResponse("ERROR");
+                    ESP_LOGE(TAG, "Invalid scene definition: %s", cmd.param);
+                }
+                break;
+
+            case CMD_SCENE_QUERY:
+            {
+                // One line per defined scene, in the SCENE= format
+                char line[SCENE_NAME_LENGTH + RELAY_MAX_COUNT * 6 + 8];
+                int defined = 0;
+                for (int number = 1; number <= SCENE_MAX; number++)
+                {
+                    if (SceneFormat(number, line, sizeof(line)) == 0)
+                    {
+                        ComSendResponse(line);
+                        defined++;
+                    }
+                }
+                if (defined == 0)
+                {
+                    ComSendResponse("NOT_SET");
+                }
+                break;
+            }
+
+            case CMD_SCENE_RECALL:
+            {
+                relay_command_t command;
+                memset(&command, 0, sizeof(command));
+                command.scene = atoi(cmd.param);
+                scene_t scene;
+                if (SceneGet(command.scene, &scene) == 0)
+                {
+                    ServerExecuteCommands(&command, 1, RELAY_SOURCE_UART);
+                    ESP_LOGI(TAG, "Executed: SCENE %d (%s)", command.scene, scene.name);
+                }
+                else
+                {
+                    ComSendResponse("ERROR");
+                }
+                break;
+            }
+
+            case CMD_STATS_QUERY:
+            {
+                http_client_stats_t stats;
+                outbox_stats_t outbox_stats;
+                retry_stats_t retry_stats;
+                uart_tx_stats_t uart_stats;
+                dns_cache_stats_t dns_stats;
+                relay_switch_stats_t switch_stats;
+                zero_cross_stats_t zero_cross_stats;
+                HttpClientGetStats(&stats);
+                OutboxGetStats(&outbox_stats);
+                HttpGetRetryStats(&retry_stats);
+                UartGetTxStats(&uart_stats);
+                DnsCacheGetStats(&dns_stats);
+                RelayGetSwitchStats(&switch_stats);
+                ZeroCrossGetStats(&zero_cross_stats);
+                char stats_str[768];
+                snprintf(stats_str, sizeof(stats_str),
+                         "requests=%lu connections=%lu reused=%lu reconnects=%lu failures=%lu connect_ms=%lu connect_avg_ms=%lu "
+                         "outbox_pending=%lu outbox_sent=%lu outbox_retries=%lu outbox_dropped=%lu outbox_rejected=%lu "
+                         "breaker=%s breaker_open_ms=%lu breaker_trips=%lu fast_fails=%lu retries=%lu "
+                         "uart_dropped=%lu uart_dropped_bytes=%lu "
+                         "dns_hits=%lu dns_stale=%lu dns_misses=%lu dns_failures=%lu duplicates=%lu "
+                         "transitions=%lu switch_skew_ns=%lu switch_skew_max_ns=%lu "
+                         "zc_locked=%d zc_interval_us=%lu zc_edges=%lu zc_noise=%lu zc_synced=%lu zc_unsynced=%lu "
+                         "zc_late_us=%lu zc_late_max_us=%lu",
+                         (unsigned long)stats.requests, (unsigned long)stats.connections,
+                         (unsigned long)stats.reused, (unsigned long)stats.reconnects,
+                         (unsigned long)stats.failures, (unsigned long)stats.connect_ms_last,
+                         (unsigned long)(stats.connections ? stats.connect_ms_total / stats.connections : 0),
+                         (unsigned long)outbox_stats.pending,
+                         (unsigned long)outbox_stats.sent, (unsigned long)outbox_stats.retries,
+                         (unsigned long)outbox_stats.dropped, (unsigned long)outbox_stats.rejected,
+                         RetryBreakerStateName(retry_stats.state),
+                         (unsigned long)retry_stats.open_remaining_ms, (unsigned long)retry_stats.trips,
+                         (unsigned long)retry_stats.fast_fails, (unsigned long)retry_stats.retries,
+                         (unsigned long)uart_stats.dropped_writes, (unsigned long)uart_stats.dropped_bytes,
+                         (unsigned long)dns_stats.hits, (unsigned long)dns_stats.stale_hits,
+                         (unsigned long)dns_stats.misses, (unsigned long)dns_stats.failures,
+                         (unsigned long)DedupGetDuplicates(), (unsigned long)switch_stats.transitions,
+                         (unsigned long)switch_stats.last_skew_ns, (unsigned long)switch_stats.max_skew_ns,
+                         zero_cross_stats.locked ? 1 : 0, (unsigned long)zero_cross_stats.interval_us,
+                         (unsigned long)zero_cross_stats.edges, (unsigned long)zero_cross_stats.noise,
+                         (unsigned long)zero_cross_stats.synced, (unsigned long)zero_cross_stats.unsynced,
+                         (unsigned long)zero_cross_stats.last_late_us, (unsigned long)zero_cross_stats.max_late_us);
+                ComSendResponse(stats_str);
+                break;
+            }
+
             default:
                 ESP_LOGW(TAG, "Unknown command type");
                 break;
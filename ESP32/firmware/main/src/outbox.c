@@ -0,0 +1,479 @@
+#include "outbox.h"
+#include "http.h"
+#include "wifi.h"
+#include "retry.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <string.h>
+
+static const char *TAG = "outbox";
+
+#define OUTBOX_CAPACITY 16
+#define OUTBOX_MAX_MESSAGE_LENGTH 224 // An ACK with the longest command_id and held list
+#define OUTBOX_BATCH_MAX 8
+#define OUTBOX_BATCH_WINDOW_MS 100 // Linger after the first message so a burst shares one POST
+#define OUTBOX_WIFI_WAIT_MS 1000
+#define OUTBOX_TRANSPORT_WAIT_MS 5000 // Re-check for a session or an HTTP server while neither is there
+#define OUTBOX_NVS_NAMESPACE "outbox"
+#define OUTBOX_NVS_KEY "pending"
+
+/**
+ * @brief A message waiting for delivery
+ */
+typedef struct
+{
+    bool persist;
+    char data[OUTBOX_MAX_MESSAGE_LENGTH];
+} outbox_entry_t;
+
+// Ring buffer of pending messages, oldest at head (guarded by outbox_mutex)
+static outbox_entry_t entries[OUTBOX_CAPACITY];
+static size_t head = 0;
+static size_t count = 0;
+static bool persist_dirty = false;
+static outbox_stats_t stats = {0};
+static outbox_sender_t transport_sender = NULL;
+
+/**
+ * @brief Backoff between delivery rounds (only the delays are used; each
+ * round's POST has its own short retry policy in HttpPostJson)
+ */
+static const retry_policy_t outbox_retry_policy = {
+    .base_delay_ms = 1000,
+    .max_delay_ms = 60000,
+};
+
+static SemaphoreHandle_t outbox_mutex = NULL;
+static TaskHandle_t sender_task = NULL;
+
+// Only used by the sender task
+static char batch_body[OUTBOX_BATCH_MAX * (OUTBOX_MAX_MESSAGE_LENGTH + 1) + 2];
+static char persist_blob[OUTBOX_CAPACITY * OUTBOX_MAX_MESSAGE_LENGTH];
+static bool send_singly = false; // A batch was refused: find the message the server rejects
+
+/**
+ * @brief Append a message to the ring (outbox_mutex must be held)
+ */
+static int push_entry(const char *json_payload, bool persist)
+{
+    if (count == OUTBOX_CAPACITY)
+    {
+        return -1;
+    }
+
+    outbox_entry_t *entry = &entries[(head + count) % OUTBOX_CAPACITY];
+    entry->persist = persist;
+    strncpy(entry->data, json_payload, OUTBOX_MAX_MESSAGE_LENGTH - 1);
+    entry->data[OUTBOX_MAX_MESSAGE_LENGTH - 1] = '\0';
+    count++;
+    return 0;
+}
+
+/**
+ * @brief Write the persistent messages still in the ring to NVS
+ * Stored as one blob of null-terminated strings; the key is erased when none are left
+ */
+static void save_pending(void)
+{
+    size_t blob_len = 0;
+
+    xSemaphoreTake(outbox_mutex, portMAX_DELAY);
+    if (!persist_dirty)
+    {
+        xSemaphoreGive(outbox_mutex);
+        return;
+    }
+    persist_dirty = false;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const outbox_entry_t *entry = &entries[(head + i) % OUTBOX_CAPACITY];
+        if (entry->persist)
+        {
+            size_t len = strlen(entry->data) + 1;
+            memcpy(persist_blob + blob_len, entry->data, len);
+            blob_len += len;
+        }
+    }
+    xSemaphoreGive(outbox_mutex);
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(OUTBOX_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return;
+    }
+
+    if (blob_len > 0)
+    {
+        err = nvs_set_blob(nvs_handle, OUTBOX_NVS_KEY, persist_blob, blob_len);
+    }
+    else
+    {
+        err = nvs_erase_key(nvs_handle, OUTBOX_NVS_KEY);
+        if (err == ESP_ERR_NVS_NOT_FOUND)
+        {
+            err = ESP_OK;
+        }
+    }
+
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error saving pending messages: %s", esp_err_to_name(err));
+    }
+}
+
+/**
+ * @brief Restore persistent messages left undelivered by the previous run
+ */
+static void restore_pending(void)
+{
+    nvs_handle_t nvs_handle;
+    if (nvs_open(OUTBOX_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK)
+    {
+        return;
+    }
+
+    size_t blob_len = sizeof(persist_blob);
+    esp_err_t err = nvs_get_blob(nvs_handle, OUTBOX_NVS_KEY, persist_blob, &blob_len);
+    nvs_close(nvs_handle);
+
+    if (err != ESP_OK)
+    {
+        if (err != ESP_ERR_NVS_NOT_FOUND)
+        {
+            ESP_LOGE(TAG, "Error reading pending messages: %s", esp_err_to_name(err));
+        }
+        return;
+    }
+
+    size_t offset = 0;
+    while (offset < blob_len)
+    {
+        const char *message = persist_blob + offset;
+        size_t len = strnlen(message, blob_len - offset);
+        if (len > 0 && push_entry(message, true) == 0)
+        {
+            stats.restored++;
+        }
+        offset += len + 1;
+    }
+
+    ESP_LOGI(TAG, "Restored %lu undelivered message(s) from NVS", (unsigned long)stats.restored);
+}
+
+/**
+ * @brief Build the POST body from the oldest messages
+ * A single message is sent as-is, several as a JSON array
+ * @param max_count Most messages to put in the body
+ * @return Number of messages in the body
+ */
+static size_t build_batch(size_t max_count)
+{
+    size_t batch_count = 0;
+    size_t len = 0;
+
+    xSemaphoreTake(outbox_mutex, portMAX_DELAY);
+    size_t available = (count < max_count) ? count : max_count;
+
+    if (available == 1)
+    {
+        strcpy(batch_body, entries[head].data);
+        batch_count = 1;
+    }
+    else if (available > 1)
+    {
+        batch_body[len++] = '[';
+        for (; batch_count < available; batch_count++)
+        {
+            const char *data = entries[(head + batch_count) % OUTBOX_CAPACITY].data;
+            if (batch_count > 0)
+            {
+                batch_body[len++] = ',';
+            }
+            size_t data_len = strlen(data);
+            memcpy(batch_body + len, data, data_len);
+            len += data_len;
+        }
+        batch_body[len++] = ']';
+        batch_body[len] = '\0';
+    }
+    xSemaphoreGive(outbox_mutex);
+
+    return batch_count;
+}
+
+/**
+ * @brief Remove messages from the head of the ring (outbox_mutex must be held)
+ */
+static void remove_head(size_t removed)
+{
+    for (size_t i = 0; i < removed; i++)
+    {
+        if (entries[head].persist)
+        {
+            persist_dirty = true;
+        }
+        head = (head + 1) % OUTBOX_CAPACITY;
+    }
+    count -= removed;
+}
+
+/**
+ * @brief Remove messages delivered in one POST or session send
+ */
+static void remove_delivered(size_t delivered)
+{
+    xSemaphoreTake(outbox_mutex, portMAX_DELAY);
+    remove_head(delivered);
+    stats.sent += delivered;
+    stats.batches++;
+    xSemaphoreGive(outbox_mutex);
+}
+
+/**
+ * @brief Drop the oldest message, which the server refused
+ * Retrying it would block every message behind it for good
+ */
+static void remove_rejected(void)
+{
+    xSemaphoreTake(outbox_mutex, portMAX_DELAY);
+    remove_head(1);
+    stats.rejected++;
+    xSemaphoreGive(outbox_mutex);
+}
+
+/**
+ * @brief Hand the oldest messages to a transport session, one per send
+ * @return 0 if they were all sent, -1 if the session failed to take one
+ */
+static int send_through(outbox_sender_t sender)
+{
+    for (size_t i = 0; i < OUTBOX_BATCH_MAX; i++)
+    {
+        if (build_batch(1) == 0)
+        {
+            break;
+        }
+        if (sender(batch_body) != 0)
+        {
+            return -1;
+        }
+        remove_delivered(1);
+    }
+    save_pending();
+    return 0;
+}
+
+/**
+ * @brief POST the oldest messages to the active HTTP server
+ * @param retry_after_ms Set to the delay the server asked for when it failed, 0 if none
+ * @return The outcome; a refused message has been dropped already
+ */
+static http_post_result_t post_batch(uint32_t *retry_after_ms)
+{
+    *retry_after_ms = 0;
+    size_t batch_count = build_batch(send_singly ? 1 : OUTBOX_BATCH_MAX);
+    if (batch_count == 0)
+    {
+        return HTTP_POST_OK;
+    }
+
+    http_post_result_t result = HttpPostJson(batch_body, retry_after_ms);
+    if (result == HTTP_POST_OK)
+    {
+        ESP_LOGI(TAG, "Delivered %u message(s)", (unsigned)batch_count);
+        remove_delivered(batch_count);
+        save_pending();
+    }
+    else if (result == HTTP_POST_REJECTED && batch_count > 1)
+    {
+        // One of them is bad; send them one by one until it is found
+        ESP_LOGW(TAG, "Server refused a batch of %u messages, sending them singly", (unsigned)batch_count);
+        send_singly = true;
+    }
+    else if (result == HTTP_POST_REJECTED)
+    {
+        ESP_LOGW(TAG, "Server refused message, dropping it: %s", batch_body);
+        remove_rejected();
+        save_pending();
+        send_singly = false;
+    }
+    return result;
+}
+
+/**
+ * @brief Outbound sender task
+ * Delivers queued messages in order so producers never block on the uplink
+ */
+static void outbox_sender_task(void *pvParameters)
+{
+    uint32_t backoff_ms = 0;
+    uint32_t retry_after_ms = 0; // Retry-After of the last failed POST
+
+    while (1)
+    {
+        xSemaphoreTake(outbox_mutex, portMAX_DELAY);
+        size_t pending = count;
+        xSemaphoreGive(outbox_mutex);
+
+        if (pending == 0)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            vTaskDelay(pdMS_TO_TICKS(OUTBOX_BATCH_WINDOW_MS));
+        }
+
+        // Persist new ACKs before trying to send them
+        save_pending();
+
+        if (!WifiIsConnected())
+        {
+            vTaskDelay(pdMS_TO_TICKS(OUTBOX_WIFI_WAIT_MS));
+            continue;
+        }
+
+        // A push session (WebSocket, MQTT) takes the messages over its own uplink
+        xSemaphoreTake(outbox_mutex, portMAX_DELAY);
+        outbox_sender_t sender = transport_sender;
+        xSemaphoreGive(outbox_mutex);
+
+        retry_after_ms = 0;
+        if (sender != NULL)
+        {
+            if (send_through(sender) == 0)
+            {
+                backoff_ms = 0;
+                continue;
+            }
+        }
+        else
+        {
+            http_post_result_t result = post_batch(&retry_after_ms);
+            if (result == HTTP_POST_OK || result == HTTP_POST_REJECTED)
+            {
+                backoff_ms = 0;
+                continue;
+            }
+            if (result == HTTP_POST_UNAVAILABLE)
+            {
+                // Broker or CoAP server: wait for its session to come up (OutboxSetSender)
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(OUTBOX_TRANSPORT_WAIT_MS));
+                continue;
+            }
+        }
+
+        // Backoff with decorrelated jitter so devices that lost the server
+        // together don't return in lockstep; new messages keep accumulating meanwhile
+        backoff_ms = RetryNextDelay(&outbox_retry_policy, backoff_ms);
+
+        // No point in trying before the server's breaker allows the next probe
+        retry_stats_t retry_stats;
+        HttpGetRetryStats(&retry_stats);
+        uint32_t delay_ms = (retry_stats.open_remaining_ms > backoff_ms) ? retry_stats.open_remaining_ms : backoff_ms;
+        if (retry_after_ms > delay_ms)
+        {
+            // The server said when to come back (429 Too Many Requests, 503)
+            delay_ms = retry_after_ms;
+        }
+
+        xSemaphoreTake(outbox_mutex, portMAX_DELAY);
+        stats.retries++;
+        xSemaphoreGive(outbox_mutex);
+
+        ESP_LOGW(TAG, "Delivery failed, retrying in %lu ms", (unsigned long)delay_ms);
+        vTaskDelay(pdMS_TO_TICKS(delay_ms));
+    }
+}
+
+void OutboxInit(void)
+{
+    outbox_mutex = xSemaphoreCreateMutex();
+    if (outbox_mutex == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create outbox mutex");
+        return;
+    }
+
+    restore_pending();
+
+    xTaskCreate(outbox_sender_task, "outbox_sender", 4096, NULL, 4, &sender_task);
+    ESP_LOGI(TAG, "Outbox initialized");
+}
+
+int OutboxEnqueue(const char *json_payload, bool persist)
+{
+    if (json_payload == NULL || outbox_mutex == NULL)
+    {
+        return -1;
+    }
+
+    if (strlen(json_payload) >= OUTBOX_MAX_MESSAGE_LENGTH)
+    {
+        ESP_LOGE(TAG, "Message too long for the outbox (%u bytes)", (unsigned)strlen(json_payload));
+        return -1;
+    }
+
+    xSemaphoreTake(outbox_mutex, portMAX_DELAY);
+    int ret = push_entry(json_payload, persist);
+    if (ret == 0)
+    {
+        if (persist)
+        {
+            persist_dirty = true;
+        }
+    }
+    else
+    {
+        stats.dropped++;
+    }
+    xSemaphoreGive(outbox_mutex);
+
+    if (ret != 0)
+    {
+        ESP_LOGW(TAG, "Outbox full, dropping message");
+        return -1;
+    }
+
+    xTaskNotifyGive(sender_task);
+    return 0;
+}
+
+void OutboxSetSender(outbox_sender_t sender)
+{
+    if (outbox_mutex == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(outbox_mutex, portMAX_DELAY);
+    transport_sender = sender;
+    xSemaphoreGive(outbox_mutex);
+
+    if (sender != NULL)
+    {
+        xTaskNotifyGive(sender_task);
+    }
+}
+
+void OutboxGetStats(outbox_stats_t *out)
+{
+    if (out == NULL || outbox_mutex == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(outbox_mutex, portMAX_DELAY);
+    *out = stats;
+    out->pending = count;
+    xSemaphoreGive(outbox_mutex);
+}
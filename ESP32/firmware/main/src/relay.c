@@ -1,59 +1,283 @@
 #include "relay.h"
+#include "zerocross.h"
 #include "driver/gpio.h"
 #include "esp_log.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#include "esp_rom_gpio.h"
+#include "freertos/FreeRTOS.h"
+#include "soc/soc.h"
+#include "soc/soc_caps.h"
+#include "soc/gpio_reg.h"
+#include "soc/gpio_sig_map.h"
+#include <stdatomic.h>
 
-#define RELAY_1_GPIO GPIO_NUM_16
-#define RELAY_2_GPIO GPIO_NUM_17
+#if CONFIG_RELAY_COUNT < 1 || CONFIG_RELAY_COUNT > RELAY_MAX_COUNT
+#error "CONFIG_RELAY_COUNT must be between 1 and RELAY_MAX_COUNT"
+#endif
+
+#define RELAY_ALL_MASK ((1u << RELAY_COUNT) - 1)
+
+#define RELAY_DESCRIPTOR(n)                                 \
+    {                                                       \
+        .gpio = (gpio_num_t)CONFIG_RELAY_##n##_GPIO,        \
+        .active_level = CONFIG_RELAY_##n##_ACTIVE_LEVEL,    \
+        .default_state = CONFIG_RELAY_##n##_DEFAULT_STATE,  \
+        .operate_us = CONFIG_RELAY_##n##_OPERATE_US,        \
+        .release_us = CONFIG_RELAY_##n##_RELEASE_US,        \
+        .name = CONFIG_RELAY_##n##_NAME,                    \
+    }
 
 static const char *TAG = "relay";
 
+// Indexed by relay number - 1; entries exist only for the configured relays
+static const relay_descriptor_t relays[RELAY_COUNT] = {
+    RELAY_DESCRIPTOR(1),
+#if CONFIG_RELAY_COUNT >= 2
+    RELAY_DESCRIPTOR(2),
+#endif
+#if CONFIG_RELAY_COUNT >= 3
+    RELAY_DESCRIPTOR(3),
+#endif
+#if CONFIG_RELAY_COUNT >= 4
+    RELAY_DESCRIPTOR(4),
+#endif
+#if CONFIG_RELAY_COUNT >= 5
+    RELAY_DESCRIPTOR(5),
+#endif
+#if CONFIG_RELAY_COUNT >= 6
+    RELAY_DESCRIPTOR(6),
+#endif
+#if CONFIG_RELAY_COUNT >= 7
+    RELAY_DESCRIPTOR(7),
+#endif
+#if CONFIG_RELAY_COUNT >= 8
+    RELAY_DESCRIPTOR(8),
+#endif
+#if CONFIG_RELAY_COUNT >= 9
+    RELAY_DESCRIPTOR(9),
+#endif
+#if CONFIG_RELAY_COUNT >= 10
+    RELAY_DESCRIPTOR(10),
+#endif
+#if CONFIG_RELAY_COUNT >= 11
+    RELAY_DESCRIPTOR(11),
+#endif
+#if CONFIG_RELAY_COUNT >= 12
+    RELAY_DESCRIPTOR(12),
+#endif
+#if CONFIG_RELAY_COUNT >= 13
+    RELAY_DESCRIPTOR(13),
+#endif
+#if CONFIG_RELAY_COUNT >= 14
+    RELAY_DESCRIPTOR(14),
+#endif
+#if CONFIG_RELAY_COUNT >= 15
+    RELAY_DESCRIPTOR(15),
+#endif
+#if CONFIG_RELAY_COUNT >= 16
+    RELAY_DESCRIPTOR(16),
+#endif
+};
+
+// Last state written to each relay, bit (n - 1) for relay n (output pins cannot be read back)
+static atomic_uint_fast32_t relay_states;
+
+// Keeps the register writes of a transition together and its state update consistent
+static portMUX_TYPE relay_lock = portMUX_INITIALIZER_UNLOCKED;
+static relay_switch_stats_t switch_stats;
+
+static void relay_set(int relayNumber, int state)
+{
+    if (RelayGetDescriptor(relayNumber) == NULL)
+    {
+        ESP_LOGE(TAG, "Invalid relay number: %d", relayNumber);
+        return;
+    }
+
+    uint32_t bit = 1u << (relayNumber - 1);
+    RelayApplyMask(bit, state ? bit : 0);
+}
+
 void RelayInit(void)
 {
-    gpio_reset_pin(RELAY_1_GPIO);
-    gpio_reset_pin(RELAY_2_GPIO);
-    gpio_set_direction(RELAY_1_GPIO, GPIO_MODE_OUTPUT);
-    gpio_set_direction(RELAY_2_GPIO, GPIO_MODE_OUTPUT);
+    uint32_t states = 0;
+
+    for (int i = 0; i < RELAY_COUNT; i++)
+    {
+        const relay_descriptor_t *relay = &relays[i];
+
+        // Drive the boot level before enabling the output so an active-low relay does not click
+        gpio_reset_pin(relay->gpio);
+        gpio_set_level(relay->gpio, relay->default_state ? relay->active_level : !relay->active_level);
+        gpio_set_direction(relay->gpio, GPIO_MODE_OUTPUT);
+        if (relay->default_state)
+        {
+            states |= 1u << i;
+        }
+        ESP_LOGI(TAG, "Relay %d (%s) on GPIO%d, active %s, %s at boot", i + 1, relay->name,
+                 relay->gpio, relay->active_level ? "high" : "low", relay->default_state ? "ON" : "OFF");
+    }
+    atomic_store(&relay_states, states);
 }
 
 void RelayOn(int relayNumber)
 {
-    gpio_num_t gpio;
-    
-    if (relayNumber == 1)
+    relay_set(relayNumber, 1);
+}
+
+void RelayOff(int relayNumber)
+{
+    relay_set(relayNumber, 0);
+}
+
+int RelayGetState(int relayNumber)
+{
+    if (relayNumber < 1 || relayNumber > RELAY_COUNT)
+    {
+        return -1;
+    }
+
+    return (atomic_load(&relay_states) >> (relayNumber - 1)) & 1;
+}
+
+/**
+ * @brief Add a relay pin's level to the output register writes of a step
+ */
+static void add_output(zero_cross_step_t *step, gpio_num_t gpio, int level)
+{
+#if SOC_GPIO_PIN_COUNT > 32
+    if (gpio >= 32)
     {
-        gpio = RELAY_1_GPIO;
+        uint32_t bit = 1u << (gpio - 32);
+        if (level)
+        {
+            step->set_bits_high |= bit;
+        }
+        else
+        {
+            step->clear_bits_high |= bit;
+        }
+        return;
     }
-    else if (relayNumber == 2)
+#endif
+    if (level)
     {
-        gpio = RELAY_2_GPIO;
+        step->set_bits |= 1u << gpio;
     }
     else
     {
-        ESP_LOGE(TAG, "Invalid relay number: %d", relayNumber);
-        return;
+        step->clear_bits |= 1u << gpio;
     }
-    
-    gpio_set_level(gpio, 1);
 }
 
-void RelayOff(int relayNumber)
+void RelayApplyMask(uint32_t mask, uint32_t states)
 {
-    gpio_num_t gpio;
-    
-    if (relayNumber == 1)
+    zero_cross_step_t all = {0};
+#if CONFIG_RELAY_ZERO_CROSS
+    zero_cross_step_t steps[RELAY_COUNT];
+    int step_count = 0;
+#endif
+
+    mask &= RELAY_ALL_MASK;
+    if (mask == 0)
     {
-        gpio = RELAY_1_GPIO;
+        return;
     }
-    else if (relayNumber == 2)
+
+    // Work out the register bits first so only the writes happen in the critical section
+    for (int i = 0; i < RELAY_COUNT; i++)
     {
-        gpio = RELAY_2_GPIO;
+        if ((mask & (1u << i)) == 0)
+        {
+            continue;
+        }
+
+        bool on = (states & (1u << i)) != 0;
+        int level = on ? relays[i].active_level : !relays[i].active_level;
+        add_output(&all, relays[i].gpio, level);
+#if CONFIG_RELAY_ZERO_CROSS
+        // Relays with the same actuation delay are written together
+        uint32_t delay_us = on ? relays[i].operate_us : relays[i].release_us;
+        int step = 0;
+        while (step < step_count && steps[step].delay_us != delay_us)
+        {
+            step++;
+        }
+        if (step == step_count)
+        {
+            steps[step] = (zero_cross_step_t){.delay_us = delay_us};
+            step_count++;
+        }
+        add_output(&steps[step], relays[i].gpio, level);
+#endif
     }
-    else
+
+#if CONFIG_RELAY_ZERO_CROSS
+    if (ZeroCrossApply(steps, step_count) == 0)
     {
-        ESP_LOGE(TAG, "Invalid relay number: %d", relayNumber);
+        portENTER_CRITICAL(&relay_lock);
+        atomic_store(&relay_states, (atomic_load(&relay_states) & ~mask) | (states & mask));
+        portEXIT_CRITICAL(&relay_lock);
         return;
     }
-    
-    gpio_set_level(gpio, 0);
+#endif
+
+    portENTER_CRITICAL(&relay_lock);
+    esp_cpu_cycle_count_t start = esp_cpu_get_cycle_count();
+    REG_WRITE(GPIO_OUT_W1TS_REG, all.set_bits);
+    REG_WRITE(GPIO_OUT_W1TC_REG, all.clear_bits);
+#if SOC_GPIO_PIN_COUNT > 32
+    REG_WRITE(GPIO_OUT1_W1TS_REG, all.set_bits_high);
+    REG_WRITE(GPIO_OUT1_W1TC_REG, all.clear_bits_high);
+#endif
+    esp_cpu_cycle_count_t end = esp_cpu_get_cycle_count();
+    atomic_store(&relay_states, (atomic_load(&relay_states) & ~mask) | (states & mask));
+    if (__builtin_popcount(mask) > 1)
+    {
+        uint32_t skew_ns = (uint32_t)(end - start) * 1000 / esp_rom_get_cpu_ticks_per_us();
+        switch_stats.transitions++;
+        switch_stats.last_skew_ns = skew_ns;
+        if (skew_ns > switch_stats.max_skew_ns)
+        {
+            switch_stats.max_skew_ns = skew_ns;
+        }
+    }
+    portEXIT_CRITICAL(&relay_lock);
+}
+
+void RelayGetSwitchStats(relay_switch_stats_t *stats)
+{
+    portENTER_CRITICAL(&relay_lock);
+    *stats = switch_stats;
+    portEXIT_CRITICAL(&relay_lock);
 }
 
+uint32_t RelayGetStates(void)
+{
+    return atomic_load(&relay_states);
+}
+
+void RelayRestoreOutput(int relayNumber)
+{
+    const relay_descriptor_t *relay = RelayGetDescriptor(relayNumber);
+    if (relay == NULL)
+    {
+        return;
+    }
+
+    int state = RelayGetState(relayNumber);
+    gpio_set_level(relay->gpio, state ? relay->active_level : !relay->active_level);
+    esp_rom_gpio_connect_out_signal(relay->gpio, SIG_GPIO_OUT_IDX, false, false);
+    gpio_set_direction(relay->gpio, GPIO_MODE_OUTPUT);
+}
+
+const relay_descriptor_t *RelayGetDescriptor(int relayNumber)
+{
+    if (relayNumber < 1 || relayNumber > RELAY_COUNT)
+    {
+        return NULL;
+    }
+
+    return &relays[relayNumber - 1];
+}
@@ -0,0 +1,184 @@
+#include "relaytimer.h"
+#include "relay.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <stdbool.h>
+
+static const char *TAG = "relaytimer";
+
+#define RELAY_TIMER_TASK_STACK_SIZE 3072
+
+/**
+ * @brief Auto-off state of one relay
+ */
+typedef struct
+{
+    esp_timer_handle_t timer;
+    int64_t deadline_us; // esp_timer time of the auto-off, 0 = none pending
+} relay_timer_t;
+
+static relay_timer_t timers[RELAY_COUNT];
+
+// Guards the deadlines
+static SemaphoreHandle_t timer_mutex = NULL;
+
+static relay_timer_expired_t expired_handler = NULL;
+
+// Runs the handler, so a zero-cross switch (10 to 40 ms) never holds up the esp_timer task
+static TaskHandle_t expiry_task = NULL;
+
+/**
+ * @brief esp_timer callback (runs in the esp_timer task)
+ * Only flags the relay (one notification bit each) for the expiry task
+ */
+static void auto_off(void *arg)
+{
+    int index = (int)(intptr_t)arg;
+
+    if (expiry_task != NULL)
+    {
+        xTaskNotify(expiry_task, 1u << index, eSetBits);
+    }
+}
+
+/**
+ * @brief Expiry task: calls the handler for every relay whose timer fired
+ * The handler decides with RelayTimerClaimExpired whether the auto-off is
+ * still due, under the same lock its commands re-arm or cancel timers with
+ */
+static void expiry_task_main(void *arg)
+{
+    while (1)
+    {
+        uint32_t fired = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &fired, portMAX_DELAY);
+
+        for (int i = 0; i < RELAY_COUNT; i++)
+        {
+            if ((fired & (1u << i)) && expired_handler != NULL)
+            {
+                expired_handler(i + 1);
+            }
+        }
+    }
+}
+
+void RelayTimerInit(relay_timer_expired_t on_expired)
+{
+    if (timer_mutex != NULL)
+    {
+        return;
+    }
+    timer_mutex = xSemaphoreCreateMutex();
+    expired_handler = on_expired;
+
+    if (xTaskCreate(expiry_task_main, "relay_timer", RELAY_TIMER_TASK_STACK_SIZE, NULL, 5, &expiry_task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create expiry task");
+        expiry_task = NULL;
+    }
+
+    for (int i = 0; i < RELAY_COUNT; i++)
+    {
+        const esp_timer_create_args_t args = {
+            .callback = auto_off,
+            .arg = (void *)(intptr_t)i,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "relay_off",
+        };
+        if (esp_timer_create(&args, &timers[i].timer) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to create timer for relay %d", i + 1);
+        }
+    }
+}
+
+int RelayTimerArm(int relayNumber, uint64_t duration_us)
+{
+    if (relayNumber < 1 || relayNumber > RELAY_COUNT || timers[relayNumber - 1].timer == NULL)
+    {
+        return -1;
+    }
+    relay_timer_t *entry = &timers[relayNumber - 1];
+
+    xSemaphoreTake(timer_mutex, portMAX_DELAY);
+    esp_timer_stop(entry->timer);
+    entry->deadline_us = esp_timer_get_time() + (int64_t)duration_us;
+    esp_err_t err = esp_timer_start_once(entry->timer, duration_us);
+    if (err != ESP_OK)
+    {
+        entry->deadline_us = 0;
+    }
+    xSemaphoreGive(timer_mutex);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to arm timer for relay %d: %s", relayNumber, esp_err_to_name(err));
+        return -1;
+    }
+    return 0;
+}
+
+void RelayTimerCancel(int relayNumber)
+{
+    if (relayNumber < 1 || relayNumber > RELAY_COUNT || timers[relayNumber - 1].timer == NULL)
+    {
+        return;
+    }
+    relay_timer_t *entry = &timers[relayNumber - 1];
+
+    xSemaphoreTake(timer_mutex, portMAX_DELAY);
+    if (entry->deadline_us != 0)
+    {
+        esp_timer_stop(entry->timer);
+        entry->deadline_us = 0;
+        ESP_LOGI(TAG, "Relay %d auto-off cancelled", relayNumber);
+    }
+    xSemaphoreGive(timer_mutex);
+}
+
+bool RelayTimerClaimExpired(int relayNumber)
+{
+    if (relayNumber < 1 || relayNumber > RELAY_COUNT || timer_mutex == NULL)
+    {
+        return false;
+    }
+    relay_timer_t *entry = &timers[relayNumber - 1];
+    bool expired = false;
+
+    // A callback that was already dispatched when the timer was re-armed or
+    // cancelled finds a later deadline, or none, and claims nothing
+    xSemaphoreTake(timer_mutex, portMAX_DELAY);
+    int64_t now = esp_timer_get_time();
+    if (entry->deadline_us != 0 && now >= entry->deadline_us)
+    {
+        entry->deadline_us = 0;
+        expired = true;
+    }
+    else if (entry->deadline_us != 0 && !esp_timer_is_active(entry->timer))
+    {
+        // Woken before the deadline with nothing pending; wait for the rest
+        esp_timer_start_once(entry->timer, (uint64_t)(entry->deadline_us - now));
+    }
+    xSemaphoreGive(timer_mutex);
+
+    return expired;
+}
+
+uint64_t RelayTimerRemainingUs(int relayNumber)
+{
+    if (relayNumber < 1 || relayNumber > RELAY_COUNT || timer_mutex == NULL)
+    {
+        return 0;
+    }
+
+    xSemaphoreTake(timer_mutex, portMAX_DELAY);
+    int64_t deadline_us = timers[relayNumber - 1].deadline_us;
+    xSemaphoreGive(timer_mutex);
+
+    int64_t now = esp_timer_get_time();
+    return (deadline_us != 0 && deadline_us > now) ? (uint64_t)(deadline_us - now) : 0;
+}
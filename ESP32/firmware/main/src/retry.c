@@ -0,0 +1,251 @@
+#include "retry.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "freertos/task.h"
+
+static const char *TAG = "retry";
+
+#define RETRY_MIN_ATTEMPT_MS 1000 // No retry is started with less budget left than this
+
+static uint32_t ms_since(TickType_t start)
+{
+    return pdTICKS_TO_MS(xTaskGetTickCount() - start);
+}
+
+/**
+ * @brief Time until the breaker's cooldown ends (mutex must be held)
+ */
+static uint32_t open_remaining_ms(const retry_breaker_t *breaker)
+{
+    int32_t remaining = (int32_t)(breaker->open_until - xTaskGetTickCount());
+    return (remaining > 0) ? pdTICKS_TO_MS(remaining) : 0;
+}
+
+/**
+ * @brief Decide whether an operation may run
+ * @param probe Set to true if the operation is the half-open probe
+ * @return false if the operation must fail fast
+ */
+static bool breaker_admit(retry_breaker_t *breaker, bool *probe)
+{
+    bool admitted = true;
+    *probe = false;
+
+    xSemaphoreTake(breaker->mutex, portMAX_DELAY);
+    breaker->stats.operations++;
+
+    if (breaker->stats.state == RETRY_BREAKER_OPEN && open_remaining_ms(breaker) == 0)
+    {
+        breaker->stats.state = RETRY_BREAKER_HALF_OPEN;
+    }
+
+    if (breaker->stats.state == RETRY_BREAKER_OPEN ||
+        (breaker->stats.state == RETRY_BREAKER_HALF_OPEN && breaker->probe_in_flight))
+    {
+        breaker->stats.fast_fails++;
+        admitted = false;
+    }
+    else if (breaker->stats.state == RETRY_BREAKER_HALF_OPEN)
+    {
+        breaker->probe_in_flight = true;
+        *probe = true;
+    }
+    xSemaphoreGive(breaker->mutex);
+
+    return admitted;
+}
+
+/**
+ * @brief Record the outcome of an admitted operation
+ */
+static void breaker_record(retry_breaker_t *breaker, bool probe, bool success)
+{
+    xSemaphoreTake(breaker->mutex, portMAX_DELAY);
+
+    if (probe)
+    {
+        breaker->probe_in_flight = false;
+    }
+
+    if (success)
+    {
+        if (breaker->stats.state != RETRY_BREAKER_CLOSED)
+        {
+            ESP_LOGI(TAG, "%s: reachable again, breaker closed", breaker->name);
+        }
+        breaker->stats.state = RETRY_BREAKER_CLOSED;
+        breaker->stats.consecutive_failures = 0;
+        breaker->cooldown_ms = breaker->cooldown_min_ms;
+    }
+    else
+    {
+        breaker->stats.failures++;
+        breaker->stats.consecutive_failures++;
+
+        if (probe || (breaker->stats.state == RETRY_BREAKER_CLOSED &&
+                      breaker->stats.consecutive_failures >= breaker->failure_threshold))
+        {
+            // A failed probe doubles the cooldown; the random part keeps a
+            // fleet of devices from probing a recovering server together
+            if (probe)
+            {
+                breaker->cooldown_ms = (breaker->cooldown_ms > breaker->cooldown_max_ms / 2)
+                                           ? breaker->cooldown_max_ms
+                                           : breaker->cooldown_ms * 2;
+            }
+            uint32_t open_ms = breaker->cooldown_ms + esp_random() % (breaker->cooldown_ms / 4 + 1);
+
+            breaker->stats.state = RETRY_BREAKER_OPEN;
+            breaker->stats.trips++;
+            breaker->open_until = xTaskGetTickCount() + pdMS_TO_TICKS(open_ms);
+            ESP_LOGW(TAG, "%s: %lu consecutive failures, breaker open for %lu ms", breaker->name,
+                     (unsigned long)breaker->stats.consecutive_failures, (unsigned long)open_ms);
+        }
+    }
+
+    xSemaphoreGive(breaker->mutex);
+}
+
+void RetryBreakerInit(retry_breaker_t *breaker, const char *name, uint8_t failure_threshold,
+                      uint32_t cooldown_min_ms, uint32_t cooldown_max_ms)
+{
+    *breaker = (retry_breaker_t){
+        .name = name,
+        .failure_threshold = (failure_threshold > 0) ? failure_threshold : 1,
+        .cooldown_min_ms = cooldown_min_ms,
+        .cooldown_max_ms = cooldown_max_ms,
+        .cooldown_ms = cooldown_min_ms,
+        .stats = {.state = RETRY_BREAKER_CLOSED},
+    };
+
+    breaker->mutex = xSemaphoreCreateMutex();
+    if (breaker->mutex == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create breaker mutex");
+    }
+}
+
+void RetryBreakerReset(retry_breaker_t *breaker)
+{
+    if (breaker == NULL || breaker->mutex == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(breaker->mutex, portMAX_DELAY);
+    breaker->stats = (retry_stats_t){.state = RETRY_BREAKER_CLOSED};
+    breaker->cooldown_ms = breaker->cooldown_min_ms;
+    breaker->probe_in_flight = false;
+    xSemaphoreGive(breaker->mutex);
+}
+
+uint32_t RetryNextDelay(const retry_policy_t *policy, uint32_t prev_delay_ms)
+{
+    uint32_t upper = (prev_delay_ms > policy->max_delay_ms / 3) ? policy->max_delay_ms : prev_delay_ms * 3;
+    if (upper < policy->base_delay_ms)
+    {
+        upper = policy->base_delay_ms;
+    }
+
+    uint32_t delay = policy->base_delay_ms + esp_random() % (upper - policy->base_delay_ms + 1);
+    return (delay > policy->max_delay_ms) ? policy->max_delay_ms : delay;
+}
+
+int RetryRun(retry_breaker_t *breaker, const retry_policy_t *policy, retry_attempt_fn_t attempt, void *ctx)
+{
+    if (breaker == NULL || breaker->mutex == NULL || policy == NULL || attempt == NULL)
+    {
+        return -1;
+    }
+
+    bool probe;
+    if (!breaker_admit(breaker, &probe))
+    {
+        ESP_LOGD(TAG, "%s: breaker open, failing fast", breaker->name);
+        return -1;
+    }
+
+    // The probe is a single attempt: one request tells whether the endpoint is back
+    uint8_t max_attempts = probe ? 1 : policy->max_attempts;
+    TickType_t start = xTaskGetTickCount();
+    uint32_t delay_ms = 0;
+    retry_attempt_result_t result = RETRY_ATTEMPT_FAILED;
+
+    for (uint8_t attempt_no = 1;; attempt_no++)
+    {
+        uint32_t elapsed_ms = ms_since(start);
+        uint32_t remaining_ms = (elapsed_ms < policy->total_budget_ms) ? policy->total_budget_ms - elapsed_ms : 0;
+        uint32_t timeout_ms = (policy->attempt_timeout_ms < remaining_ms) ? policy->attempt_timeout_ms : remaining_ms;
+
+        xSemaphoreTake(breaker->mutex, portMAX_DELAY);
+        breaker->stats.attempts++;
+        if (attempt_no > 1)
+        {
+            breaker->stats.retries++;
+        }
+        xSemaphoreGive(breaker->mutex);
+
+        result = attempt(timeout_ms, ctx);
+        if (result != RETRY_ATTEMPT_FAILED || attempt_no >= max_attempts)
+        {
+            break;
+        }
+
+        // Give up early rather than start an attempt the budget cannot cover
+        delay_ms = RetryNextDelay(policy, delay_ms);
+        if (ms_since(start) + delay_ms + RETRY_MIN_ATTEMPT_MS > policy->total_budget_ms)
+        {
+            ESP_LOGW(TAG, "%s: retry budget exhausted after %u attempt(s)", breaker->name, attempt_no);
+            break;
+        }
+
+        ESP_LOGW(TAG, "%s: attempt %u/%u failed, retrying in %lu ms", breaker->name, attempt_no, max_attempts,
+                 (unsigned long)delay_ms);
+        vTaskDelay(pdMS_TO_TICKS(delay_ms));
+    }
+
+    breaker_record(breaker, probe, result != RETRY_ATTEMPT_FAILED);
+    return (result == RETRY_ATTEMPT_OK) ? 0 : -1;
+}
+
+uint32_t RetryBreakerWaitMs(retry_breaker_t *breaker)
+{
+    if (breaker == NULL || breaker->mutex == NULL)
+    {
+        return 0;
+    }
+
+    xSemaphoreTake(breaker->mutex, portMAX_DELAY);
+    uint32_t wait_ms = (breaker->stats.state == RETRY_BREAKER_OPEN) ? open_remaining_ms(breaker) : 0;
+    xSemaphoreGive(breaker->mutex);
+
+    return wait_ms;
+}
+
+void RetryBreakerGetStats(retry_breaker_t *breaker, retry_stats_t *stats)
+{
+    if (breaker == NULL || breaker->mutex == NULL || stats == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(breaker->mutex, portMAX_DELAY);
+    *stats = breaker->stats;
+    stats->open_remaining_ms = (breaker->stats.state == RETRY_BREAKER_OPEN) ? open_remaining_ms(breaker) : 0;
+    xSemaphoreGive(breaker->mutex);
+}
+
+const char *RetryBreakerStateName(retry_breaker_state_t state)
+{
+    switch (state)
+    {
+    case RETRY_BREAKER_CLOSED:
+        return "closed";
+    case RETRY_BREAKER_OPEN:
+        return "open";
+    case RETRY_BREAKER_HALF_OPEN:
+        return "half_open";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,214 @@
+#include "scene.h"
+#include "relay.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "scene";
+
+#define SCENE_NVS_NAMESPACE "scene"
+
+// RAM copy of the table, so recalling a scene never waits for flash (guarded by scene_mutex)
+static scene_t scenes[SCENE_MAX];
+static SemaphoreHandle_t scene_mutex = NULL;
+
+/**
+ * @brief Write the scene table to NVS (scene_mutex must be held)
+ * @return 0 on success, -1 on error
+ */
+static int save_scenes(void)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(SCENE_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return -1;
+    }
+
+    err = nvs_set_blob(nvs_handle, "table", scenes, sizeof(scenes));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error saving scenes: %s", esp_err_to_name(err));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read the scene table from NVS
+ */
+static void load_scenes(void)
+{
+    nvs_handle_t nvs_handle;
+    if (nvs_open(SCENE_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK)
+    {
+        return;
+    }
+
+    size_t blob_len = sizeof(scenes);
+    if (nvs_get_blob(nvs_handle, "table", scenes, &blob_len) != ESP_OK || blob_len != sizeof(scenes))
+    {
+        memset(scenes, 0, sizeof(scenes));
+    }
+    nvs_close(nvs_handle);
+
+    for (int i = 0; i < SCENE_MAX; i++)
+    {
+        scenes[i].name[SCENE_NAME_LENGTH - 1] = '\0';
+    }
+}
+
+/**
+ * @brief Parse "<relay>=<state>[,<relay>=<state>...]" into a scene
+ * @return 0 on success, -1 if it is invalid
+ */
+static int parse_relays(const char *spec, scene_t *scene)
+{
+    while (*spec != '\0')
+    {
+        unsigned int relay, state;
+        int consumed = 0;
+
+        if (*spec == ',' || *spec == ' ')
+        {
+            spec++;
+            continue;
+        }
+        if (sscanf(spec, "%u=%u%n", &relay, &state, &consumed) != 2 || relay < 1 || relay > RELAY_COUNT ||
+            state > 1)
+        {
+            return -1;
+        }
+
+        uint32_t bit = 1u << (relay - 1);
+        scene->mask |= bit;
+        if (state)
+        {
+            scene->states |= bit;
+        }
+        else
+        {
+            scene->states &= ~bit;
+        }
+        spec += consumed;
+    }
+
+    return (scene->mask != 0) ? 0 : -1;
+}
+
+void SceneInit(void)
+{
+    if (scene_mutex != NULL)
+    {
+        return;
+    }
+    scene_mutex = xSemaphoreCreateMutex();
+
+    load_scenes();
+
+    int count = 0;
+    for (int i = 0; i < SCENE_MAX; i++)
+    {
+        if (scenes[i].mask != 0)
+        {
+            count++;
+        }
+    }
+    ESP_LOGI(TAG, "%d scenes defined", count);
+}
+
+int SceneDefine(const char *definition)
+{
+    int number;
+    int consumed = 0;
+    scene_t scene;
+
+    if (definition == NULL || scene_mutex == NULL)
+    {
+        return -1;
+    }
+    if (sscanf(definition, "%d%n", &number, &consumed) != 1 || number < 1 || number > SCENE_MAX)
+    {
+        return -1;
+    }
+
+    memset(&scene, 0, sizeof(scene));
+    const char *rest = definition + consumed;
+    while (*rest == ' ')
+    {
+        rest++;
+    }
+
+    // "<number>" alone deletes the scene
+    if (*rest != '\0')
+    {
+        // %15s: SCENE_NAME_LENGTH - 1
+        if (sscanf(rest, "%15s%n", scene.name, &consumed) != 1 || parse_relays(rest + consumed, &scene) != 0)
+        {
+            return -1;
+        }
+    }
+
+    xSemaphoreTake(scene_mutex, portMAX_DELAY);
+    scenes[number - 1] = scene;
+    int result = save_scenes();
+    xSemaphoreGive(scene_mutex);
+
+    if (scene.mask != 0)
+    {
+        ESP_LOGI(TAG, "Scene %d (%s) set: mask=0x%lx states=0x%lx", number, scene.name,
+                 (unsigned long)scene.mask, (unsigned long)scene.states);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Scene %d deleted", number);
+    }
+    return result;
+}
+
+int SceneGet(int number, scene_t *scene)
+{
+    if (number < 1 || number > SCENE_MAX || scene == NULL || scene_mutex == NULL)
+    {
+        return -1;
+    }
+
+    xSemaphoreTake(scene_mutex, portMAX_DELAY);
+    *scene = scenes[number - 1];
+    xSemaphoreGive(scene_mutex);
+
+    return (scene->mask != 0) ? 0 : -1;
+}
+
+int SceneFormat(int number, char *buffer, size_t size)
+{
+    scene_t scene;
+
+    if (buffer == NULL || size == 0 || SceneGet(number, &scene) != 0)
+    {
+        return -1;
+    }
+
+    int len = snprintf(buffer, size, "%d %s", number, scene.name);
+    char separator = ' ';
+    for (int relay = 1; relay <= RELAY_MAX_COUNT && (size_t)len < size; relay++)
+    {
+        uint32_t bit = 1u << (relay - 1);
+        if (scene.mask & bit)
+        {
+            len += snprintf(buffer + len, size - len, "%c%d=%d", separator, relay, (scene.states & bit) ? 1 : 0);
+            separator = ',';
+        }
+    }
+    return 0;
+}
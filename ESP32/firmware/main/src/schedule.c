@@ -0,0 +1,462 @@
+#include "schedule.h"
+#include "server.h"
+#include "relay.h"
+#include "timesync.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static const char *TAG = "schedule";
+
+#define SCHEDULE_NVS_NAMESPACE "sched"
+#define SCHEDULE_MAX_SLEEP_MS 60000 // Re-check at least this often, so clock corrections are picked up
+#define SCHEDULE_CLOCK_WAIT_MS 1000 // Retry interval while the clock is not set
+#define SCHEDULE_GRACE_S 60         // A missed instant action still runs if it is at most this late
+#define SCHEDULE_TASK_STACK_SIZE 4096
+
+// The stored schedule (guarded by schedule_mutex)
+static schedule_entry_t entries[SCHEDULE_MAX_ENTRIES];
+static size_t entry_count = 0;
+static uint32_t version = 0;
+static char time_zone[SCHEDULE_MAX_TZ_LENGTH] = {0};
+static bool reload = true; // The entries changed; re-establish the windows in progress
+
+static SemaphoreHandle_t schedule_mutex = NULL;
+static TaskHandle_t schedule_task_handle = NULL;
+
+// Actions that are due, executed after the mutex is released (only used by the schedule task)
+static relay_command_t due_commands[SCHEDULE_MAX_ENTRIES];
+
+/**
+ * @brief Local time of an entry on the day that is offset days from base
+ * @return The Unix time, and the weekday of that day in weekday
+ */
+static time_t time_on_day(const schedule_entry_t *entry, const struct tm *base, int offset, int *weekday)
+{
+    struct tm day = *base;
+    day.tm_mday += offset;
+    day.tm_hour = (int)(entry->start / 3600);
+    day.tm_min = (int)(entry->start / 60 % 60);
+    day.tm_sec = (int)(entry->start % 60);
+    day.tm_isdst = -1;
+    time_t result = mktime(&day);
+    *weekday = day.tm_wday;
+    return result;
+}
+
+/**
+ * @brief First time an entry runs after a given time
+ * @return The Unix time, 0 if it never runs again
+ */
+static time_t next_occurrence(const schedule_entry_t *entry, time_t after)
+{
+    if (entry->days == 0)
+    {
+        return ((time_t)entry->start > after) ? (time_t)entry->start : 0;
+    }
+
+    struct tm base;
+    localtime_r(&after, &base);
+    for (int offset = 0; offset <= 7; offset++)
+    {
+        int weekday;
+        time_t candidate = time_on_day(entry, &base, offset, &weekday);
+        if ((entry->days & (1 << weekday)) && candidate > after)
+        {
+            return candidate;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Last time an entry ran at or before a given time
+ * @return The Unix time, 0 if it has not run yet
+ */
+static time_t previous_occurrence(const schedule_entry_t *entry, time_t at)
+{
+    if (entry->days == 0)
+    {
+        return ((time_t)entry->start <= at) ? (time_t)entry->start : 0;
+    }
+
+    struct tm base;
+    localtime_r(&at, &base);
+    for (int offset = 0; offset <= 7; offset++)
+    {
+        int weekday;
+        time_t candidate = time_on_day(entry, &base, -offset, &weekday);
+        if ((entry->days & (1 << weekday)) && candidate <= at)
+        {
+            return candidate;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Earliest action of the schedule after a given time (schedule_mutex must be held)
+ * @return The Unix time, 0 if none
+ */
+static time_t next_event(time_t after)
+{
+    time_t next = 0;
+    for (size_t i = 0; i < entry_count; i++)
+    {
+        time_t candidate = next_occurrence(&entries[i], after);
+        if (candidate != 0 && (next == 0 || candidate < next))
+        {
+            next = candidate;
+        }
+    }
+    return next;
+}
+
+/**
+ * @brief Queue the action of an entry that was due at a given time
+ * A late ON with a duration only runs for what is left of its window
+ * @return true if the action was queued
+ */
+static bool queue_action(const schedule_entry_t *entry, time_t due, time_t now, size_t *count)
+{
+    time_t late = now - due;
+    uint32_t duration_s = 0;
+
+    if (entry->state == 1 && entry->duration_s > 0)
+    {
+        if (late >= (time_t)entry->duration_s)
+        {
+            return false;
+        }
+        duration_s = entry->duration_s - (uint32_t)late;
+    }
+    else if (late > SCHEDULE_GRACE_S)
+    {
+        return false;
+    }
+
+    relay_command_t *command = &due_commands[(*count)++];
+    memset(command, 0, sizeof(*command));
+    relay_action_t *action = &command->relays[entry->relay - 1];
+    action->present = true;
+    action->state = entry->state;
+    action->duration_ms = (duration_s > INT32_MAX / 1000) ? INT32_MAX : (int)(duration_s * 1000);
+    ESP_LOGI(TAG, "Relay %u %s (scheduled)", entry->relay, entry->state ? "ON" : "OFF");
+    return true;
+}
+
+/**
+ * @brief Queue the actions that fell due in (cursor, now] (schedule_mutex must be held)
+ * Right after boot or a schedule change, ON windows already in progress are
+ * entered instead, for the rest of their duration; only the newest past
+ * action of each relay counts, so a later OFF ends an earlier ON window
+ */
+static size_t collect_due(time_t cursor, time_t now, bool restore)
+{
+    size_t count = 0;
+    if (restore)
+    {
+        const schedule_entry_t *newest[RELAY_COUNT] = {0};
+        time_t newest_due[RELAY_COUNT] = {0};
+        for (size_t i = 0; i < entry_count; i++)
+        {
+            // Of two actions due at the same time the later entry wins, as when they run
+            time_t due = previous_occurrence(&entries[i], now);
+            size_t relay = entries[i].relay - 1;
+            if (due != 0 && due >= newest_due[relay])
+            {
+                newest[relay] = &entries[i];
+                newest_due[relay] = due;
+            }
+        }
+        for (size_t relay = 0; relay < RELAY_COUNT; relay++)
+        {
+            if (newest[relay] != NULL && newest[relay]->state == 1 && newest[relay]->duration_s > 0)
+            {
+                queue_action(newest[relay], newest_due[relay], now, &count);
+            }
+        }
+        return count;
+    }
+
+    for (size_t i = 0; i < entry_count; i++)
+    {
+        time_t due = next_occurrence(&entries[i], cursor);
+        if (due != 0 && due <= now)
+        {
+            queue_action(&entries[i], due, now, &count);
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Task running the schedule
+ * Sleeps until the next action is due (or the schedule changes), so the
+ * entries are only evaluated once per action
+ */
+static void schedule_task(void *pvParameters)
+{
+    time_t cursor = 0; // Actions up to this time have been handled
+
+    while (1)
+    {
+        uint32_t wait_ms = SCHEDULE_CLOCK_WAIT_MS;
+
+        if (TimeSyncIsValid())
+        {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            time_t now = tv.tv_sec;
+
+            xSemaphoreTake(schedule_mutex, portMAX_DELAY);
+            // A clock that went backwards (or a first valid reading) starts over
+            bool restore = reload || cursor == 0 || now < cursor;
+            reload = false;
+            size_t due = collect_due(cursor, now, restore);
+            cursor = now;
+            time_t next = next_event(now);
+            xSemaphoreGive(schedule_mutex);
+
+            for (size_t i = 0; i < due; i++)
+            {
+                ServerExecuteCommands(&due_commands[i], 1, RELAY_SOURCE_SCHEDULE);
+            }
+
+            wait_ms = SCHEDULE_MAX_SLEEP_MS;
+            if (next != 0)
+            {
+                int64_t until_ms = (int64_t)(next - now) * 1000 - tv.tv_usec / 1000;
+                if (until_ms < wait_ms)
+                {
+                    wait_ms = (until_ms > 0) ? (uint32_t)until_ms : 0;
+                }
+            }
+        }
+
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_ms));
+    }
+}
+
+/**
+ * @brief Write the schedule to NVS (schedule_mutex must be held)
+ */
+static void save_schedule(void)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(SCHEDULE_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return;
+    }
+
+    // An empty schedule has no entries key
+    if (entry_count > 0)
+    {
+        err = nvs_set_blob(nvs_handle, "entries", entries, entry_count * sizeof(schedule_entry_t));
+    }
+    else
+    {
+        err = nvs_erase_key(nvs_handle, "entries");
+        if (err == ESP_ERR_NVS_NOT_FOUND)
+        {
+            err = ESP_OK;
+        }
+    }
+    if (err == ESP_OK)
+    {
+        err = nvs_set_str(nvs_handle, "tz", time_zone);
+    }
+    if (err == ESP_OK)
+    {
+        err = nvs_set_u32(nvs_handle, "version", version);
+    }
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error saving schedule: %s", esp_err_to_name(err));
+    }
+}
+
+/**
+ * @brief Read the schedule from NVS
+ */
+static void load_schedule(void)
+{
+    nvs_handle_t nvs_handle;
+    if (nvs_open(SCHEDULE_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK)
+    {
+        return;
+    }
+
+    size_t blob_len = sizeof(entries);
+    size_t tz_len = sizeof(time_zone);
+    if (nvs_get_u32(nvs_handle, "version", &version) != ESP_OK ||
+        nvs_get_str(nvs_handle, "tz", time_zone, &tz_len) != ESP_OK)
+    {
+        version = 0;
+        time_zone[0] = '\0';
+    }
+    if (version == 0 || nvs_get_blob(nvs_handle, "entries", entries, &blob_len) != ESP_OK)
+    {
+        blob_len = 0;
+    }
+    entry_count = blob_len / sizeof(schedule_entry_t);
+    nvs_close(nvs_handle);
+}
+
+/**
+ * @brief Parse one "<relay>,<state>,<days>,<start>,<duration_s>" entry
+ * @return 0 on success, -1 if it is invalid
+ */
+static int parse_entry(const char *token, schedule_entry_t *entry)
+{
+    unsigned int relay, state, days;
+    unsigned long start, duration_s;
+    int consumed = 0;
+
+    if (sscanf(token, "%u,%u,%u,%lu,%lu%n", &relay, &state, &days, &start, &duration_s, &consumed) != 5 ||
+        token[consumed] != '\0')
+    {
+        return -1;
+    }
+    if (relay < 1 || relay > RELAY_COUNT || state > 1 || days > 0x7F ||
+        (days != 0 && start >= 86400))
+    {
+        return -1;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    entry->relay = (uint8_t)relay;
+    entry->state = (uint8_t)state;
+    entry->days = (uint8_t)days;
+    entry->start = (uint32_t)start;
+    entry->duration_s = (uint32_t)duration_s;
+    return 0;
+}
+
+void ScheduleInit(void)
+{
+    if (schedule_mutex != NULL)
+    {
+        return;
+    }
+    schedule_mutex = xSemaphoreCreateMutex();
+
+    load_schedule();
+    TimeSyncSetTimezone(time_zone);
+    ESP_LOGI(TAG, "Schedule version %lu with %u entries", (unsigned long)version, (unsigned)entry_count);
+
+    xTaskCreate(schedule_task, "schedule", SCHEDULE_TASK_STACK_SIZE, NULL, 5, &schedule_task_handle);
+}
+
+int ScheduleApply(const char *spec)
+{
+    if (spec == NULL || schedule_mutex == NULL)
+    {
+        return -1;
+    }
+
+    // Only used by the polling task
+    static char buffer[SCHEDULE_SPEC_LENGTH];
+    static schedule_entry_t parsed[SCHEDULE_MAX_ENTRIES];
+    if (strlen(spec) >= sizeof(buffer))
+    {
+        return -1;
+    }
+    strcpy(buffer, spec);
+
+    char *saveptr = NULL;
+    char *token = strtok_r(buffer, " ", &saveptr);
+    if (token == NULL)
+    {
+        return -1;
+    }
+    char *end = NULL;
+    unsigned long new_version = strtoul(token, &end, 10);
+    if (*end != '\0')
+    {
+        return -1;
+    }
+    if (new_version == ScheduleGetVersion())
+    {
+        return 0;
+    }
+
+    char new_time_zone[SCHEDULE_MAX_TZ_LENGTH] = {0};
+    size_t count = 0;
+    while ((token = strtok_r(NULL, " ", &saveptr)) != NULL)
+    {
+        if (strncmp(token, "tz=", 3) == 0)
+        {
+            if (strlen(token + 3) >= sizeof(new_time_zone))
+            {
+                return -1;
+            }
+            strcpy(new_time_zone, token + 3);
+        }
+        else if (count == SCHEDULE_MAX_ENTRIES || parse_entry(token, &parsed[count++]) != 0)
+        {
+            ESP_LOGW(TAG, "Invalid schedule entry: %s", token);
+            return -1;
+        }
+    }
+
+    xSemaphoreTake(schedule_mutex, portMAX_DELAY);
+    memcpy(entries, parsed, count * sizeof(schedule_entry_t));
+    entry_count = count;
+    version = (uint32_t)new_version;
+    strcpy(time_zone, new_time_zone);
+    reload = true;
+    TimeSyncSetTimezone(time_zone);
+    save_schedule();
+    xSemaphoreGive(schedule_mutex);
+
+    ESP_LOGI(TAG, "Schedule version %lu with %u entries received", new_version, (unsigned)count);
+    xTaskNotifyGive(schedule_task_handle);
+    return 0;
+}
+
+uint32_t ScheduleGetVersion(void)
+{
+    if (schedule_mutex == NULL)
+    {
+        return 0;
+    }
+
+    xSemaphoreTake(schedule_mutex, portMAX_DELAY);
+    uint32_t result = version;
+    xSemaphoreGive(schedule_mutex);
+    return result;
+}
+
+int ScheduleGetInfo(time_t *next)
+{
+    *next = 0;
+    if (schedule_mutex == NULL)
+    {
+        return 0;
+    }
+
+    xSemaphoreTake(schedule_mutex, portMAX_DELAY);
+    int count = (int)entry_count;
+    if (TimeSyncIsValid())
+    {
+        *next = next_event(time(NULL));
+    }
+    xSemaphoreGive(schedule_mutex);
+    return count;
+}
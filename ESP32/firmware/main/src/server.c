@@ -1,227 +1,398 @@
 #include "server.h"
-#include "relay.h"
-#include "http.h"
+#include "dispatcher.h"
+#include "scene.h"
+#include "dedup.h"
+#include "outbox.h"
 #include "esp_log.h"
-#include "cJSON.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
 
 static const char *TAG = "server";
 
+static server_ack_sender_t ack_sender = NULL;
+
+// Sequence numbers of commands a manual hold kept from running, oldest first,
+// until the server has been told (see ServerGetHeld)
+static portMUX_TYPE held_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t held_seqs[SERVER_MAX_HELD];
+static size_t held_count = 0;
+
+// Serializes command execution; commands arrive from the polling task and
+// from the web server's LAN endpoint
+static SemaphoreHandle_t execute_mutex = NULL;
+
 /**
- * @brief Structure for relay timer task parameters
+ * @brief Switch the relays of one command in a single transition
+ * The scene (if any) is applied first and the command's relay members
+ * override it; every relay that changes switches in the same GPIO write.
+ * @return The relays of the command the dispatcher refused (manual hold), 0 if none
  */
-typedef struct
+static uint32_t apply_command(const relay_command_t *command, relay_source_t source)
 {
-    int relay_num;
-    int duration_ms;
-} relay_timer_params_t;
+    relay_request_t request = {
+        .source = source,
+        .report_id = command->command_id,
+    };
+
+    if (command->scene != 0)
+    {
+        scene_t scene;
+        if (SceneGet(command->scene, &scene) == 0)
+        {
+            ESP_LOGI(TAG, "Recalling scene %d (%s)", command->scene, scene.name);
+            request.mask = scene.mask;
+            request.states = scene.states;
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Scene %d is not defined", command->scene);
+        }
+    }
+
+    for (int i = 0; i < CMD_MAX_RELAYS; i++)
+    {
+        const relay_action_t *action = &command->relays[i];
+        uint32_t bit = 1u << i;
+
+        // A waveform replaces the state (the relay runs it from OFF)
+        if (WaveformIsSet(&action->waveform))
+        {
+            request.mask |= bit;
+            request.states &= ~bit;
+            request.waveform[i] = &action->waveform;
+            request.duration_ms[i] = (uint32_t)action->duration_ms;
+            continue;
+        }
+        if (!action->present)
+        {
+            continue;
+        }
+        if (action->state != 0 && action->state != 1)
+        {
+            ESP_LOGW(TAG, "Invalid relay%d state value: %d (expected 0 or 1)", i + 1, action->state);
+            continue;
+        }
+        request.mask |= bit;
+        request.states = action->state ? (request.states | bit) : (request.states & ~bit);
+        request.duration_ms[i] = (uint32_t)action->duration_ms;
+    }
+
+    if (request.mask == 0)
+    {
+        return 0;
+    }
+    return request.mask & ~DispatcherSubmit(&request);
+}
 
 /**
- * @brief Task to handle timed relay operations
- * Turns off relay after specified duration
+ * @brief Remember a sequenced command that a manual hold kept from running
  */
-static void relay_timer_task(void *pvParameters)
+static void add_held(uint32_t seq)
 {
-    relay_timer_params_t *params = (relay_timer_params_t *)pvParameters;
-
-    if (params == NULL)
+    portENTER_CRITICAL(&held_lock);
+    if (held_count == SERVER_MAX_HELD)
     {
-        vTaskDelete(NULL);
-        return;
+        // The oldest has most likely been reported with an earlier ACK already
+        memmove(held_seqs, held_seqs + 1, (SERVER_MAX_HELD - 1) * sizeof(held_seqs[0]));
+        held_count--;
     }
+    held_seqs[held_count++] = seq;
+    portEXIT_CRITICAL(&held_lock);
+}
 
-    int relay_num = params->relay_num;
-    int duration_ms = params->duration_ms;
+/**
+ * @brief Source of the commands of a batch and the ACK owed for its sequenced commands
+ * One cumulative ACK for the last of them covers the whole batch
+ */
+typedef struct
+{
+    relay_source_t source;
+    bool pending;  // A sequenced command was executed
+    bool ack_now;  // One of them asked for an immediate ACK
+    uint32_t seq;  // Sequence number of the last one
+    char command_id[CMD_MAX_ID_LENGTH];
+} batch_ack_t;
 
-    // Wait for the specified duration
-    vTaskDelay(pdMS_TO_TICKS(duration_ms));
+/**
+ * @brief Deliver a report over the active transport, or queue it in the outbox
+ */
+static void deliver_report(const char *report)
+{
+    if (ack_sender == NULL || ack_sender(report) != 0)
+    {
+        // POSTed in the background and kept in NVS until the server has it
+        OutboxEnqueue(report, true);
+    }
+}
 
-    // Turn off the relay
-    RelayOff(relay_num);
-    ESP_LOGI(TAG, "Relay %d auto-turned OFF after %d ms", relay_num, duration_ms);
+/**
+ * @brief Send an ACK over the active transport, or queue it in the outbox
+ * A sequenced ACK carries the commands held since the last one in "held"
+ * @param command_id JSON-escaped command_id to echo
+ * @param has_seq true to include the sequence number
+ * @param seq Sequence number (cumulative: acknowledges everything up to it)
+ * @param held true if an unsequenced command was not run because of a manual hold
+ */
+static void send_ack(const char *command_id, bool has_seq, uint32_t seq, bool held)
+{
+    // command_id is still JSON-escaped, so it can be copied verbatim
+    char ack_str[CMD_MAX_ID_LENGTH + SERVER_HELD_LIST_LENGTH + 80];
+    uint32_t held_up_to = 0;
+    if (has_seq)
+    {
+        char held_list[SERVER_HELD_LIST_LENGTH];
+        held_up_to = ServerGetHeld(held_list, sizeof(held_list));
+        int len = snprintf(ack_str, sizeof(ack_str), "{\"command_id\":\"%s\",\"seq\":%lu,\"status\":\"received\"",
+                           command_id, (unsigned long)seq);
+        snprintf(ack_str + len, sizeof(ack_str) - len, (held_up_to != 0) ? ",\"held\":[%s]}" : "}", held_list);
+    }
+    else
+    {
+        snprintf(ack_str, sizeof(ack_str), "{\"command_id\":\"%s\",\"status\":\"%s\"}", command_id,
+                 held ? "held" : "received");
+    }
 
-    // Free the parameters structure
-    free(params);
-    vTaskDelete(NULL);
+    ESP_LOGI(TAG, "Sending ACK for command_id: %s", command_id);
+    deliver_report(ack_str);
+    ServerClearHeld(held_up_to);
 }
 
 /**
- * @brief Process a single relay command from JSON
+ * @brief Report the end of a command's waveform (dispatcher waveform handler)
+ * Sent like an ACK, with the relay and "completed" or "failed" as status
  */
-static void process_relay_command(cJSON *relay_obj, int relay_num)
+static void report_waveform_end(int relayNumber, waveform_result_t result, const char *report_id)
 {
-    if (relay_obj == NULL || !cJSON_IsObject(relay_obj))
+    // Commands without a command_id (e.g. from the UART) are not reported
+    if (report_id[0] == '\0')
     {
         return;
     }
 
-    cJSON *state = cJSON_GetObjectItem(relay_obj, "state");
-    cJSON *duration = cJSON_GetObjectItem(relay_obj, "duration");
+    char report[CMD_MAX_ID_LENGTH + 64];
+    snprintf(report, sizeof(report), "{\"command_id\":\"%s\",\"relay\":%d,\"status\":\"%s\"}", report_id,
+             relayNumber, (result == WAVEFORM_COMPLETED) ? "completed" : "failed");
+
+    ESP_LOGI(TAG, "Reporting waveform end of command_id: %s", report_id);
+    deliver_report(report);
+}
 
-    if (state == NULL || !cJSON_IsNumber(state))
+/**
+ * @brief Switch the relays of one command and record what it needs acknowledged
+ */
+static void execute_command(const relay_command_t *command, batch_ack_t *batch)
+{
+    if (command->command_id[0] != '\0')
     {
-        return;
+        ESP_LOGI(TAG, "Command ID: %s", command->command_id);
     }
 
-    int relay_state = state->valueint;
-    int duration_ms = 0;
-
-    if (duration != NULL && cJSON_IsNumber(duration))
+    // A command delivered again (e.g. its ACK was lost) is acknowledged but not run twice
+    bool duplicate = DedupSeen(command->command_id);
+    uint32_t held = 0;
+    if (duplicate)
+    {
+        ESP_LOGW(TAG, "Command %s already executed, acknowledging only", command->command_id);
+    }
+    else
     {
-        duration_ms = duration->valueint;
+        held = apply_command(command, batch->source);
     }
 
-    if (relay_state == 1)
+    if (command->has_seq && held != 0)
     {
-        ESP_LOGI(TAG, "Turning ON relay %d", relay_num);
-        RelayOn(relay_num);
-        ESP_LOGI(TAG, "Relay %d turned ON", relay_num);
+        // Still covered by the cumulative ACK; the held list tells the server it did not run
+        ESP_LOGW(TAG, "Command %lu not run on relays 0x%lx (manual hold), reporting it as held",
+                 (unsigned long)command->seq, (unsigned long)held);
+        add_held(command->seq);
+    }
 
-        // If duration is specified and > 0, set up auto-off timer
-        if (duration_ms > 0)
-        {
-            // Allocate parameters structure
-            relay_timer_params_t *params = malloc(sizeof(relay_timer_params_t));
-            if (params != NULL)
-            {
-                params->relay_num = relay_num;
-                params->duration_ms = duration_ms;
-                char task_name[16];
-                snprintf(task_name, sizeof(task_name), "relay%d_timer", relay_num);
-                xTaskCreate(relay_timer_task, task_name, 2048, params, 5, NULL);
-                ESP_LOGI(TAG, "Relay %d will auto-turn OFF after %d ms", relay_num, duration_ms);
-            }
-        }
+    if (command->has_seq)
+    {
+        // Kept with the command ids below and checkpointed when the batch
+        // ends, so a batch delivered again after a reboot is still skipped
+        DedupSetSeq(command->seq);
+        batch->pending = true;
+        batch->ack_now |= command->ack_now;
+        batch->seq = DedupGetSeq();
+        strcpy(batch->command_id, command->command_id);
     }
-    else if (relay_state == 0)
+    else if (command->command_id[0] != '\0')
     {
-        ESP_LOGI(TAG, "Turning OFF relay %d", relay_num);
-        RelayOff(relay_num);
-        ESP_LOGI(TAG, "Relay %d turned OFF", relay_num);
+        // Unsequenced commands from older servers are acknowledged one by one
+        send_ack(command->command_id, false, 0, held != 0);
     }
-    else
+
+    if (!duplicate)
     {
-        ESP_LOGW(TAG, "Invalid relay state value: %d (expected 0 or 1)", relay_state);
+        DedupRecord(command->command_id);
     }
 }
 
-void ServerProcessResponse(const char *response, size_t response_len, int status_code)
+/**
+ * @brief Acknowledge the sequenced commands of a batch
+ * They are acknowledged cumulatively on the next poll; a separate ACK is
+ * only sent when the server asks for it or a push transport with its own
+ * uplink is active
+ */
+static void finish_batch(const batch_ack_t *batch)
 {
-    // Only process if status is 200
-    if (status_code != 200 || response == NULL || response_len == 0)
+    if (!batch->pending)
     {
         return;
     }
 
-    // Ensure response is null-terminated (create a copy if needed)
-    char *response_copy = malloc(response_len + 1);
-    if (response_copy == NULL)
+    // The watermark reaches NVS before the server hears about it
+    DedupFlush();
+
+    if ((batch->ack_now || ack_sender != NULL) && batch->command_id[0] != '\0')
     {
-        ESP_LOGE(TAG, "Failed to allocate memory for response");
-        return;
+        send_ack(batch->command_id, true, batch->seq, false);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Command %lu executed, ACK deferred to next poll", (unsigned long)batch->seq);
     }
+}
 
-    memcpy(response_copy, response, response_len);
-    response_copy[response_len] = '\0';
+/**
+ * @brief Parser callback used by ServerProcessResponse
+ */
+static void execute_parsed_command(const relay_command_t *command, void *ctx)
+{
+    execute_command(command, (batch_ack_t *)ctx);
+}
 
-    // Trim whitespace from response
-    char *trimmed = response_copy;
-    while (*trimmed == ' ' || *trimmed == '\t' || *trimmed == '\r' || *trimmed == '\n')
+void ServerInit(void)
+{
+    if (execute_mutex == NULL)
     {
-        trimmed++;
+        execute_mutex = xSemaphoreCreateMutex();
     }
-    int len = strlen(trimmed);
-    while (len > 0 && (trimmed[len - 1] == ' ' || trimmed[len - 1] == '\t' ||
-                       trimmed[len - 1] == '\r' || trimmed[len - 1] == '\n'))
+    DispatcherSetWaveformHandler(report_waveform_end);
+}
+
+void ServerSetAckSender(server_ack_sender_t sender)
+{
+    ack_sender = sender;
+    OutboxSetSender(sender);
+}
+
+uint32_t ServerGetExecutedSeq(void)
+{
+    return DedupGetSeq();
+}
+
+uint32_t ServerGetHeld(char *out, size_t size)
+{
+    uint32_t seqs[SERVER_MAX_HELD];
+    size_t n;
+
+    portENTER_CRITICAL(&held_lock);
+    n = held_count;
+    memcpy(seqs, held_seqs, n * sizeof(seqs[0]));
+    portEXIT_CRITICAL(&held_lock);
+
+    size_t len = 0;
+    out[0] = '\0';
+    for (size_t i = 0; i < n && len < size; i++)
     {
-        trimmed[--len] = '\0';
+        len += snprintf(out + len, size - len, (i == 0) ? "%lu" : ",%lu", (unsigned long)seqs[i]);
     }
+    return (n > 0) ? seqs[n - 1] : 0;
+}
 
-    if (len == 0)
+void ServerClearHeld(uint32_t up_to_seq)
+{
+    if (up_to_seq == 0)
     {
-        free(response_copy);
         return;
     }
 
-    // Try to parse as JSON
-    cJSON *json = cJSON_Parse(trimmed);
-    if (json != NULL)
+    portENTER_CRITICAL(&held_lock);
+    size_t keep = 0;
+    for (size_t i = 0; i < held_count; i++)
     {
-        ESP_LOGI(TAG, "JSON parsed successfully");
-
-        // Check if this is an empty JSON object (no commands)
-        // An empty object {} will have no children
-        if (json->child == NULL)
+        // Commands held after the list was taken stay for the next report
+        if (held_seqs[i] > up_to_seq)
         {
-            ESP_LOGD(TAG, "Empty JSON object received (no commands)");
-            cJSON_Delete(json);
-            free(response_copy);
-            return;
+            held_seqs[keep++] = held_seqs[i];
         }
+    }
+    held_count = keep;
+    portEXIT_CRITICAL(&held_lock);
+}
 
-        // Extract command_id first
-        cJSON *command_id = cJSON_GetObjectItem(json, "command_id");
-        if (command_id != NULL && cJSON_IsString(command_id))
-        {
-            ESP_LOGI(TAG, "Command ID: %s", command_id->valuestring);
-        }
+void ServerExecuteCommands(const relay_command_t *commands, size_t count, relay_source_t source)
+{
+    if (commands == NULL)
+    {
+        return;
+    }
 
-        // Process relay1
-        cJSON *relay1 = cJSON_GetObjectItem(json, "relay1");
-        if (relay1 != NULL)
-        {
-            ESP_LOGI(TAG, "Processing relay1 command");
-            process_relay_command(relay1, 1);
-        }
+    xSemaphoreTake(execute_mutex, portMAX_DELAY);
+    batch_ack_t batch = {.source = source};
+    for (size_t i = 0; i < count; i++)
+    {
+        execute_command(&commands[i], &batch);
+    }
+    finish_batch(&batch);
+    xSemaphoreGive(execute_mutex);
+}
 
-        // Process relay2
-        cJSON *relay2 = cJSON_GetObjectItem(json, "relay2");
-        if (relay2 != NULL)
+uint32_t ServerExecuteNewCommands(const relay_command_t *commands, size_t count)
+{
+    xSemaphoreTake(execute_mutex, portMAX_DELAY);
+    batch_ack_t batch = {.source = RELAY_SOURCE_REMOTE};
+    for (size_t i = 0; commands != NULL && i < count; i++)
+    {
+        if (commands[i].has_seq && commands[i].seq <= DedupGetSeq())
         {
-            ESP_LOGI(TAG, "Processing relay2 command");
-            process_relay_command(relay2, 2);
+            ESP_LOGI(TAG, "Command %lu already executed, skipped", (unsigned long)commands[i].seq);
+            continue;
         }
+        execute_command(&commands[i], &batch);
+    }
+    // The caller acknowledges the batch itself, so only the watermark is updated
+    DedupFlush();
+    uint32_t seq = DedupGetSeq();
+    xSemaphoreGive(execute_mutex);
+    return seq;
+}
 
-        // Send ACK via POST if command_id is present
-        if (command_id != NULL && cJSON_IsString(command_id))
-        {
-            // Create ACK JSON with command_id
-            cJSON *ack_json = cJSON_CreateObject();
-            cJSON_AddStringToObject(ack_json, "command_id", command_id->valuestring);
-            cJSON_AddStringToObject(ack_json, "status", "received");
-
-            char *ack_str = cJSON_PrintUnformatted(ack_json);
-            if (ack_str)
-            {
-                ESP_LOGI(TAG, "Sending ACK for command_id: %s", command_id->valuestring);
-                HttpPostJson(ack_str);
-                free(ack_str);
-            }
-            cJSON_Delete(ack_json);
-        }
+int ServerProcessResponse(const char *response, size_t response_len, int status_code)
+{
+    // Only process if status is 200
+    if (status_code != 200 || response == NULL || response_len == 0)
+    {
+        return 0;
+    }
+
+    // Parse in place; commands are executed in order as soon as they are complete
+    // and acknowledged together at the end
+    batch_ack_t batch = {.source = RELAY_SOURCE_REMOTE};
+    cmd_parser_t parser;
+    CmdParserInit(&parser, execute_parsed_command, &batch);
 
-        cJSON_Delete(json);
+    xSemaphoreTake(execute_mutex, portMAX_DELAY);
+    CmdParserFeed(&parser, response, response_len);
+    int commands = CmdParserFinish(&parser);
+    finish_batch(&batch);
+    xSemaphoreGive(execute_mutex);
+
+    if (commands < 0)
+    {
+        ESP_LOGW(TAG, "Failed to parse command response");
+        return (parser.commands > 0) ? 1 : 0;
     }
-    else
+    if (commands == 0)
     {
-        const char *error_ptr = cJSON_GetErrorPtr();
-        ESP_LOGW(TAG, "Failed to parse JSON response: %s", error_ptr ? error_ptr : "unknown error");
-
-        // Fallback: try simple string parsing for backward compatibility
-        if (strcmp(trimmed, "0") == 0)
-        {
-            RelayOff(1);
-            ESP_LOGI(TAG, "Response is '0', turning OFF relay 1");
-        }
-        else if (strcmp(trimmed, "1") == 0)
-        {
-            RelayOn(1);
-            ESP_LOGI(TAG, "Response is '1', turning ON relay 1");
-        }
+        ESP_LOGD(TAG, "No command in response");
     }
-
-    free(response_copy);
+    return (commands > 0) ? 1 : 0;
 }
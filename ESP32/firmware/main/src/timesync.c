@@ -0,0 +1,106 @@
+#include "timesync.h"
+#include "esp_log.h"
+#include "esp_netif_sntp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <time.h>
+
+static const char *TAG = "timesync";
+
+#define TIMESYNC_SERVER "pool.ntp.org"
+#define TIMESYNC_VALID_AFTER 1700000000 // Nov 2023: an earlier clock has not been set since boot
+#define TIMESYNC_DATE_TOLERANCE_S 2     // Date header corrections smaller than this are ignored
+
+// Set once SNTP has synchronized the clock; the Date header is ignored from then on
+static volatile bool sntp_synced = false;
+
+/**
+ * @brief Days since 1970-01-01 of a civil date (proleptic Gregorian)
+ */
+static long days_from_civil(int year, int month, int day)
+{
+    year -= (month <= 2);
+    long era = (year >= 0 ? year : year - 399) / 400;
+    long yoe = year - era * 400;
+    long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/**
+ * @brief Called by the SNTP client whenever it has set the clock
+ */
+static void time_synced(struct timeval *tv)
+{
+    sntp_synced = true;
+    ESP_LOGI(TAG, "Clock synchronized (%lld)", (long long)tv->tv_sec);
+}
+
+void TimeSyncInit(void)
+{
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(TIMESYNC_SERVER);
+    config.sync_cb = time_synced;
+
+    esp_err_t err = esp_netif_sntp_init(&config);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start SNTP: %s", esp_err_to_name(err));
+        return;
+    }
+    ESP_LOGI(TAG, "SNTP started (%s)", TIMESYNC_SERVER);
+}
+
+bool TimeSyncIsValid(void)
+{
+    return time(NULL) >= TIMESYNC_VALID_AFTER;
+}
+
+int TimeSyncFromHttpDate(const char *date)
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    if (sntp_synced || date == NULL)
+    {
+        return -1;
+    }
+
+    // IMF-fixdate (RFC 9110), the only format servers send today
+    int day, year, hour, minute, second;
+    char month_name[4];
+    if (sscanf(date, "%*3s, %d %3s %d %d:%d:%d GMT", &day, month_name, &year, &hour, &minute, &second) != 6)
+    {
+        return -1;
+    }
+    const char *found = strstr(months, month_name);
+    if (found == NULL || strlen(month_name) != 3 || (found - months) % 3 != 0)
+    {
+        return -1;
+    }
+    int month = (int)(found - months) / 3 + 1;
+
+    time_t server_time = (time_t)(days_from_civil(year, month, day) * 86400L + hour * 3600L + minute * 60L + second);
+    if (server_time < TIMESYNC_VALID_AFTER)
+    {
+        return -1;
+    }
+
+    long long offset = (long long)server_time - (long long)time(NULL);
+    if (offset <= TIMESYNC_DATE_TOLERANCE_S && offset >= -TIMESYNC_DATE_TOLERANCE_S)
+    {
+        return -1;
+    }
+
+    struct timeval tv = {.tv_sec = server_time, .tv_usec = 0};
+    settimeofday(&tv, NULL);
+    ESP_LOGI(TAG, "Clock set from HTTP Date header (%+lld s)", offset);
+    return 0;
+}
+
+void TimeSyncSetTimezone(const char *tz)
+{
+    setenv("TZ", (tz != NULL && tz[0] != '\0') ? tz : "UTC0", 1);
+    tzset();
+}
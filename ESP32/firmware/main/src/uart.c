@@ -1,9 +1,54 @@
 #include "uart.h"
 #include "driver/uart.h"
+#include "freertos/semphr.h"
 #include <string.h>
 
 #define UART_NUM UART_NUM_0
 #define BUF_SIZE 1024
+#define UART_TX_BUF_SIZE 4096 // Driver TX ring buffer; writes only copy into it
+#define UART_TX_HEADROOM 64   // Reserve for the driver's ring buffer item headers
+
+static SemaphoreHandle_t tx_mutex = NULL;
+static uart_tx_stats_t tx_stats = {0};
+
+/**
+ * @brief Queue data for transmission without waiting for the wire
+ * The write is all or nothing: if the TX buffer cannot take every part, nothing
+ * is queued and the bytes are counted as dropped
+ * @return Number of bytes queued, or -1 if they were dropped
+ */
+static int write_parts(const char *first, size_t first_len, const char *second, size_t second_len)
+{
+    size_t length = first_len + second_len;
+
+    if (tx_mutex == NULL)
+    {
+        // Not initialized yet: nothing to pace, the driver is not installed
+        return -1;
+    }
+
+    xSemaphoreTake(tx_mutex, portMAX_DELAY);
+
+    size_t free_size = 0;
+    if (uart_get_tx_buffer_free_size(UART_NUM, &free_size) != ESP_OK ||
+        length + UART_TX_HEADROOM > free_size)
+    {
+        tx_stats.dropped_bytes += length;
+        tx_stats.dropped_writes++;
+        xSemaphoreGive(tx_mutex);
+        return -1;
+    }
+
+    uart_write_bytes(UART_NUM, first, first_len);
+    if (second_len > 0)
+    {
+        uart_write_bytes(UART_NUM, second, second_len);
+    }
+    tx_stats.written_bytes += length;
+
+    xSemaphoreGive(tx_mutex);
+    return (int)length;
+}
 
 void UartInit(void)
 {
@@ -17,7 +62,9 @@ void UartInit(void)
 
     uart_param_config(UART_NUM, &uart_config);
     uart_set_pin(UART_NUM, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-    uart_driver_install(UART_NUM, BUF_SIZE * 2, 0, 0, NULL, 0);
+    uart_driver_install(UART_NUM, BUF_SIZE * 2, UART_TX_BUF_SIZE, 0, NULL, 0);
+
+    tx_mutex = xSemaphoreCreateMutex();
 }
 
 int UartWrite(const char *data, size_t length)
@@ -26,8 +73,30 @@ int UartWrite(const char *data, size_t length)
     {
         return -1;
     }
-    
-    return uart_write_bytes(UART_NUM, data, length);
+
+    return write_parts(data, length, NULL, 0);
+}
+
+int UartWriteLine(const char *line)
+{
+    if (line == NULL)
+    {
+        return -1;
+    }
+
+    return write_parts(line, strlen(line), "\r\n", 2);
+}
+
+void UartGetTxStats(uart_tx_stats_t *stats)
+{
+    if (stats == NULL || tx_mutex == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(tx_mutex, portMAX_DELAY);
+    *stats = tx_stats;
+    xSemaphoreGive(tx_mutex);
 }
 
 int UartReadBytes(uint8_t *data, size_t length, TickType_t timeout_ms)
@@ -50,4 +119,3 @@ int UartReadByte(TickType_t timeout_ms)
     }
     return -1;
 }
-
@@ -0,0 +1,546 @@
+#include "waveform.h"
+#include "relay.h"
+#include "cmdparser.h"
+#include "driver/rmt_tx.h"
+#include "driver/ledc.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "soc/soc_caps.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "waveform";
+
+#define WAVEFORM_SYMBOL_MAX_TICKS 32767 // 15-bit duration of one half of an RMT symbol
+#define WAVEFORM_EVENT_QUEUE_SIZE (RELAY_COUNT * 2)
+#define WAVEFORM_TASK_STACK_SIZE 3072
+#define WAVEFORM_PWM_CLOCK_HZ 80000000 // APB clock the LEDC resolution is sized for
+#define WAVEFORM_PWM_MIN_BITS 7        // 1 % duty steps
+
+/**
+ * @brief End of a waveform, signalled by the RMT interrupt or the PWM duration timer
+ */
+typedef struct
+{
+    int relay;
+    uint32_t generation;
+} waveform_event_t;
+
+/**
+ * @brief Waveform running on one relay
+ */
+typedef struct
+{
+    bool running;
+    uint32_t generation;           // Read by the RMT interrupt to tag its event
+    int pwm;                       // LEDC timer and channel, -1 for a pulse train
+    rmt_channel_handle_t channel;  // Pulse train
+    rmt_encoder_handle_t encoder;
+    rmt_symbol_word_t *symbols;    // Sent from RAM until the train is over
+    esp_timer_handle_t stop_timer; // Ends a PWM after its duration
+} waveform_slot_t;
+
+/**
+ * @brief Packs (level, duration) segments into RMT symbols, two halves per symbol
+ * With symbols == NULL it only counts them
+ */
+typedef struct
+{
+    rmt_symbol_word_t *symbols;
+    size_t count;
+    bool half; // The second half of symbols[count] is still free
+} symbol_writer_t;
+
+static waveform_slot_t slots[RELAY_COUNT];
+static bool pwm_used[WAVEFORM_MAX_PWM];
+static uint32_t last_generation = 0;
+
+static QueueHandle_t event_queue = NULL;
+static waveform_end_t end_handler = NULL;
+
+static void write_level(symbol_writer_t *writer, int level, uint32_t ticks)
+{
+    // Counting stops past the limit, so an oversized train is rejected quickly
+    while (ticks > 0 && writer->count <= WAVEFORM_MAX_SYMBOLS)
+    {
+        uint32_t part = (ticks > WAVEFORM_SYMBOL_MAX_TICKS) ? WAVEFORM_SYMBOL_MAX_TICKS : ticks;
+        if (writer->symbols != NULL)
+        {
+            rmt_symbol_word_t *symbol = &writer->symbols[writer->count];
+            if (!writer->half)
+            {
+                symbol->duration0 = part;
+                symbol->level0 = level;
+            }
+            else
+            {
+                symbol->duration1 = part;
+                symbol->level1 = level;
+            }
+        }
+        if (writer->half)
+        {
+            writer->count++;
+        }
+        writer->half = !writer->half;
+        ticks -= part;
+    }
+}
+
+/**
+ * @brief Close the last symbol
+ * A half-filled symbol cannot be left with a zero duration (that ends the
+ * transmission early), so its first half is split in two instead of padded
+ */
+static void finish_symbols(symbol_writer_t *writer)
+{
+    if (!writer->half)
+    {
+        return;
+    }
+
+    if (writer->symbols != NULL)
+    {
+        rmt_symbol_word_t *symbol = &writer->symbols[writer->count];
+        uint32_t duration = symbol->duration0;
+        if (duration >= 2)
+        {
+            symbol->duration0 = duration / 2;
+            symbol->duration1 = duration - duration / 2;
+            symbol->level1 = symbol->level0;
+        }
+        else
+        {
+            // A 1 us pulse: followed by 1 us at the OFF level the pin idles at anyway
+            symbol->duration1 = 1;
+            symbol->level1 = 0;
+        }
+    }
+    writer->count++;
+    writer->half = false;
+}
+
+/**
+ * @brief Compile a pulse train into RMT symbols (1 tick = 1 us)
+ * @param waveform The train
+ * @param pulses Number of pulses to compile
+ * @param trailing_gap true to end with a gap (one period of a looped train)
+ * @param symbols Output, or NULL to only count the symbols
+ * @return Number of symbols (more than WAVEFORM_MAX_SYMBOLS: the train is too long)
+ */
+static size_t compile_train(const waveform_t *waveform, uint32_t pulses, bool trailing_gap, rmt_symbol_word_t *symbols)
+{
+    symbol_writer_t writer = {.symbols = symbols};
+
+    for (uint32_t i = 0; i < pulses && writer.count <= WAVEFORM_MAX_SYMBOLS; i++)
+    {
+        write_level(&writer, 1, waveform->pulse_us);
+        if (i + 1 < pulses || trailing_gap)
+        {
+            write_level(&writer, 0, waveform->gap_us);
+        }
+    }
+    finish_symbols(&writer);
+    return writer.count;
+}
+
+static bool is_valid(const waveform_t *waveform)
+{
+    if (waveform->pwm_hz > 0)
+    {
+        return waveform->pulse_us == 0 && waveform->pwm_hz <= WAVEFORM_MAX_PWM_HZ && waveform->duty >= 1 &&
+               waveform->duty <= 99;
+    }
+    return waveform->pulse_us > 0 && (waveform->count <= 1 || waveform->gap_us > 0);
+}
+
+/**
+ * @brief RMT "transmission done" callback (runs in the RMT interrupt)
+ */
+static bool IRAM_ATTR train_sent(rmt_channel_handle_t channel, const rmt_tx_done_event_data_t *edata, void *ctx)
+{
+    int index = (int)(intptr_t)ctx;
+    waveform_event_t event = {
+        .relay = index + 1,
+        .generation = slots[index].generation,
+    };
+    BaseType_t woken = pdFALSE;
+
+    xQueueSendFromISR(event_queue, &event, &woken);
+    return woken == pdTRUE;
+}
+
+/**
+ * @brief PWM duration timer callback (runs in the esp_timer task)
+ */
+static void pwm_expired(void *arg)
+{
+    int index = (int)(intptr_t)arg;
+    waveform_event_t event = {
+        .relay = index + 1,
+        .generation = slots[index].generation,
+    };
+
+    xQueueSend(event_queue, &event, 0);
+}
+
+/**
+ * @brief Hands the end of waveforms to the dispatcher outside of any interrupt
+ */
+static void waveform_task(void *arg)
+{
+    waveform_event_t event;
+
+    while (1)
+    {
+        if (xQueueReceive(event_queue, &event, portMAX_DELAY) == pdTRUE && end_handler != NULL)
+        {
+            end_handler(event.relay, event.generation);
+        }
+    }
+}
+
+/**
+ * @brief Delete the RMT objects of a pulse train
+ * @param enabled true if the channel was enabled (a train still being sent is aborted)
+ */
+static void free_train(waveform_slot_t *slot, bool enabled)
+{
+    if (enabled)
+    {
+        rmt_disable(slot->channel);
+    }
+    if (slot->channel != NULL)
+    {
+        rmt_del_channel(slot->channel);
+        slot->channel = NULL;
+    }
+    if (slot->encoder != NULL)
+    {
+        rmt_del_encoder(slot->encoder);
+        slot->encoder = NULL;
+    }
+    free(slot->symbols);
+    slot->symbols = NULL;
+}
+
+/**
+ * @brief Stop the output of a slot, free its channel and give the pin back to the relay
+ */
+static void release(int index)
+{
+    waveform_slot_t *slot = &slots[index];
+
+    if (slot->pwm >= 0)
+    {
+        esp_timer_stop(slot->stop_timer);
+        ledc_stop(LEDC_LOW_SPEED_MODE, (ledc_channel_t)slot->pwm, 0);
+        ledc_timer_pause(LEDC_LOW_SPEED_MODE, (ledc_timer_t)slot->pwm);
+        pwm_used[slot->pwm] = false;
+    }
+    else
+    {
+        free_train(slot, true);
+    }
+
+    slot->running = false;
+    RelayRestoreOutput(index + 1);
+}
+
+static int start_train(int index, const relay_descriptor_t *relay, const waveform_t *waveform)
+{
+    waveform_slot_t *slot = &slots[index];
+    uint32_t pulses = (waveform->count > 0) ? waveform->count : 1;
+    rmt_transmit_config_t transmit = {
+        .loop_count = 0,
+        .flags.eot_level = 0,
+    };
+
+    size_t symbol_count = compile_train(waveform, pulses, false, NULL);
+    bool looped = false;
+#if SOC_RMT_SUPPORT_TX_LOOP_COUNT
+    // The hardware repeats one period by itself if it fits in the channel memory
+    size_t period_count = compile_train(waveform, 1, true, NULL);
+    if (pulses > 1 && period_count < SOC_RMT_MEM_WORDS_PER_CHANNEL)
+    {
+        symbol_count = period_count;
+        transmit.loop_count = pulses;
+        looped = true;
+    }
+#endif
+    if (symbol_count > WAVEFORM_MAX_SYMBOLS)
+    {
+        ESP_LOGE(TAG, "Relay %d: pulse train needs more than %d RMT symbols", index + 1, WAVEFORM_MAX_SYMBOLS);
+        return -1;
+    }
+
+    slot->pwm = -1;
+    slot->symbols = malloc(symbol_count * sizeof(rmt_symbol_word_t));
+    if (slot->symbols == NULL)
+    {
+        return -1;
+    }
+    compile_train(waveform, looped ? 1 : pulses, looped, slot->symbols);
+
+    rmt_tx_channel_config_t channel_config = {
+        .gpio_num = relay->gpio,
+        .clk_src = RMT_CLK_SRC_DEFAULT,
+        .resolution_hz = WAVEFORM_RESOLUTION_HZ,
+        .mem_block_symbols = SOC_RMT_MEM_WORDS_PER_CHANNEL,
+        .trans_queue_depth = 1,
+        .flags.invert_out = !relay->active_level,
+    };
+    rmt_copy_encoder_config_t encoder_config = {0};
+    rmt_tx_event_callbacks_t callbacks = {
+        .on_trans_done = train_sent,
+    };
+
+    if (rmt_new_tx_channel(&channel_config, &slot->channel) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Relay %d: no RMT channel free", index + 1);
+        slot->channel = NULL;
+        free_train(slot, false);
+        return -1;
+    }
+    if (rmt_new_copy_encoder(&encoder_config, &slot->encoder) != ESP_OK ||
+        rmt_tx_register_event_callbacks(slot->channel, &callbacks, (void *)(intptr_t)index) != ESP_OK ||
+        rmt_enable(slot->channel) != ESP_OK)
+    {
+        free_train(slot, false);
+        return -1;
+    }
+    if (rmt_transmit(slot->channel, slot->encoder, slot->symbols, symbol_count * sizeof(rmt_symbol_word_t),
+                     &transmit) != ESP_OK)
+    {
+        free_train(slot, true);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Finest duty resolution the APB clock can divide down to a frequency
+ * LEDC_AUTO_CLK picks a slower clock where the divider would still overflow
+ */
+static uint32_t pwm_resolution(uint32_t freq_hz)
+{
+    uint32_t bits = WAVEFORM_PWM_MIN_BITS;
+    while (bits < SOC_LEDC_TIMER_BIT_WIDTH && (WAVEFORM_PWM_CLOCK_HZ >> (bits + 1)) >= freq_hz)
+    {
+        bits++;
+    }
+    return bits;
+}
+
+static int start_pwm(int index, const relay_descriptor_t *relay, const waveform_t *waveform, uint32_t duration_ms)
+{
+    waveform_slot_t *slot = &slots[index];
+    int pwm = -1;
+
+    for (int i = 0; i < WAVEFORM_MAX_PWM; i++)
+    {
+        if (!pwm_used[i])
+        {
+            pwm = i;
+            break;
+        }
+    }
+    if (pwm < 0)
+    {
+        ESP_LOGE(TAG, "Relay %d: all %d PWM outputs are in use", index + 1, WAVEFORM_MAX_PWM);
+        return -1;
+    }
+
+    uint32_t bits = pwm_resolution(waveform->pwm_hz);
+    ledc_timer_config_t timer_config = {
+        .speed_mode = LEDC_LOW_SPEED_MODE,
+        .duty_resolution = (ledc_timer_bit_t)bits,
+        .timer_num = (ledc_timer_t)pwm,
+        .freq_hz = waveform->pwm_hz,
+        .clk_cfg = LEDC_AUTO_CLK,
+    };
+    ledc_channel_config_t channel_config = {
+        .gpio_num = relay->gpio,
+        .speed_mode = LEDC_LOW_SPEED_MODE,
+        .channel = (ledc_channel_t)pwm,
+        .intr_type = LEDC_INTR_DISABLE,
+        .timer_sel = (ledc_timer_t)pwm,
+        .duty = ((1u << bits) * waveform->duty + 50) / 100,
+        .hpoint = 0,
+        .flags.output_invert = !relay->active_level,
+    };
+
+    if (ledc_timer_config(&timer_config) != ESP_OK || ledc_channel_config(&channel_config) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Relay %d: %u Hz PWM is not possible", index + 1, waveform->pwm_hz);
+        return -1;
+    }
+
+    pwm_used[pwm] = true;
+    slot->pwm = pwm;
+    if (duration_ms > 0)
+    {
+        esp_timer_start_once(slot->stop_timer, (uint64_t)duration_ms * 1000);
+    }
+    return 0;
+}
+
+void WaveformInit(waveform_end_t on_end)
+{
+    if (event_queue != NULL)
+    {
+        return;
+    }
+    end_handler = on_end;
+
+    event_queue = xQueueCreate(WAVEFORM_EVENT_QUEUE_SIZE, sizeof(waveform_event_t));
+    if (event_queue == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create waveform queue");
+        return;
+    }
+
+    for (int i = 0; i < RELAY_COUNT; i++)
+    {
+        const esp_timer_create_args_t args = {
+            .callback = pwm_expired,
+            .arg = (void *)(intptr_t)i,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "pwm_stop",
+        };
+        if (esp_timer_create(&args, &slots[i].stop_timer) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to create PWM timer for relay %d", i + 1);
+        }
+    }
+
+    xTaskCreate(waveform_task, "waveform", WAVEFORM_TASK_STACK_SIZE, NULL, 5, NULL);
+}
+
+bool WaveformIsSet(const waveform_t *waveform)
+{
+    return waveform->pulse_us != 0 || waveform->pwm_hz != 0;
+}
+
+int WaveformParse(const char *text, waveform_t *waveform, uint32_t *duration_ms)
+{
+    char kind[8];
+    char first[16];
+    char second[16];
+    char third[16];
+
+    if (text == NULL || waveform == NULL || duration_ms == NULL)
+    {
+        return -1;
+    }
+    memset(waveform, 0, sizeof(*waveform));
+    *duration_ms = 0;
+
+    int fields = sscanf(text, "%7s %15s %15s %15s", kind, first, second, third);
+    if (fields >= 2 && strcmp(kind, "pulse") == 0 && (fields == 2 || fields == 4))
+    {
+        waveform->pulse_us = CmdParserMsToUs(first);
+        if (fields == 4)
+        {
+            unsigned long count = strtoul(third, NULL, 10);
+            if (count == 0 || count > UINT16_MAX)
+            {
+                return -1;
+            }
+            waveform->gap_us = CmdParserMsToUs(second);
+            waveform->count = (uint16_t)count;
+        }
+    }
+    else if (fields >= 3 && strcmp(kind, "pwm") == 0)
+    {
+        unsigned long hz = strtoul(first, NULL, 10);
+        unsigned long duty = strtoul(second, NULL, 10);
+        waveform->pwm_hz = (hz <= UINT16_MAX) ? (uint16_t)hz : 0;
+        waveform->duty = (duty <= 100) ? (uint8_t)duty : 0;
+        if (fields == 4)
+        {
+            *duration_ms = (uint32_t)strtoul(third, NULL, 10);
+        }
+    }
+    else
+    {
+        return -1;
+    }
+
+    return is_valid(waveform) ? 0 : -1;
+}
+
+int WaveformStart(int relayNumber, const waveform_t *waveform, uint32_t duration_ms)
+{
+    const relay_descriptor_t *relay = RelayGetDescriptor(relayNumber);
+    if (relay == NULL || waveform == NULL || event_queue == NULL)
+    {
+        return -1;
+    }
+    if (!is_valid(waveform))
+    {
+        ESP_LOGE(TAG, "Relay %d: invalid waveform", relayNumber);
+        return -1;
+    }
+
+    int index = relayNumber - 1;
+    waveform_slot_t *slot = &slots[index];
+    if (slot->running)
+    {
+        release(index);
+    }
+
+    // Set before the hardware starts: a short train can end before this returns
+    slot->generation = ++last_generation;
+
+    int result = (waveform->pwm_hz > 0) ? start_pwm(index, relay, waveform, duration_ms)
+                                        : start_train(index, relay, waveform);
+    if (result != 0)
+    {
+        RelayRestoreOutput(relayNumber);
+        return -1;
+    }
+
+    slot->running = true;
+    if (waveform->pwm_hz > 0)
+    {
+        ESP_LOGI(TAG, "Relay %d: %u Hz PWM at %u%%", relayNumber, waveform->pwm_hz, waveform->duty);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Relay %d: %u x %lu us pulse, %lu us gap", relayNumber,
+                 (waveform->count > 0) ? waveform->count : 1, (unsigned long)waveform->pulse_us,
+                 (unsigned long)waveform->gap_us);
+    }
+    return 0;
+}
+
+bool WaveformIsRunning(int relayNumber)
+{
+    return relayNumber >= 1 && relayNumber <= RELAY_COUNT && slots[relayNumber - 1].running;
+}
+
+void WaveformStop(int relayNumber)
+{
+    if (WaveformIsRunning(relayNumber))
+    {
+        release(relayNumber - 1);
+        ESP_LOGI(TAG, "Relay %d: waveform stopped", relayNumber);
+    }
+}
+
+bool WaveformClaimEnded(int relayNumber, uint32_t generation)
+{
+    if (!WaveformIsRunning(relayNumber) || slots[relayNumber - 1].generation != generation)
+    {
+        return false;
+    }
+
+    release(relayNumber - 1);
+    return true;
+}
@@ -1,39 +1,39 @@
 #include "webserver.h"
 #include "http.h"
+#include "endpoint.h"
 #include "relay.h"
+#include "dispatcher.h"
 #include "wifi.h"
+#include "server.h"
+#include "lanauth.h"
+#include "cmdparser.h"
 #include "esp_log.h"
 #include "esp_http_server.h"
-#include "driver/gpio.h"
 #include <string.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 
 static const char *TAG = "webserver";
 static httpd_handle_t server_handle = NULL;
 
-// Track relay states
-static bool relay1_state = false;
-static bool relay2_state = false;
+#define LAN_COMMAND_MAX_BODY 1024
 
 /**
- * @brief Get current relay state
+ * @brief Commands collected from a LAN request
  */
-static int get_relay_state(int relay_num)
+typedef struct
 {
-    if (relay_num == 1)
-    {
-        return relay1_state ? 1 : 0;
-    }
-    else
-    {
-        return relay2_state ? 1 : 0;
-    }
-}
+    relay_command_t commands[CMD_MAX_BATCH];
+    size_t count;
+    bool overflow;
+    bool unsequenced; // A command without seq (replays could not be detected)
+} lan_batch_t;
 
 /**
- * @brief Generate HTML page
+ * @brief HTML page, sent in chunks: the head, one section per relay, then the tail
  */
-static const char *html_page =
+static const char *html_head =
     "<!DOCTYPE html>"
     "<html>"
     "<head>"
@@ -65,23 +65,22 @@ static const char *html_page =
     "</div>"
     "<div class=\"section\">"
     "<h2>Set Server URL</h2>"
+    "<p>Several servers may be listed, separated by spaces, in order of preference.</p>"
     "<form method=\"POST\" action=\"/seturl\">"
     "<input type=\"text\" name=\"url\" placeholder=\"https://example.com/api/relay\" value=\"%s\">"
     "<button type=\"submit\" class=\"btn-save\">Save URL</button>"
     "</form>"
-    "</div>"
-    "<div class=\"section\">"
-    "<h2>Relay 1</h2>"
-    "<div class=\"status %s\">Status: %s</div>"
-    "<button onclick=\"location.href='/relay1/on'\" class=\"btn-on\">ON</button>"
-    "<button onclick=\"location.href='/relay1/off'\" class=\"btn-off\">OFF</button>"
-    "</div>"
+    "</div>";
+
+static const char *html_relay =
     "<div class=\"section\">"
-    "<h2>Relay 2</h2>"
+    "<h2>%s</h2>"
     "<div class=\"status %s\">Status: %s</div>"
-    "<button onclick=\"location.href='/relay2/on'\" class=\"btn-on\">ON</button>"
-    "<button onclick=\"location.href='/relay2/off'\" class=\"btn-off\">OFF</button>"
-    "</div>"
+    "<button onclick=\"location.href='/relay%d/on'\" class=\"btn-on\">ON</button>"
+    "<button onclick=\"location.href='/relay%d/off'\" class=\"btn-off\">OFF</button>"
+    "</div>";
+
+static const char *html_tail =
     "<div class=\"footer\">"
     "<p>Web Relay Controller | <a href=\"https://github.com/hadideveloper/web-relay\" target=\"_blank\">GitHub</a></p>"
     "</div>"
@@ -94,9 +93,8 @@ static const char *html_page =
  */
 static esp_err_t root_get_handler(httpd_req_t *req)
 {
-    char url[128] = {0};
-    HttpLoadUrl(url, sizeof(url));
-    if (strlen(url) == 0)
+    char url[ENDPOINT_LIST_LENGTH] = {0};
+    if (EndpointGetList(url, sizeof(url)) != 0)
     {
         strcpy(url, "Not set");
     }
@@ -104,37 +102,68 @@ static esp_err_t root_get_handler(httpd_req_t *req)
     char ip_str[16] = "Not connected";
     WifiGetIpAddress(ip_str, sizeof(ip_str));
 
-    int relay1_state_val = get_relay_state(1);
-    int relay2_state_val = get_relay_state(2);
-
-    const char *relay1_status = relay1_state_val ? "ON" : "OFF";
-    const char *relay2_status = relay2_state_val ? "ON" : "OFF";
-    const char *relay1_class = relay1_state_val ? "status-on" : "status-off";
-    const char *relay2_class = relay2_state_val ? "status-on" : "status-off";
-
     char html[4096];
-    int len = snprintf(html, sizeof(html), html_page,
-                       ip_str,
-                       url,
-                       relay1_class, relay1_status,
-                       relay2_class, relay2_status);
-
+    int len = snprintf(html, sizeof(html), html_head, ip_str, url);
     if (len >= sizeof(html))
     {
         ESP_LOGW(TAG, "HTML buffer may be truncated (len=%d, size=%d)", len, sizeof(html));
     }
 
     httpd_resp_set_type(req, "text/html");
-    httpd_resp_send(req, html, HTTPD_RESP_USE_STRLEN);
+    httpd_resp_send_chunk(req, html, HTTPD_RESP_USE_STRLEN);
+
+    // One snapshot, so the page never shows a transition half applied
+    relay_snapshot_t snapshot;
+    DispatcherGetSnapshot(&snapshot);
+    for (int relay = 1; relay <= RELAY_COUNT; relay++)
+    {
+        int state = (snapshot.states >> (relay - 1)) & 1;
+        bool waveform = (snapshot.waveforms >> (relay - 1)) & 1;
+        snprintf(html, sizeof(html), html_relay, RelayGetDescriptor(relay)->name,
+                 (state || waveform) ? "status-on" : "status-off", waveform ? "WAVEFORM" : (state ? "ON" : "OFF"),
+                 relay, relay);
+        httpd_resp_send_chunk(req, html, HTTPD_RESP_USE_STRLEN);
+    }
+
+    httpd_resp_send_chunk(req, html_tail, HTTPD_RESP_USE_STRLEN);
+    httpd_resp_send_chunk(req, NULL, 0);
     return ESP_OK;
 }
 
+/**
+ * @brief Decode one application/x-www-form-urlencoded value
+ * Stops at the end of the value ('&'); '+' becomes a space and %XX the byte it encodes
+ */
+static void form_decode(const char *in, char *out, size_t max_len)
+{
+    size_t j = 0;
+    for (size_t i = 0; in[i] != '\0' && in[i] != '&' && j < max_len - 1; i++)
+    {
+        if (in[i] == '+')
+        {
+            out[j++] = ' ';
+        }
+        else if (in[i] == '%' && isxdigit((unsigned char)in[i + 1]) && isxdigit((unsigned char)in[i + 2]))
+        {
+            char hex[3] = {in[i + 1], in[i + 2], '\0'};
+            out[j++] = (char)strtol(hex, NULL, 16);
+            i += 2;
+        }
+        else
+        {
+            out[j++] = in[i];
+        }
+    }
+    out[j] = '\0';
+}
+
 /**
  * @brief Handler for /seturl POST request
  */
 static esp_err_t seturl_post_handler(httpd_req_t *req)
 {
-    char content[256];
+    // Room for a full endpoint list with every character percent-encoded
+    char content[ENDPOINT_LIST_LENGTH * 3];
     size_t recv_size = sizeof(content) - 1;
 
     int ret = httpd_req_recv(req, content, recv_size);
@@ -148,40 +177,16 @@ static esp_err_t seturl_post_handler(httpd_req_t *req)
     }
     content[ret] = '\0';
 
-    // Parse URL from form data (url=...)
+    // Parse URL list from form data (url=...)
     char *url_start = strstr(content, "url=");
     if (url_start)
     {
-        url_start += 4; // Skip "url="
-        // URL decode (simple version - replace + with space, %20 with space)
-        char url[128] = {0};
-        int i = 0, j = 0;
-        while (url_start[i] && j < sizeof(url) - 1)
-        {
-            if (url_start[i] == '+')
-            {
-                url[j++] = ' ';
-            }
-            else if (url_start[i] == '%' && url_start[i + 1] == '2' && url_start[i + 2] == '0')
-            {
-                url[j++] = ' ';
-                i += 2;
-            }
-            else if (url_start[i] == '&')
-            {
-                break; // End of url parameter
-            }
-            else
-            {
-                url[j++] = url_start[i];
-            }
-            i++;
-        }
-        url[j] = '\0';
+        char url[ENDPOINT_LIST_LENGTH] = {0};
+        form_decode(url_start + 4, url, sizeof(url));
 
         if (strlen(url) > 0)
         {
-            if (HttpSaveUrl(url) == 0)
+            if (EndpointSetList(url) == 0)
             {
                 ESP_LOGI(TAG, "URL saved via web: %s", url);
                 httpd_resp_set_status(req, "303 See Other");
@@ -198,36 +203,30 @@ static esp_err_t seturl_post_handler(httpd_req_t *req)
 }
 
 /**
- * @brief Handler for relay control
+ * @brief Handler for relay control (/relay<N>/on and /relay<N>/off)
  */
 static esp_err_t relay_handler(httpd_req_t *req)
 {
-    const char *uri = req->uri;
+    int relay = 0;
+    int consumed = 0;
+    char action[4] = {0};
 
-    if (strstr(uri, "/relay1/on"))
-    {
-        RelayOn(1);
-        relay1_state = true;
-        ESP_LOGI(TAG, "Relay 1 turned ON via web");
-    }
-    else if (strstr(uri, "/relay1/off"))
+    if (sscanf(req->uri, "/relay%d/%3[a-z]%n", &relay, action, &consumed) != 2 || req->uri[consumed] != '\0' ||
+        RelayGetDescriptor(relay) == NULL || (strcmp(action, "on") != 0 && strcmp(action, "off") != 0))
     {
-        RelayOff(1);
-        relay1_state = false;
-        ESP_LOGI(TAG, "Relay 1 turned OFF via web");
+        httpd_resp_send_404(req);
+        return ESP_OK;
     }
-    else if (strstr(uri, "/relay2/on"))
-    {
-        RelayOn(2);
-        relay2_state = true;
-        ESP_LOGI(TAG, "Relay 2 turned ON via web");
-    }
-    else if (strstr(uri, "/relay2/off"))
+
+    int on = (strcmp(action, "on") == 0);
+    if (DispatcherSwitch(relay, on, RELAY_SOURCE_WEB) != 0)
     {
-        RelayOff(2);
-        relay2_state = false;
-        ESP_LOGI(TAG, "Relay 2 turned OFF via web");
+        ESP_LOGW(TAG, "Relay %d not turned %s via web: rejected by the dispatcher", relay, on ? "ON" : "OFF");
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_send(req, "Relay not switched", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
     }
+    ESP_LOGI(TAG, "Relay %d turned %s via web", relay, on ? "ON" : "OFF");
 
     // Redirect back to home
     httpd_resp_set_status(req, "303 See Other");
@@ -236,15 +235,128 @@ static esp_err_t relay_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
-void WebserverInit(void)
+/**
+ * @brief Parser callback collecting the commands of a LAN request
+ */
+static void collect_lan_command(const relay_command_t *command, void *ctx)
+{
+    lan_batch_t *batch = (lan_batch_t *)ctx;
+    if (!command->has_seq)
+    {
+        batch->unsequenced = true;
+    }
+    if (batch->count < CMD_MAX_BATCH)
+    {
+        batch->commands[batch->count++] = *command;
+    }
+    else
+    {
+        batch->overflow = true;
+    }
+}
+
+/**
+ * @brief Send an error status with a short plain-text reason
+ */
+static esp_err_t send_error(httpd_req_t *req, const char *status, const char *reason)
 {
-    // Initialize relay states from GPIO
-    relay1_state = (gpio_get_level(GPIO_NUM_16) == 1);
-    relay2_state = (gpio_get_level(GPIO_NUM_17) == 1);
+    httpd_resp_set_status(req, status);
+    httpd_resp_send(req, reason, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+/**
+ * @brief Handler for /api/command POST request
+ * Lets the server deliver commands directly on the LAN instead of waiting
+ * for the next poll. The body is the same JSON as a poll response; the
+ * request is signed with the pre-shared key (X-Relay-Timestamp and
+ * X-Relay-Signature) and answered with the ACK.
+ */
+static esp_err_t command_post_handler(httpd_req_t *req)
+{
+    if (!LanAuthIsEnabled())
+    {
+        return send_error(req, "403 Forbidden", "LAN commands disabled");
+    }
+    if (req->content_len == 0 || req->content_len > LAN_COMMAND_MAX_BODY)
+    {
+        return send_error(req, "413 Payload Too Large", "Invalid body size");
+    }
+
+    char timestamp[24] = {0};
+    char signature[LAN_AUTH_SIGNATURE_LENGTH + 2] = {0};
+    if (httpd_req_get_hdr_value_str(req, "X-Relay-Timestamp", timestamp, sizeof(timestamp)) != ESP_OK ||
+        httpd_req_get_hdr_value_str(req, "X-Relay-Signature", signature, sizeof(signature)) != ESP_OK)
+    {
+        return send_error(req, "401 Unauthorized", "Missing signature");
+    }
+
+    static char body[LAN_COMMAND_MAX_BODY + 1]; // Only used by the web server task
+    size_t received = 0;
+    while (received < req->content_len)
+    {
+        int ret = httpd_req_recv(req, body + received, req->content_len - received);
+        if (ret <= 0)
+        {
+            if (ret == HTTPD_SOCK_ERR_TIMEOUT)
+            {
+                httpd_resp_send_408(req);
+            }
+            return ESP_FAIL;
+        }
+        received += ret;
+    }
+    body[received] = '\0';
+
+    switch (LanAuthVerify(timestamp, body, received, signature))
+    {
+    case LAN_AUTH_OK:
+        break;
+    case LAN_AUTH_NO_CLOCK:
+        return send_error(req, "503 Service Unavailable", "Clock not synchronized");
+    case LAN_AUTH_DISABLED:
+        return send_error(req, "403 Forbidden", "LAN commands disabled");
+    default:
+        ESP_LOGW(TAG, "Rejected unauthenticated LAN command");
+        return send_error(req, "401 Unauthorized", "Invalid signature");
+    }
+
+    static lan_batch_t batch; // Too large for the handler's stack
+    memset(&batch, 0, sizeof(batch));
+    cmd_parser_t parser;
+    CmdParserInit(&parser, collect_lan_command, &batch);
+    CmdParserFeed(&parser, body, received);
+    if (CmdParserFinish(&parser) <= 0 || batch.overflow || batch.unsequenced)
+    {
+        return send_error(req, "400 Bad Request", "Invalid command");
+    }
+
+    // A batch delivered again (e.g. after a lost response) is only acknowledged
+    uint32_t executed_seq = ServerExecuteNewCommands(batch.commands, batch.count);
+    const relay_command_t *last = &batch.commands[batch.count - 1];
+    ESP_LOGI(TAG, "LAN command %lu done", (unsigned long)last->seq);
+
+    // Commands a manual hold kept from running are listed so the server does not take them as applied
+    char held_list[SERVER_HELD_LIST_LENGTH];
+    uint32_t held_up_to = ServerGetHeld(held_list, sizeof(held_list));
+    char ack_str[CMD_MAX_ID_LENGTH + SERVER_HELD_LIST_LENGTH + 80];
+    int len = snprintf(ack_str, sizeof(ack_str), "{\"command_id\":\"%s\",\"seq\":%lu,\"status\":\"received\"",
+                       last->command_id, (unsigned long)executed_seq);
+    snprintf(ack_str + len, sizeof(ack_str) - len, (held_up_to != 0) ? ",\"held\":[%s]}" : "}", held_list);
+    httpd_resp_set_type(req, "application/json");
+    if (httpd_resp_send(req, ack_str, HTTPD_RESP_USE_STRLEN) == ESP_OK)
+    {
+        ServerClearHeld(held_up_to);
+    }
+    return ESP_OK;
+}
 
+void WebserverInit(void)
+{
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.lru_purge_enable = true;
     config.stack_size = 8192; // Increase stack size to prevent overflow
+    config.uri_match_fn = httpd_uri_match_wildcard; // One handler for /relay<N>/on|off
 
     ESP_LOGI(TAG, "Starting web server on port: '%d'", config.server_port);
 
@@ -265,33 +377,19 @@ void WebserverInit(void)
         };
         httpd_register_uri_handler(server_handle, &seturl);
 
-        httpd_uri_t relay1_on = {
-            .uri = "/relay1/on",
-            .method = HTTP_GET,
-            .handler = relay_handler,
-        };
-        httpd_register_uri_handler(server_handle, &relay1_on);
-
-        httpd_uri_t relay1_off = {
-            .uri = "/relay1/off",
-            .method = HTTP_GET,
-            .handler = relay_handler,
-        };
-        httpd_register_uri_handler(server_handle, &relay1_off);
-
-        httpd_uri_t relay2_on = {
-            .uri = "/relay2/on",
-            .method = HTTP_GET,
-            .handler = relay_handler,
+        httpd_uri_t command = {
+            .uri = "/api/command",
+            .method = HTTP_POST,
+            .handler = command_post_handler,
         };
-        httpd_register_uri_handler(server_handle, &relay2_on);
+        httpd_register_uri_handler(server_handle, &command);
 
-        httpd_uri_t relay2_off = {
-            .uri = "/relay2/off",
+        httpd_uri_t relay = {
+            .uri = "/relay*",
             .method = HTTP_GET,
             .handler = relay_handler,
         };
-        httpd_register_uri_handler(server_handle, &relay2_off);
+        httpd_register_uri_handler(server_handle, &relay);
 
         ESP_LOGI(TAG, "Web server started successfully");
     }
@@ -0,0 +1,221 @@
+#include "websocket.h"
+#include "server.h"
+#include "esp_log.h"
+#include "esp_websocket_client.h"
+#include "esp_crt_bundle.h"
+#include "esp_bit_defs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include <string.h>
+
+static const char *TAG = "websocket";
+
+#define WS_CONNECT_TIMEOUT_MS 10000
+#define WS_SEND_TIMEOUT_MS 5000
+#define WS_NETWORK_TIMEOUT_MS 10000
+#define WS_PING_INTERVAL_S 20
+#define WS_MESSAGE_QUEUE_SIZE 4
+#define MAX_MESSAGE_LENGTH 512
+
+#define WS_CONNECTED_BIT BIT0
+#define WS_DISCONNECTED_BIT BIT1
+
+/**
+ * @brief A complete text message received from the server
+ */
+typedef struct
+{
+    size_t length;
+    char data[MAX_MESSAGE_LENGTH];
+} ws_message_t;
+
+// Client of the connected session; WebsocketSendText runs in other tasks (web
+// server, outbox, waveform end reports), so it is set and cleared under client_mutex
+static esp_websocket_client_handle_t client = NULL;
+static SemaphoreHandle_t client_mutex = NULL;
+static QueueHandle_t message_queue = NULL;
+static EventGroupHandle_t ws_events = NULL;
+
+// Reassembly of fragmented messages (only touched from the websocket task)
+static ws_message_t partial = {0};
+static bool partial_overflow = false;
+
+/**
+ * @brief WebSocket event handler
+ * Runs in the websocket client task; complete messages are handed to the session loop
+ */
+static void websocket_event_handler(void *arg, esp_event_base_t event_base,
+                                    int32_t event_id, void *event_data)
+{
+    esp_websocket_event_data_t *data = (esp_websocket_event_data_t *)event_data;
+
+    switch (event_id)
+    {
+    case WEBSOCKET_EVENT_CONNECTED:
+        ESP_LOGI(TAG, "WebSocket connected");
+        xEventGroupSetBits(ws_events, WS_CONNECTED_BIT);
+        break;
+
+    case WEBSOCKET_EVENT_DISCONNECTED:
+    case WEBSOCKET_EVENT_CLOSED:
+        ESP_LOGW(TAG, "WebSocket disconnected");
+        xEventGroupSetBits(ws_events, WS_DISCONNECTED_BIT);
+        break;
+
+    case WEBSOCKET_EVENT_ERROR:
+        ESP_LOGE(TAG, "WebSocket error");
+        xEventGroupSetBits(ws_events, WS_DISCONNECTED_BIT);
+        break;
+
+    case WEBSOCKET_EVENT_DATA:
+        // Only text frames (and their continuations) carry commands
+        if (data->op_code != 0x1 && data->op_code != 0x0)
+        {
+            break;
+        }
+
+        if (data->payload_offset == 0)
+        {
+            partial.length = 0;
+            partial_overflow = false;
+        }
+
+        if (partial.length + data->data_len >= MAX_MESSAGE_LENGTH)
+        {
+            partial_overflow = true;
+        }
+        else if (data->data_len > 0)
+        {
+            memcpy(partial.data + partial.length, data->data_ptr, data->data_len);
+            partial.length += data->data_len;
+            partial.data[partial.length] = '\0';
+        }
+
+        if (data->payload_offset + data->data_len >= data->payload_len && data->fin)
+        {
+            if (partial_overflow)
+            {
+                ESP_LOGW(TAG, "Dropping oversized message (%d bytes)", data->payload_len);
+            }
+            else if (xQueueSend(message_queue, &partial, 0) != pdTRUE)
+            {
+                ESP_LOGW(TAG, "Message queue full, dropping message");
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+int WebsocketRun(const char *url, websocket_stop_cb_t should_stop)
+{
+    if (url == NULL)
+    {
+        return -1;
+    }
+
+    if (message_queue == NULL)
+    {
+        message_queue = xQueueCreate(WS_MESSAGE_QUEUE_SIZE, sizeof(ws_message_t));
+        ws_events = xEventGroupCreate();
+        client_mutex = xSemaphoreCreateMutex();
+        if (message_queue == NULL || ws_events == NULL || client_mutex == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to create WebSocket queue");
+            return -1;
+        }
+    }
+
+    xEventGroupClearBits(ws_events, WS_CONNECTED_BIT | WS_DISCONNECTED_BIT);
+
+    esp_websocket_client_config_t config = {
+        .uri = url,
+        .disable_auto_reconnect = true, // Reconnects are driven by the polling task
+        .network_timeout_ms = WS_NETWORK_TIMEOUT_MS,
+        .ping_interval_sec = WS_PING_INTERVAL_S,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+    };
+
+    ESP_LOGI(TAG, "Connecting to %s", url);
+    esp_websocket_client_handle_t session = esp_websocket_client_init(&config);
+    if (session == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to initialize WebSocket client");
+        return -1;
+    }
+
+    esp_websocket_register_events(session, WEBSOCKET_EVENT_ANY, websocket_event_handler, NULL);
+    if (esp_websocket_client_start(session) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start WebSocket client");
+        esp_websocket_client_destroy(session);
+        return -1;
+    }
+
+    // Wait for the upgrade to complete
+    EventBits_t bits = xEventGroupWaitBits(ws_events, WS_CONNECTED_BIT | WS_DISCONNECTED_BIT,
+                                           pdFALSE, pdFALSE, pdMS_TO_TICKS(WS_CONNECT_TIMEOUT_MS));
+    if ((bits & WS_CONNECTED_BIT) == 0)
+    {
+        ESP_LOGW(TAG, "WebSocket upgrade failed");
+        esp_websocket_client_destroy(session);
+        return -1;
+    }
+
+    // ACKs go back on the socket while the session is up
+    xSemaphoreTake(client_mutex, portMAX_DELAY);
+    client = session;
+    xSemaphoreGive(client_mutex);
+    ServerSetAckSender(WebsocketSendText);
+
+    ws_message_t message;
+    while (!should_stop() && (xEventGroupGetBits(ws_events) & WS_DISCONNECTED_BIT) == 0)
+    {
+        if (xQueueReceive(message_queue, &message, pdMS_TO_TICKS(1000)) == pdTRUE)
+        {
+            ESP_LOGI(TAG, "Command pushed (%d bytes): %s", message.length, message.data);
+            ServerProcessResponse(message.data, message.length, 200);
+        }
+    }
+
+    ServerSetAckSender(NULL);
+
+    // A send in progress in another task finishes before the client goes away
+    xSemaphoreTake(client_mutex, portMAX_DELAY);
+    client = NULL;
+    xSemaphoreGive(client_mutex);
+    if (esp_websocket_client_is_connected(session))
+    {
+        esp_websocket_client_close(session, pdMS_TO_TICKS(WS_SEND_TIMEOUT_MS));
+    }
+    esp_websocket_client_destroy(session);
+
+    // Drop anything that arrived while closing
+    while (xQueueReceive(message_queue, &message, 0) == pdTRUE)
+    {
+    }
+
+    ESP_LOGI(TAG, "WebSocket session ended");
+    return 0;
+}
+
+int WebsocketSendText(const char *text)
+{
+    if (text == NULL || client_mutex == NULL)
+    {
+        return -1;
+    }
+
+    int sent = -1;
+    xSemaphoreTake(client_mutex, portMAX_DELAY);
+    if (client != NULL && esp_websocket_client_is_connected(client))
+    {
+        sent = esp_websocket_client_send_text(client, text, strlen(text), pdMS_TO_TICKS(WS_SEND_TIMEOUT_MS));
+    }
+    xSemaphoreGive(client_mutex);
+    return (sent >= 0) ? 0 : -1;
+}
@@ -3,6 +3,7 @@
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_netif.h"
+#include "esp_mac.h"
 #include "nvs_flash.h"
 #include "nvs.h"
 #include "lwip/inet.h"
@@ -331,3 +332,24 @@ int WifiGetIpAddress(char* ip_str, size_t max_len)
              ip4_addr4(&ip_info.ip));
     return 0;
 }
+
+int WifiGetDeviceId(char* id_str, size_t max_len)
+{
+    if (id_str == NULL || max_len < 13)
+    {
+        ESP_LOGE(TAG, "Invalid parameters for getting device ID");
+        return -1;
+    }
+
+    uint8_t mac[6];
+    esp_err_t err = esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to read MAC address: %s", esp_err_to_name(err));
+        return -1;
+    }
+
+    snprintf(id_str, max_len, "%02x%02x%02x%02x%02x%02x",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    return 0;
+}
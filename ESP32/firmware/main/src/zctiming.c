@@ -0,0 +1,77 @@
+#include "zctiming.h"
+#include "esp_attr.h"
+
+bool IRAM_ATTR ZcTimingEdge(zc_detector_t *detector, uint64_t now)
+{
+    uint64_t elapsed = now - detector->last_edge_us;
+    uint32_t min_gap = (detector->interval_us * 3 / 4 > ZERO_CROSS_MIN_INTERVAL_US) ? detector->interval_us * 3 / 4
+                                                                                    : ZERO_CROSS_MIN_INTERVAL_US;
+    if (detector->have_edge && elapsed < min_gap)
+    {
+        return false;
+    }
+
+    if (detector->have_edge && elapsed <= ZERO_CROSS_MAX_INTERVAL_US)
+    {
+        uint32_t interval_us = detector->interval_us;
+        uint32_t deviation = (elapsed > interval_us) ? elapsed - interval_us : interval_us - (uint32_t)elapsed;
+        if (interval_us != 0 && deviation <= interval_us / 8)
+        {
+            detector->interval_us = (uint32_t)((int32_t)interval_us + ((int32_t)elapsed - (int32_t)interval_us) / 8);
+            if (detector->regular < ZERO_CROSS_LOCK_EDGES)
+            {
+                detector->regular++;
+            }
+        }
+        else
+        {
+            detector->interval_us = (uint32_t)elapsed;
+            detector->regular = 0;
+        }
+    }
+    else
+    {
+        // First edge, or the signal was lost
+        detector->interval_us = 0;
+        detector->regular = 0;
+    }
+    detector->have_edge = true;
+    detector->last_edge_us = now;
+    return true;
+}
+
+bool IRAM_ATTR ZcTimingIsLocked(const zc_detector_t *detector, uint64_t now)
+{
+    return detector->regular >= ZERO_CROSS_LOCK_EDGES &&
+           now - detector->last_edge_us <= 2 * (uint64_t)detector->interval_us;
+}
+
+uint64_t ZcTimingNextCrossing(const zc_detector_t *detector, uint64_t earliest, uint32_t offset_us)
+{
+    uint64_t crossing = detector->last_edge_us + offset_us;
+    if (earliest > crossing)
+    {
+        uint32_t interval_us = detector->interval_us;
+        crossing += (earliest - crossing + interval_us - 1) / interval_us * interval_us;
+    }
+    return crossing;
+}
+
+void ZcTimingSchedule(const zero_cross_step_t *steps, int count, uint64_t crossing, zc_scheduled_step_t *out)
+{
+    // Insertion sort, at most RELAY_COUNT steps
+    for (int i = 0; i < count; i++)
+    {
+        zc_scheduled_step_t entry = {
+            .at_us = crossing - steps[i].delay_us,
+            .step = steps[i],
+        };
+        int j = i;
+        while (j > 0 && out[j - 1].at_us > entry.at_us)
+        {
+            out[j] = out[j - 1];
+            j--;
+        }
+        out[j] = entry;
+    }
+}
@@ -0,0 +1,258 @@
+#include "zerocross.h"
+#include "zctiming.h"
+#include "relay.h"
+#include "sdkconfig.h"
+#include <string.h>
+
+#if CONFIG_RELAY_ZERO_CROSS
+#include "driver/gpio.h"
+#include "driver/gptimer.h"
+#include "esp_attr.h"
+#include "esp_intr_alloc.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "soc/gpio_reg.h"
+#include "soc/soc.h"
+#include "soc/soc_caps.h"
+
+static const char *TAG = "zerocross";
+
+#define ZERO_CROSS_LEAD_US 200     // Earliest a write is scheduled after the request (covers arming the alarm)
+#define ZERO_CROSS_GROUP_US 20     // Writes due this close together are done in one interrupt
+#define ZERO_CROSS_TIMEOUT_MS 20   // Extra wait for the last write before it is done without the timer
+#define ZERO_CROSS_INTR_PRIORITY 3 // Highest level a C interrupt handler may use
+
+// 1 MHz free-running counter: edge timestamps, write alarms and lateness use the same clock
+static gptimer_handle_t timer = NULL;
+
+// Guards everything below, between the two interrupts and ZeroCrossApply
+static portMUX_TYPE zero_cross_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Detector, written by edge_isr
+static zc_detector_t detector;
+
+// Transition in progress, written out by alarm_isr
+static zc_scheduled_step_t scheduled[RELAY_COUNT];
+static int scheduled_count;
+static int next_step;
+
+static zero_cross_stats_t stats;
+
+// One transition at a time; done is given by alarm_isr after its last write
+static SemaphoreHandle_t apply_mutex = NULL;
+static SemaphoreHandle_t done = NULL;
+
+static void IRAM_ATTR write_step(const zero_cross_step_t *step)
+{
+    REG_WRITE(GPIO_OUT_W1TS_REG, step->set_bits);
+    REG_WRITE(GPIO_OUT_W1TC_REG, step->clear_bits);
+#if SOC_GPIO_PIN_COUNT > 32
+    REG_WRITE(GPIO_OUT1_W1TS_REG, step->set_bits_high);
+    REG_WRITE(GPIO_OUT1_W1TC_REG, step->clear_bits_high);
+#endif
+}
+
+/**
+ * @brief Detector edge interrupt: timestamp the crossing and track the interval
+ */
+static void IRAM_ATTR edge_isr(void *arg)
+{
+    uint64_t now;
+    gptimer_get_raw_count(timer, &now);
+
+    portENTER_CRITICAL_ISR(&zero_cross_lock);
+    if (ZcTimingEdge(&detector, now))
+    {
+        stats.edges++;
+    }
+    else
+    {
+        stats.noise++;
+    }
+    portEXIT_CRITICAL_ISR(&zero_cross_lock);
+}
+
+/**
+ * @brief Timer alarm interrupt: write the steps that are due and arm the next one
+ */
+static bool IRAM_ATTR alarm_isr(gptimer_handle_t gptimer, const gptimer_alarm_event_data_t *edata, void *ctx)
+{
+    BaseType_t woken = pdFALSE;
+    uint64_t now;
+    gptimer_get_raw_count(gptimer, &now);
+
+    portENTER_CRITICAL_ISR(&zero_cross_lock);
+    while (next_step < scheduled_count && scheduled[next_step].at_us <= now + ZERO_CROSS_GROUP_US)
+    {
+        write_step(&scheduled[next_step].step);
+        uint32_t late = (now > scheduled[next_step].at_us) ? (uint32_t)(now - scheduled[next_step].at_us) : 0;
+        stats.last_late_us = late;
+        if (late > stats.max_late_us)
+        {
+            stats.max_late_us = late;
+        }
+        next_step++;
+    }
+
+    if (next_step < scheduled_count)
+    {
+        gptimer_alarm_config_t alarm = {
+            .alarm_count = scheduled[next_step].at_us,
+        };
+        gptimer_set_alarm_action(gptimer, &alarm);
+    }
+    else
+    {
+        gptimer_set_alarm_action(gptimer, NULL);
+        xSemaphoreGiveFromISR(done, &woken);
+    }
+    portEXIT_CRITICAL_ISR(&zero_cross_lock);
+
+    return woken == pdTRUE;
+}
+#endif
+
+void ZeroCrossInit(void)
+{
+#if CONFIG_RELAY_ZERO_CROSS
+    if (timer != NULL)
+    {
+        return;
+    }
+    apply_mutex = xSemaphoreCreateMutex();
+    done = xSemaphoreCreateBinary();
+
+    gptimer_config_t timer_config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = ZERO_CROSS_RESOLUTION_HZ,
+        .intr_priority = ZERO_CROSS_INTR_PRIORITY,
+    };
+    gptimer_event_callbacks_t callbacks = {
+        .on_alarm = alarm_isr,
+    };
+    if (gptimer_new_timer(&timer_config, &timer) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "No timer free, relays switch without zero-cross timing");
+        timer = NULL;
+        return;
+    }
+    if (gptimer_register_event_callbacks(timer, &callbacks, NULL) != ESP_OK || gptimer_enable(timer) != ESP_OK ||
+        gptimer_start(timer) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start the timer, relays switch without zero-cross timing");
+        gptimer_del_timer(timer);
+        timer = NULL;
+        return;
+    }
+
+    gpio_config_t input = {
+        .pin_bit_mask = 1ULL << CONFIG_RELAY_ZERO_CROSS_GPIO,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = CONFIG_RELAY_ZERO_CROSS_EDGE ? GPIO_INTR_POSEDGE : GPIO_INTR_NEGEDGE,
+    };
+    gpio_config(&input);
+
+    // ESP_ERR_INVALID_STATE: another module installed the service already
+    esp_err_t err = gpio_install_isr_service(ESP_INTR_FLAG_IRAM | ESP_INTR_FLAG_LEVEL3);
+    if ((err != ESP_OK && err != ESP_ERR_INVALID_STATE) ||
+        gpio_isr_handler_add((gpio_num_t)CONFIG_RELAY_ZERO_CROSS_GPIO, edge_isr, NULL) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to attach the detector interrupt, relays switch without zero-cross timing");
+        return;
+    }
+
+    ESP_LOGI(TAG, "Zero-cross detector on GPIO%d (%s edge), switching %d us after it",
+             CONFIG_RELAY_ZERO_CROSS_GPIO, CONFIG_RELAY_ZERO_CROSS_EDGE ? "rising" : "falling",
+             CONFIG_RELAY_ZERO_CROSS_OFFSET_US);
+#endif
+}
+
+int ZeroCrossApply(const zero_cross_step_t *steps, int count)
+{
+#if CONFIG_RELAY_ZERO_CROSS
+    if (timer == NULL || steps == NULL || count < 1 || count > RELAY_COUNT)
+    {
+        return -1;
+    }
+
+    xSemaphoreTake(apply_mutex, portMAX_DELAY);
+    xSemaphoreTake(done, 0);
+
+    uint32_t max_delay_us = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (steps[i].delay_us > max_delay_us)
+        {
+            max_delay_us = steps[i].delay_us;
+        }
+    }
+
+    // Planned and armed with interrupts off, so the lead cannot be eaten up by preemption
+    portENTER_CRITICAL(&zero_cross_lock);
+    uint64_t now;
+    gptimer_get_raw_count(timer, &now);
+    if (!ZcTimingIsLocked(&detector, now))
+    {
+        stats.unsynced++;
+        portEXIT_CRITICAL(&zero_cross_lock);
+        xSemaphoreGive(apply_mutex);
+        return -1;
+    }
+
+    // The first crossing after the slowest relay's delay; all contacts change at it
+    uint64_t earliest = now + ZERO_CROSS_LEAD_US + max_delay_us;
+    uint64_t crossing = ZcTimingNextCrossing(&detector, earliest, CONFIG_RELAY_ZERO_CROSS_OFFSET_US);
+    ZcTimingSchedule(steps, count, crossing, scheduled);
+    scheduled_count = count;
+    next_step = 0;
+    stats.synced++;
+
+    gptimer_alarm_config_t alarm = {
+        .alarm_count = scheduled[0].at_us,
+    };
+    gptimer_set_alarm_action(timer, &alarm);
+    uint32_t wait_ms = (uint32_t)((crossing - now) / 1000) + ZERO_CROSS_TIMEOUT_MS;
+    portEXIT_CRITICAL(&zero_cross_lock);
+
+    if (xSemaphoreTake(done, pdMS_TO_TICKS(wait_ms) + 1) != pdTRUE)
+    {
+        // Never expected: finish the transition rather than leave relays half switched
+        portENTER_CRITICAL(&zero_cross_lock);
+        gptimer_set_alarm_action(timer, NULL);
+        while (next_step < scheduled_count)
+        {
+            write_step(&scheduled[next_step++].step);
+        }
+        portEXIT_CRITICAL(&zero_cross_lock);
+        ESP_LOGW(TAG, "Timed write did not fire, relays switched late");
+    }
+
+    xSemaphoreGive(apply_mutex);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void ZeroCrossGetStats(zero_cross_stats_t *out)
+{
+    memset(out, 0, sizeof(*out));
+#if CONFIG_RELAY_ZERO_CROSS
+    if (timer == NULL)
+    {
+        return;
+    }
+
+    portENTER_CRITICAL(&zero_cross_lock);
+    uint64_t now;
+    gptimer_get_raw_count(timer, &now);
+    *out = stats;
+    out->locked = ZcTimingIsLocked(&detector, now);
+    out->interval_us = detector.interval_us;
+    portEXIT_CRITICAL(&zero_cross_lock);
+#endif
+}
@@ -0,0 +1,252 @@
+#include "test.h"
+#include "cmdcbor.h"
+#include "cmdparser.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef BENCH_HAVE_CJSON
+#include "cJSON.h"
+#endif
+
+// Poll bodies as the server sends them, parsed by CmdParser and by cJSON (what
+// the firmware used before CmdParser, and what ESP-IDF ships), and one command
+// decoded by CmdCborParser against its JSON form; each pair must decode the
+// same commands. Build and run:
+//
+//   cmake --build build-tests --target bench_cmdparse && build-tests/bench_cmdparse
+
+#define ITERATIONS 200000
+#define MAX_COMMANDS CMD_MAX_BATCH
+
+typedef struct
+{
+    const char *name;
+    const char *body;
+} body_t;
+
+static const body_t bodies[] = {
+    {"empty", "{}"},
+    {"single", "{\"command_id\":\"42\",\"seq\":42,\"relay1\":{\"state\":1,\"duration\":5000}}"},
+    {"extra members",
+     "{\"command_id\":\"43\",\"seq\":43,\"created\":\"2026-10-15T08:30:00Z\",\"origin\":{\"user\":\"dashboard\","
+     "\"ip\":\"192.168.1.20\"},\"relay1\":{\"state\":0},\"relay2\":{\"state\":1,\"duration\":60000,"
+     "\"label\":\"Garden pump\"},\"tags\":[\"manual\",\"ui\"]}"},
+    {"batch of 8",
+     "[{\"command_id\":\"50\",\"seq\":50,\"relay1\":{\"state\":1}},{\"command_id\":\"51\",\"seq\":51,\"relay2\":{\"state\":1}},"
+     "{\"command_id\":\"52\",\"seq\":52,\"relay1\":{\"state\":0}},{\"command_id\":\"53\",\"seq\":53,\"relay2\":{\"state\":0}},"
+     "{\"command_id\":\"54\",\"seq\":54,\"scene\":2},{\"command_id\":\"55\",\"seq\":55,\"relay1\":{\"state\":1,\"duration\":"
+     "1000}},{\"command_id\":\"56\",\"seq\":56,\"relay2\":{\"state\":1,\"duration\":2000}},{\"command_id\":\"57\","
+     "\"seq\":57,\"ack_now\":true,\"relay1\":{\"state\":0},\"relay2\":{\"state\":0}}]"},
+};
+
+// "single" above, CBOR-encoded as the server sends it to devices that accept application/cbor
+static const uint8_t single_cbor[] = {0xa3, 0x00, 0x62, '4', '2', 0x01, 0x18, 0x2a, 0x03,
+                                      0xa1, 0x01, 0xa2, 0x00, 0x01, 0x01, 0x19, 0x13, 0x88};
+
+/**
+ * @brief Commands decoded from one body
+ */
+typedef struct
+{
+    relay_command_t commands[MAX_COMMANDS];
+    int count;
+} collected_t;
+
+static void collect(const relay_command_t *command, void *ctx)
+{
+    collected_t *out = (collected_t *)ctx;
+    if (out->count < MAX_COMMANDS)
+    {
+        out->commands[out->count] = *command;
+    }
+    out->count++;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Parse a body with CmdParser in one chunk, as the poll does for a small response
+ */
+static int parse_cmdparser(const char *body, size_t len, collected_t *out)
+{
+    cmd_parser_t parser;
+
+    out->count = 0;
+    CmdParserInit(&parser, collect, out);
+    if (CmdParserFeed(&parser, body, len) != 0)
+    {
+        return -1;
+    }
+    return CmdParserFinish(&parser);
+}
+
+/**
+ * @brief Decode a CBOR body with CmdCborParser in one chunk
+ */
+static int parse_cbor(const char *body, size_t len, collected_t *out)
+{
+    cmd_cbor_parser_t parser;
+
+    out->count = 0;
+    CmdCborParserInit(&parser, collect, out);
+    if (CmdCborParserFeed(&parser, (const uint8_t *)body, len) != 0)
+    {
+        return -1;
+    }
+    return CmdCborParserFinish(&parser);
+}
+
+#ifdef BENCH_HAVE_CJSON
+static size_t heap_allocations = 0;
+static size_t heap_bytes = 0;
+
+static void *counting_malloc(size_t size)
+{
+    heap_allocations++;
+    heap_bytes += size;
+    return malloc(size);
+}
+
+/**
+ * @brief Read one command object from the cJSON tree, the way server.c did before CmdParser
+ */
+static void read_cjson_command(const cJSON *json, relay_command_t *command)
+{
+    memset(command, 0, sizeof(*command));
+
+    const cJSON *command_id = cJSON_GetObjectItemCaseSensitive(json, "command_id");
+    if (cJSON_IsString(command_id))
+    {
+        snprintf(command->command_id, sizeof(command->command_id), "%s", command_id->valuestring);
+    }
+    const cJSON *seq = cJSON_GetObjectItemCaseSensitive(json, "seq");
+    if (cJSON_IsNumber(seq))
+    {
+        command->has_seq = true;
+        command->seq = (uint32_t)seq->valuedouble;
+    }
+    command->ack_now = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(json, "ack_now"));
+    const cJSON *scene = cJSON_GetObjectItemCaseSensitive(json, "scene");
+    if (cJSON_IsNumber(scene))
+    {
+        command->scene = scene->valueint;
+    }
+
+    for (int i = 0; i < CMD_MAX_RELAYS; i++)
+    {
+        char key[12];
+        snprintf(key, sizeof(key), "relay%d", i + 1);
+        const cJSON *relay = cJSON_GetObjectItemCaseSensitive(json, key);
+        const cJSON *state = cJSON_GetObjectItemCaseSensitive(relay, "state");
+        if (!cJSON_IsNumber(state))
+        {
+            continue;
+        }
+        command->relays[i].present = true;
+        command->relays[i].state = state->valueint;
+        const cJSON *duration = cJSON_GetObjectItemCaseSensitive(relay, "duration");
+        if (cJSON_IsNumber(duration) && duration->valueint > 0)
+        {
+            command->relays[i].duration_ms = duration->valueint;
+        }
+    }
+}
+
+/**
+ * @brief Parse a body with cJSON into the same commands
+ */
+static int parse_cjson(const char *body, size_t len, collected_t *out)
+{
+    out->count = 0;
+    cJSON *json = cJSON_ParseWithLength(body, len);
+    if (json == NULL)
+    {
+        return -1;
+    }
+
+    relay_command_t command;
+    if (cJSON_IsArray(json))
+    {
+        const cJSON *element;
+        cJSON_ArrayForEach(element, json)
+        {
+            read_cjson_command(element, &command);
+            collect(&command, out);
+        }
+    }
+    else if (json->child != NULL)
+    {
+        read_cjson_command(json, &command);
+        collect(&command, out);
+    }
+    cJSON_Delete(json);
+    return out->count;
+}
+#endif
+
+/**
+ * @brief Time ITERATIONS parses of a body
+ * @return Nanoseconds per parse
+ */
+static double time_parse(int (*parse)(const char *, size_t, collected_t *), const char *body, size_t len,
+                         collected_t *out)
+{
+    uint64_t start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        CHECK(parse(body, len, out) >= 0);
+    }
+    return (double)(now_ns() - start) / ITERATIONS;
+}
+
+int main(void)
+{
+#ifdef BENCH_HAVE_CJSON
+    cJSON_Hooks hooks = {.malloc_fn = counting_malloc, .free_fn = free};
+    cJSON_InitHooks(&hooks);
+#else
+    printf("cJSON not built in (set IDF_PATH or CJSON_DIR), measuring CmdParser only\n");
+#endif
+    printf("CmdParser state: %zu bytes on the caller's stack, no heap\n\n", sizeof(cmd_parser_t));
+    printf("%-14s %5s %14s %14s %18s\n", "body", "bytes", "CmdParser ns", "cJSON ns", "cJSON heap/parse");
+
+    for (size_t b = 0; b < sizeof(bodies) / sizeof(bodies[0]); b++)
+    {
+        static collected_t streamed;
+        double streamed_ns = time_parse(parse_cmdparser, bodies[b].body, strlen(bodies[b].body), &streamed);
+        printf("%-14s %5zu %14.0f", bodies[b].name, strlen(bodies[b].body), streamed_ns);
+
+#ifdef BENCH_HAVE_CJSON
+        static collected_t tree;
+        heap_allocations = 0;
+        heap_bytes = 0;
+        double tree_ns = time_parse(parse_cjson, bodies[b].body, strlen(bodies[b].body), &tree);
+        printf(" %14.0f %8zu allocs %5zu B\n", tree_ns, heap_allocations / ITERATIONS, heap_bytes / ITERATIONS);
+
+        CHECK(tree.count == streamed.count);
+        CHECK(memcmp(tree.commands, streamed.commands, sizeof(tree.commands)) == 0);
+#else
+        printf(" %14s %18s\n", "-", "-");
+#endif
+    }
+
+    static collected_t json;
+    static collected_t cbor;
+    const char *single_json = bodies[1].body;
+    double json_ns = time_parse(parse_cmdparser, single_json, strlen(single_json), &json);
+    double cbor_ns = time_parse(parse_cbor, (const char *)single_cbor, sizeof(single_cbor), &cbor);
+    printf("\nCmdCborParser state: %zu bytes on the caller's stack, no heap\n\n", sizeof(cmd_cbor_parser_t));
+    printf("%-14s %5s %14s\n", "single", "bytes", "ns");
+    printf("%-14s %5zu %14.0f\n", "JSON", strlen(single_json), json_ns);
+    printf("%-14s %5zu %14.0f\n", "CBOR", sizeof(single_cbor), cbor_ns);
+    CHECK(cbor.count == 1 && json.count == 1);
+    CHECK(memcmp(&cbor.commands[0], &json.commands[0], sizeof(relay_command_t)) == 0);
+
+    printf("\n");
+    return TEST_RESULT();
+}
@@ -0,0 +1,140 @@
+#!/usr/bin/env bash
+# End-to-end test of the MQTT transport against a device connected to a broker
+#
+# Usage: mqtt_e2e.sh [-h host] [-p port] [-t prefix] [-d device_id] [-r relay]
+#
+# The device must be configured with URL=mqtt://<host>:<port>[/<prefix>].
+# Without -d the first device whose status topic says "online" is used.
+# Needs mosquitto_pub and mosquitto_sub (mosquitto-clients).
+
+set -euo pipefail
+
+HOST=localhost
+PORT=1883
+PREFIX=webrelay
+DEVICE=
+RELAY=1
+TIMEOUT_S=10
+DURATION_MS=3000
+
+while getopts "h:p:t:d:r:" opt; do
+    case "$opt" in
+    h) HOST=$OPTARG ;;
+    p) PORT=$OPTARG ;;
+    t) PREFIX=$OPTARG ;;
+    d) DEVICE=$OPTARG ;;
+    r) RELAY=$OPTARG ;;
+    *) sed -n '4p' "$0" >&2; exit 2 ;;
+    esac
+done
+
+WORK=$(mktemp -d)
+SUBSCRIBERS=()
+cleanup()
+{
+    if [ ${#SUBSCRIBERS[@]} -gt 0 ]; then
+        kill "${SUBSCRIBERS[@]}" 2>/dev/null || true
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+FAILURES=0
+pass() { echo "PASS: $1"; }
+fail() { echo "FAIL: $1"; FAILURES=$((FAILURES + 1)); }
+
+# Collect every message of a topic into a file (appended, so it can be cleared)
+subscribe()
+{
+    mosquitto_sub -h "$HOST" -p "$PORT" -q 1 -t "$1" >> "$2" 2>/dev/null &
+    SUBSCRIBERS+=($!)
+}
+
+# Wait until a file contains a fixed string
+await()
+{
+    local file=$1 text=$2 timeout_s=$3
+    local deadline=$((SECONDS + timeout_s))
+    until grep -aqF -- "$text" "$file"; do
+        if [ "$SECONDS" -ge "$deadline" ]; then
+            return 1
+        fi
+        sleep 0.2
+    done
+}
+
+publish()
+{
+    mosquitto_pub -h "$HOST" -p "$PORT" -q 1 -t "$PREFIX/$DEVICE/cmd" -m "$1"
+}
+
+if [ -z "$DEVICE" ]; then
+    # The status topic is retained, so an online device answers at once
+    DEVICE=$(mosquitto_sub -h "$HOST" -p "$PORT" -t "$PREFIX/+/status" -v -W 5 2>/dev/null |
+        awk '$2 == "online" { split($1, t, "/"); print t[length(t) - 1]; exit }' || true)
+    if [ -z "$DEVICE" ]; then
+        echo "No device online under $PREFIX/+/status on $HOST:$PORT" >&2
+        exit 1
+    fi
+fi
+echo "Testing device $DEVICE, relay $RELAY, on $HOST:$PORT"
+
+ACKS=$WORK/ack
+STATES=$WORK/state
+touch "$ACKS" "$STATES"
+subscribe "$PREFIX/$DEVICE/ack" "$ACKS"
+subscribe "$PREFIX/$DEVICE/state" "$STATES"
+sleep 1
+
+RUN="e2e-$(date +%s)-$$"
+
+# 1. Timed ON: acknowledged, state published, switched off by the device itself
+: > "$STATES"
+publish "{\"command_id\":\"$RUN-on\",\"relay$RELAY\":{\"state\":1,\"duration\":$DURATION_MS}}"
+if await "$ACKS" "\"command_id\":\"$RUN-on\"" "$TIMEOUT_S"; then
+    pass "ON acknowledged"
+else
+    fail "no ACK for ON"
+fi
+if await "$STATES" "\"relay$RELAY\":1" "$TIMEOUT_S"; then
+    pass "state shows relay$RELAY ON"
+else
+    fail "state did not show relay$RELAY ON"
+fi
+: > "$STATES"
+if await "$STATES" "\"relay$RELAY\":0" $((DURATION_MS / 1000 + TIMEOUT_S)); then
+    pass "auto-off published"
+else
+    fail "relay$RELAY was not switched off after ${DURATION_MS} ms"
+fi
+
+# 2. The same command again (lost ACK): acknowledged again, not run again
+: > "$ACKS"
+: > "$STATES"
+publish "{\"command_id\":\"$RUN-on\",\"relay$RELAY\":{\"state\":1,\"duration\":$DURATION_MS}}"
+if await "$ACKS" "\"command_id\":\"$RUN-on\"" "$TIMEOUT_S"; then
+    pass "re-delivered command acknowledged"
+else
+    fail "no ACK for re-delivered command"
+fi
+sleep 2
+if grep -aqF "\"relay$RELAY\":1" "$STATES"; then
+    fail "re-delivered command switched relay$RELAY again"
+else
+    pass "re-delivered command not executed"
+fi
+
+# 3. Plain OFF
+: > "$ACKS"
+publish "{\"command_id\":\"$RUN-off\",\"relay$RELAY\":{\"state\":0}}"
+if await "$ACKS" "\"command_id\":\"$RUN-off\"" "$TIMEOUT_S"; then
+    pass "OFF acknowledged"
+else
+    fail "no ACK for OFF"
+fi
+
+if [ "$FAILURES" -ne 0 ]; then
+    echo "$FAILURES check(s) failed"
+    exit 1
+fi
+echo "All checks passed"
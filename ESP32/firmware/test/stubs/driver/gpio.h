@@ -0,0 +1,7 @@
+#ifndef DRIVER_GPIO_H
+#define DRIVER_GPIO_H
+
+// Host stand-in: only the type relay.h needs
+typedef int gpio_num_t;
+
+#endif // DRIVER_GPIO_H
@@ -0,0 +1,201 @@
+#include "host.h"
+#include "esp_random.h"
+#include "lwip/dns.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * @brief A task: a thread and its notification value
+ */
+struct host_task
+{
+    pthread_t thread;
+    TaskFunction_t code;
+    void *param;
+    uint32_t notifications;
+    bool waiting; // Blocked in ulTaskNotifyTake
+};
+
+struct host_semaphore
+{
+    pthread_mutex_t mutex;
+};
+
+// Guards the tick count, the notifications and busy_tasks
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t host_cond = PTHREAD_COND_INITIALIZER;
+static TickType_t ticks = 0;
+static int busy_tasks = 0; // Tasks not blocked in ulTaskNotifyTake
+static __thread struct host_task *current_task = NULL;
+
+static void *task_main(void *arg)
+{
+    current_task = (struct host_task *)arg;
+    current_task->code(current_task->param);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint32_t stack_depth, void *param,
+                       UBaseType_t priority, TaskHandle_t *created)
+{
+    struct host_task *task = calloc(1, sizeof(*task));
+    if (task == NULL)
+    {
+        return pdFAIL;
+    }
+    task->code = code;
+    task->param = param;
+
+    pthread_mutex_lock(&host_lock);
+    busy_tasks++;
+    pthread_mutex_unlock(&host_lock);
+
+    if (pthread_create(&task->thread, NULL, task_main, task) != 0)
+    {
+        pthread_mutex_lock(&host_lock);
+        busy_tasks--;
+        pthread_mutex_unlock(&host_lock);
+        free(task);
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+
+    if (created != NULL)
+    {
+        *created = task;
+    }
+    return pdPASS;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    pthread_mutex_lock(&host_lock);
+    TickType_t now = ticks;
+    pthread_mutex_unlock(&host_lock);
+    return now;
+}
+
+void vTaskDelay(TickType_t delay)
+{
+    struct timespec duration = {
+        .tv_sec = delay / 1000,
+        .tv_nsec = (long)(delay % 1000) * 1000000,
+    };
+    nanosleep(&duration, NULL);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait)
+{
+    struct host_task *task = current_task;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ticks_to_wait / 1000;
+    deadline.tv_nsec += (long)(ticks_to_wait % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&host_lock);
+    while (task->notifications == 0)
+    {
+        if (!task->waiting)
+        {
+            task->waiting = true;
+            busy_tasks--;
+            pthread_cond_broadcast(&host_cond);
+        }
+        int err = (ticks_to_wait == portMAX_DELAY) ? pthread_cond_wait(&host_cond, &host_lock)
+                                                   : pthread_cond_timedwait(&host_cond, &host_lock, &deadline);
+        if (err == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    if (task->waiting)
+    {
+        task->waiting = false;
+        busy_tasks++;
+    }
+
+    uint32_t value = task->notifications;
+    if (value > 0)
+    {
+        task->notifications = clear_on_exit ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&host_lock);
+    return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&host_lock);
+    task->notifications++;
+    if (task->waiting)
+    {
+        // Counted busy from now on, so HostWaitForTasks waits for it to run
+        task->waiting = false;
+        busy_tasks++;
+    }
+    pthread_cond_broadcast(&host_cond);
+    pthread_mutex_unlock(&host_lock);
+    return pdPASS;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    struct host_semaphore *semaphore = calloc(1, sizeof(*semaphore));
+    if (semaphore != NULL)
+    {
+        pthread_mutex_init(&semaphore->mutex, NULL);
+    }
+    return semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait)
+{
+    if (ticks_to_wait == portMAX_DELAY)
+    {
+        return (pthread_mutex_lock(&semaphore->mutex) == 0) ? pdTRUE : pdFALSE;
+    }
+    return (pthread_mutex_trylock(&semaphore->mutex) == 0) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    return (pthread_mutex_unlock(&semaphore->mutex) == 0) ? pdTRUE : pdFALSE;
+}
+
+uint32_t esp_random(void)
+{
+    return (uint32_t)rand();
+}
+
+const ip_addr_t *dns_getserver(uint8_t numdns)
+{
+    return NULL;
+}
+
+void HostAdvanceTicks(uint32_t advance)
+{
+    pthread_mutex_lock(&host_lock);
+    ticks += advance;
+    pthread_mutex_unlock(&host_lock);
+}
+
+void HostWaitForTasks(void)
+{
+    pthread_mutex_lock(&host_lock);
+    while (busy_tasks > 0)
+    {
+        pthread_cond_wait(&host_cond, &host_lock);
+    }
+    pthread_mutex_unlock(&host_lock);
+}
@@ -0,0 +1,17 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+
+/**
+ * @brief Move the tick count forward (one tick = 1 ms)
+ */
+void HostAdvanceTicks(uint32_t ticks);
+
+/**
+ * @brief Wait until every task is blocked waiting for a notification
+ * Lets a test observe the result of work it handed to a background task
+ */
+void HostWaitForTasks(void);
+
+#endif // HOST_H
@@ -0,0 +1,27 @@
+#ifndef LWIP_DNS_H
+#define LWIP_DNS_H
+
+#include <stdint.h>
+
+typedef struct
+{
+    uint32_t addr;
+} ip4_addr_t;
+
+typedef struct
+{
+    union
+    {
+        ip4_addr_t ip4;
+    } u_addr;
+    uint8_t type;
+} ip_addr_t;
+
+#define IPADDR_TYPE_V4 0
+#define IP_IS_V4(a) ((a)->type == IPADDR_TYPE_V4)
+#define ip_2_ip4(a) (&((a)->u_addr.ip4))
+
+// The host has no interface DNS server: always NULL
+const ip_addr_t *dns_getserver(uint8_t numdns);
+
+#endif // LWIP_DNS_H
@@ -0,0 +1,7 @@
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+// Host test configuration (menuconfig values the tested modules read)
+#define CONFIG_RELAY_COUNT 4
+
+#endif // SDKCONFIG_H
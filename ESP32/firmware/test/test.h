@@ -0,0 +1,25 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+// Minimal check macros shared by the host tests: a failed CHECK is reported
+// and counted, and TEST_RESULT() makes the test exit with a failure status
+
+static int test_failures = 0;
+
+#define CHECK(cond)                                                                   \
+    do                                                                                \
+    {                                                                                 \
+        if (!(cond))                                                                  \
+        {                                                                             \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++;                                                          \
+        }                                                                             \
+    } while (0)
+
+#define TEST_RESULT()                                                   \
+    (test_failures == 0 ? (printf("All checks passed\n"), 0)           \
+                        : (printf("%d check(s) failed\n", test_failures), 1))
+
+#endif // TEST_H
@@ -0,0 +1,222 @@
+#include "test.h"
+#include "cmdcbor.h"
+#include <string.h>
+
+#define MAX_COMMANDS 8
+
+/**
+ * @brief Commands reported by one decode
+ */
+typedef struct
+{
+    relay_command_t commands[MAX_COMMANDS];
+    int count;
+} collected_t;
+
+static void collect(const relay_command_t *command, void *ctx)
+{
+    collected_t *out = (collected_t *)ctx;
+    if (out->count < MAX_COMMANDS)
+    {
+        out->commands[out->count] = *command;
+    }
+    out->count++;
+}
+
+/**
+ * @brief Decode a document fed in chunks of the given size (0 = all at once)
+ * @return What CmdCborParserFinish returned, or -2 if a chunk was refused
+ */
+static int decode(const uint8_t *doc, size_t len, size_t chunk, collected_t *out)
+{
+    cmd_cbor_parser_t parser;
+
+    memset(out, 0, sizeof(*out));
+    CmdCborParserInit(&parser, collect, out);
+    if (chunk == 0)
+    {
+        chunk = (len > 0) ? len : 1;
+    }
+    for (size_t pos = 0; pos < len; pos += chunk)
+    {
+        size_t n = (len - pos < chunk) ? len - pos : chunk;
+        if (CmdCborParserFeed(&parser, doc + pos, n) != 0)
+        {
+            return -2;
+        }
+    }
+    return CmdCborParserFinish(&parser);
+}
+
+/**
+ * @brief Decode a document split in two at every position
+ * @return true if every split gives the same commands as the whole document
+ */
+static bool same_at_every_split(const uint8_t *doc, size_t len)
+{
+    collected_t whole;
+    int expected = decode(doc, len, 0, &whole);
+
+    for (size_t split = 1; split < len; split++)
+    {
+        cmd_cbor_parser_t parser;
+        collected_t parts = {0};
+        CmdCborParserInit(&parser, collect, &parts);
+        int fed = CmdCborParserFeed(&parser, doc, split) | CmdCborParserFeed(&parser, doc + split, len - split);
+        int result = (fed != 0) ? -2 : CmdCborParserFinish(&parser);
+
+        if (result != expected || parts.count != whole.count ||
+            memcmp(parts.commands, whole.commands, sizeof(whole.commands)) != 0)
+        {
+            fprintf(stderr, "split at %zu differs\n", split);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Parse a JSON document in one piece
+ */
+static int parse_json(const char *doc, collected_t *out)
+{
+    cmd_parser_t parser;
+
+    memset(out, 0, sizeof(*out));
+    CmdParserInit(&parser, collect, out);
+    CmdParserFeed(&parser, doc, strlen(doc));
+    return CmdParserFinish(&parser);
+}
+
+static void test_single_command(void)
+{
+    // {0: "42", 1: 7, 2: true, 3: {2: {0: 1, 1: 1500}}}
+    const uint8_t doc[] = {0xa4, 0x00, 0x62, '4', '2', 0x01, 0x07, 0x02, 0xf5,
+                           0x03, 0xa1, 0x02, 0xa2, 0x00, 0x01, 0x01, 0x19, 0x05, 0xdc};
+    const char *json = "{\"command_id\":\"42\",\"seq\":7,\"ack_now\":true,\"relay2\":{\"state\":1,\"duration\":1500}}";
+    collected_t out;
+    collected_t from_json;
+
+    CHECK(decode(doc, sizeof(doc), 0, &out) == 1);
+    CHECK(out.count == 1);
+    CHECK(strcmp(out.commands[0].command_id, "42") == 0);
+    CHECK(out.commands[0].has_seq && out.commands[0].seq == 7);
+    CHECK(out.commands[0].ack_now);
+    CHECK(out.commands[0].relays[1].present && out.commands[0].relays[1].state == 1);
+    CHECK(out.commands[0].relays[1].duration_ms == 1500);
+
+    // The same command as the JSON parser decodes it, in under half the bytes
+    CHECK(parse_json(json, &from_json) == 1);
+    CHECK(memcmp(&out.commands[0], &from_json.commands[0], sizeof(relay_command_t)) == 0);
+    printf("Command: %zu bytes as JSON, %zu bytes as CBOR\n", strlen(json), sizeof(doc));
+    CHECK(sizeof(doc) * 2 < strlen(json));
+
+    CHECK(same_at_every_split(doc, sizeof(doc)));
+    collected_t bytewise;
+    CHECK(decode(doc, sizeof(doc), 1, &bytewise) == 1);
+    CHECK(memcmp(&bytewise.commands[0], &out.commands[0], sizeof(relay_command_t)) == 0);
+}
+
+static void test_batch(void)
+{
+    // [{0: "a", 1: 1, 3: {1: {0: 1}}}, {0: "b", 1: 2, 3: {1: {0: 0}}}]
+    const uint8_t doc[] = {0x82, 0xa3, 0x00, 0x61, 'a', 0x01, 0x01, 0x03, 0xa1, 0x01, 0xa1, 0x00, 0x01,
+                           0xa3, 0x00, 0x61, 'b', 0x01, 0x02, 0x03, 0xa1, 0x01, 0xa1, 0x00, 0x00};
+    collected_t out;
+
+    CHECK(decode(doc, sizeof(doc), 0, &out) == 2);
+    CHECK(out.count == 2);
+    CHECK(strcmp(out.commands[0].command_id, "a") == 0 && out.commands[0].seq == 1);
+    CHECK(out.commands[0].relays[0].present && out.commands[0].relays[0].state == 1);
+    CHECK(strcmp(out.commands[1].command_id, "b") == 0 && out.commands[1].seq == 2);
+    CHECK(out.commands[1].relays[0].present && out.commands[1].relays[0].state == 0);
+    CHECK(same_at_every_split(doc, sizeof(doc)));
+}
+
+static void test_empty(void)
+{
+    const uint8_t empty_map[] = {0xa0};
+    const uint8_t empty_array[] = {0x80};
+    collected_t out;
+
+    CHECK(decode(empty_map, sizeof(empty_map), 0, &out) == 0 && out.count == 0);
+    CHECK(decode(empty_array, sizeof(empty_array), 0, &out) == 0 && out.count == 0);
+}
+
+static void test_skipped_items(void)
+{
+    // {9: [1, -5, h'0102', {"x": 1}], 3: {3: {0: 1}, 5: {0: 1}}, 0: "z", 1: 65536 (4-byte argument)}
+    const uint8_t doc[] = {0xa4, 0x09, 0x84, 0x01, 0x24, 0x42, 0x01, 0x02, 0xa1, 0x61, 'x', 0x01,
+                           0x03, 0xa2, 0x03, 0xa1, 0x00, 0x01, 0x05, 0xa1, 0x00, 0x01,
+                           0x00, 0x61, 'z', 0x01, 0x1a, 0x00, 0x01, 0x00, 0x00};
+    collected_t out;
+
+    CHECK(decode(doc, sizeof(doc), 0, &out) == 1);
+    CHECK(strcmp(out.commands[0].command_id, "z") == 0);
+    CHECK(out.commands[0].seq == 65536);
+    CHECK(out.commands[0].relays[2].present && out.commands[0].relays[2].state == 1);
+    // Relay 5 is beyond CONFIG_RELAY_COUNT
+    CHECK(!out.commands[0].relays[0].present && !out.commands[0].relays[3].present);
+    CHECK(same_at_every_split(doc, sizeof(doc)));
+}
+
+static void test_command_id(void)
+{
+    // {0: "a\"b"}: the ID is stored JSON-escaped so ACKs can embed it
+    const uint8_t quoted[] = {0xa1, 0x00, 0x63, 'a', '"', 'b'};
+    collected_t out;
+
+    CHECK(decode(quoted, sizeof(quoted), 0, &out) == 1);
+    CHECK(strcmp(out.commands[0].command_id, "a\\\"b") == 0);
+
+    // An ID too long to echo back is dropped, the command still runs
+    uint8_t overlong[4 + 100 + 6] = {0xa2, 0x00, 0x78, 100};
+    memset(overlong + 4, 'x', 100);
+    memcpy(overlong + 104, (const uint8_t[]){0x03, 0xa1, 0x01, 0xa1, 0x00, 0x01}, 6);
+    CHECK(decode(overlong, sizeof(overlong), 0, &out) == 1);
+    CHECK(out.commands[0].command_id[0] == '\0');
+    CHECK(out.commands[0].relays[0].present);
+}
+
+static void test_invalid(void)
+{
+    const uint8_t indefinite[] = {0xbf, 0x00, 0x61, 'a', 0xff};
+    const uint8_t truncated[] = {0xa2, 0x00, 0x61, 'a'};
+    const uint8_t trailing[] = {0xa0, 0x00};
+    const uint8_t too_deep[] = {0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x01};
+    collected_t out;
+
+    CHECK(decode(indefinite, sizeof(indefinite), 0, &out) == -2);
+    CHECK(decode(truncated, sizeof(truncated), 0, &out) == -1);
+    CHECK(decode(trailing, sizeof(trailing), 0, &out) == -2);
+    CHECK(decode(too_deep, sizeof(too_deep), 0, &out) == -2);
+}
+
+static void test_waveform(void)
+{
+    // {3: {1: {2: 500, 4: 2, 3: 1000}, 2: {5: 50, 6: 30, 1: 2000}}}
+    const uint8_t doc[] = {0xa1, 0x03, 0xa2, 0x01, 0xa3, 0x02, 0x19, 0x01, 0xf4, 0x04, 0x02, 0x03, 0x19, 0x03, 0xe8,
+                           0x02, 0xa3, 0x05, 0x18, 0x32, 0x06, 0x18, 0x1e, 0x01, 0x19, 0x07, 0xd0};
+    collected_t out;
+
+    CHECK(decode(doc, sizeof(doc), 0, &out) == 1);
+    CHECK(out.commands[0].relays[0].waveform.pulse_us == 500);
+    CHECK(out.commands[0].relays[0].waveform.count == 2);
+    CHECK(out.commands[0].relays[0].waveform.gap_us == 1000);
+    CHECK(out.commands[0].relays[1].waveform.pwm_hz == 50);
+    CHECK(out.commands[0].relays[1].waveform.duty == 30);
+    CHECK(out.commands[0].relays[1].duration_ms == 2000);
+    CHECK(same_at_every_split(doc, sizeof(doc)));
+}
+
+int main(void)
+{
+    test_single_command();
+    test_batch();
+    test_empty();
+    test_skipped_items();
+    test_command_id();
+    test_invalid();
+    test_waveform();
+    return TEST_RESULT();
+}
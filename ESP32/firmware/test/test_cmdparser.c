@@ -0,0 +1,241 @@
+#include "test.h"
+#include "cmdparser.h"
+#include <string.h>
+
+#define MAX_COMMANDS 8
+
+/**
+ * @brief Commands reported by one parse
+ */
+typedef struct
+{
+    relay_command_t commands[MAX_COMMANDS];
+    int count;
+} collected_t;
+
+static void collect(const relay_command_t *command, void *ctx)
+{
+    collected_t *out = (collected_t *)ctx;
+    if (out->count < MAX_COMMANDS)
+    {
+        out->commands[out->count] = *command;
+    }
+    out->count++;
+}
+
+/**
+ * @brief Parse a document fed in chunks of the given size (0 = all at once)
+ * @return What CmdParserFinish returned, or -2 if a chunk was refused
+ */
+static int parse(const char *doc, size_t chunk, collected_t *out)
+{
+    cmd_parser_t parser;
+    size_t len = strlen(doc);
+
+    memset(out, 0, sizeof(*out));
+    CmdParserInit(&parser, collect, out);
+    if (chunk == 0)
+    {
+        chunk = (len > 0) ? len : 1;
+    }
+    for (size_t pos = 0; pos < len; pos += chunk)
+    {
+        size_t n = (len - pos < chunk) ? len - pos : chunk;
+        if (CmdParserFeed(&parser, doc + pos, n) != 0)
+        {
+            return -2;
+        }
+    }
+    return CmdParserFinish(&parser);
+}
+
+/**
+ * @brief Parse a document split in two at every position
+ * @return true if every split gives the same commands as the whole document
+ */
+static bool same_at_every_split(const char *doc)
+{
+    collected_t whole;
+    int expected = parse(doc, 0, &whole);
+    size_t len = strlen(doc);
+
+    for (size_t split = 1; split < len; split++)
+    {
+        cmd_parser_t parser;
+        collected_t parts = {0};
+        CmdParserInit(&parser, collect, &parts);
+        int fed = CmdParserFeed(&parser, doc, split) | CmdParserFeed(&parser, doc + split, len - split);
+        int result = (fed != 0) ? -2 : CmdParserFinish(&parser);
+
+        if (result != expected || parts.count != whole.count ||
+            memcmp(parts.commands, whole.commands, sizeof(whole.commands)) != 0)
+        {
+            fprintf(stderr, "split at %zu of %s differs\n", split, doc);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_single_command(void)
+{
+    const char *doc = "{\"command_id\":\"42\",\"seq\":7,\"ack_now\":true,"
+                      "\"relay2\":{\"state\":1,\"duration\":1500}}";
+    collected_t out;
+
+    CHECK(parse(doc, 0, &out) == 1);
+    CHECK(out.count == 1);
+    CHECK(strcmp(out.commands[0].command_id, "42") == 0);
+    CHECK(out.commands[0].has_seq && out.commands[0].seq == 7);
+    CHECK(out.commands[0].ack_now);
+    CHECK(!out.commands[0].relays[0].present);
+    CHECK(out.commands[0].relays[1].present);
+    CHECK(out.commands[0].relays[1].state == 1);
+    CHECK(out.commands[0].relays[1].duration_ms == 1500);
+
+    // Same result however the body is split into HTTP_EVENT_ON_DATA chunks
+    CHECK(same_at_every_split(doc));
+    collected_t bytewise;
+    CHECK(parse(doc, 1, &bytewise) == 1);
+    CHECK(memcmp(&bytewise.commands[0], &out.commands[0], sizeof(relay_command_t)) == 0);
+}
+
+static void test_batch(void)
+{
+    const char *doc = "[{\"command_id\":\"a\",\"seq\":1,\"relay1\":{\"state\":1}},"
+                      " {\"command_id\":\"b\",\"seq\":2,\"relay1\":{\"state\":0}},\n"
+                      " {\"command_id\":\"c\",\"seq\":3,\"scene\":3}]";
+    collected_t out;
+
+    CHECK(parse(doc, 0, &out) == 3);
+    CHECK(out.count == 3);
+    CHECK(strcmp(out.commands[0].command_id, "a") == 0 && out.commands[0].relays[0].state == 1);
+    CHECK(strcmp(out.commands[1].command_id, "b") == 0 && out.commands[1].relays[0].state == 0);
+    CHECK(strcmp(out.commands[2].command_id, "c") == 0 && out.commands[2].scene == 3);
+    CHECK(out.commands[2].seq == 3);
+    CHECK(same_at_every_split(doc));
+}
+
+static void test_empty(void)
+{
+    collected_t out;
+
+    CHECK(parse("{}", 0, &out) == 0 && out.count == 0);
+    CHECK(parse("{}", 1, &out) == 0 && out.count == 0);
+    CHECK(parse(" { } \r\n", 0, &out) == 0 && out.count == 0);
+    CHECK(parse("[]", 0, &out) == 0 && out.count == 0);
+    CHECK(parse("", 0, &out) == 0 && out.count == 0);
+}
+
+static void test_large_body(void)
+{
+    // Longer than the old 512-byte response buffer, with the command fields at the end
+    static char doc[4096];
+    int len = snprintf(doc, sizeof(doc), "{\"note\":\"");
+    for (int i = 0; i < 1500; i++)
+    {
+        doc[len++] = 'x';
+    }
+    snprintf(doc + len, sizeof(doc) - len,
+             "\",\"extra\":{\"nested\":[1,2.5,{\"a\":\"b\\\"c\"},null,false]},"
+             "\"command_id\":\"big\",\"relay4\":{\"state\":1}}");
+
+    const size_t chunks[] = {0, 1, 7, 512};
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+    {
+        collected_t out;
+        CHECK(parse(doc, chunks[i], &out) == 1);
+        CHECK(strcmp(out.commands[0].command_id, "big") == 0);
+        CHECK(out.commands[0].relays[3].present && out.commands[0].relays[3].state == 1);
+    }
+}
+
+static void test_ignored_members(void)
+{
+    // relay0 and relays beyond CONFIG_RELAY_COUNT are skipped, as are unknown relay members
+    const char *doc = "{\"relay0\":{\"state\":1},\"relay5\":{\"state\":1},\"relay12\":{\"state\":1},"
+                      "\"relay3\":{\"state\":1,\"colour\":\"red\",\"duration\":-5}}";
+    collected_t out;
+
+    CHECK(parse(doc, 0, &out) == 1);
+    CHECK(!out.commands[0].relays[0].present);
+    CHECK(out.commands[0].relays[2].present && out.commands[0].relays[2].state == 1);
+    CHECK(out.commands[0].relays[2].duration_ms == 0);
+    CHECK(out.commands[0].command_id[0] == '\0');
+}
+
+static void test_command_id(void)
+{
+    collected_t out;
+
+    // Escapes are kept raw so the ID can be echoed back as-is
+    CHECK(parse("{\"command_id\":\"a\\\"b\\\\\",\"relay1\":{\"state\":0}}", 3, &out) == 1);
+    CHECK(strcmp(out.commands[0].command_id, "a\\\"b\\\\") == 0);
+
+    // An ID too long to echo back is dropped, the command still runs
+    char doc[256];
+    snprintf(doc, sizeof(doc), "{\"command_id\":\"%0100d\",\"relay1\":{\"state\":1}}", 0);
+    CHECK(parse(doc, 0, &out) == 1);
+    CHECK(out.commands[0].command_id[0] == '\0');
+    CHECK(out.commands[0].relays[0].present);
+}
+
+static void test_legacy_body(void)
+{
+    collected_t out;
+
+    CHECK(parse("1", 0, &out) == 1);
+    CHECK(out.commands[0].relays[0].present && out.commands[0].relays[0].state == 1);
+    CHECK(parse("0\n", 0, &out) == 1);
+    CHECK(out.commands[0].relays[0].present && out.commands[0].relays[0].state == 0);
+    CHECK(parse("2", 0, &out) == 0);
+}
+
+static void test_invalid(void)
+{
+    collected_t out;
+
+    CHECK(parse("{\"relay1\":{\"state\":1}", 0, &out) == -1); // Truncated
+    CHECK(parse("{\"relay1\" 1}", 0, &out) == -2);
+    CHECK(parse("{\"ack_now\":tru}", 0, &out) == -2);
+    CHECK(parse("{} x", 0, &out) == -2);
+    CHECK(parse("[[[[[[[[[1]]]]]]]]]", 0, &out) == -2); // Deeper than CMD_PARSER_MAX_DEPTH
+}
+
+static void test_waveform(void)
+{
+    const char *doc = "{\"command_id\":\"w\",\"relay2\":{\"pulse\":0.25,\"gap\":10,\"count\":3},"
+                      "\"relay1\":{\"pwm\":50,\"duty\":30,\"duration\":2000}}";
+    collected_t out;
+
+    CHECK(parse(doc, 0, &out) == 1);
+    CHECK(out.commands[0].relays[1].waveform.pulse_us == 250);
+    CHECK(out.commands[0].relays[1].waveform.gap_us == 10000);
+    CHECK(out.commands[0].relays[1].waveform.count == 3);
+    CHECK(out.commands[0].relays[0].waveform.pwm_hz == 50);
+    CHECK(out.commands[0].relays[0].waveform.duty == 30);
+    CHECK(out.commands[0].relays[0].duration_ms == 2000);
+    CHECK(!out.commands[0].relays[0].present);
+    CHECK(same_at_every_split(doc));
+
+    CHECK(CmdParserMsToUs("150") == 150000);
+    CHECK(CmdParserMsToUs("0.5") == 500);
+    CHECK(CmdParserMsToUs("1.2345") == 1234);
+    CHECK(CmdParserMsToUs("0.0004") == 0);
+    CHECK(CmdParserMsToUs("abc") == 0);
+    CHECK(CmdParserMsToUs("99999999") == 0); // Above UINT32_MAX us
+}
+
+int main(void)
+{
+    test_single_command();
+    test_batch();
+    test_empty();
+    test_large_body();
+    test_ignored_members();
+    test_command_id();
+    test_legacy_body();
+    test_invalid();
+    test_waveform();
+    return TEST_RESULT();
+}
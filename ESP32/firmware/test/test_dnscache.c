@@ -0,0 +1,259 @@
+#include "test.h"
+#include "host.h"
+#include "dnscache.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define MAX_NAMES 16
+
+/**
+ * @brief A name the fake resolver knows
+ */
+typedef struct
+{
+    const char *host;
+    uint32_t ipv4;
+    uint32_t ttl_s;
+    bool fail;
+    int calls;
+} fake_name_t;
+
+// The fake resolver is called from the test and from the cache's refresh task
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+static fake_name_t names[MAX_NAMES];
+
+static int fake_resolve(const char *host, uint32_t *ipv4, uint32_t *ttl_s, uint32_t timeout_ms)
+{
+    int err = -1;
+    pthread_mutex_lock(&fake_lock);
+    for (int i = 0; i < MAX_NAMES; i++)
+    {
+        if (names[i].host != NULL && strcmp(names[i].host, host) == 0)
+        {
+            names[i].calls++;
+            if (!names[i].fail)
+            {
+                *ipv4 = names[i].ipv4;
+                *ttl_s = names[i].ttl_s;
+                err = 0;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fake_lock);
+    return err;
+}
+
+/**
+ * @brief Add a name to the fake resolver or change its answer
+ */
+static void fake_set(const char *host, uint32_t ipv4, uint32_t ttl_s, bool fail)
+{
+    pthread_mutex_lock(&fake_lock);
+    for (int i = 0; i < MAX_NAMES; i++)
+    {
+        if (names[i].host == NULL || strcmp(names[i].host, host) == 0)
+        {
+            names[i].host = host;
+            names[i].ipv4 = ipv4;
+            names[i].ttl_s = ttl_s;
+            names[i].fail = fail;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fake_lock);
+}
+
+static int fake_calls(const char *host)
+{
+    int calls = 0;
+    pthread_mutex_lock(&fake_lock);
+    for (int i = 0; i < MAX_NAMES; i++)
+    {
+        if (names[i].host != NULL && strcmp(names[i].host, host) == 0)
+        {
+            calls = names[i].calls;
+        }
+    }
+    pthread_mutex_unlock(&fake_lock);
+    return calls;
+}
+
+/**
+ * @brief Look a name up and return the address, 0 on failure
+ */
+static uint32_t lookup(const char *host)
+{
+    uint32_t ipv4 = 0;
+    return (DnsCacheLookup(host, &ipv4) == 0) ? ipv4 : 0;
+}
+
+static dns_cache_stats_t stats_now(void)
+{
+    dns_cache_stats_t stats;
+    DnsCacheGetStats(&stats);
+    return stats;
+}
+
+static void test_builtin_resolver(void)
+{
+    // Without a resolver the cache queries the interface's DNS server;
+    // the host stand-in has none, so the lookup fails cleanly
+    DnsCacheInit(NULL);
+    dns_cache_stats_t before = stats_now();
+    CHECK(lookup("nowhere.example") == 0);
+    dns_cache_stats_t after = stats_now();
+    CHECK(after.misses == before.misses + 1);
+    CHECK(after.failures == before.failures + 1);
+
+    // Names too long for an entry are refused without a lookup
+    char long_name[DNS_CACHE_MAX_HOST_LENGTH + 8];
+    memset(long_name, 'a', sizeof(long_name) - 1);
+    long_name[sizeof(long_name) - 1] = '\0';
+    CHECK(lookup(long_name) == 0);
+    CHECK(stats_now().misses == after.misses);
+
+    DnsCacheInit(fake_resolve);
+}
+
+static void test_miss_then_hit(void)
+{
+    fake_set("poll.example", 0x0100000a, 60, false);
+    dns_cache_stats_t before = stats_now();
+
+    CHECK(lookup("poll.example") == 0x0100000a);
+    CHECK(lookup("poll.example") == 0x0100000a);
+    HostAdvanceTicks(59999);
+    CHECK(lookup("poll.example") == 0x0100000a);
+
+    dns_cache_stats_t after = stats_now();
+    CHECK(fake_calls("poll.example") == 1);
+    CHECK(after.misses == before.misses + 1);
+    CHECK(after.hits == before.hits + 2);
+}
+
+static void test_expired_served_stale(void)
+{
+    // poll.example expires now; the server moved meanwhile
+    HostAdvanceTicks(1);
+    fake_set("poll.example", 0x0200000a, 60, false);
+    dns_cache_stats_t before = stats_now();
+
+    // The old answer is served at once and refreshed in the background
+    CHECK(lookup("poll.example") == 0x0100000a);
+    HostWaitForTasks();
+    CHECK(fake_calls("poll.example") == 2);
+    CHECK(lookup("poll.example") == 0x0200000a);
+
+    dns_cache_stats_t after = stats_now();
+    CHECK(after.stale_hits == before.stale_hits + 1);
+    CHECK(after.refreshes == before.refreshes + 1);
+    CHECK(after.hits == before.hits + 1);
+    CHECK(after.misses == before.misses);
+}
+
+static void test_ttl_limits(void)
+{
+    // A 0 TTL is raised to 30 s instead of defeating the cache
+    fake_set("zero-ttl.example", 0x0300000a, 0, false);
+    CHECK(lookup("zero-ttl.example") == 0x0300000a);
+    HostAdvanceTicks(29999);
+    dns_cache_stats_t before = stats_now();
+    CHECK(lookup("zero-ttl.example") == 0x0300000a);
+    CHECK(stats_now().hits == before.hits + 1);
+    HostAdvanceTicks(1);
+    CHECK(lookup("zero-ttl.example") == 0x0300000a);
+    CHECK(stats_now().stale_hits == before.stale_hits + 1);
+    HostWaitForTasks();
+    CHECK(fake_calls("zero-ttl.example") == 2);
+}
+
+static void test_resolver_failure(void)
+{
+    fake_set("flaky.example", 0x0400000a, 60, false);
+    CHECK(lookup("flaky.example") == 0x0400000a);
+
+    // The resolver fails after the TTL: the stale answer stays in use
+    fake_set("flaky.example", 0, 0, true);
+    HostAdvanceTicks(60000);
+    dns_cache_stats_t before = stats_now();
+    CHECK(lookup("flaky.example") == 0x0400000a);
+    HostWaitForTasks();
+    CHECK(lookup("flaky.example") == 0x0400000a);
+    HostWaitForTasks();
+    CHECK(stats_now().failures == before.failures + 2);
+
+    // Past the serve-stale window the lookup waits for the resolver and fails
+    HostAdvanceTicks(3600 * 1000);
+    CHECK(lookup("flaky.example") == 0);
+
+    // Once the resolver answers again the name is cached again
+    fake_set("flaky.example", 0x0500000a, 60, false);
+    CHECK(lookup("flaky.example") == 0x0500000a);
+    dns_cache_stats_t after = stats_now();
+    CHECK(after.misses == before.misses + 2);
+    CHECK(lookup("flaky.example") == 0x0500000a);
+    CHECK(stats_now().hits == after.hits + 1);
+}
+
+static void test_prefetch(void)
+{
+    // A name not cached yet is resolved in the background
+    fake_set("next.example", 0x0600000a, 60, false);
+    DnsCachePrefetch("next.example", 10000);
+    HostWaitForTasks();
+    CHECK(fake_calls("next.example") == 1);
+    dns_cache_stats_t before = stats_now();
+    CHECK(lookup("next.example") == 0x0600000a);
+    CHECK(stats_now().hits == before.hits + 1);
+
+    // Still fresh when needed (plus the 2 s margin): nothing to do
+    DnsCachePrefetch("next.example", 50000);
+    HostWaitForTasks();
+    CHECK(fake_calls("next.example") == 1);
+
+    // Would expire before it is needed: refreshed ahead of time
+    DnsCachePrefetch("next.example", 58500);
+    HostWaitForTasks();
+    CHECK(fake_calls("next.example") == 2);
+}
+
+static void test_eviction(void)
+{
+    // Four entries: filling them with new names evicts the least recently used
+    const char *hosts[] = {"a.example", "b.example", "c.example", "d.example"};
+    for (int i = 0; i < 4; i++)
+    {
+        fake_set(hosts[i], 0x0700000a + (uint32_t)i, 600, false);
+        HostAdvanceTicks(10);
+        CHECK(lookup(hosts[i]) != 0);
+    }
+    HostAdvanceTicks(10);
+    CHECK(lookup("a.example") != 0); // b.example is now the oldest
+
+    fake_set("e.example", 0x0800000a, 600, false);
+    HostAdvanceTicks(10);
+    CHECK(lookup("e.example") == 0x0800000a);
+
+    dns_cache_stats_t before = stats_now();
+    CHECK(lookup("a.example") != 0);
+    CHECK(lookup("c.example") != 0);
+    CHECK(stats_now().misses == before.misses);
+    CHECK(lookup("b.example") != 0);
+    CHECK(stats_now().misses == before.misses + 1);
+    CHECK(fake_calls("b.example") == 2);
+}
+
+int main(void)
+{
+    // The tests share the cache and its clock, so they run in this order
+    test_builtin_resolver();
+    test_miss_then_hit();
+    test_expired_served_stale();
+    test_ttl_limits();
+    test_resolver_failure();
+    test_prefetch();
+    test_eviction();
+    return TEST_RESULT();
+}
@@ -0,0 +1,214 @@
+#include "test.h"
+#include "zctiming.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PERIOD_US 10000 // 50 Hz mains, two crossings per cycle
+
+/**
+ * @brief Feed edges at a fixed interval
+ * @return Time of the last edge
+ */
+static uint64_t feed(zc_detector_t *detector, uint64_t first, uint32_t interval_us, int count)
+{
+    uint64_t at = first;
+    for (int i = 0; i < count; i++)
+    {
+        at = first + (uint64_t)i * interval_us;
+        CHECK(ZcTimingEdge(detector, at));
+    }
+    return at;
+}
+
+static void test_lock(void)
+{
+    zc_detector_t detector = {0};
+
+    // The first edge only starts the measurement, the second gives the interval
+    uint64_t last = feed(&detector, 1000, PERIOD_US, 2);
+    CHECK(detector.interval_us == PERIOD_US && detector.regular == 0);
+    CHECK(!ZcTimingIsLocked(&detector, last));
+
+    // ZERO_CROSS_LOCK_EDGES matching intervals lock the detector
+    last = feed(&detector, last + PERIOD_US, PERIOD_US, ZERO_CROSS_LOCK_EDGES - 1);
+    CHECK(!ZcTimingIsLocked(&detector, last));
+    last = feed(&detector, last + PERIOD_US, PERIOD_US, 1);
+    CHECK(ZcTimingIsLocked(&detector, last));
+
+    // One missed edge is tolerated, two are not
+    CHECK(ZcTimingIsLocked(&detector, last + 2 * PERIOD_US));
+    CHECK(!ZcTimingIsLocked(&detector, last + 2 * PERIOD_US + 1));
+
+    // An edge after the signal was lost restarts the measurement
+    CHECK(ZcTimingEdge(&detector, last + ZERO_CROSS_MAX_INTERVAL_US + 1));
+    CHECK(detector.interval_us == 0 && detector.regular == 0);
+}
+
+static void test_noise(void)
+{
+    zc_detector_t detector = {0};
+    uint64_t last = feed(&detector, 0, PERIOD_US, ZERO_CROSS_LOCK_EDGES + 2);
+    zc_detector_t before = detector;
+
+    // Edges within 3/4 of the interval are dropped without touching the timing
+    CHECK(!ZcTimingEdge(&detector, last + 300));
+    CHECK(!ZcTimingEdge(&detector, last + PERIOD_US * 3 / 4 - 1));
+    CHECK(memcmp(&detector, &before, sizeof(detector)) == 0);
+    CHECK(ZcTimingIsLocked(&detector, last + PERIOD_US));
+
+    // Before an interval is known, anything under ZERO_CROSS_MIN_INTERVAL_US is noise
+    zc_detector_t fresh = {0};
+    CHECK(ZcTimingEdge(&fresh, 5000));
+    CHECK(!ZcTimingEdge(&fresh, 5000 + ZERO_CROSS_MIN_INTERVAL_US - 1));
+    CHECK(ZcTimingEdge(&fresh, 5000 + ZERO_CROSS_MIN_INTERVAL_US));
+}
+
+static void test_frequency(void)
+{
+    zc_detector_t detector = {0};
+    uint64_t last = feed(&detector, 0, PERIOD_US, ZERO_CROSS_LOCK_EDGES + 2);
+
+    // Jitter within 1/8 of the interval is filtered
+    CHECK(ZcTimingEdge(&detector, last + PERIOD_US + 80));
+    CHECK(detector.interval_us == PERIOD_US + 10);
+    CHECK(ZcTimingIsLocked(&detector, last + PERIOD_US + 80));
+
+    // Slow drift to 49 Hz is followed without losing the lock
+    last += PERIOD_US + 80;
+    for (int i = 0; i < 40; i++)
+    {
+        last += 10204;
+        CHECK(ZcTimingEdge(&detector, last));
+        CHECK(ZcTimingIsLocked(&detector, last));
+    }
+    // The filter steps by 1/8 of the difference, so it settles within 7 us
+    CHECK(detector.interval_us >= 10204 - 7 && detector.interval_us <= 10204);
+
+    // A jump to 60 Hz restarts the lock at the new interval
+    last += 8333;
+    CHECK(ZcTimingEdge(&detector, last));
+    CHECK(detector.interval_us == 8333 && detector.regular == 0);
+    CHECK(!ZcTimingIsLocked(&detector, last));
+    last = feed(&detector, last + 8333, 8333, ZERO_CROSS_LOCK_EDGES);
+    CHECK(ZcTimingIsLocked(&detector, last));
+}
+
+static void test_next_crossing(void)
+{
+    zc_detector_t detector = {.have_edge = true, .last_edge_us = 50000, .interval_us = PERIOD_US,
+                              .regular = ZERO_CROSS_LOCK_EDGES};
+
+    // The crossing belonging to the last edge while it is still ahead
+    CHECK(ZcTimingNextCrossing(&detector, 50100, 300) == 50300);
+    CHECK(ZcTimingNextCrossing(&detector, 50300, 300) == 50300);
+
+    // Otherwise whole intervals later
+    CHECK(ZcTimingNextCrossing(&detector, 50301, 300) == 60300);
+    CHECK(ZcTimingNextCrossing(&detector, 60300, 300) == 60300);
+    CHECK(ZcTimingNextCrossing(&detector, 78000, 300) == 80300);
+}
+
+static void test_schedule(void)
+{
+    const zero_cross_step_t steps[] = {
+        {.delay_us = 4000, .clear_bits = 1u << 17},
+        {.delay_us = 8000, .set_bits = 1u << 16},
+        {.delay_us = 6000, .set_bits = 1u << 18},
+    };
+    zc_scheduled_step_t plan[3];
+
+    // The slowest relay is written first; all contacts change at the crossing
+    ZcTimingSchedule(steps, 3, 100000, plan);
+    CHECK(plan[0].at_us == 92000 && plan[0].step.set_bits == 1u << 16);
+    CHECK(plan[1].at_us == 94000 && plan[1].step.set_bits == 1u << 18);
+    CHECK(plan[2].at_us == 96000 && plan[2].step.clear_bits == 1u << 17);
+    for (int i = 0; i < 3; i++)
+    {
+        CHECK(plan[i].at_us + plan[i].step.delay_us == 100000);
+    }
+}
+
+/**
+ * @brief Uniform random value in [-range, range]
+ */
+static int32_t jitter(int32_t range)
+{
+    return rand() % (2 * range + 1) - range;
+}
+
+static void test_simulated_mains(void)
+{
+    // Detector edges at each crossing with 20 us of jitter, a noise pulse every
+    // seventh half cycle, and transitions requested at random times; the
+    // contacts must change within 150 us of a real crossing
+    const uint32_t operate_us = 8000;
+    const uint32_t release_us = 3500;
+    const uint32_t lead_us = 200;
+    zc_detector_t detector = {0};
+    uint32_t max_error_us = 0;
+    uint64_t max_wait_us = 0;
+    int transitions = 0;
+
+    srand(1);
+    uint64_t crossing = 1234;
+    for (int half_cycle = 0; half_cycle < 2000; half_cycle++)
+    {
+        crossing += PERIOD_US;
+        uint64_t edge = crossing + jitter(20);
+        ZcTimingEdge(&detector, edge);
+        if (half_cycle % 7 == 3)
+        {
+            CHECK(!ZcTimingEdge(&detector, edge + 200 + (uint64_t)(rand() % 3000)));
+        }
+
+        uint64_t now = edge + (uint64_t)(rand() % PERIOD_US);
+        if (!ZcTimingIsLocked(&detector, now))
+        {
+            continue;
+        }
+
+        const zero_cross_step_t steps[] = {
+            {.delay_us = operate_us, .set_bits = 1u << 16},
+            {.delay_us = release_us, .clear_bits = 1u << 17},
+        };
+        zc_scheduled_step_t plan[2];
+        uint64_t target = ZcTimingNextCrossing(&detector, now + lead_us + operate_us, 0);
+        ZcTimingSchedule(steps, 2, target, plan);
+        CHECK(plan[0].at_us >= now + lead_us);
+        CHECK(plan[0].at_us <= plan[1].at_us);
+
+        for (int i = 0; i < 2; i++)
+        {
+            // The alarm interrupt writes a few microseconds late
+            uint64_t contact = plan[i].at_us + (uint64_t)(rand() % 5) + plan[i].step.delay_us;
+            uint64_t phase = (contact - 1234) % PERIOD_US;
+            uint32_t error_us = (uint32_t)((phase < PERIOD_US / 2) ? phase : PERIOD_US - phase);
+            if (error_us > max_error_us)
+            {
+                max_error_us = error_us;
+            }
+        }
+        if (target - now > max_wait_us)
+        {
+            max_wait_us = target - now;
+        }
+        transitions++;
+    }
+
+    printf("%d transitions, contacts within %u us of a crossing, longest wait %llu us\n", transitions,
+           (unsigned)max_error_us, (unsigned long long)max_wait_us);
+    CHECK(transitions > 1900);
+    CHECK(max_error_us < 150);
+    CHECK(max_wait_us < 4 * PERIOD_US);
+}
+
+int main(void)
+{
+    test_lock();
+    test_noise();
+    test_frequency();
+    test_next_crossing();
+    test_schedule();
+    test_simulated_mains();
+    return TEST_RESULT();
+}
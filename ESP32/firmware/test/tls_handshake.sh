@@ -0,0 +1,72 @@
+#!/usr/bin/env bash
+# Handshake cost of a full and a resumed TLS 1.2 session against an HTTPS server
+#
+# Usage: tls_handshake.sh [-h host] [-p port] [-k ec|rsa] [-s seconds]
+#
+# Without -h a local stand-in server (openssl s_server) is started with a
+# throwaway certificate of the given key type. Reports the bytes each side
+# sends during the handshake and how many handshakes per second the host
+# completes, with and without resuming the session. Needs openssl.
+
+set -euo pipefail
+
+HOST=
+PORT=8443
+KEY=ec
+SECONDS_PER_RUN=3
+
+while getopts "h:p:k:s:" opt; do
+    case "$opt" in
+    h) HOST=$OPTARG ;;
+    p) PORT=$OPTARG ;;
+    k) KEY=$OPTARG ;;
+    s) SECONDS_PER_RUN=$OPTARG ;;
+    *) sed -n '4p' "$0" >&2; exit 2 ;;
+    esac
+done
+
+WORK=$(mktemp -d)
+SERVER=
+cleanup()
+{
+    if [ -n "$SERVER" ]; then
+        kill "$SERVER" 2>/dev/null || true
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+if [ -z "$HOST" ]; then
+    HOST=127.0.0.1
+    case "$KEY" in
+    ec) KEY_OPTS=(-newkey ec -pkeyopt ec_paramgen_curve:P-256) ;;
+    rsa) KEY_OPTS=(-newkey rsa:2048) ;;
+    *) echo "Unknown key type: $KEY" >&2; exit 2 ;;
+    esac
+    openssl req -x509 "${KEY_OPTS[@]}" -nodes -days 1 -subj /CN=localhost \
+        -keyout "$WORK/key.pem" -out "$WORK/cert.pem" 2>/dev/null
+    openssl s_server -accept "$PORT" -cert "$WORK/cert.pem" -key "$WORK/key.pem" -tls1_2 -www -quiet \
+        > /dev/null 2>&1 &
+    SERVER=$!
+    sleep 1
+fi
+echo "Server $HOST:$PORT"
+
+# "SSL handshake has read <n> bytes and written <n> bytes" of one connection
+handshake()
+{
+    echo | openssl s_client -connect "$HOST:$PORT" -tls1_2 "$@" 2>/dev/null |
+        awk '/handshake has read/ { bytes = "read " $5 " bytes, written " $9 " bytes" }
+             /^(New|Reused),/ { sub(/,.*/, ""); kind = tolower($0) }
+             END { print bytes " (" kind " session)" }'
+}
+
+# Handshakes per second over one run of s_time
+rate()
+{
+    openssl s_time -connect "$HOST:$PORT" "$1" -time "$SECONDS_PER_RUN" 2>/dev/null |
+        awk '/connections\/user sec/ { print $5 " handshakes/s"; exit }'
+}
+
+echo "Full:    $(handshake -sess_out "$WORK/session.pem"), $(rate -new)"
+echo "Resumed: $(handshake -sess_in "$WORK/session.pem"), $(rate -reuse)"
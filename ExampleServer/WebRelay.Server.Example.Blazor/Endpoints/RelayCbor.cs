@@ -0,0 +1,362 @@
+using System.Text;
+using WebRelay.Server.Example.Blazor.Services;
+
+namespace WebRelay.Server.Example.Blazor.Endpoints;
+
+/// <summary>
+/// Compact CBOR (RFC 8949) encoding of the relay protocol, used when the device sends
+/// "Accept: application/cbor". Maps use small integer keys instead of member names:
+/// command { 0: command_id, 1: seq, 2: ack_now, 3: { relay number: { 0: state, 1: duration } }, 4: scene },
+/// where a relay map may add a waveform { 2: pulse µs, 3: gap µs, 4: count } or { 5: pwm Hz, 6: duty % },
+/// ACK { 0: command_id, 1: seq, 2: status, 3: relay }. A batch of commands or ACKs is an array of maps.
+/// </summary>
+public static class RelayCbor
+{
+    public const string ContentType = "application/cbor";
+
+    private const int KeyCommandId = 0;
+    private const int KeySeq = 1;
+    private const int KeyAckNow = 2;
+    private const int KeyRelays = 3;
+    private const int KeyScene = 4;
+    private const int KeyState = 0;
+    private const int KeyDuration = 1;
+    private const int KeyPulse = 2;
+    private const int KeyGap = 3;
+    private const int KeyCount = 4;
+    private const int KeyPwm = 5;
+    private const int KeyDuty = 6;
+    private const int KeyStatus = 2;
+    private const int KeyRelay = 3;
+
+    private const int MajorUnsigned = 0;
+    private const int MajorNegative = 1;
+    private const int MajorBytes = 2;
+    private const int MajorText = 3;
+    private const int MajorArray = 4;
+    private const int MajorMap = 5;
+    private const int MajorTag = 6;
+    private const int MajorSimple = 7;
+
+    /// <summary>
+    /// Check whether the request's Accept header asks for CBOR
+    /// </summary>
+    public static bool IsAccepted(HttpRequest request)
+    {
+        return request.GetTypedHeaders().Accept.Any(mediaType =>
+            mediaType.MediaType.Equals(ContentType, StringComparison.OrdinalIgnoreCase) &&
+            (mediaType.Quality ?? 1.0) > 0);
+    }
+
+    /// <summary>
+    /// Encode the commands of a poll response: none is the empty map, one is a
+    /// plain command map, several are an array of command maps
+    /// </summary>
+    public static byte[] EncodeCommands(IReadOnlyList<RelayCommand> commands)
+    {
+        var output = new List<byte>(32 * Math.Max(commands.Count, 1));
+        if (commands.Count == 0)
+        {
+            WriteHead(output, MajorMap, 0);
+        }
+        else if (commands.Count == 1)
+        {
+            WriteCommand(output, commands[0]);
+        }
+        else
+        {
+            WriteHead(output, MajorArray, (ulong)commands.Count);
+            foreach (var command in commands)
+            {
+                WriteCommand(output, command);
+            }
+        }
+        return output.ToArray();
+    }
+
+    private static void WriteCommand(List<byte> output, RelayCommand command)
+    {
+        var relays = new List<(int Number, RelayState State)>();
+        if (command.Relay1 != null)
+        {
+            relays.Add((1, command.Relay1));
+        }
+        if (command.Relay2 != null)
+        {
+            relays.Add((2, command.Relay2));
+        }
+
+        var count = (command.CommandId != null ? 1 : 0) + 1 + (command.AckNow == true ? 1 : 0) + (relays.Count > 0 ? 1 : 0) +
+                    (command.Scene != null ? 1 : 0);
+        WriteHead(output, MajorMap, (ulong)count);
+
+        if (command.CommandId != null)
+        {
+            WriteHead(output, MajorUnsigned, KeyCommandId);
+            WriteText(output, command.CommandId);
+        }
+
+        WriteHead(output, MajorUnsigned, KeySeq);
+        WriteHead(output, MajorUnsigned, (ulong)command.Seq);
+
+        if (command.AckNow == true)
+        {
+            WriteHead(output, MajorUnsigned, KeyAckNow);
+            output.Add(0xF5); // true
+        }
+
+        if (relays.Count > 0)
+        {
+            WriteHead(output, MajorUnsigned, KeyRelays);
+            WriteHead(output, MajorMap, (ulong)relays.Count);
+            foreach (var (number, state) in relays)
+            {
+                var members = new List<(int Key, ulong Value)> { (KeyState, (ulong)state.State) };
+                if (state.Duration != null)
+                {
+                    members.Add((KeyDuration, (ulong)state.Duration.Value));
+                }
+                // Pulse and gap go on the wire in µs
+                if (state.Pulse != null)
+                {
+                    members.Add((KeyPulse, (ulong)Math.Round(state.Pulse.Value * 1000)));
+                }
+                if (state.Gap != null)
+                {
+                    members.Add((KeyGap, (ulong)Math.Round(state.Gap.Value * 1000)));
+                }
+                if (state.Count != null)
+                {
+                    members.Add((KeyCount, (ulong)state.Count.Value));
+                }
+                if (state.Pwm != null)
+                {
+                    members.Add((KeyPwm, (ulong)state.Pwm.Value));
+                }
+                if (state.Duty != null)
+                {
+                    members.Add((KeyDuty, (ulong)state.Duty.Value));
+                }
+
+                WriteHead(output, MajorUnsigned, (ulong)number);
+                WriteHead(output, MajorMap, (ulong)members.Count);
+                foreach (var (key, value) in members)
+                {
+                    WriteHead(output, MajorUnsigned, (ulong)key);
+                    WriteHead(output, MajorUnsigned, value);
+                }
+            }
+        }
+
+        if (command.Scene != null)
+        {
+            WriteHead(output, MajorUnsigned, KeyScene);
+            WriteHead(output, MajorUnsigned, (ulong)command.Scene.Value);
+        }
+    }
+
+    /// <summary>
+    /// Decode a single ACK map or an array of them
+    /// </summary>
+    /// <exception cref="FormatException">The payload is not valid CBOR for this protocol</exception>
+    public static List<RelayAck> DecodeAcks(ReadOnlySpan<byte> data)
+    {
+        var reader = new Reader(data);
+        var acks = new List<RelayAck>();
+
+        var (major, argument) = reader.ReadHead();
+        if (major == MajorArray)
+        {
+            for (ulong i = 0; i < argument; i++)
+            {
+                var (itemMajor, itemArgument) = reader.ReadHead();
+                acks.Add(ReadAck(ref reader, itemMajor, itemArgument));
+            }
+        }
+        else
+        {
+            acks.Add(ReadAck(ref reader, major, argument));
+        }
+
+        return acks;
+    }
+
+    private static RelayAck ReadAck(ref Reader reader, int major, ulong pairs)
+    {
+        if (major != MajorMap)
+        {
+            throw new FormatException("ACK must be a CBOR map");
+        }
+
+        var ack = new RelayAck();
+        for (ulong i = 0; i < pairs; i++)
+        {
+            var (keyMajor, key) = reader.ReadHead();
+            var (valueMajor, value) = reader.ReadHead();
+
+            if (keyMajor == MajorUnsigned && key == KeyCommandId && valueMajor == MajorText)
+            {
+                ack.CommandId = reader.ReadText(value);
+            }
+            else if (keyMajor == MajorUnsigned && key == KeySeq && valueMajor == MajorUnsigned)
+            {
+                ack.Seq = (long)value;
+            }
+            else if (keyMajor == MajorUnsigned && key == KeyStatus && valueMajor == MajorText)
+            {
+                ack.Status = reader.ReadText(value);
+            }
+            else if (keyMajor == MajorUnsigned && key == KeyRelay && valueMajor == MajorUnsigned)
+            {
+                ack.Relay = (int)value;
+            }
+            else
+            {
+                reader.SkipItem(valueMajor, value);
+            }
+        }
+        return ack;
+    }
+
+    private static void WriteHead(List<byte> output, int major, ulong value)
+    {
+        var initial = (byte)(major << 5);
+        if (value < 24)
+        {
+            output.Add((byte)(initial | (byte)value));
+        }
+        else if (value <= byte.MaxValue)
+        {
+            output.Add((byte)(initial | 24));
+            output.Add((byte)value);
+        }
+        else if (value <= ushort.MaxValue)
+        {
+            output.Add((byte)(initial | 25));
+            output.Add((byte)(value >> 8));
+            output.Add((byte)value);
+        }
+        else if (value <= uint.MaxValue)
+        {
+            output.Add((byte)(initial | 26));
+            for (var shift = 24; shift >= 0; shift -= 8)
+            {
+                output.Add((byte)(value >> shift));
+            }
+        }
+        else
+        {
+            output.Add((byte)(initial | 27));
+            for (var shift = 56; shift >= 0; shift -= 8)
+            {
+                output.Add((byte)(value >> shift));
+            }
+        }
+    }
+
+    private static void WriteText(List<byte> output, string text)
+    {
+        var bytes = Encoding.UTF8.GetBytes(text);
+        WriteHead(output, MajorText, (ulong)bytes.Length);
+        output.AddRange(bytes);
+    }
+
+    /// <summary>
+    /// Minimal forward-only reader for definite-length items
+    /// </summary>
+    private ref struct Reader
+    {
+        private readonly ReadOnlySpan<byte> _data;
+        private int _position;
+
+        public Reader(ReadOnlySpan<byte> data)
+        {
+            _data = data;
+            _position = 0;
+        }
+
+        public (int Major, ulong Argument) ReadHead()
+        {
+            var initial = ReadByte();
+            var major = initial >> 5;
+            var info = initial & 0x1F;
+
+            ulong argument = info switch
+            {
+                < 24 => (ulong)info,
+                24 => ReadByte(),
+                25 => ReadBigEndian(2),
+                26 => ReadBigEndian(4),
+                27 => ReadBigEndian(8),
+                _ => throw new FormatException("Indefinite-length and reserved items are not supported")
+            };
+            return (major, argument);
+        }
+
+        public string ReadText(ulong length)
+        {
+            var bytes = Take(length);
+            return Encoding.UTF8.GetString(bytes);
+        }
+
+        public void SkipItem(int major, ulong argument)
+        {
+            switch (major)
+            {
+                case MajorBytes:
+                case MajorText:
+                    Take(argument);
+                    break;
+                case MajorArray:
+                case MajorMap:
+                    var items = major == MajorMap ? argument * 2 : argument;
+                    for (ulong i = 0; i < items; i++)
+                    {
+                        var (itemMajor, itemArgument) = ReadHead();
+                        SkipItem(itemMajor, itemArgument);
+                    }
+                    break;
+                case MajorTag:
+                    var (taggedMajor, taggedArgument) = ReadHead();
+                    SkipItem(taggedMajor, taggedArgument);
+                    break;
+                case MajorUnsigned:
+                case MajorNegative:
+                case MajorSimple:
+                default:
+                    // The argument was the whole item
+                    break;
+            }
+        }
+
+        private byte ReadByte()
+        {
+            if (_position >= _data.Length)
+            {
+                throw new FormatException("Unexpected end of CBOR data");
+            }
+            return _data[_position++];
+        }
+
+        private ulong ReadBigEndian(int length)
+        {
+            ulong value = 0;
+            for (var i = 0; i < length; i++)
+            {
+                value = (value << 8) | ReadByte();
+            }
+            return value;
+        }
+
+        private ReadOnlySpan<byte> Take(ulong length)
+        {
+            if (length > (ulong)(_data.Length - _position))
+            {
+                throw new FormatException("Unexpected end of CBOR data");
+            }
+            var slice = _data.Slice(_position, (int)length);
+            _position += (int)length;
+            return slice;
+        }
+    }
+}
@@ -0,0 +1,601 @@
+using System.Net;
+using System.Net.Sockets;
+using System.Text;
+using System.Text.Json;
+using WebRelay.Server.Example.Blazor.Services;
+
+namespace WebRelay.Server.Example.Blazor.Endpoints;
+
+/// <summary>
+/// CoAP (RFC 7252) transport for devices configured with a coap:// URL. The device observes
+/// /api/relay (RFC 7641); queued commands are pushed to it as a confirmable notification, and
+/// the device's CoAP ACK of that notification acknowledges the commands it carried. Reports
+/// (waveform ends, commands held by a manual hold) arrive as confirmable POSTs of the same JSON
+/// the HTTP ACK endpoint takes.
+/// Listens on UDP port "Relay:CoapPort" (default 5683, 0 disables it).
+/// </summary>
+public sealed class RelayCoap : BackgroundService
+{
+    public const int DefaultPort = 5683;
+
+    private const string ResourcePath = "api/relay";
+
+    // RFC 7252 transmission parameters
+    private static readonly TimeSpan AckTimeout = TimeSpan.FromSeconds(2);
+    private const double AckRandomFactor = 1.5;
+    private const int MaxRetransmit = 4;
+
+    // How long to wait for a command before checking the observer again
+    private static readonly TimeSpan CommandWaitInterval = TimeSpan.FromSeconds(30);
+
+    // Commands per notification; the device executes at most 8 per batch
+    private const int MaxBatchSize = 8;
+
+    private readonly RelayCommandService _relayService;
+    private readonly int _port;
+    private readonly object _lock = new();
+    private Observer? _observer;
+    private TaskCompletionSource _observerRegistered = new(TaskCreationOptions.RunContinuationsAsynchronously);
+    private InFlightNotification? _inFlight;
+    private ushort _nextMessageId = (ushort)Random.Shared.Next();
+    private uint _observeSequence;
+
+    public RelayCoap(RelayCommandService relayService, IConfiguration configuration)
+    {
+        _relayService = relayService;
+        _port = configuration.GetValue("Relay:CoapPort", DefaultPort);
+    }
+
+    protected override async Task ExecuteAsync(CancellationToken stoppingToken)
+    {
+        if (_port == 0)
+        {
+            return;
+        }
+
+        UdpClient socket;
+        try
+        {
+            socket = new UdpClient(_port);
+        }
+        catch (SocketException ex)
+        {
+            Console.WriteLine($"CoAP transport disabled - cannot listen on udp/{_port}: {ex.Message}");
+            return;
+        }
+
+        using (socket)
+        {
+            Console.WriteLine($"CoAP transport listening on udp/{_port}");
+            var notifyTask = NotifyObserverAsync(socket, stoppingToken);
+
+            try
+            {
+                await ReceiveAsync(socket, stoppingToken);
+            }
+            catch (OperationCanceledException)
+            {
+                // Server shutting down
+            }
+
+            try
+            {
+                await notifyTask;
+            }
+            catch (OperationCanceledException)
+            {
+            }
+        }
+    }
+
+    /// <summary>
+    /// Handle registrations, deregistrations and the ACKs of notifications
+    /// </summary>
+    private async Task ReceiveAsync(UdpClient socket, CancellationToken cancellationToken)
+    {
+        while (!cancellationToken.IsCancellationRequested)
+        {
+            UdpReceiveResult datagram;
+            try
+            {
+                datagram = await socket.ReceiveAsync(cancellationToken);
+            }
+            catch (SocketException)
+            {
+                // ICMP port unreachable from a device that went away
+                continue;
+            }
+
+            var message = CoapMessage.TryParse(datagram.Buffer);
+            if (message == null)
+            {
+                continue;
+            }
+
+            var reply = HandleMessage(message, datagram.RemoteEndPoint);
+            if (reply != null)
+            {
+                await socket.SendAsync(reply.Encode(), datagram.RemoteEndPoint, cancellationToken);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Process one received message
+    /// </summary>
+    /// <returns>The reply to send, if any</returns>
+    private CoapMessage? HandleMessage(CoapMessage message, IPEndPoint remote)
+    {
+        if (message.Type is CoapMessage.TypeAcknowledgement or CoapMessage.TypeReset)
+        {
+            lock (_lock)
+            {
+                if (_inFlight != null && _inFlight.MessageId == message.MessageId && _inFlight.EndPoint.Equals(remote))
+                {
+                    // A reset means the device no longer wants the notifications
+                    _inFlight.Acknowledged.TrySetResult(message.Type == CoapMessage.TypeAcknowledgement);
+                }
+            }
+            return null;
+        }
+
+        if (message.Code == CoapMessage.CodeEmpty)
+        {
+            // CoAP ping: answered with a reset
+            return message.Type == CoapMessage.TypeConfirmable ? CoapMessage.EmptyReply(CoapMessage.TypeReset, message) : null;
+        }
+
+        if (message.Code is not (CoapMessage.CodeGet or CoapMessage.CodePost))
+        {
+            return CreateResponse(message, CoapMessage.CodeMethodNotAllowed);
+        }
+        if (message.GetPath() != ResourcePath)
+        {
+            return CreateResponse(message, CoapMessage.CodeNotFound);
+        }
+        if (message.Code == CoapMessage.CodePost)
+        {
+            return CreateResponse(message, HandleReport(message.Payload) ? CoapMessage.CodeChanged : CoapMessage.CodeBadRequest);
+        }
+
+        var observe = message.GetUint(CoapMessage.OptionObserve);
+        lock (_lock)
+        {
+            if (observe == 0)
+            {
+                // A new registration (or a refresh with the same token) replaces the previous one;
+                // this example server tracks a single device
+                var isNew = _observer == null || !_observer.EndPoint.Equals(remote) || !_observer.Token.SequenceEqual(message.Token);
+                _observer = new Observer(remote, message.Token, message.GetUint(CoapMessage.OptionAccept) == CoapMessage.FormatCbor);
+                _observerRegistered.TrySetResult();
+                _observerRegistered = new TaskCompletionSource(TaskCreationOptions.RunContinuationsAsynchronously);
+                if (isNew)
+                {
+                    Console.WriteLine($"Device {remote} observing over CoAP");
+                }
+
+                // Commands are only ever delivered in confirmable notifications, so the answer is empty
+                var response = CreateResponse(message, CoapMessage.CodeContent);
+                response.Options.Add((CoapMessage.OptionObserve, CoapMessage.EncodeUint(NextObserveSequence())));
+                return response;
+            }
+
+            if (observe == 1 && _observer != null && _observer.EndPoint.Equals(remote) && _observer.Token.SequenceEqual(message.Token))
+            {
+                _observer = null;
+                Console.WriteLine($"Device {remote} stopped observing");
+            }
+        }
+
+        // A plain GET (or a deregistration) gets an empty representation without Observe
+        return CreateResponse(message, CoapMessage.CodeContent);
+    }
+
+    /// <summary>
+    /// Apply a report POSTed by the device. A retransmitted POST is applied again,
+    /// which changes nothing: ACKs are cumulative and a waveform end is only logged again.
+    /// </summary>
+    /// <returns>false if the payload is not a valid report</returns>
+    private bool HandleReport(byte[] payload)
+    {
+        List<RelayAck?>? reports;
+        try
+        {
+            var body = Encoding.UTF8.GetString(payload);
+            reports = body.TrimStart().StartsWith('[')
+                ? JsonSerializer.Deserialize<List<RelayAck?>>(body, RelayEndpoints.JsonOptions)
+                : [JsonSerializer.Deserialize<RelayAck>(body, RelayEndpoints.JsonOptions)];
+        }
+        catch (JsonException)
+        {
+            return false;
+        }
+
+        foreach (var report in reports ?? [])
+        {
+            if (report?.IsWaveformReport == true)
+            {
+                _relayService.ReportWaveformEnd(report.CommandId, report.Relay!.Value, report.Status!);
+                continue;
+            }
+            var seq = report?.GetSeq();
+            if (seq != null)
+            {
+                // Arrives before the ACK of the notification that caused it, so held
+                // commands are dropped before the notification's commands are applied
+                _relayService.AcknowledgeCommand(seq.Value, report!.GetHeld());
+            }
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Push queued commands to the observing device, one confirmable notification at a time
+    /// </summary>
+    private async Task NotifyObserverAsync(UdpClient socket, CancellationToken cancellationToken)
+    {
+        while (!cancellationToken.IsCancellationRequested)
+        {
+            // Commands stay queued until a device is observing
+            Task registered;
+            lock (_lock)
+            {
+                registered = _observer == null ? _observerRegistered.Task : Task.CompletedTask;
+            }
+            await registered.WaitAsync(cancellationToken);
+
+            // Commands leave the queue only once the device has acknowledged the notification
+            var commands = await _relayService.PeekPendingCommandsAsync(CommandWaitInterval, MaxBatchSize, cancellationToken);
+            if (commands.Count == 0)
+            {
+                continue;
+            }
+
+            Observer? observer;
+            lock (_lock)
+            {
+                observer = _observer;
+            }
+            if (observer == null)
+            {
+                Console.WriteLine($"CoAP device went away - {commands.Count} command(s) left queued");
+                _relayService.ReleasePendingCommands();
+                continue;
+            }
+
+            var lastSeq = commands.Max(command => command.Seq);
+            if (await SendNotificationAsync(socket, observer, commands, cancellationToken))
+            {
+                _relayService.MarkDelivered(lastSeq);
+                _relayService.AcknowledgeCommand(lastSeq);
+                continue;
+            }
+            _relayService.ReleasePendingCommands();
+
+            // RFC 7641: a notification that is reset or never acknowledged ends the observation
+            lock (_lock)
+            {
+                if (_observer == observer)
+                {
+                    _observer = null;
+                }
+            }
+            Console.WriteLine($"Device {observer.EndPoint} did not acknowledge notification - observation cancelled");
+        }
+    }
+
+    /// <summary>
+    /// Send commands as a confirmable notification, retransmitting with exponential back-off
+    /// </summary>
+    /// <returns>true once the device has acknowledged it, false if it reset it or never answered</returns>
+    private async Task<bool> SendNotificationAsync(UdpClient socket, Observer observer, List<RelayCommand> commands, CancellationToken cancellationToken)
+    {
+        var payload = observer.UseCbor
+            ? RelayCbor.EncodeCommands(commands)
+            : commands.Count == 1
+                ? JsonSerializer.SerializeToUtf8Bytes(commands[0], RelayEndpoints.JsonOptions)
+                : JsonSerializer.SerializeToUtf8Bytes(commands, RelayEndpoints.JsonOptions);
+
+        var inFlight = new InFlightNotification(observer.EndPoint);
+        CoapMessage notification;
+        lock (_lock)
+        {
+            inFlight.MessageId = _nextMessageId++;
+            notification = new CoapMessage
+            {
+                Type = CoapMessage.TypeConfirmable,
+                Code = CoapMessage.CodeContent,
+                MessageId = inFlight.MessageId,
+                Token = observer.Token,
+                Options =
+                [
+                    (CoapMessage.OptionObserve, CoapMessage.EncodeUint(NextObserveSequence())),
+                    (CoapMessage.OptionContentFormat, CoapMessage.EncodeUint((uint)(observer.UseCbor ? CoapMessage.FormatCbor : CoapMessage.FormatJson)))
+                ],
+                Payload = payload
+            };
+            _inFlight = inFlight;
+        }
+
+        var datagram = notification.Encode();
+        var timeout = AckTimeout * (1 + Random.Shared.NextDouble() * (AckRandomFactor - 1));
+        try
+        {
+            for (var attempt = 0; attempt <= MaxRetransmit; attempt++)
+            {
+                await socket.SendAsync(datagram, observer.EndPoint, cancellationToken);
+                try
+                {
+                    return await inFlight.Acknowledged.Task.WaitAsync(timeout, cancellationToken);
+                }
+                catch (TimeoutException)
+                {
+                    timeout *= 2;
+                }
+            }
+            return false;
+        }
+        catch (SocketException)
+        {
+            // The device's address is unreachable
+            return false;
+        }
+        finally
+        {
+            lock (_lock)
+            {
+                _inFlight = null;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Next Observe option value (24 bits, wrapping); must be called with _lock held
+    /// </summary>
+    private uint NextObserveSequence()
+    {
+        _observeSequence = (_observeSequence + 1) & 0xFFFFFF;
+        return _observeSequence;
+    }
+
+    /// <summary>
+    /// Response to a request: piggybacked on the ACK of a confirmable request, or a
+    /// non-confirmable message of its own
+    /// </summary>
+    private CoapMessage CreateResponse(CoapMessage request, int code)
+    {
+        var confirmable = request.Type == CoapMessage.TypeConfirmable;
+        ushort messageId;
+        lock (_lock)
+        {
+            messageId = confirmable ? request.MessageId : _nextMessageId++;
+        }
+
+        return new CoapMessage
+        {
+            Type = confirmable ? CoapMessage.TypeAcknowledgement : CoapMessage.TypeNonConfirmable,
+            Code = code,
+            MessageId = messageId,
+            Token = request.Token
+        };
+    }
+
+    /// <summary>
+    /// The device observing the command resource
+    /// </summary>
+    private sealed record Observer(IPEndPoint EndPoint, byte[] Token, bool UseCbor);
+
+    /// <summary>
+    /// A notification waiting for the device's ACK
+    /// </summary>
+    private sealed class InFlightNotification(IPEndPoint endPoint)
+    {
+        public IPEndPoint EndPoint { get; } = endPoint;
+        public ushort MessageId { get; set; }
+        public TaskCompletionSource<bool> Acknowledged { get; } = new(TaskCreationOptions.RunContinuationsAsynchronously);
+    }
+}
+
+/// <summary>
+/// A CoAP message (RFC 7252 section 3): 4-byte header, token, options in ascending order, payload
+/// </summary>
+internal sealed class CoapMessage
+{
+    public const int TypeConfirmable = 0;
+    public const int TypeNonConfirmable = 1;
+    public const int TypeAcknowledgement = 2;
+    public const int TypeReset = 3;
+
+    public const int CodeEmpty = 0x00;
+    public const int CodeGet = 0x01;
+    public const int CodePost = 0x02;
+    public const int CodeChanged = 0x44;          // 2.04
+    public const int CodeContent = 0x45;          // 2.05
+    public const int CodeBadRequest = 0x80;       // 4.00
+    public const int CodeNotFound = 0x84;         // 4.04
+    public const int CodeMethodNotAllowed = 0x85; // 4.05
+
+    public const int OptionObserve = 6;
+    public const int OptionUriPath = 11;
+    public const int OptionContentFormat = 12;
+    public const int OptionAccept = 17;
+
+    public const int FormatJson = 50;
+    public const int FormatCbor = 60;
+
+    private const int Version = 1;
+    private const byte PayloadMarker = 0xFF;
+
+    public int Type { get; init; }
+    public int Code { get; init; }
+    public ushort MessageId { get; init; }
+    public byte[] Token { get; init; } = [];
+    public List<(int Number, byte[] Value)> Options { get; init; } = [];
+    public byte[] Payload { get; init; } = [];
+
+    /// <summary>
+    /// An empty ACK or reset answering a message
+    /// </summary>
+    public static CoapMessage EmptyReply(int type, CoapMessage message) => new()
+    {
+        Type = type,
+        Code = CodeEmpty,
+        MessageId = message.MessageId
+    };
+
+    /// <summary>
+    /// Parse a datagram
+    /// </summary>
+    /// <returns>The message, or null if it is not valid CoAP</returns>
+    public static CoapMessage? TryParse(byte[] data)
+    {
+        if (data.Length < 4 || data[0] >> 6 != Version || (data[0] & 0x0F) > 8 || 4 + (data[0] & 0x0F) > data.Length)
+        {
+            return null;
+        }
+
+        var tokenLength = data[0] & 0x0F;
+        var options = new List<(int Number, byte[] Value)>();
+        var pos = 4 + tokenLength;
+        var number = 0;
+        while (pos < data.Length && data[pos] != PayloadMarker)
+        {
+            var header = data[pos++];
+            if (!TryReadExtended(data, ref pos, header >> 4, out var delta) ||
+                !TryReadExtended(data, ref pos, header & 0x0F, out var length) ||
+                pos + length > data.Length)
+            {
+                return null;
+            }
+
+            number += delta;
+            options.Add((number, data[pos..(pos + length)]));
+            pos += length;
+        }
+
+        return new CoapMessage
+        {
+            Type = (data[0] >> 4) & 0x03,
+            Code = data[1],
+            MessageId = (ushort)((data[2] << 8) | data[3]),
+            Token = data[4..(4 + tokenLength)],
+            Options = options,
+            Payload = pos < data.Length ? data[(pos + 1)..] : []
+        };
+    }
+
+    /// <summary>
+    /// Encode the message into a datagram
+    /// </summary>
+    public byte[] Encode()
+    {
+        var output = new List<byte>(16 + Payload.Length)
+        {
+            (byte)((Version << 6) | (Type << 4) | Token.Length),
+            (byte)Code,
+            (byte)(MessageId >> 8),
+            (byte)(MessageId & 0xFF)
+        };
+        output.AddRange(Token);
+
+        var last = 0;
+        foreach (var (number, value) in Options.OrderBy(option => option.Number))
+        {
+            var headerIndex = output.Count;
+            output.Add(0);
+            var delta = WriteExtended(output, number - last);
+            var length = WriteExtended(output, value.Length);
+            output[headerIndex] = (byte)((delta << 4) | length);
+            output.AddRange(value);
+            last = number;
+        }
+
+        if (Payload.Length > 0)
+        {
+            output.Add(PayloadMarker);
+            output.AddRange(Payload);
+        }
+        return output.ToArray();
+    }
+
+    /// <summary>
+    /// Value of an unsigned integer option, or null if the option is absent
+    /// </summary>
+    public uint? GetUint(int number)
+    {
+        foreach (var (optionNumber, value) in Options)
+        {
+            if (optionNumber == number)
+            {
+                return value.Aggregate(0u, (result, b) => (result << 8) | b);
+            }
+        }
+        return null;
+    }
+
+    /// <summary>
+    /// The Uri-Path options joined with '/'
+    /// </summary>
+    public string GetPath()
+    {
+        return string.Join('/', Options
+            .Where(option => option.Number == OptionUriPath)
+            .Select(option => Encoding.UTF8.GetString(option.Value)));
+    }
+
+    /// <summary>
+    /// Shortest encoding of an unsigned integer option value (0 is empty)
+    /// </summary>
+    public static byte[] EncodeUint(uint value)
+    {
+        var bytes = new List<byte>(4);
+        for (var shift = 24; shift >= 0; shift -= 8)
+        {
+            if (bytes.Count > 0 || ((value >> shift) & 0xFF) != 0)
+            {
+                bytes.Add((byte)(value >> shift));
+            }
+        }
+        return bytes.ToArray();
+    }
+
+    private static bool TryReadExtended(byte[] data, ref int pos, int nibble, out int value)
+    {
+        value = nibble;
+        if (nibble == 13)
+        {
+            if (pos + 1 > data.Length)
+            {
+                return false;
+            }
+            value = 13 + data[pos];
+            pos += 1;
+        }
+        else if (nibble == 14)
+        {
+            if (pos + 2 > data.Length)
+            {
+                return false;
+            }
+            value = 269 + ((data[pos] << 8) | data[pos + 1]);
+            pos += 2;
+        }
+        return nibble != 15;
+    }
+
+    private static int WriteExtended(List<byte> output, int value)
+    {
+        if (value < 13)
+        {
+            return value;
+        }
+        if (value < 269)
+        {
+            output.Add((byte)(value - 13));
+            return 13;
+        }
+        output.Add((byte)((value - 269) >> 8));
+        output.Add((byte)((value - 269) & 0xFF));
+        return 14;
+    }
+}
@@ -6,41 +6,249 @@ namespace WebRelay.Server.Example.Blazor.Endpoints;
 
 public static class RelayEndpoints
 {
-    private static readonly JsonSerializerOptions JsonOptions = new()
+    internal static readonly JsonSerializerOptions JsonOptions = new()
     {
         PropertyNamingPolicy = JsonNamingPolicy.SnakeCaseLower,
         DefaultIgnoreCondition = JsonIgnoreCondition.WhenWritingNull
     };
 
+    // Upper bound for the wait budget a device may request for a long-poll
+    private const int MaxLongPollWaitSeconds = 30;
+
+    // Upper bound for the number of commands a device may request per poll
+    private const int MaxBatchSize = 32;
+
+    // Scenes a device stores (SCENE_MAX in the firmware)
+    private const int MaxScene = 16;
+
+    // Relays a device can drive (RELAY_MAX_COUNT in the firmware)
+    private const int MaxRelay = 16;
+
+    // Waveform limits of the firmware (WAVEFORM_MAX_PWM_HZ, 16-bit pulse count)
+    private const int MaxPwmHz = 1000;
+    private const int MaxPulseCount = 65535;
+    private const double MinWaveformMs = 0.001;
+
     public static void MapRelayEndpoints(this WebApplication app)
     {
+        // Servers a device may use, in order of preference ("Relay:Endpoints" in appsettings).
+        // Sent to devices in "X-Relay-Endpoints" so a fleet can be moved between regional
+        // servers without touching each device; empty means devices keep their own list.
+        var endpointList = string.Join(' ', app.Configuration.GetSection("Relay:Endpoints").Get<string[]>() ?? []);
+
         // GET endpoint - ESP32 polls this for commands
-        app.MapGet("/api/relay", (RelayCommandService relayService) =>
+        // Devices that send "X-Relay-Wait: <seconds>" are long-polled: the request is parked
+        // until a command is queued or the wait budget runs out. The granted budget is echoed
+        // in "X-Relay-Long-Poll" so the device knows it may re-issue the GET immediately.
+        // Devices without the header get an immediate answer (plain polling).
+        // Every answer carries the queue's ETag; when nothing is queued and the device sends
+        // that tag in If-None-Match the answer is 304 without a body. "X-Relay-Next-Poll"
+        // suggests the delay in ms before the next poll while commands are flowing.
+        // "X-Relay-Ack: <seq>" acknowledges every delivered command up to that sequence number,
+        // so a device that polls again needs no separate ACK POST. "X-Relay-Held: <seq>,<seq>"
+        // lists the ones among them that a manual hold kept from running.
+        // "X-Relay-Batch: <n>" lets the device take up to n queued commands at once; they are
+        // returned in order as an array (a single command is still a plain object). Devices
+        // without the header get one command per poll.
+        // Devices that list "application/cbor" in Accept get the command CBOR-encoded (see
+        // RelayCbor); everyone else gets JSON.
+        // A WebSocket upgrade on the same URL opens a push session instead (see RelayWebSocket).
+        // "X-Relay-Endpoints" carries the configured server list (see above).
+        // "X-Relay-Lan: <url>" is sent by devices with a LAN key; new commands are then
+        // POSTed to that URL directly and only fall back to polling if it fails (see RelayLanClient).
+        // "X-Relay-Schedule-Version: <n>" reports the version of the device's stored schedule; if the
+        // server manages schedules and its version differs, "X-Relay-Schedule" carries the new one.
+        app.MapGet("/api/relay", async (HttpRequest request, HttpResponse response, RelayCommandService relayService,
+            RelayLanClient lanClient, RelayScheduleService scheduleService) =>
         {
-            var command = relayService.GetAndClearPendingCommand();
+            if (request.HttpContext.WebSockets.IsWebSocketRequest)
+            {
+                using var socket = await request.HttpContext.WebSockets.AcceptWebSocketAsync();
+                await RelayWebSocket.RunSessionAsync(socket, relayService, request.HttpContext.RequestAborted);
+                return Results.Empty;
+            }
+
+            if (long.TryParse(request.Headers["X-Relay-Ack"], out var ackedSeq))
+            {
+                relayService.AcknowledgeCommand(ackedSeq, ParseHeld(request.Headers["X-Relay-Held"]));
+            }
+
+            lanClient.UpdateDeviceEndpoint(request.Headers["X-Relay-Lan"]);
+
+            var batchSize = 1;
+            if (int.TryParse(request.Headers["X-Relay-Batch"], out var requestedBatch) && requestedBatch > 1)
+            {
+                batchSize = Math.Min(requestedBatch, MaxBatchSize);
+            }
+
+            List<RelayCommand> commands;
+
+            if (int.TryParse(request.Headers["X-Relay-Wait"], out var waitSeconds) && waitSeconds > 0)
+            {
+                waitSeconds = Math.Min(waitSeconds, MaxLongPollWaitSeconds);
+                response.Headers["X-Relay-Long-Poll"] = waitSeconds.ToString();
+
+                try
+                {
+                    commands = await relayService.WaitForPendingCommandsAsync(
+                        TimeSpan.FromSeconds(waitSeconds), batchSize, request.HttpContext.RequestAborted);
+                }
+                catch (OperationCanceledException)
+                {
+                    // Device went away while parked
+                    return Results.Empty;
+                }
+            }
+            else
+            {
+                commands = relayService.TakePendingCommands(batchSize);
+            }
+
+            var etag = relayService.CurrentETag;
+            response.Headers.ETag = etag;
+            response.Headers.Vary = "Accept";
+            if (endpointList.Length > 0)
+            {
+                response.Headers["X-Relay-Endpoints"] = endpointList;
+            }
+            var scheduleUpdate = scheduleService.GetUpdateFor(request.Headers["X-Relay-Schedule-Version"]);
+            if (scheduleUpdate != null)
+            {
+                response.Headers["X-Relay-Schedule"] = scheduleUpdate;
+            }
+            var useCbor = RelayCbor.IsAccepted(request);
+
+            var nextPollMs = relayService.GetNextPollHintMs();
+            if (nextPollMs != null)
+            {
+                response.Headers["X-Relay-Next-Poll"] = nextPollMs.Value.ToString();
+            }
 
-            if (command == null)
+            if (commands.Count == 0)
             {
-                // Return empty JSON object when no pending commands
-                return Results.Content("{}", "application/json");
+                if (request.Headers.IfNoneMatch.Contains(etag))
+                {
+                    return Results.StatusCode(StatusCodes.Status304NotModified);
+                }
+
+                // Return empty object when no pending commands
+                return useCbor
+                    ? Results.Bytes(RelayCbor.EncodeCommands(commands), RelayCbor.ContentType)
+                    : Results.Content("{}", "application/json");
             }
 
-            var json = JsonSerializer.Serialize(command, JsonOptions);
+            if (useCbor)
+            {
+                return Results.Bytes(RelayCbor.EncodeCommands(commands), RelayCbor.ContentType);
+            }
+
+            var json = commands.Count == 1
+                ? JsonSerializer.Serialize(commands[0], JsonOptions)
+                : JsonSerializer.Serialize(commands, JsonOptions);
             return Results.Content(json, "application/json");
         });
 
-        // POST endpoint - ESP32 sends acknowledgments here
-        app.MapPost("/api/relay", async (HttpRequest request, RelayCommandService relayService) =>
+        // Schedule the devices run locally (see RelayScheduleService); PUT replaces it and
+        // devices pick it up on their next poll
+        app.MapGet("/api/relay/schedule", (RelayScheduleService scheduleService) =>
+            scheduleService.Schedule is { } schedule ? Results.Json(schedule, JsonOptions) : Results.NotFound());
+
+        app.MapPut("/api/relay/schedule", async (HttpRequest request, RelayScheduleService scheduleService) =>
+        {
+            try
+            {
+                var schedule = await request.ReadFromJsonAsync<RelaySchedule>(JsonOptions);
+                scheduleService.SetSchedule(schedule ?? new RelaySchedule());
+                return Results.Ok();
+            }
+            catch (Exception ex) when (ex is ArgumentException or JsonException)
+            {
+                return Results.BadRequest(ex.Message);
+            }
+        });
+
+        // Recall a scene stored on the device; the device switches all of its relays at once
+        app.MapPost("/api/relay/scene/{scene:int}", (int scene, RelayCommandService relayService) =>
+        {
+            if (scene < 1 || scene > MaxScene)
+            {
+                return Results.BadRequest($"Scenes are numbered 1 to {MaxScene}");
+            }
+            relayService.RecallScene(scene);
+            return Results.Accepted();
+        });
+
+        // Run a pulse train ({"pulse": ms, "gap": ms, "count": n}) or a PWM ({"pwm": Hz, "duty": %,
+        // "duration": ms}) on a relay; the device times it in hardware and reports its end
+        app.MapPost("/api/relay/{relay:int}/waveform", (int relay, RelayState waveform, RelayCommandService relayService) =>
         {
-            using var reader = new StreamReader(request.Body);
-            var body = await reader.ReadToEndAsync();
+            if (relay < 1 || relay > MaxRelay)
+            {
+                return Results.BadRequest($"Relays are numbered 1 to {MaxRelay}");
+            }
+            // Times below 1 µs would be serialized in exponent notation, which the device does not read
+            var isPulse = waveform.Pulse >= MinWaveformMs && waveform.Pwm == null &&
+                          (waveform.Count ?? 1) is >= 1 and <= MaxPulseCount &&
+                          (waveform.Count is null or 1 || waveform.Gap >= MinWaveformMs);
+            var isPwm = waveform.Pwm is >= 1 and <= MaxPwmHz && waveform.Duty is >= 1 and <= 99 && waveform.Pulse == null;
+            if (!isPulse && !isPwm)
+            {
+                return Results.BadRequest("Expected pulse (ms) with gap and count, or pwm (1 to 1000 Hz) with duty (1 to 99 %)");
+            }
+            relayService.SetWaveform(relay, new RelayState
+            {
+                Duration = isPwm ? waveform.Duration : null,
+                Pulse = waveform.Pulse,
+                Gap = isPulse ? waveform.Gap : null,
+                Count = isPulse ? waveform.Count : null,
+                Pwm = waveform.Pwm,
+                Duty = waveform.Duty
+            });
+            return Results.Accepted();
+        });
 
+        // HEAD endpoint - devices with several servers probe each one's round trip with it;
+        // it touches neither the queue nor the ACK state
+        app.MapMethods("/api/relay", [HttpMethods.Head], () => Results.NoContent());
+
+        // POST endpoint - ESP32 sends acknowledgments here when a command asked for an
+        // immediate ACK (or from firmware without piggybacked ACKs); the body is a single
+        // ACK object or an array of them, as JSON or (Content-Type: application/cbor) CBOR
+        app.MapPost("/api/relay", async (HttpRequest request, RelayCommandService relayService) =>
+        {
             try
             {
-                var ack = JsonSerializer.Deserialize<RelayAck>(body, JsonOptions);
-                if (ack?.CommandId != null)
+                List<RelayAck?>? acks;
+
+                if (request.ContentType?.StartsWith(RelayCbor.ContentType, StringComparison.OrdinalIgnoreCase) == true)
+                {
+                    using var buffer = new MemoryStream();
+                    await request.Body.CopyToAsync(buffer);
+                    acks = RelayCbor.DecodeAcks(buffer.ToArray()).ToList<RelayAck?>();
+                }
+                else
+                {
+                    using var reader = new StreamReader(request.Body);
+                    var body = await reader.ReadToEndAsync();
+
+                    // The device batches queued ACKs into a JSON array
+                    acks = body.TrimStart().StartsWith('[')
+                        ? JsonSerializer.Deserialize<List<RelayAck?>>(body, JsonOptions)
+                        : new List<RelayAck?> { JsonSerializer.Deserialize<RelayAck>(body, JsonOptions) };
+                }
+
+                foreach (var ack in acks ?? [])
                 {
-                    relayService.AcknowledgeCommand(ack.CommandId);
+                    if (ack?.IsWaveformReport == true)
+                    {
+                        relayService.ReportWaveformEnd(ack.CommandId, ack.Relay!.Value, ack.Status!);
+                        continue;
+                    }
+                    var seq = ack?.GetSeq();
+                    if (seq != null)
+                    {
+                        relayService.AcknowledgeCommand(seq.Value, ack!.GetHeld());
+                    }
                 }
             }
             catch
@@ -51,6 +259,21 @@ public static class RelayEndpoints
             return Results.Ok();
         });
     }
+
+    /// <summary>
+    /// Sequence numbers of the comma-separated "X-Relay-Held" poll header
+    /// </summary>
+    private static List<long>? ParseHeld(string? header)
+    {
+        if (string.IsNullOrEmpty(header))
+        {
+            return null;
+        }
+        return header.Split(',', StringSplitOptions.TrimEntries | StringSplitOptions.RemoveEmptyEntries)
+            .Select(value => long.TryParse(value, out var seq) ? seq : (long?)null)
+            .OfType<long>()
+            .ToList();
+    }
 }
 
 public class RelayAck
@@ -58,7 +281,54 @@ public class RelayAck
     [JsonPropertyName("command_id")]
     public string? CommandId { get; set; }
 
+    [JsonPropertyName("seq")]
+    public long? Seq { get; set; }
+
     [JsonPropertyName("status")]
     public string? Status { get; set; }
-}
 
+    /// <summary>
+    /// Relay whose waveform ended; only set in a waveform end report
+    /// </summary>
+    [JsonPropertyName("relay")]
+    public int? Relay { get; set; }
+
+    /// <summary>
+    /// Whether this is the end report of a waveform ("completed" or "failed") rather than an ACK
+    /// </summary>
+    [JsonIgnore]
+    public bool IsWaveformReport => Relay != null && Status is "completed" or "failed";
+
+    /// <summary>
+    /// Sequence numbers up to <see cref="Seq"/> that the device did not execute because
+    /// a manual hold kept the relay in its manual setting
+    /// </summary>
+    [JsonPropertyName("held")]
+    public List<long>? Held { get; set; }
+
+    /// <summary>
+    /// Sequence number acknowledged by this ACK (older firmware only echoes command_id,
+    /// which carries the same number)
+    /// </summary>
+    public long? GetSeq()
+    {
+        if (Seq != null)
+        {
+            return Seq;
+        }
+        return long.TryParse(CommandId, out var seq) ? seq : null;
+    }
+
+    /// <summary>
+    /// Sequence numbers this ACK reports as not executed: the "held" list, or the command
+    /// itself when its status is "held"
+    /// </summary>
+    public IReadOnlyCollection<long>? GetHeld()
+    {
+        if (Status == "held" && GetSeq() is long seq)
+        {
+            return [seq, .. Held ?? []];
+        }
+        return Held;
+    }
+}
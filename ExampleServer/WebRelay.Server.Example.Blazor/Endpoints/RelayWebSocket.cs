@@ -0,0 +1,127 @@
+using System.Net.WebSockets;
+using System.Text;
+using System.Text.Json;
+using WebRelay.Server.Example.Blazor.Services;
+
+namespace WebRelay.Server.Example.Blazor.Endpoints;
+
+/// <summary>
+/// Push channel for devices connected over WebSocket: commands are sent the moment
+/// they are queued and ACKs come back on the same socket
+/// </summary>
+public static class RelayWebSocket
+{
+    // How long to wait for a command before checking the socket state again
+    private static readonly TimeSpan CommandWaitInterval = TimeSpan.FromSeconds(30);
+
+    private const int MaxAckMessageSize = 1024;
+
+    /// <summary>
+    /// Run a session until the device disconnects or the request is aborted
+    /// </summary>
+    public static async Task RunSessionAsync(WebSocket socket, RelayCommandService relayService, CancellationToken cancellationToken)
+    {
+        using var sessionCts = CancellationTokenSource.CreateLinkedTokenSource(cancellationToken);
+        var receiveTask = ReceiveAcksAsync(socket, relayService, sessionCts);
+
+        Console.WriteLine("Device connected over WebSocket");
+
+        try
+        {
+            while (socket.State == WebSocketState.Open)
+            {
+                // Drain everything queued, one message per command in order; each command
+                // leaves the queue once it has been sent, so a failed send loses none of them
+                var commands = await relayService.PeekPendingCommandsAsync(CommandWaitInterval, int.MaxValue, sessionCts.Token);
+                foreach (var command in commands)
+                {
+                    var json = JsonSerializer.SerializeToUtf8Bytes(command, RelayEndpoints.JsonOptions);
+                    await socket.SendAsync(json, WebSocketMessageType.Text, true, sessionCts.Token);
+                    relayService.MarkDelivered(command.Seq);
+                }
+            }
+        }
+        catch (OperationCanceledException)
+        {
+            // Device disconnected or server shutting down
+        }
+        catch (WebSocketException)
+        {
+            // Connection dropped while sending
+        }
+        finally
+        {
+            // Commands not sent stay queued for the next session or poll
+            relayService.ReleasePendingCommands();
+            sessionCts.Cancel();
+            await receiveTask;
+        }
+
+        Console.WriteLine("Device WebSocket session ended");
+    }
+
+    /// <summary>
+    /// Read ACK messages from the device until it closes the socket
+    /// </summary>
+    private static async Task ReceiveAcksAsync(WebSocket socket, RelayCommandService relayService, CancellationTokenSource sessionCts)
+    {
+        var buffer = new byte[MaxAckMessageSize];
+
+        try
+        {
+            while (socket.State == WebSocketState.Open)
+            {
+                var length = 0;
+                WebSocketReceiveResult result;
+                do
+                {
+                    if (length == buffer.Length)
+                    {
+                        await socket.CloseAsync(WebSocketCloseStatus.MessageTooBig, null, sessionCts.Token);
+                        return;
+                    }
+
+                    result = await socket.ReceiveAsync(
+                        new ArraySegment<byte>(buffer, length, buffer.Length - length), sessionCts.Token);
+                    length += result.Count;
+                } while (!result.EndOfMessage);
+
+                if (result.MessageType == WebSocketMessageType.Close)
+                {
+                    await socket.CloseOutputAsync(WebSocketCloseStatus.NormalClosure, null, CancellationToken.None);
+                    return;
+                }
+
+                try
+                {
+                    var ack = JsonSerializer.Deserialize<RelayAck>(Encoding.UTF8.GetString(buffer, 0, length), RelayEndpoints.JsonOptions);
+                    if (ack?.IsWaveformReport == true)
+                    {
+                        relayService.ReportWaveformEnd(ack.CommandId, ack.Relay!.Value, ack.Status!);
+                        continue;
+                    }
+                    var seq = ack?.GetSeq();
+                    if (seq != null)
+                    {
+                        relayService.AcknowledgeCommand(seq.Value, ack!.GetHeld());
+                    }
+                }
+                catch (JsonException)
+                {
+                    // Ignore invalid ACK payloads
+                }
+            }
+        }
+        catch (OperationCanceledException)
+        {
+        }
+        catch (WebSocketException)
+        {
+        }
+        finally
+        {
+            // Wake up the send loop so the session ends with the socket
+            sessionCts.Cancel();
+        }
+    }
+}
@@ -17,6 +17,15 @@ namespace WebRelay.Server.Example.Blazor
             // Register relay command service as singleton
             builder.Services.AddSingleton<RelayCommandService>();
 
+            // Sends commands straight to devices that accept them on the LAN ("Relay:LanKey")
+            builder.Services.AddSingleton<RelayLanClient>();
+
+            // Schedules devices store and run on their own clock ("Relay:Schedule")
+            builder.Services.AddSingleton<RelayScheduleService>();
+
+            // Devices using coap:// URLs observe the command resource over UDP (see RelayCoap)
+            builder.Services.AddHostedService<RelayCoap>();
+
             var app = builder.Build();
 
             // Configure the HTTP request pipeline.
@@ -30,6 +39,9 @@ namespace WebRelay.Server.Example.Blazor
 
             app.MapStaticAssets();
 
+            // Devices using ws:// or wss:// URLs upgrade /api/relay to a WebSocket
+            app.UseWebSockets();
+
             // Map relay API endpoints for ESP32 communication
             // MUST be before MapRazorComponents to avoid Blazor catching the request
             app.MapRelayEndpoints();
@@ -6,8 +6,79 @@ namespace WebRelay.Server.Example.Blazor.Services;
 public class RelayCommandService
 {
     private readonly object _lock = new();
-    private RelayCommand? _pendingCommand;
-    private readonly Dictionary<string, PendingCommandInfo> _pendingCommands = new();
+    private readonly Queue<RelayCommand> _commandQueue = new();
+    private readonly SortedDictionary<long, PendingCommandInfo> _pendingCommands = new();
+    private long _lastSeq;
+
+    // Devices skip sequence numbers up to the last one they executed, also after their
+    // own reboot, so numbers must never repeat across server restarts either. They are
+    // reserved in blocks; the end of the reserved block is kept in a file
+    private const long SeqReserveBlock = 1000;
+    private static readonly string SeqFile = Path.Combine(AppContext.BaseDirectory, "relay-seq.txt");
+    private long _seqReservedUpTo;
+    private TaskCompletionSource _commandQueued = new(TaskCreationOptions.RunContinuationsAsynchronously);
+    private long _queueVersion;
+    private DateTime _lastCommandQueuedAt = DateTime.MinValue;
+
+    // Devices are asked to poll fast while commands are in flight or were queued recently
+    private const int FastPollIntervalMs = 1000;
+    private static readonly TimeSpan ActivityWindow = TimeSpan.FromSeconds(60);
+
+    // Commands waiting for pickup; the oldest is dropped beyond this
+    private const int MaxQueuedCommands = 64;
+
+    // Commands per direct LAN request; the device executes at most 8 per batch
+    private const int MaxLanBatchSize = 8;
+
+    private readonly RelayLanClient _lanClient;
+
+    // Set while the head of the queue is being sent over the LAN; polls leave it alone meanwhile
+    private bool _lanInFlight;
+
+    public RelayCommandService(RelayLanClient lanClient)
+    {
+        _lanClient = lanClient;
+
+        // Numbering continues after the last reserved block. Without the file it starts at
+        // the current Unix time, which is past any number of an earlier run that reserved
+        // less than one per second (and fits the device's 32-bit seq)
+        _lastSeq = Math.Max(ReadReservedSeq(), DateTimeOffset.UtcNow.ToUnixTimeSeconds());
+        _seqReservedUpTo = _lastSeq;
+    }
+
+    private static long ReadReservedSeq()
+    {
+        try
+        {
+            return File.Exists(SeqFile) && long.TryParse(File.ReadAllText(SeqFile).Trim(), out var seq) ? seq : 0;
+        }
+        catch (Exception ex) when (ex is IOException or UnauthorizedAccessException)
+        {
+            Console.WriteLine($"Could not read {SeqFile}: {ex.Message}");
+            return 0;
+        }
+    }
+
+    /// <summary>
+    /// Next sequence number, reserving a new block first when the current one is used up
+    /// (must be called with _lock held)
+    /// </summary>
+    private long NextSeq()
+    {
+        if (_lastSeq >= _seqReservedUpTo)
+        {
+            _seqReservedUpTo = _lastSeq + SeqReserveBlock;
+            try
+            {
+                File.WriteAllText(SeqFile, _seqReservedUpTo.ToString());
+            }
+            catch (Exception ex) when (ex is IOException or UnauthorizedAccessException)
+            {
+                Console.WriteLine($"Could not save {SeqFile}: {ex.Message}");
+            }
+        }
+        return ++_lastSeq;
+    }
     
     public event Action? OnStateChanged;
 
@@ -22,19 +93,15 @@ public class RelayCommandService
         lock (_lock)
         {
             // Don't update state optimistically - wait for ESP32 confirmation
-            _pendingCommand = new RelayCommand
+            QueueCommand(new RelayCommand
             {
-                CommandId = Guid.NewGuid().ToString("N")[..8],
                 Relay1 = new RelayState { State = state ? 1 : 0 },
                 Relay2 = null
-            };
-            
-            // Store command info for later ACK processing
-            _pendingCommands[_pendingCommand.CommandId] = new PendingCommandInfo
+            }, new PendingCommandInfo
             {
                 RelayNumber = 1,
                 TargetState = state
-            };
+            });
         }
         // Don't trigger state change yet - wait for ACK
     }
@@ -47,46 +114,223 @@ public class RelayCommandService
         lock (_lock)
         {
             // Don't update state optimistically - wait for ESP32 confirmation
-            _pendingCommand = new RelayCommand
+            QueueCommand(new RelayCommand
             {
-                CommandId = Guid.NewGuid().ToString("N")[..8],
                 Relay1 = null,
                 Relay2 = new RelayState { State = state ? 1 : 0 }
-            };
-            
-            // Store command info for later ACK processing
-            _pendingCommands[_pendingCommand.CommandId] = new PendingCommandInfo
+            }, new PendingCommandInfo
             {
                 RelayNumber = 2,
                 TargetState = state
-            };
+            });
         }
         // Don't trigger state change yet - wait for ACK
     }
 
     /// <summary>
-    /// Get and clear the pending command (called by ESP32 polling endpoint)
+    /// Queue a command recalling a scene stored on the device (defined there with SCENE=);
+    /// all relays of the scene switch at the same instant
     /// </summary>
-    public RelayCommand? GetAndClearPendingCommand()
+    public void RecallScene(int scene)
     {
         lock (_lock)
         {
-            var command = _pendingCommand;
-            _pendingCommand = null;
-            return command;
+            // The server does not know the scene's relays, so the ACK updates no relay state
+            QueueCommand(new RelayCommand
+            {
+                Scene = scene
+            }, new PendingCommandInfo
+            {
+                Scene = scene
+            });
         }
     }
 
     /// <summary>
-    /// Handle acknowledgment from ESP32
+    /// Queue a pulse train or PWM for a relay (<paramref name="waveform"/> carries
+    /// Pulse/Gap/Count or Pwm/Duty/Duration); the device times it in hardware and
+    /// reports its end with a "completed" or "failed" status
     /// </summary>
-    public void AcknowledgeCommand(string commandId)
+    public void SetWaveform(int relayNumber, RelayState waveform)
     {
         lock (_lock)
         {
-            if (_pendingCommands.TryGetValue(commandId, out var commandInfo))
+            QueueCommand(new RelayCommand
+            {
+                Relay1 = relayNumber == 1 ? waveform : null,
+                Relay2 = relayNumber == 2 ? waveform : null
+            }, new PendingCommandInfo
+            {
+                RelayNumber = relayNumber,
+                Waveform = true
+            });
+        }
+    }
+
+    /// <summary>
+    /// Handle the device's report that a waveform has ended
+    /// </summary>
+    public void ReportWaveformEnd(string? commandId, int relayNumber, string status)
+    {
+        Console.WriteLine($"Command {commandId}: waveform on Relay {relayNumber} {status}");
+        OnStateChanged?.Invoke();
+    }
+
+    /// <summary>
+    /// Take up to <paramref name="maxCount"/> queued commands in order (called by ESP32 polling endpoint)
+    /// </summary>
+    public List<RelayCommand> TakePendingCommands(int maxCount)
+    {
+        lock (_lock)
+        {
+            return _lanInFlight ? [] : DequeueCommands(maxCount);
+        }
+    }
+
+    /// <summary>
+    /// Wait until a command is queued or the timeout expires (long-poll)
+    /// </summary>
+    /// <returns>Up to <paramref name="maxCount"/> queued commands in order; empty if none was queued in time</returns>
+    public Task<List<RelayCommand>> WaitForPendingCommandsAsync(TimeSpan timeout, int maxCount, CancellationToken cancellationToken)
+    {
+        return WaitForQueuedCommandsAsync(timeout, maxCount, true, cancellationToken);
+    }
+
+    /// <summary>
+    /// Wait like <see cref="WaitForPendingCommandsAsync"/>, but leave the commands in the queue
+    /// (push transports): take each one off with <see cref="MarkDelivered"/> once the device
+    /// has received it, and call <see cref="ReleasePendingCommands"/> if sending fails
+    /// </summary>
+    /// <returns>Up to <paramref name="maxCount"/> commands from the head of the queue; empty if none was queued in time</returns>
+    public Task<List<RelayCommand>> PeekPendingCommandsAsync(TimeSpan timeout, int maxCount, CancellationToken cancellationToken)
+    {
+        return WaitForQueuedCommandsAsync(timeout, maxCount, false, cancellationToken);
+    }
+
+    /// <summary>
+    /// Take the commands up to and including <paramref name="seq"/> off the queue after
+    /// the device received them; they then wait for the device's ACK
+    /// </summary>
+    public void MarkDelivered(long seq)
+    {
+        lock (_lock)
+        {
+            DequeueCommandsUpTo(seq);
+        }
+    }
+
+    /// <summary>
+    /// Wake parked polls after a push transport failed to deliver the head of the queue,
+    /// so the commands are picked up another way
+    /// </summary>
+    public void ReleasePendingCommands()
+    {
+        lock (_lock)
+        {
+            if (_commandQueue.Count > 0)
+            {
+                SignalCommandQueued();
+            }
+        }
+    }
+
+    private async Task<List<RelayCommand>> WaitForQueuedCommandsAsync(TimeSpan timeout, int maxCount, bool take, CancellationToken cancellationToken)
+    {
+        var deadline = DateTime.UtcNow + timeout;
+
+        while (true)
+        {
+            Task commandQueued;
+            lock (_lock)
+            {
+                if (_commandQueue.Count > 0 && !_lanInFlight)
+                {
+                    return take ? DequeueCommands(maxCount) : _commandQueue.Take(maxCount).ToList();
+                }
+                commandQueued = _commandQueued.Task;
+            }
+
+            var remaining = deadline - DateTime.UtcNow;
+            if (remaining <= TimeSpan.Zero)
+            {
+                return [];
+            }
+
+            try
+            {
+                await commandQueued.WaitAsync(remaining, cancellationToken);
+            }
+            catch (TimeoutException)
+            {
+                return [];
+            }
+        }
+    }
+
+    /// <summary>
+    /// Entity tag of the command queue; it changes every time a command is queued
+    /// so polls carrying the current tag in If-None-Match can be answered with 304
+    /// </summary>
+    public string CurrentETag
+    {
+        get
+        {
+            lock (_lock)
+            {
+                return $"\"{_queueVersion}\"";
+            }
+        }
+    }
+
+    /// <summary>
+    /// Suggested delay before the device's next poll, or null to let it back off
+    /// </summary>
+    public int? GetNextPollHintMs()
+    {
+        lock (_lock)
+        {
+            if (_pendingCommands.Count > 0 || DateTime.UtcNow - _lastCommandQueuedAt < ActivityWindow)
+            {
+                return FastPollIntervalMs;
+            }
+            return null;
+        }
+    }
+
+    /// <summary>
+    /// Handle acknowledgment from ESP32: the device has executed every command
+    /// delivered to it up to and including sequence number <paramref name="seq"/>,
+    /// except those listed in <paramref name="held"/>, which a manual hold on the
+    /// device kept from running
+    /// </summary>
+    public void AcknowledgeCommand(long seq, IReadOnlyCollection<long>? held = null)
+    {
+        lock (_lock)
+        {
+            var changed = false;
+            foreach (var heldSeq in held ?? [])
+            {
+                // Dropped without touching the relay state: the relay kept its manual setting
+                if (_pendingCommands.Remove(heldSeq, out var heldInfo))
+                {
+                    Console.WriteLine($"Command {heldSeq} not executed by ESP32 - Relay {heldInfo.RelayNumber} is held by a manual command");
+                    changed = true;
+                }
+            }
+
+            var acknowledged = _pendingCommands.Where(entry => entry.Key <= seq && entry.Value.Delivered).ToList();
+            if (acknowledged.Count == 0)
+            {
+                if (changed)
+                {
+                    OnStateChanged?.Invoke();
+                }
+                return;
+            }
+
+            // Apply in sequence order so the last command for a relay wins
+            foreach (var (commandSeq, commandInfo) in acknowledged)
             {
-                // Update relay state based on the acknowledged command
                 if (commandInfo.RelayNumber == 1)
                 {
                     Relay1State = commandInfo.TargetState;
@@ -95,22 +339,137 @@ public class RelayCommandService
                 {
                     Relay2State = commandInfo.TargetState;
                 }
-                
-                // Remove from pending commands
-                _pendingCommands.Remove(commandId);
-                
-                // Trigger state change event to update UI
-                OnStateChanged?.Invoke();
-                
-                Console.WriteLine($"Command {commandId} acknowledged by ESP32 - Relay {commandInfo.RelayNumber} set to {(commandInfo.TargetState ? "ON" : "OFF")}");
+
+                _pendingCommands.Remove(commandSeq);
+
+                Console.WriteLine(commandInfo.Scene != null
+                    ? $"Command {commandSeq} acknowledged by ESP32 - scene {commandInfo.Scene} recalled"
+                    : commandInfo.Waveform
+                        ? $"Command {commandSeq} acknowledged by ESP32 - waveform started on Relay {commandInfo.RelayNumber}"
+                        : $"Command {commandSeq} acknowledged by ESP32 - Relay {commandInfo.RelayNumber} set to {(commandInfo.TargetState ? "ON" : "OFF")}");
+            }
+
+            // Trigger state change event to update UI
+            OnStateChanged?.Invoke();
+        }
+    }
+
+    /// <summary>
+    /// Assign the next sequence number to a command and append it to the queue
+    /// (must be called with _lock held)
+    /// </summary>
+    private void QueueCommand(RelayCommand command, PendingCommandInfo commandInfo)
+    {
+        if (_commandQueue.Count == MaxQueuedCommands)
+        {
+            // A command dropped before the device picked it up will never be acknowledged
+            var dropped = _commandQueue.Dequeue();
+            _pendingCommands.Remove(dropped.Seq);
+            Console.WriteLine($"Command queue full - dropped command {dropped.Seq}");
+        }
+
+        command.Seq = NextSeq();
+        command.CommandId = command.Seq.ToString();
+        _commandQueue.Enqueue(command);
+
+        // Store command info for later ACK processing
+        _pendingCommands[command.Seq] = commandInfo;
+
+        SignalCommandQueued();
+
+        if (!_lanInFlight && _lanClient.IsAvailable)
+        {
+            _lanInFlight = true;
+            _ = SendOverLanAsync();
+        }
+    }
+
+    /// <summary>
+    /// Deliver the head of the queue straight to the device; whatever is not acknowledged
+    /// is left in the queue for the next poll
+    /// </summary>
+    private async Task SendOverLanAsync()
+    {
+        while (true)
+        {
+            List<RelayCommand> commands;
+            lock (_lock)
+            {
+                commands = _commandQueue.Take(MaxLanBatchSize).ToList();
+                if (commands.Count == 0)
+                {
+                    _lanInFlight = false;
+                    return;
+                }
+            }
+
+            var ack = await _lanClient.SendAsync(commands);
+            var ackedSeq = ack?.GetSeq();
+
+            lock (_lock)
+            {
+                if (ackedSeq != null)
+                {
+                    DequeueCommandsUpTo(ackedSeq.Value);
+                    Console.WriteLine($"Commands up to {ackedSeq.Value} delivered over LAN");
+                }
+
+                if (ackedSeq == null || !_lanClient.IsAvailable)
+                {
+                    // Wake parked polls so they pick up what is left
+                    _lanInFlight = false;
+                    if (_commandQueue.Count > 0)
+                    {
+                        SignalCommandQueued();
+                    }
+                    return;
+                }
             }
-            else
+
+            AcknowledgeCommand(ackedSeq.Value, ack!.GetHeld());
+        }
+    }
+
+    /// <summary>
+    /// Hand the oldest queued commands to the device (must be called with _lock held)
+    /// </summary>
+    private List<RelayCommand> DequeueCommands(int maxCount)
+    {
+        var commands = new List<RelayCommand>();
+        while (commands.Count < maxCount && _commandQueue.TryDequeue(out var command))
+        {
+            if (_pendingCommands.TryGetValue(command.Seq, out var commandInfo))
             {
-                Console.WriteLine($"Command {commandId} acknowledged but not found in pending commands");
+                commandInfo.Delivered = true;
             }
+            commands.Add(command);
         }
+        return commands;
     }
-    
+
+    /// <summary>
+    /// Take the head of the queue off up to and including <paramref name="seq"/>; queue full
+    /// drops or a poll may have removed some of them meanwhile (must be called with _lock held)
+    /// </summary>
+    private void DequeueCommandsUpTo(long seq)
+    {
+        while (_commandQueue.TryPeek(out var head) && head.Seq <= seq)
+        {
+            DequeueCommands(1);
+        }
+    }
+
+    /// <summary>
+    /// Wake up parked long-poll requests (must be called with _lock held)
+    /// </summary>
+    private void SignalCommandQueued()
+    {
+        _queueVersion++;
+        _lastCommandQueuedAt = DateTime.UtcNow;
+        _commandQueued.TrySetResult();
+        _commandQueued = new TaskCompletionSource(TaskCreationOptions.RunContinuationsAsynchronously);
+    }
+
     /// <summary>
     /// Information about a pending command waiting for ACK
     /// </summary>
@@ -118,19 +477,68 @@ public class RelayCommandService
     {
         public int RelayNumber { get; set; }
         public bool TargetState { get; set; }
+        public int? Scene { get; set; }
+        public bool Waveform { get; set; } // The relay runs a waveform from OFF (TargetState false)
+        public bool Delivered { get; set; }
     }
 }
 
 public class RelayCommand
 {
     public string? CommandId { get; set; }
+
+    /// <summary>
+    /// Monotonic sequence number; the device acknowledges a range by reporting
+    /// the last sequence number it executed
+    /// </summary>
+    public long Seq { get; set; }
+
+    /// <summary>
+    /// Ask the device to acknowledge this command with an immediate POST instead
+    /// of reporting it on its next poll
+    /// </summary>
+    public bool? AckNow { get; set; }
     public RelayState? Relay1 { get; set; }
     public RelayState? Relay2 { get; set; }
+
+    /// <summary>
+    /// Number of a scene stored on the device, applied before Relay1/Relay2
+    /// </summary>
+    public int? Scene { get; set; }
 }
 
 public class RelayState
 {
     public int State { get; set; }
+
+    /// <summary>
+    /// Auto-off after this many ms; with Pwm, how long the PWM runs
+    /// </summary>
     public int? Duration { get; set; }
+
+    /// <summary>
+    /// Pulse train instead of State: ON time of each pulse in ms (µs resolution)
+    /// </summary>
+    public double? Pulse { get; set; }
+
+    /// <summary>
+    /// OFF time between pulses in ms (µs resolution)
+    /// </summary>
+    public double? Gap { get; set; }
+
+    /// <summary>
+    /// Number of pulses (default 1)
+    /// </summary>
+    public int? Count { get; set; }
+
+    /// <summary>
+    /// PWM instead of State: frequency in Hz (1 to 1000)
+    /// </summary>
+    public int? Pwm { get; set; }
+
+    /// <summary>
+    /// PWM ON time in percent (1 to 99)
+    /// </summary>
+    public int? Duty { get; set; }
 }
 
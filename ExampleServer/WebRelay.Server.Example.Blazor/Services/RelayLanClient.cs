@@ -0,0 +1,133 @@
+using System.Globalization;
+using System.Security.Cryptography;
+using System.Text;
+using System.Text.Json;
+using WebRelay.Server.Example.Blazor.Endpoints;
+
+namespace WebRelay.Server.Example.Blazor.Services;
+
+/// <summary>
+/// Delivers commands straight to the device over the LAN when the server can reach it,
+/// instead of waiting for the device's next poll. The device advertises its endpoint in
+/// "X-Relay-Lan" on every poll; requests are signed with the pre-shared key "Relay:LanKey"
+/// (set on the device with PSK=). Empty key disables direct delivery.
+/// </summary>
+public class RelayLanClient
+{
+    // A LAN round trip is a few ms; anything slower falls back to polling
+    private static readonly TimeSpan RequestTimeout = TimeSpan.FromSeconds(1);
+
+    // After a failure the device is left to poll for a while before LAN is tried again
+    private static readonly TimeSpan RetryAfterFailure = TimeSpan.FromSeconds(60);
+
+    private readonly object _lock = new();
+    private readonly byte[] _key;
+    private readonly HttpClient _httpClient = new() { Timeout = RequestTimeout };
+    private Uri? _deviceUri;
+    private DateTime _disabledUntil = DateTime.MinValue;
+
+    public RelayLanClient(IConfiguration configuration)
+    {
+        _key = Encoding.UTF8.GetBytes(configuration.GetValue("Relay:LanKey", "") ?? "");
+    }
+
+    /// <summary>
+    /// True when a key is configured, the device has advertised its endpoint and the
+    /// last attempt did not fail recently
+    /// </summary>
+    public bool IsAvailable
+    {
+        get
+        {
+            lock (_lock)
+            {
+                return _key.Length > 0 && _deviceUri != null && DateTime.UtcNow >= _disabledUntil;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Record the endpoint from a poll's "X-Relay-Lan" header (null or empty: not offered)
+    /// </summary>
+    public void UpdateDeviceEndpoint(string? url)
+    {
+        Uri? uri = null;
+        if (!string.IsNullOrEmpty(url) && Uri.TryCreate(url, UriKind.Absolute, out var parsed) && parsed.Scheme == Uri.UriSchemeHttp)
+        {
+            uri = parsed;
+        }
+
+        lock (_lock)
+        {
+            if (uri != _deviceUri)
+            {
+                Console.WriteLine(uri != null ? $"Device accepts LAN commands at {uri}" : "Device no longer accepts LAN commands");
+                _deviceUri = uri;
+                _disabledUntil = DateTime.MinValue;
+            }
+        }
+    }
+
+    /// <summary>
+    /// POST commands to the device
+    /// </summary>
+    /// <returns>The device's ACK, or null if the commands were not delivered</returns>
+    public async Task<RelayAck?> SendAsync(List<RelayCommand> commands)
+    {
+        Uri? uri;
+        lock (_lock)
+        {
+            uri = _deviceUri;
+        }
+        if (uri == null || commands.Count == 0)
+        {
+            return null;
+        }
+
+        var body = commands.Count == 1
+            ? JsonSerializer.Serialize(commands[0], RelayEndpoints.JsonOptions)
+            : JsonSerializer.Serialize(commands, RelayEndpoints.JsonOptions);
+        var timestamp = DateTimeOffset.UtcNow.ToUnixTimeSeconds().ToString(CultureInfo.InvariantCulture);
+
+        using var request = new HttpRequestMessage(HttpMethod.Post, uri)
+        {
+            Content = new StringContent(body, Encoding.UTF8, "application/json")
+        };
+        request.Headers.Add("X-Relay-Timestamp", timestamp);
+        request.Headers.Add("X-Relay-Signature", Sign(timestamp, body));
+
+        try
+        {
+            using var response = await _httpClient.SendAsync(request);
+            if (response.IsSuccessStatusCode)
+            {
+                var ack = JsonSerializer.Deserialize<RelayAck>(await response.Content.ReadAsStringAsync(), RelayEndpoints.JsonOptions);
+                var seq = ack?.GetSeq();
+                if (seq != null && seq.Value >= commands[^1].Seq)
+                {
+                    return ack;
+                }
+            }
+            Console.WriteLine($"LAN delivery to {uri} rejected ({(int)response.StatusCode}), falling back to polling");
+        }
+        catch (Exception ex) when (ex is HttpRequestException or TaskCanceledException or JsonException)
+        {
+            Console.WriteLine($"LAN delivery to {uri} failed ({ex.Message}), falling back to polling");
+        }
+
+        lock (_lock)
+        {
+            _disabledUntil = DateTime.UtcNow + RetryAfterFailure;
+        }
+        return null;
+    }
+
+    /// <summary>
+    /// Hex HMAC-SHA256 of "&lt;timestamp&gt;.&lt;body&gt;", as checked by the device
+    /// </summary>
+    private string Sign(string timestamp, string body)
+    {
+        var hash = HMACSHA256.HashData(_key, Encoding.UTF8.GetBytes($"{timestamp}.{body}"));
+        return Convert.ToHexString(hash).ToLowerInvariant();
+    }
+}
@@ -0,0 +1,195 @@
+using System.Globalization;
+using System.Security.Cryptography;
+using System.Text;
+
+namespace WebRelay.Server.Example.Blazor.Services;
+
+/// <summary>
+/// Relay schedule that devices store and run on their own clock, so scheduled switching keeps
+/// working without the server and without waiting for a poll. Loaded from "Relay:Schedule" and
+/// replaceable at runtime; without that section the server leaves the devices' schedules alone.
+/// Sent to a device in "X-Relay-Schedule" when the version it reports differs.
+/// </summary>
+public class RelayScheduleService
+{
+    // The device keeps at most this many entries
+    public const int MaxEntries = 16;
+
+    // Relays a device can be built with (CONFIG_RELAY_COUNT); the device rejects numbers it does not have
+    public const int MaxRelays = 16;
+
+    private static readonly string[] DayNames = ["Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"];
+
+    private readonly object _lock = new();
+    private RelaySchedule? _schedule;
+    private string _spec = "";
+    private uint _version;
+
+    public RelayScheduleService(IConfiguration configuration)
+    {
+        var section = configuration.GetSection("Relay:Schedule");
+        if (section.Exists())
+        {
+            SetSchedule(section.Get<RelaySchedule>() ?? new RelaySchedule());
+        }
+    }
+
+    /// <summary>
+    /// The current schedule, or null if the server does not manage schedules
+    /// </summary>
+    public RelaySchedule? Schedule
+    {
+        get
+        {
+            lock (_lock)
+            {
+                return _schedule;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Replace the schedule; devices pick it up on their next poll
+    /// </summary>
+    /// <exception cref="ArgumentException">An entry is invalid</exception>
+    public void SetSchedule(RelaySchedule schedule)
+    {
+        var spec = Encode(schedule);
+        lock (_lock)
+        {
+            _schedule = schedule;
+            _spec = spec.Body;
+            _version = spec.Version;
+        }
+        Console.WriteLine($"Relay schedule version {spec.Version} with {schedule.Entries.Count} entries");
+    }
+
+    /// <summary>
+    /// Value for "X-Relay-Schedule" if a device reporting <paramref name="deviceVersion"/> needs
+    /// the schedule, otherwise null
+    /// </summary>
+    public string? GetUpdateFor(string? deviceVersion)
+    {
+        lock (_lock)
+        {
+            if (_schedule == null || !uint.TryParse(deviceVersion, out var version) || version == _version)
+            {
+                return null;
+            }
+            return _spec.Length > 0 ? $"{_version} {_spec}" : _version.ToString(CultureInfo.InvariantCulture);
+        }
+    }
+
+    /// <summary>
+    /// Encode a schedule in the device format: "[tz=&lt;TZ&gt;] &lt;relay&gt;,&lt;state&gt;,&lt;days&gt;,&lt;start&gt;,&lt;duration_s&gt; ...".
+    /// The version is derived from the content, so an unchanged schedule keeps its version
+    /// across server restarts and devices do not rewrite their flash
+    /// </summary>
+    private static (uint Version, string Body) Encode(RelaySchedule schedule)
+    {
+        if (schedule.Entries.Count > MaxEntries)
+        {
+            throw new ArgumentException($"At most {MaxEntries} schedule entries are supported");
+        }
+        if (schedule.TimeZone?.Contains(' ') == true)
+        {
+            throw new ArgumentException("The time zone must be a POSIX TZ string without spaces");
+        }
+
+        var tokens = new List<string>();
+        if (!string.IsNullOrEmpty(schedule.TimeZone))
+        {
+            tokens.Add($"tz={schedule.TimeZone}");
+        }
+
+        foreach (var entry in schedule.Entries)
+        {
+            if (entry.Relay is < 1 or > MaxRelays || entry.State is < 0 or > 1)
+            {
+                throw new ArgumentException("Invalid relay or state in schedule entry");
+            }
+
+            var duration = (long)(entry.Duration ?? TimeSpan.Zero).TotalSeconds;
+            if (duration < 0 || duration > uint.MaxValue)
+            {
+                throw new ArgumentException("Invalid schedule entry duration");
+            }
+
+            long start;
+            var days = 0;
+            if (entry.At != null)
+            {
+                start = entry.At.Value.ToUnixTimeSeconds();
+            }
+            else if (entry.Start != null)
+            {
+                foreach (var day in entry.Days)
+                {
+                    var index = Array.FindIndex(DayNames, name => day.StartsWith(name, StringComparison.OrdinalIgnoreCase));
+                    if (index < 0)
+                    {
+                        throw new ArgumentException($"Unknown day '{day}' in schedule entry");
+                    }
+                    days |= 1 << index;
+                }
+                if (days == 0)
+                {
+                    throw new ArgumentException("A recurring schedule entry needs at least one day");
+                }
+                start = (long)entry.Start.Value.ToTimeSpan().TotalSeconds;
+            }
+            else
+            {
+                throw new ArgumentException("A schedule entry needs either At or Start");
+            }
+
+            tokens.Add(string.Create(CultureInfo.InvariantCulture, $"{entry.Relay},{entry.State},{days},{start},{duration}"));
+        }
+
+        var body = string.Join(' ', tokens);
+        var hash = SHA256.HashData(Encoding.UTF8.GetBytes(body));
+        // 0 means "no schedule" on the device
+        var version = Math.Max(BitConverter.ToUInt32(hash, 0) & 0x7FFFFFFF, 1u);
+        return (version, body);
+    }
+}
+
+public class RelaySchedule
+{
+    /// <summary>
+    /// POSIX TZ string for the device's local time, e.g. "CET-1CEST,M3.5.0,M10.5.0/3" (empty = UTC)
+    /// </summary>
+    public string? TimeZone { get; set; }
+
+    public List<RelayScheduleEntry> Entries { get; set; } = [];
+}
+
+public class RelayScheduleEntry
+{
+    public int Relay { get; set; }
+
+    /// <summary>
+    /// 1 = ON, 0 = OFF
+    /// </summary>
+    public int State { get; set; } = 1;
+
+    /// <summary>
+    /// Weekdays of a recurring entry ("Mon", "Tue", ...)
+    /// </summary>
+    public List<string> Days { get; set; } = [];
+
+    /// <summary>
+    /// Local time of day of a recurring entry
+    /// </summary>
+    public TimeOnly? Start { get; set; }
+
+    /// <summary>
+    /// Time of a one-shot entry (instead of Days and Start)
+    /// </summary>
+    public DateTimeOffset? At { get; set; }
+
+    /// <summary>
+    /// For ON entries: switch OFF again after this long
+    /// </summary>
+    public TimeSpan? Duration { get; set; }
+}